@@ -0,0 +1,525 @@
+/*
+ * batchio.h
+ * =====================================================================
+ * Enhanced TFTP – batched datagram I/O
+ *
+ * Moving a window of DATA blocks one sendto() / recvfrom() at a time
+ * costs a system call per packet, which is most of the CPU a transfer
+ * uses once the window is large.  Linux can move many datagrams per
+ * call instead:
+ *
+ *   • TxBatch – packets are queued as they are produced and go out in
+ *               one sendmmsg() when the sender's pump ends (or the batch
+ *               fills).  Each entry may carry its own SO_TXTIME
+ *               departure time, so kernel pacing still works.
+ *   • RxBatch – one recvmmsg() takes up to IO_BATCH queued datagrams,
+ *               each with its sender's address, into buffers that stay
+ *               valid until the next fill.
+ *
+ * What is left after batching is the trip of every datagram through
+ * the UDP/IP stack.  UDP segmentation offload cuts that too:
+ *
+ *   • GSO – with `gso` set, a run of equal-length packets (the last may
+ *           be shorter) is handed over as one buffer with UDP_SEGMENT;
+ *           the kernel or NIC cuts it back into the same datagrams.
+ *           If the socket or device refuses, the run is sent packet by
+ *           packet and `gso` is cleared, so the owner stops asking.
+ *   • GRO – a socket with UDP_GRO on (udp_gro_enable) may deliver such
+ *           runs whole; the fill splits them back into datagrams, so
+ *           callers see the same packets either way.  Its buffers must
+ *           then hold GRO_BUF_SIZE bytes.
+ *
+ *   • Zero-copy – with `zerocopy` set, sends carry MSG_ZEROCOPY: the
+ *                 kernel pins the packets' pages instead of copying
+ *                 them, and reports on the socket's error queue when it
+ *                 is done with each send (ZcTracker).  Until then the
+ *                 packets must not be rewritten.
+ *
+ * Both are plain structs with no state beyond one call, so the
+ * transport, the server's listeners and the multicast paths share
+ * them.  A datagram the kernel refuses is dropped just like a failed
+ * sendto(): the transport's timers resend it.
+ * =====================================================================
+ */
+
+#ifndef BATCHIO_H
+#define BATCHIO_H
+
+#include "udp_file_transfer.h"
+#include <netinet/udp.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+
+#define IO_BATCH            32          /* Datagrams per sendmmsg/recvmmsg*/
+#define IO_BATCH_IOV        256         /* Packets queued per flush       */
+#define GSO_MAX_SEGS        64          /* Kernel's UDP_MAX_SEGMENTS      */
+#define GSO_MAX_BYTES       65507       /* Largest IPv4 UDP payload       */
+#define GRO_BUF_SIZE        65535       /* Receive buffer for a GRO run   */
+#define ZC_TRACK            4096        /* Zero-copy sends awaiting notice*/
+#define TX_UNTAGGED         UINT32_MAX  /* Tag of a packet nobody resends */
+
+/* UDP_SEGMENT works on this socket (kernel 4.18+) */
+static inline int udp_gso_supported(int sockfd)
+{
+    int       size = 0;
+    socklen_t len  = sizeof(size);
+    return getsockopt(sockfd, SOL_UDP, UDP_SEGMENT, &size, &len) == 0;
+}
+
+/* Let `sockfd` deliver GRO runs (kernel 5.0+); 1 if it now may */
+static inline int udp_gro_enable(int sockfd)
+{
+    int on = 1;
+    return setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof(on)) == 0;
+}
+
+/* Let `sockfd` send with MSG_ZEROCOPY (kernel 4.14+, UDP 5.0+) */
+static inline int udp_zerocopy_enable(int sockfd)
+{
+    int on = 1;
+    return setsockopt(sockfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Send side                                                          */
+/* ------------------------------------------------------------------ */
+
+/* One sendmmsg() entry: a single packet or a GSO run */
+typedef struct {
+    int                 iov;            /* First packet in TxBatch.iov    */
+    int                 nseg;           /* Packets in the entry           */
+    int                 seg;            /* Length of all but the last     */
+    int                 bytes;
+    int                 open;           /* May take another packet        */
+    uint64_t            departure;      /* SO_TXTIME stamp (ns)           */
+} TxEntry;
+
+typedef struct {
+    int                         sockfd;
+    const struct sockaddr_in   *dest;
+    socklen_t                   dest_len;
+    int                         txtime;     /* Stamp with SCM_TXTIME      */
+    int                         gso;        /* Coalesce with UDP_SEGMENT  */
+    int                         count;      /* Entries queued             */
+    int                         niov;       /* Packets queued             */
+    unsigned                    segmented;  /* Packets sent inside a run  */
+    int                         zerocopy;   /* Send with MSG_ZEROCOPY     */
+    unsigned                    zc_sends;   /* Zero-copy sends that went  */
+    void                      (*refused)(void *arg, uint32_t tag);
+    void                       *refused_arg; /* Told of each packet a full */
+                                             /* socket buffer turned away */
+    TxEntry                     entry[IO_BATCH];
+    struct mmsghdr              msgs[IO_BATCH];
+    struct iovec                iov[IO_BATCH_IOV];
+    uint32_t                    tag[IO_BATCH_IOV];
+    union {
+        char                    buf[CMSG_SPACE(sizeof(uint64_t)) +
+                                    CMSG_SPACE(sizeof(uint16_t))];
+        struct cmsghdr          align;
+    }                           ctl[IO_BATCH];
+} TxBatch;
+
+static inline void tx_batch_init(TxBatch *b, int sockfd,
+                                 const struct sockaddr_in *dest,
+                                 socklen_t dest_len, int txtime)
+{
+    b->sockfd    = sockfd;
+    b->dest      = dest;
+    b->dest_len  = dest_len;
+    b->txtime    = txtime;
+    b->gso       = 0;
+    b->count     = 0;
+    b->niov      = 0;
+    b->segmented = 0;
+    b->zerocopy  = 0;
+    b->zc_sends  = 0;
+    b->refused   = NULL;
+}
+
+/* Hand the packets of entries `from`.. to the refused callback */
+static inline void tx_batch_refuse(TxBatch *b, int from, int first)
+{
+    for (int i = from; i < b->count; i++) {
+        const TxEntry *e = &b->entry[i];
+        for (int j = i == from ? first : 0; j < e->nseg; j++)
+            if (b->refused)
+                b->refused(b->refused_arg, b->tag[e->iov + j]);
+    }
+}
+
+/* Fill in the msghdr for entry `i`; a single packet gets no
+ * UDP_SEGMENT, which also serves to send a refused run one by one.   */
+static inline void tx_batch_msg(TxBatch *b, int i, struct msghdr *m,
+                                int first, int nseg)
+{
+    const TxEntry *e = &b->entry[i];
+
+    memset(m, 0, sizeof(*m));
+    m->msg_name    = (void *)b->dest;
+    m->msg_namelen = b->dest_len;
+    m->msg_iov     = &b->iov[first];
+    m->msg_iovlen  = nseg;
+    if (!b->txtime && nseg == 1)
+        return;
+
+    m->msg_control    = b->ctl[i].buf;
+    m->msg_controllen = sizeof(b->ctl[i].buf);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(m);
+    size_t          used = 0;
+    if (b->txtime) {
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type  = SCM_TXTIME;
+        cm->cmsg_len   = CMSG_LEN(sizeof(uint64_t));
+        memcpy(CMSG_DATA(cm), &e->departure, sizeof(e->departure));
+        used += CMSG_SPACE(sizeof(uint64_t));
+        cm = CMSG_NXTHDR(m, cm);
+    }
+    if (nseg > 1) {
+        uint16_t seg = (uint16_t)e->seg;
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type  = UDP_SEGMENT;
+        cm->cmsg_len   = CMSG_LEN(sizeof(uint16_t));
+        memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+        used += CMSG_SPACE(sizeof(uint16_t));
+    }
+    m->msg_controllen = used;
+}
+
+/*
+ * tx_batch_flush – Send everything queued, in as few sendmmsg() calls
+ *                  as the kernel allows.  A datagram it refuses is
+ *                  skipped so the rest still go out; a GSO run it
+ *                  refuses is sent again one packet at a time, copied so
+ *                  it adds no completions, and GSO is switched off.  A
+ *                  zero-copy send refused for want of notification
+ *                  memory (ENOBUFS) is sent again copied.  Once the
+ *                  socket buffer is full (EAGAIN) the rest is not tried
+ *                  and each packet's tag goes to `refused`, so the
+ *                  caller can send it again later.  `zc_sends` counts
+ *                  the sends that went zero-copy.
+ */
+static inline void tx_batch_flush(TxBatch *b)
+{
+    int flags = b->zerocopy ? MSG_ZEROCOPY : 0;
+
+    for (int i = 0; i < b->count; i++)
+        tx_batch_msg(b, i, &b->msgs[i].msg_hdr, b->entry[i].iov,
+                     b->entry[i].nseg);
+
+    int sent = 0;
+    while (sent < b->count) {
+        int n = sendmmsg(b->sockfd, b->msgs + sent, b->count - sent, flags);
+        if (n > 0) {
+            for (int i = sent; i < sent + n; i++)
+                if (b->entry[i].nseg > 1)
+                    b->segmented += b->entry[i].nseg;
+            if (flags)
+                b->zc_sends += n;
+            sent += n;
+            continue;
+        }
+
+        const TxEntry *e = &b->entry[sent];
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            tx_batch_refuse(b, sent, 0);
+            break;
+        }
+        if (e->nseg > 1 &&
+            (errno == EIO || errno == EINVAL || errno == EOPNOTSUPP)) {
+            b->gso = 0;
+            int j;
+            for (j = 0; j < e->nseg; j++) {
+                struct msghdr m;
+                tx_batch_msg(b, sent, &m, e->iov + j, 1);
+                if (sendmsg(b->sockfd, &m, 0) < 0 &&
+                    (errno == EAGAIN || errno == EWOULDBLOCK))
+                    break;
+            }
+            if (j < e->nseg) {
+                tx_batch_refuse(b, sent, j);
+                break;
+            }
+        } else if (flags && errno == ENOBUFS) {
+            sendmsg(b->sockfd, &b->msgs[sent].msg_hdr, 0);
+        }
+        sent++;
+    }
+    b->count = 0;
+    b->niov  = 0;
+}
+
+/*
+ * tx_batch_add – Queue one datagram, leaving at `departure` (ns, the
+ *                pacer's clock) when txtime is on.  `pkt` is not copied
+ *                and must stay unchanged until the next flush.  With GSO
+ *                it joins the previous entry when it fits that run: no
+ *                longer than its packets (a shorter one ends the run),
+ *                within the kernel's limits, and leaving at the same
+ *                time – with txtime that is rare, so kernel pacing and
+ *                GSO mostly exclude each other.  `tag` is what
+ *                `refused` hears of it.
+ */
+static inline void tx_batch_add(TxBatch *b, const uint8_t *pkt, int len,
+                                uint64_t departure, uint32_t tag)
+{
+    if (b->niov == IO_BATCH_IOV)
+        tx_batch_flush(b);
+
+    TxEntry *e = b->count ? &b->entry[b->count - 1] : NULL;
+    if (!b->gso || !e || !e->open || len > e->seg ||
+        e->nseg == GSO_MAX_SEGS || e->bytes + len > GSO_MAX_BYTES ||
+        (b->txtime && departure != e->departure)) {
+        if (b->count == IO_BATCH)
+            tx_batch_flush(b);
+        e = &b->entry[b->count++];
+        e->iov       = b->niov;
+        e->nseg      = 0;
+        e->seg       = len;
+        e->bytes     = 0;
+        e->departure = departure;
+    }
+
+    b->iov[b->niov].iov_base = (void *)pkt;
+    b->iov[b->niov].iov_len  = len;
+    b->tag[b->niov]          = tag;
+    b->niov++;
+    e->nseg++;
+    e->bytes += len;
+    e->open   = len == e->seg;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Zero-copy completions                                              */
+/* ------------------------------------------------------------------ */
+
+/*
+ * The kernel numbers a socket's zero-copy sends 0, 1, 2 … and reports
+ * finished ranges of them on the error queue, not necessarily in order.
+ * A ZcTracker keeps the first send not yet reported (`done`) and a
+ * bitmap of the ones reported beyond it, so an owner can tell when the
+ * buffers of a given send may be reused.
+ */
+typedef struct {
+    uint32_t            sent;           /* Sends numbered so far          */
+    uint32_t            done;           /* All before this are finished   */
+    unsigned            copied;         /* Reports of a copy after all    */
+    uint8_t             seen[ZC_TRACK / 8];  /* Finished beyond `done`    */
+} ZcTracker;
+
+/* Sends `z` may still start before its bitmap could overflow */
+static inline int zc_room(const ZcTracker *z)
+{
+    return (int)(ZC_TRACK - (z->sent - z->done));
+}
+
+/* Whether every send numbered below `upto` has finished; `upto` past
+ * the sends made so far means all of them                            */
+static inline int zc_released(const ZcTracker *z, uint32_t upto)
+{
+    if ((int32_t)(upto - z->sent) > 0)
+        upto = z->sent;
+    return (int32_t)(z->done - upto) >= 0;
+}
+
+static inline void zc_finish(ZcTracker *z, uint32_t lo, uint32_t hi)
+{
+    for (uint32_t id = lo; id != hi + 1; id++) {
+        uint32_t ahead = id - z->done;
+        if (ahead < ZC_TRACK)
+            z->seen[(id % ZC_TRACK) / 8] |= (uint8_t)(1u << (id % 8));
+    }
+    for (;;) {
+        uint8_t *bit  = &z->seen[(z->done % ZC_TRACK) / 8];
+        uint8_t  mask = (uint8_t)(1u << (z->done % 8));
+        if (!(*bit & mask))
+            break;
+        *bit &= (uint8_t)~mask;
+        z->done++;
+    }
+}
+
+/*
+ * zc_reap – Take every completion queued on `sockfd`'s error queue.
+ *           Returns how many of them said the kernel had copied the
+ *           data after all (e.g. over loopback), where zero-copy only
+ *           costs.
+ */
+static inline int zc_reap(ZcTracker *z, int sockfd)
+{
+    int copied = 0;
+    for (;;) {
+        union {
+            char            buf[CMSG_SPACE(sizeof(struct sock_extended_err)) +
+                                64];
+            struct cmsghdr  align;
+        } ctl;
+        struct msghdr m;
+        memset(&m, 0, sizeof(m));
+        m.msg_control    = ctl.buf;
+        m.msg_controllen = sizeof(ctl.buf);
+        if (recvmsg(sockfd, &m, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+            break;
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&m); cm;
+             cm = CMSG_NXTHDR(&m, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 &&
+                   cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            struct sock_extended_err ee;
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            zc_finish(z, ee.ee_info, ee.ee_data);
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                copied++;
+        }
+    }
+    z->copied += copied;
+    return copied;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Receive side                                                       */
+/* ------------------------------------------------------------------ */
+
+/* One datagram of the last fill, possibly cut out of a GRO run */
+typedef struct {
+    uint32_t            off;            /* Into RxBatch.buf               */
+    uint16_t            len;
+    uint16_t            msg;            /* recvmmsg() entry it came from  */
+} RxSegment;
+
+typedef struct {
+    int                 count;          /* Datagrams from the last fill   */
+    int                 received;       /* recvmmsg() entries filled      */
+    unsigned            coalesced;      /* Of `count`, arrived in a run   */
+    size_t              cap;            /* Bytes per recvmmsg() buffer    */
+    int                 max_seg;        /* Largest GRO segment taken, or 0*/
+    uint8_t            *buf;            /* IO_BATCH × cap                 */
+    RxSegment          *seg;            /* IO_BATCH × GSO_MAX_SEGS        */
+    struct mmsghdr      msgs[IO_BATCH];
+    struct iovec        iov[IO_BATCH];
+    struct sockaddr_in  from[IO_BATCH];
+    union {
+        char            buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr  align;
+    }                   ctl[IO_BATCH];
+} RxBatch;
+
+/* Buffers for IO_BATCH datagrams of up to `cap` bytes (GRO_BUF_SIZE if
+ * the socket has GRO on); 0 or -1                                     */
+static inline int rx_batch_init(RxBatch *b, size_t cap)
+{
+    b->count    = 0;
+    b->received = 0;
+    b->cap      = cap;
+    b->max_seg  = 0;
+    b->buf      = malloc(IO_BATCH * cap);
+    b->seg      = malloc(IO_BATCH * GSO_MAX_SEGS * sizeof(RxSegment));
+    if (!b->buf || !b->seg) {
+        free(b->buf);
+        free(b->seg);
+        b->buf = NULL;
+        b->seg = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static inline void rx_batch_free(RxBatch *b)
+{
+    free(b->buf);
+    free(b->seg);
+    b->buf = NULL;
+    b->seg = NULL;
+}
+
+/* Segment size of a GRO run, or 0 for a plain datagram */
+static inline int rx_batch_gro_size(struct msghdr *m)
+{
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(m); cm;
+         cm = CMSG_NXTHDR(m, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cm), sizeof(size));
+            return size;
+        }
+    }
+    return 0;
+}
+
+/*
+ * rx_batch_fill – Take whatever is queued on `sockfd`, up to IO_BATCH
+ *                 recvmmsg() entries, without blocking, and cut GRO runs
+ *                 back into datagrams.  Returns how many datagrams;
+ *                 rx_batch_drained() tells whether the socket is empty.
+ *                 A run cut into segments larger than `max_seg` (when
+ *                 set) is malformed and dropped whole.
+ */
+static inline int rx_batch_fill(RxBatch *b, int sockfd)
+{
+    for (int i = 0; i < IO_BATCH; i++) {
+        struct msghdr *m = &b->msgs[i].msg_hdr;
+        b->iov[i].iov_base = b->buf + (size_t)i * b->cap;
+        b->iov[i].iov_len  = b->cap;
+        memset(m, 0, sizeof(*m));
+        m->msg_name       = &b->from[i];
+        m->msg_namelen    = sizeof(b->from[i]);
+        m->msg_iov        = &b->iov[i];
+        m->msg_iovlen     = 1;
+        m->msg_control    = b->ctl[i].buf;
+        m->msg_controllen = sizeof(b->ctl[i].buf);
+    }
+
+    int n = recvmmsg(sockfd, b->msgs, IO_BATCH, MSG_DONTWAIT, NULL);
+    b->received  = n > 0 ? n : 0;
+    b->count     = 0;
+    b->coalesced = 0;
+    for (int i = 0; i < b->received; i++) {
+        uint32_t base = (uint32_t)((size_t)i * b->cap);
+        int      len  = (int)b->msgs[i].msg_len;
+        int      size = rx_batch_gro_size(&b->msgs[i].msg_hdr);
+        if (size > 0 && b->max_seg > 0 && size > b->max_seg)
+            continue;           /* the peer picks the segment size     */
+        if (size <= 0 || size >= len)
+            size = len;
+        else
+            b->coalesced += (len + size - 1) / size;
+
+        int off = 0;
+        do {
+            RxSegment *s = &b->seg[b->count++];
+            s->off = base + off;
+            s->len = (uint16_t)(len - off < size ? len - off : size);
+            s->msg = (uint16_t)i;
+            off   += size;
+        } while (off < len && b->count < IO_BATCH * GSO_MAX_SEGS);
+    }
+    return b->count;
+}
+
+/* The last fill emptied the socket */
+static inline int rx_batch_drained(const RxBatch *b)
+{
+    return b->received < IO_BATCH;
+}
+
+/* Payload, length and sender of datagram `i` from the last fill */
+static inline uint8_t *rx_batch_data(const RxBatch *b, int i)
+{
+    return b->buf + b->seg[i].off;
+}
+
+static inline int rx_batch_len(const RxBatch *b, int i)
+{
+    return b->seg[i].len;
+}
+
+static inline const struct sockaddr_in *rx_batch_from(const RxBatch *b,
+                                                      int i)
+{
+    return &b->from[b->seg[i].msg];
+}
+
+#endif /* BATCHIO_H */
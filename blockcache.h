@@ -0,0 +1,547 @@
+/*
+ * blockcache.h
+ * =====================================================================
+ * Enhanced TFTP – server-wide cache of encrypted DATA blocks
+ *
+ * Under AES-256-CBC every DATA block is encrypted with the same key and
+ * IV, so a block of a file always becomes the same ciphertext.  A GCM
+ * download the cache can serve gets a salt of the file's own from
+ * block_cache_salt instead of the client's, and with it the same key
+ * as every other download of that version of the file from the same
+ * byte.  When many clients fetch a popular file, each download would
+ * still read and encrypt every block again; with the cache only the
+ * first one does:
+ *
+ *   • Key – the file's identity (device, inode, mtime, size), the
+ *           block's byte offset and plaintext length, and for GCM the
+ *           byte the stream starts at.  A file that is rewritten in
+ *           place gets a new mtime, so its old blocks can no longer be
+ *           hit even before they are dropped.
+ *   • File keys – a GCM nonce is the block's offset in the stream, so
+ *                 the salt covers the file's identity and the stream's
+ *                 first byte, under a secret drawn at startup: ranged
+ *                 and resumed downloads get keys of their own, and a
+ *                 nonce only repeats for the same plaintext.  The price
+ *                 is that two downloads of a file send the same
+ *                 ciphertext, as under CBC; content that changes with
+ *                 neither mtime nor size moving would reuse nonces.
+ *   • Shards – CACHE_SHARDS hash tables, each with its own lock, LRU
+ *              list and share of the memory budget.  A block's shard
+ *              comes from its key hash, so workers fetching different
+ *              blocks seldom meet on a lock.
+ *   • Budget – ciphertext plus per-entry overhead; an insert past a
+ *              shard's share evicts from the cold end of its LRU.
+ *   • Invalidation – an upload or delete drops every block of the file
+ *                    it replaces (block_cache_forget).
+ *   • Single flight – the first session to miss a block leaves a
+ *                     marker under its key until it has cached the
+ *                     block.  Callers run on reactor workers, so one
+ *                     that meets the marker does not wait: its
+ *                     producer answers PRODUCE_AGAIN and the session
+ *                     retries after CACHE_RETRY_USEC, when the block
+ *                     is usually there.
+ *
+ * A download reaches the cache through cache_produce, a BlockProducer
+ * wrapped around the one that would read the file, so it combines with
+ * mapped (-z) and io_uring (-U) reads.  Compressed streams are not
+ * cached: how a block is deflated depends on the blocks before it.
+ * =====================================================================
+ */
+
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include "udp_file_transfer.h"
+#include "transport.h"
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define CACHE_SHARDS        16
+#define CACHE_DEFAULT_MB    64
+#define CACHE_RETRY_USEC    200         /* Wait for another's fill    */
+
+#define CACHE_MISS          -1          /* block_cache_claim results      */
+#define CACHE_FILLING       -2
+
+typedef struct {
+    uint64_t    dev;
+    uint64_t    ino;
+    int64_t     mtime_ns;
+    int64_t     size;
+    uint64_t    base;                   /* GCM stream's first byte, else 0*/
+    uint64_t    pos;                    /* File byte the block starts at  */
+    int         len;                    /* Its plaintext length           */
+    int         gcm;                    /* Sealed with the file's GCM key */
+} CacheKey;
+
+typedef struct CacheEntry {
+    struct CacheEntry  *hnext;          /* Hash chain                     */
+    struct CacheEntry  *prev, *next;    /* LRU, most recent first         */
+    CacheKey            key;
+    uint32_t            hash;
+    int                 enc_len;        /* CACHE_FILLING for a marker,    */
+                                        /* which is only on its chain     */
+    uint8_t             data[];         /* Ciphertext                     */
+} CacheEntry;
+
+typedef struct {
+    pthread_mutex_t     lock;
+    CacheEntry        **buckets;
+    unsigned            nbuckets;       /* Power of two                   */
+    CacheEntry         *head, *tail;    /* LRU ends                       */
+    size_t              bytes;
+    size_t              budget;
+} CacheShard;
+
+typedef struct {
+    CacheShard          shards[CACHE_SHARDS];
+    size_t              budget;         /* 0 = cache off                  */
+    uint8_t             secret[AES_KEY_SIZE];   /* Keys the file salts    */
+    uint64_t            hits;           /* (atomic)                       */
+    uint64_t            joined;         /* Of them, waited for a fill     */
+    uint64_t            misses;         /* (atomic)                       */
+    uint64_t            evictions;      /* (atomic)                       */
+} BlockCache;
+
+/*
+ * block_cache_init – Set up an empty cache of `budget` bytes; 0 leaves
+ *                    it off.  Returns 0, or -1 if out of memory.
+ */
+static inline int block_cache_init(BlockCache *c, size_t budget)
+{
+    memset(c, 0, sizeof(*c));
+    c->budget = budget;
+    if (budget == 0)
+        return 0;
+
+    /* About one bucket per full-sized default block the share holds */
+    size_t   share    = budget / CACHE_SHARDS;
+    unsigned nbuckets = 64;
+    while (nbuckets < share / ENHANCED_BLOCK_SIZE && nbuckets < 1u << 20)
+        nbuckets <<= 1;
+
+    if (RAND_bytes(c->secret, sizeof(c->secret)) != 1)
+        return -1;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *sh = &c->shards[i];
+        pthread_mutex_init(&sh->lock, NULL);
+        sh->budget   = share;
+        sh->nbuckets = nbuckets;
+        sh->buckets  = calloc(nbuckets, sizeof(*sh->buckets));
+        if (!sh->buckets)
+            return -1;
+    }
+    return 0;
+}
+
+static inline void block_cache_destroy(BlockCache *c)
+{
+    if (c->budget == 0)
+        return;
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *sh = &c->shards[i];
+        for (unsigned b = 0; b < sh->nbuckets; b++)     /* and markers */
+            for (CacheEntry *e = sh->buckets[b], *next; e; e = next) {
+                next = e->hnext;
+                free(e);
+            }
+        free(sh->buckets);
+        pthread_mutex_destroy(&sh->lock);
+    }
+    OPENSSL_cleanse(c->secret, sizeof(c->secret));
+    c->budget = 0;
+}
+
+static inline uint32_t cache_hash(const CacheKey *k)
+{
+    uint64_t h = k->ino * 0x9E3779B97F4A7C15ULL;
+    h ^= (uint64_t)k->mtime_ns + (h << 6) + (h >> 2);
+    h ^= k->dev + (h << 6) + (h >> 2);
+    h ^= k->base + (uint64_t)k->gcm + (h << 6) + (h >> 2);
+    h ^= k->pos + (uint64_t)k->len + (h << 6) + (h >> 2);
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    return (uint32_t)h;
+}
+
+static inline int cache_key_equal(const CacheKey *a, const CacheKey *b)
+{
+    return a->pos == b->pos && a->ino == b->ino && a->dev == b->dev &&
+           a->mtime_ns == b->mtime_ns && a->size == b->size &&
+           a->len == b->len && a->base == b->base && a->gcm == b->gcm;
+}
+
+static inline CacheShard *cache_shard(BlockCache *c, uint32_t hash)
+{
+    return &c->shards[hash >> 28 & (CACHE_SHARDS - 1)];
+}
+
+/* The chain link holding `k`'s entry or marker, or the chain's end */
+static inline CacheEntry **cache_find(CacheShard *sh, uint32_t hash,
+                                      const CacheKey *k)
+{
+    CacheEntry **pp = &sh->buckets[hash & (sh->nbuckets - 1)];
+    while (*pp && !((*pp)->hash == hash && cache_key_equal(&(*pp)->key, k)))
+        pp = &(*pp)->hnext;
+    return pp;
+}
+
+/* Unlink `e` from its chain and the LRU; the caller holds the lock */
+static inline void cache_remove(CacheShard *sh, CacheEntry *e)
+{
+    CacheEntry **pp = &sh->buckets[e->hash & (sh->nbuckets - 1)];
+    while (*pp != e)
+        pp = &(*pp)->hnext;
+    *pp = e->hnext;
+
+    if (e->prev) e->prev->next = e->next; else sh->head = e->next;
+    if (e->next) e->next->prev = e->prev; else sh->tail = e->prev;
+    sh->bytes -= sizeof(*e) + (size_t)e->enc_len;
+}
+
+static inline void cache_push_front(CacheShard *sh, CacheEntry *e)
+{
+    e->prev = NULL;
+    e->next = sh->head;
+    if (sh->head)
+        sh->head->prev = e;
+    sh->head = e;
+    if (!sh->tail)
+        sh->tail = e;
+}
+
+/*
+ * block_cache_claim – Copy the ciphertext cached for `k` into `payload`
+ *                     and return its length.  CACHE_FILLING means
+ *                     another session is filling the block.  On
+ *                     CACHE_MISS the caller is the filler: a marker
+ *                     now stands for the block until it calls
+ *                     block_cache_put or block_cache_release.
+ */
+static inline int block_cache_claim(BlockCache *c, const CacheKey *k,
+                                    uint8_t *payload)
+{
+    uint32_t    hash = cache_hash(k);
+    CacheShard *sh   = cache_shard(c, hash);
+    int         len  = CACHE_MISS;
+
+    pthread_mutex_lock(&sh->lock);
+    CacheEntry **pp = cache_find(sh, hash, k);
+    CacheEntry  *e  = *pp;
+    if (e && e->enc_len == CACHE_FILLING) {
+        len = CACHE_FILLING;
+    } else if (e) {
+        if (e != sh->head) {
+            if (e->prev) e->prev->next = e->next;
+            if (e->next) e->next->prev = e->prev; else sh->tail = e->prev;
+            cache_push_front(sh, e);
+        }
+        memcpy(payload, e->data, e->enc_len);
+        len = e->enc_len;
+    } else if ((e = malloc(sizeof(*e))) != NULL) {
+        e->key     = *k;
+        e->hash    = hash;
+        e->enc_len = CACHE_FILLING;
+        e->hnext   = NULL;
+        *pp        = e;
+    }
+    pthread_mutex_unlock(&sh->lock);
+    return len;
+}
+
+/*
+ * block_cache_release – Take down the marker of a claim that will not
+ *                       be filled (a failed or short read, or a session
+ *                       that ends first).
+ */
+static inline void block_cache_release(BlockCache *c, const CacheKey *k)
+{
+    uint32_t    hash = cache_hash(k);
+    CacheShard *sh   = cache_shard(c, hash);
+    CacheEntry *e;
+
+    pthread_mutex_lock(&sh->lock);
+    CacheEntry **pp = cache_find(sh, hash, k);
+    e = *pp;
+    if (e && e->enc_len == CACHE_FILLING)
+        *pp = e->hnext;
+    else
+        e = NULL;
+    pthread_mutex_unlock(&sh->lock);
+    free(e);
+}
+
+/*
+ * block_cache_put – Cache `enc_len` bytes of ciphertext for `k` in place
+ *                   of its marker, making room in its shard from the
+ *                   cold end.  A block already cached is left as it is.
+ */
+static inline void block_cache_put(BlockCache *c, const CacheKey *k,
+                                   const uint8_t *cipher, int enc_len)
+{
+    size_t      need = sizeof(CacheEntry) + (size_t)enc_len;
+    uint32_t    hash = cache_hash(k);
+    CacheShard *sh   = cache_shard(c, hash);
+    CacheEntry *e    = need > sh->budget ? NULL : malloc(need);
+    if (!e) {
+        block_cache_release(c, k);
+        return;
+    }
+    e->key     = *k;
+    e->hash    = hash;
+    e->enc_len = enc_len;
+    memcpy(e->data, cipher, enc_len);
+
+    unsigned    evicted = 0;
+    CacheEntry *victims = NULL;
+    pthread_mutex_lock(&sh->lock);
+
+    CacheEntry **pp  = cache_find(sh, hash, k);
+    CacheEntry  *dup = *pp;
+    if (dup && dup->enc_len != CACHE_FILLING) {
+        pthread_mutex_unlock(&sh->lock);
+        free(e);
+        return;
+    }
+    if (dup)
+        *pp = dup->hnext;               /* the marker, freed below      */
+    while (sh->tail && sh->bytes + need > sh->budget) {
+        CacheEntry *old = sh->tail;
+        cache_remove(sh, old);
+        old->next = victims;            /* freed once the lock is gone  */
+        victims   = old;
+        evicted++;
+    }
+    CacheEntry **bucket = &sh->buckets[hash & (sh->nbuckets - 1)];
+    e->hnext = *bucket;
+    *bucket  = e;
+    cache_push_front(sh, e);
+    sh->bytes += need;
+
+    pthread_mutex_unlock(&sh->lock);
+
+    free(dup);
+    while (victims) {
+        CacheEntry *next = victims->next;
+        free(victims);
+        victims = next;
+    }
+    if (evicted)
+        __atomic_add_fetch(&c->evictions, evicted, __ATOMIC_RELAXED);
+}
+
+/*
+ * block_cache_forget – Drop every cached block of the file at `path`,
+ *                      before an upload or delete replaces it.  Returns
+ *                      the number of blocks dropped.
+ */
+static inline unsigned block_cache_forget(BlockCache *c, const char *path)
+{
+    struct stat st;
+    unsigned    dropped = 0;
+    if (c->budget == 0 || stat(path, &st) < 0)
+        return 0;
+
+    for (int i = 0; i < CACHE_SHARDS; i++) {
+        CacheShard *sh      = &c->shards[i];
+        CacheEntry *victims = NULL;
+        pthread_mutex_lock(&sh->lock);
+        for (CacheEntry *e = sh->head, *next; e; e = next) {
+            next = e->next;
+            if (e->key.ino != (uint64_t)st.st_ino ||
+                e->key.dev != (uint64_t)st.st_dev)
+                continue;
+            cache_remove(sh, e);
+            e->next = victims;
+            victims = e;
+            dropped++;
+        }
+        pthread_mutex_unlock(&sh->lock);
+        while (victims) {
+            CacheEntry *next = victims->next;
+            free(victims);
+            victims = next;
+        }
+    }
+    return dropped;
+}
+
+/* The identity of the file open at `fd` into `k`, which is cleared
+ * first; -1 if it is not a regular file with a name                  */
+static inline int cache_identity(int fd, CacheKey *k)
+{
+    struct stat st;
+    memset(k, 0, sizeof(*k));
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_nlink == 0)
+        return -1;
+    k->dev      = (uint64_t)st.st_dev;
+    k->ino      = (uint64_t)st.st_ino;
+    k->mtime_ns = (int64_t)st.st_mtim.tv_sec * 1000000000LL +
+                  st.st_mtim.tv_nsec;
+    k->size     = (int64_t)st.st_size;
+    return 0;
+}
+
+/*
+ * block_cache_salt – The GCM salt for a download of the file open at
+ *                    `fd` that starts at file byte `base`: the leading
+ *                    GCM_SALT_LEN bytes of HMAC-SHA256 of its identity
+ *                    under the cache's secret.  Returns 0, or -1 when
+ *                    the cache is off or the file cannot be cached.
+ */
+static inline int block_cache_salt(BlockCache *c, int fd, uint64_t base,
+                                   uint8_t *salt)
+{
+    CacheKey      id;
+    uint8_t       mac[EVP_MAX_MD_SIZE];
+    unsigned int  len = 0;
+
+    if (c->budget == 0 || cache_identity(fd, &id) < 0)
+        return -1;
+    id.base = base;
+    id.gcm  = 1;
+    if (!HMAC(EVP_sha256(), c->secret, sizeof(c->secret),
+              (const uint8_t *)&id, sizeof(id), mac, &len) ||
+        len < GCM_SALT_LEN)
+        return -1;
+    memcpy(salt, mac, GCM_SALT_LEN);
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Cached downloads                                                   */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    BlockCache     *cache;
+    FileStream     *fs;
+    CacheKey        key;                /* File identity; pos/len per call*/
+    BlockProducer   produce;            /* Reads and encrypts on a miss   */
+    void           *arg;
+    unsigned        hits;
+    unsigned        joined;             /* Hits that waited for a fill    */
+    unsigned        misses;
+    int             claimed;            /* Holds the marker of `key`      */
+    int             waiting;            /* Another session fills `key`    */
+} CacheFile;
+
+/* Whether `fs` is sealed with the GCM key block_cache_salt gives it */
+static inline int cache_file_key(BlockCache *c, const FileStream *fs)
+{
+    uint8_t     salt[GCM_SALT_LEN];
+    BlockCipher bc;
+    int         own;
+
+    cipher_init(&bc);
+    own = block_cache_salt(c, fs->fd, fs->base, salt) == 0 &&
+          cipher_set_gcm(&bc, salt) == 0 &&
+          CRYPTO_memcmp(bc.key, fs->cipher.key, AES_KEY_SIZE) == 0;
+    cipher_free(&bc);
+    return own;
+}
+
+/*
+ * cache_file_open – Put the cache in front of `produce`/`arg`, the
+ *                   producer of `fs`.  Returns 0, or -1 when the stream
+ *                   cannot share blocks: the cache is off, the stream
+ *                   is compressed or digested, its GCM key is not the
+ *                   file's, or the file is unlinked.
+ */
+static inline int cache_file_open(CacheFile *cf, BlockCache *c,
+                                  FileStream *fs, BlockProducer produce,
+                                  void *arg)
+{
+    CacheKey id;
+    if (c->budget == 0 || fs->codec != CODEC_NONE || fs->md5 ||
+        cache_identity(fs->fd, &id) < 0 ||
+        (fs->cipher.gcm && !cache_file_key(c, fs)))
+        return -1;
+
+    memset(cf, 0, sizeof(*cf));
+    cf->cache    = c;
+    cf->fs       = fs;
+    cf->key      = id;
+    cf->key.gcm  = fs->cipher.gcm;
+    cf->key.base = fs->cipher.gcm ? fs->base : 0;
+    cf->produce  = produce;
+    cf->arg      = arg;
+    return 0;
+}
+
+/*
+ * cache_file_close – Take down the marker of a fill the session leaves
+ *                    unfinished.
+ */
+static inline void cache_file_close(CacheFile *cf)
+{
+    if (cf->claimed)
+        block_cache_release(cf->cache, &cf->key);
+    cf->claimed = 0;
+}
+
+/*
+ * cache_produce – BlockProducer: the cached ciphertext of the block at
+ *                 stream byte `offset`, or else the wrapped producer's,
+ *                 which is then cached if it read the whole block.
+ *                 While another session fills the block it answers
+ *                 PRODUCE_AGAIN with `waiting` set, and the caller
+ *                 comes back after CACHE_RETRY_USEC.  A fill of its
+ *                 own that the wrapped producer defers keeps its
+ *                 marker until the retry completes it.
+ */
+static inline int cache_produce(void *arg, uint64_t offset,
+                                uint8_t *payload, int *raw_len)
+{
+    CacheFile *cf   = (CacheFile *)arg;
+    uint64_t   pos  = cf->fs->base + offset;
+    int        want = file_stream_want(cf->fs, offset);
+
+    /* Without a range the stream runs to EOF, which the key knows */
+    if (pos >= (uint64_t)cf->key.size)
+        want = 0;
+    else if ((uint64_t)cf->key.size - pos < (uint64_t)want)
+        want = (int)((uint64_t)cf->key.size - pos);
+    if (cf->claimed && (cf->key.pos != pos || cf->key.len != want))
+        cache_file_close(cf);
+    if (want == 0)
+        return cf->produce(cf->arg, offset, payload, raw_len);
+
+    if (!cf->claimed) {
+        cf->key.pos = pos;
+        cf->key.len = want;
+        int enc_len = block_cache_claim(cf->cache, &cf->key, payload);
+        if (enc_len == CACHE_FILLING) {
+            cf->waiting = 1;
+            return PRODUCE_AGAIN;
+        }
+        if (enc_len >= 0) {
+            cf->hits++;
+            __atomic_add_fetch(&cf->cache->hits, 1, __ATOMIC_RELAXED);
+            if (cf->waiting) {
+                cf->joined++;
+                __atomic_add_fetch(&cf->cache->joined, 1, __ATOMIC_RELAXED);
+            }
+            cf->waiting = 0;
+            *raw_len = want;
+            return enc_len;
+        }
+        cf->waiting = 0;                /* a failed fill passes it on   */
+        cf->claimed = 1;
+    }
+
+    int enc_len = cf->produce(cf->arg, offset, payload, raw_len);
+    if (enc_len == PRODUCE_AGAIN)
+        return PRODUCE_AGAIN;
+    cf->claimed = 0;
+    if (enc_len > 0 && *raw_len == want)
+        block_cache_put(cf->cache, &cf->key, payload, enc_len);
+    else
+        block_cache_release(cf->cache, &cf->key);
+
+    cf->misses++;
+    __atomic_add_fetch(&cf->cache->misses, 1, __ATOMIC_RELAXED);
+    return enc_len;
+}
+
+#endif /* BLOCKCACHE_H */
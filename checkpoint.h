@@ -0,0 +1,251 @@
+/*
+ * checkpoint.h
+ * =====================================================================
+ * Enhanced TFTP – resumable transfers ("resume" option)
+ *
+ * The receiving end of a transfer keeps a small journal next to the
+ * file it is writing, "<file>.ckpt":
+ *
+ *     tftp-checkpoint 1
+ *     size   <bytes in the whole file, -1 if unknown>
+ *     offset <bytes known to be on disk>
+ *     md5    <digest of those first offset bytes>
+ *
+ * Blocks are consumed in order, so everything before `offset` has been
+ * written.  Every CHECKPOINT_INTERVAL bytes the data is flushed with
+ * fdatasync() and only then is the journal replaced (write, fsync,
+ * rename), so it never claims more than the disk holds – even if the
+ * process or the machine dies.  A failed transfer records how far it
+ * got; a completed one deletes its journal.
+ *
+ * A new request names the offset with the "resume" option and block 1
+ * starts there.  The digest lets the receiver check that the partial
+ * file still holds what the journal says; re-reading that prefix also
+ * rebuilds the running MD5, since an EVP digest cannot be saved.
+ * =====================================================================
+ */
+
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "udp_file_transfer.h"
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define CHECKPOINT_SUFFIX   ".ckpt"             /* Journal file suffix      */
+#define CHECKPOINT_INTERVAL (8 * 1024 * 1024)   /* Bytes between journals   */
+
+/* ------------------------------------------------------------------ */
+/*  Journal state                                                      */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    char        path[512 + sizeof(CHECKPOINT_SUFFIX)]; /* "<file>.ckpt"    */
+    int         fd;                     /* File being written             */
+    long long   size;                   /* Whole file size, -1 = unknown  */
+    uint64_t    offset;                 /* Bytes the journal vouches for  */
+    uint64_t    written;                /* Bytes consumed in order so far */
+    EVP_MD_CTX *prefix;                 /* Digest of the loaded prefix    */
+    FileStream *fs;                     /* Stream the blocks go through   */
+} Checkpoint;
+
+/*
+ * checkpoint_init – Prepare the journal of `path`, the file open as
+ *                   `fd` (nothing is read or written yet).
+ */
+static inline void checkpoint_init(Checkpoint *ck, const char *path,
+                                   int fd, long long size)
+{
+    memset(ck, 0, sizeof(*ck));
+    snprintf(ck->path, sizeof(ck->path), "%s%s", path, CHECKPOINT_SUFFIX);
+    ck->fd   = fd;
+    ck->size = size;
+}
+
+static inline void checkpoint_free(Checkpoint *ck)
+{
+    if (ck->prefix) EVP_MD_CTX_free(ck->prefix);
+    ck->prefix = NULL;
+}
+
+/*
+ * checkpoint_load – Read the journal and check it against the file:
+ *                   the sizes must agree (when `ck->size` is known) and
+ *                   the file's first `offset` bytes must still have the
+ *                   recorded digest.  Returns the offset a transfer can
+ *                   resume from, or 0 when there is nothing usable.
+ */
+static inline uint64_t checkpoint_load(Checkpoint *ck)
+{
+    FILE *jf = fopen(ck->path, "r");
+    if (!jf) return 0;
+
+    int                version = 0;
+    long long          size = -1;
+    unsigned long long offset = 0;
+    char               md5[33] = "";
+    int ok = fscanf(jf, "tftp-checkpoint %d size %lld offset %llu md5 %32s",
+                    &version, &size, &offset, md5) == 4 && version == 1;
+    fclose(jf);
+
+    if (!ok || offset == 0 || (ck->size >= 0 && size != ck->size) ||
+        (size >= 0 && offset > (unsigned long long)size))
+        return 0;
+
+    ck->prefix = EVP_MD_CTX_new();
+    if (!ck->prefix) return 0;
+    EVP_DigestInit_ex(ck->prefix, EVP_md5(), NULL);
+    if (md5_update_fd(ck->prefix, ck->fd, offset) != (long long)offset) {
+        checkpoint_free(ck);
+        return 0;
+    }
+
+    /* Compare on a copy: the context goes on hashing the rest */
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char          hex[33];
+    EVP_MD_CTX   *tmp = EVP_MD_CTX_new();
+    if (!tmp || !EVP_MD_CTX_copy_ex(tmp, ck->prefix)) {
+        EVP_MD_CTX_free(tmp);
+        checkpoint_free(ck);
+        return 0;
+    }
+    EVP_DigestFinal_ex(tmp, digest, NULL);
+    EVP_MD_CTX_free(tmp);
+    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+    if (strcmp(hex, md5) != 0) {
+        checkpoint_free(ck);
+        return 0;
+    }
+
+    ck->size = size;
+    return offset;
+}
+
+/*
+ * checkpoint_attach – Route the blocks of `fs` through the journal,
+ *                     starting `offset` bytes into the file (0 for a
+ *                     fresh transfer, or what checkpoint_load returned).
+ *                     The stream's running MD5 picks up the prefix.
+ */
+static inline void checkpoint_attach(Checkpoint *ck, FileStream *fs,
+                                     uint64_t offset)
+{
+    ck->fs      = fs;
+    ck->offset  = offset;
+    ck->written = offset;
+    if (offset > 0 && fs->md5 && ck->prefix)
+        EVP_MD_CTX_copy_ex(fs->md5, ck->prefix);
+    fs->base = offset;
+}
+
+/*
+ * checkpoint_record – Format the journal that vouches for the first
+ *                     `ck->written` bytes into `rec`.  Returns its
+ *                     length, or -1.
+ */
+static inline int checkpoint_record(Checkpoint *ck, char *rec, size_t cap)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    char          hex[33];
+    EVP_MD_CTX   *tmp = EVP_MD_CTX_new();
+    if (!tmp || !EVP_MD_CTX_copy_ex(tmp, ck->fs->md5)) {
+        EVP_MD_CTX_free(tmp);
+        return -1;
+    }
+    EVP_DigestFinal_ex(tmp, digest, NULL);
+    EVP_MD_CTX_free(tmp);
+    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(hex + i * 2, "%02x", digest[i]);
+
+    int len = snprintf(rec, cap,
+                       "tftp-checkpoint 1\nsize %lld\noffset %llu\nmd5 %s\n",
+                       ck->size, (unsigned long long)ck->written, hex);
+    return len > 0 && (size_t)len < cap ? len : -1;
+}
+
+/* The journal is written here first and renamed over `ck->path` */
+static inline void checkpoint_tmp_path(const Checkpoint *ck, char *out,
+                                       size_t cap)
+{
+    snprintf(out, cap, "%s.tmp", ck->path);
+}
+
+/*
+ * checkpoint_save – Make the first `ck->written` bytes durable, then
+ *                   record them in the journal.  Returns 0 or -1.
+ */
+static inline int checkpoint_save(Checkpoint *ck)
+{
+    if (ck->written == 0 || !ck->fs || !ck->fs->md5)
+        return 0;
+    if (fdatasync(ck->fd) < 0)
+        return -1;
+
+    char rec[160];
+    int  len = checkpoint_record(ck, rec, sizeof(rec));
+    if (len < 0)
+        return -1;
+
+    char tmp_path[sizeof(ck->path) + 4];
+    checkpoint_tmp_path(ck, tmp_path, sizeof(tmp_path));
+    int jfd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (jfd < 0)
+        return -1;
+
+    if (write(jfd, rec, len) != len || fsync(jfd) < 0) {
+        close(jfd);
+        unlink(tmp_path);
+        return -1;
+    }
+    close(jfd);
+    if (rename(tmp_path, ck->path) < 0) {
+        unlink(tmp_path);
+        return -1;
+    }
+    ck->offset = ck->written;
+    return 0;
+}
+
+/*
+ * checkpoint_finish – End of transfer: drop the journal of a complete
+ *                     file, or record how far a failed one got.
+ */
+static inline void checkpoint_finish(Checkpoint *ck, int complete)
+{
+    if (complete)
+        unlink(ck->path);
+    else if (ck->written > ck->offset)
+        checkpoint_save(ck);
+}
+
+/* Note that the file is now whole up to byte `end`, and save a
+ * checkpoint once CHECKPOINT_INTERVAL bytes have built up since the last */
+static inline void checkpoint_advance(Checkpoint *ck, uint64_t end)
+{
+    ck->written = end;
+    if (ck->written - ck->offset >= CHECKPOINT_INTERVAL)
+        checkpoint_save(ck);    /* a missed journal only costs a resend */
+}
+
+/*
+ * checkpoint_consume – BlockConsumer: write the block through the
+ *                      journal's stream (file_stream_consume) and save
+ *                      a checkpoint every CHECKPOINT_INTERVAL bytes.
+ */
+static inline int checkpoint_consume(void *arg, uint64_t offset,
+                                     const uint8_t *payload, int len)
+{
+    Checkpoint *ck = (Checkpoint *)arg;
+
+    int n = file_stream_consume(ck->fs, offset, payload, len);
+    if (n < 0)
+        return n;
+
+    checkpoint_advance(ck, ck->fs->base + offset + n);
+    return n;
+}
+
+#endif /* CHECKPOINT_H */
@@ -8,17 +8,50 @@
  *   • Upload   (WRQ)  – send a local file to the server.
  *   • Download (RRQ)  – fetch a file from the server.
  *   • Delete          – ask the server to remove a file.
- *   • AES-256-CBC encryption on all DATA payloads.
+ *   • Encryption of all DATA payloads: AES-256-GCM under a key from
+ *     the salt the server answers a random one with ("gcm" option; a
+ *     cached download gets the file's), with a tag that authenticates
+ *     each block; -E cbc asks for the shared AES-256-CBC key instead.
  *   • MD5 integrity check printed after each transfer.
  *   • Configurable block size and retransmission.
+ *   • RFC 2347 options: blksize (-b), timeout (-t), tsize, and the
+ *     RFC 7440 sliding window windowsize (-w).
+ *   • Congestion control (-c) and packet pacing (-p) for uploads.
+ *   • Selective ACKs ("sack" option) so only lost blocks are resent;
+ *     -G falls back to plain go-back-N.
+ *   • Files of any size: 32-bit block numbers ("exthdr" option) by
+ *     default, or -r 0|1 for classic 16-bit numbers that roll over.
+ *   • Multicast downloads (-M, RFC 2090): many clients fetching the
+ *     same file share one stream from the server.
+ *   • Parallel downloads (-P streams): a large file is split into byte
+ *     ranges ("range" option) fetched at once over separate TIDs.
+ *   • Resumable transfers ("resume" option): downloads keep a
+ *     checkpoint journal next to the file, and an interrupted upload
+ *     or download continues from the last durable offset.
+ *   • Forward error correction (-F K,M): M parity blocks after every K
+ *     DATA blocks rebuild lost blocks without a resend.
+ *   • Per-block compression (-Z deflate, "compress" option): blocks
+ *     are compressed before encryption unless they don't shrink.
+ *   • Delta-sync uploads (-D): only the parts of a file that differ
+ *     from the server's copy are sent ("delta" option).
+ *   • Batched I/O (batchio.h): uploads send in sendmmsg() batches and
+ *     downloads drain the socket with recvmmsg().  Uploads use UDP GSO
+ *     and downloads accept GRO runs where the kernel allows (-N turns
+ *     both off).
+ *   • Crypto pipeline (-X threads, cryptopool.h): uploads and GCM
+ *     downloads encrypt or decrypt a chunk of blocks at a time on a
+ *     pool of threads, so one large transfer can use several cores.
  *
  * Compile
  * -------
- *   gcc -Wall -Wextra -o client client.c -lssl -lcrypto
+ *   gcc -Wall -Wextra -pthread -o client client.c -lssl -lcrypto -lz
  *
  * Usage
  * -----
- *   ./client <server_ip> [port]
+ *   ./client [-b blksize] [-t timeout] [-w window] [-G] [-r 0|1] [-M]
+ *            [-P streams] [-F K,M] [-D] [-Z deflate] [-E gcm|cbc] [-N]
+ *            [-X threads] [-c aimd|vegas|fixed]
+ *            [-p user|txtime|off] <server_ip> [port]
  *
  *   Interactive menu:
  *     1) Upload a file
@@ -29,6 +62,11 @@
  */
 
 #include "udp_file_transfer.h"
+#include "transport.h"
+#include "multicast.h"
+#include "checkpoint.h"
+#include "delta.h"
+#include "cryptopool.h"
 
 /* ------------------------------------------------------------------ */
 /*  Globals                                                            */
@@ -36,276 +74,998 @@
 static struct sockaddr_in server_addr;
 static socklen_t          addr_len = sizeof(struct sockaddr_in);
 static int                g_block_size = ENHANCED_BLOCK_SIZE;
+static int                g_window_size = DEFAULT_WINDOW_SIZE;
+static int                g_timeout = 0;   /* 0 = server default */
+static const CongestionOps *g_congestion = &CC_AIMD;
+static int                g_pacing = PACE_USER;
+static int                g_sack = 1;      /* request selective ACKs */
+static int                g_exthdr = 1;    /* request 32-bit blocks  */
+static int                g_rollover = -1; /* 16-bit rollover, -1 = none */
+static int                g_multicast = 0; /* RFC 2090 downloads     */
+static int                g_streams = 1;   /* parallel range downloads */
+static int                g_fec_k = 0;     /* FEC group size, 0 = off */
+static int                g_fec_m = 0;     /* FEC parity per group    */
+static int                g_delta = 0;     /* delta-sync uploads      */
+static int                g_compress = CODEC_NONE; /* block codec    */
+static int                g_gcm = 1;       /* AES-256-GCM, -E cbc = off */
+static int                g_offload = 1;   /* UDP GSO / GRO, -N = off */
+static CryptoPool         g_crypto;        /* -X threads, 0 = off     */
+
+#define MAX_STREAMS         16  /* -P upper bound                         */
+#define MIN_RANGE_BLOCKS    256 /* Smallest range worth its own stream    */
 
 /* ================================================================== */
-/*  Upload (WRQ)                                                       */
+/*  Request helpers                                                    */
 /* ================================================================== */
 
-static int upload_file(int sockfd, const char *filename)
+/*
+ * build_request – Encode a RRQ / WRQ for `filename` in "enhanced" mode,
+ *                 followed by the options we want to negotiate.  `tsize`
+ *                 is the upload size for WRQ (0 asks the size on RRQ).
+ *                 A RRQ with `range_len` >= 0 asks for that many bytes
+ *                 from `range_off` only.  `resume` >= 0 asks to resume:
+ *                 at that offset for RRQ, where the server's journal
+ *                 says for WRQ.  `delta` > 0 asks for the signature
+ *                 (RRQ) or sends a delta stream (WRQ) at that block
+ *                 size.  Returns the packet length.
+ */
+static size_t build_request(uint8_t *buf, size_t cap, uint16_t opcode,
+                            const char *filename, long long tsize,
+                            long long range_off, long long range_len,
+                            long long resume, int delta)
 {
-    /* Open the local file */
-    FILE *fp = fopen(filename, "rb");
-    if (!fp) {
-        perror("upload: fopen");
+    memset(buf, 0, cap);
+
+    uint16_t op = htons(opcode);
+    memcpy(buf, &op, 2);
+
+    size_t off = 2;
+    memcpy(buf + off, filename, strlen(filename) + 1);
+    off += strlen(filename) + 1;
+    memcpy(buf + off, "enhanced", 9);  /* mode = "enhanced" */
+    off += 9;
+
+    TransferOptions opts;
+    options_init(&opts);
+    opts.blksize = g_block_size;
+    opts.timeout = g_timeout;
+    opts.tsize   = tsize;
+    if (g_window_size > 1) {
+        opts.windowsize = g_window_size;
+        opts.sack       = g_sack;
+    }
+    opts.exthdr   = g_exthdr;
+    opts.rollover = g_rollover;
+    opts.multicast = opcode == OP_RRQ && g_multicast && range_len < 0 &&
+                     resume < 0 && delta == 0;
+    opts.resume    = resume;
+    opts.fec_k     = g_fec_k;
+    opts.fec_m     = g_fec_m;
+    opts.delta     = delta;
+    opts.compress  = g_compress;
+    opts.gcm       = g_gcm &&
+                     RAND_bytes(opts.gcm_salt, GCM_SALT_LEN) == 1;
+    if (opcode == OP_RRQ && range_len >= 0) {
+        opts.range     = 1;
+        opts.range_off = range_off;
+        opts.range_len = range_len;
+    }
+
+    return options_encode(buf, off, cap, &opts);
+}
+
+/*
+ * await_reply – Send `req` to the server and wait for its first answer
+ *               from any TID, resending the request on timeout.
+ *               Returns the reply length, or -1 if the server is silent.
+ *               `*rtt` receives the request's round trip, or 0 if the
+ *               request had to be resent (Karn's rule).
+ */
+static ssize_t await_reply(int sockfd, const uint8_t *req, size_t req_len,
+                           uint8_t *buf, size_t cap,
+                           struct sockaddr_in *from, int64_t *rtt)
+{
+    set_socket_timeout(sockfd, TIMEOUT_SEC, TIMEOUT_USEC);
+    *rtt = 0;
+
+    for (int retries = 0; retries < MAX_RETRIES; retries++) {
+        uint64_t sent = now_usec();
+        sendto(sockfd, req, req_len, 0,
+               (struct sockaddr *)&server_addr, addr_len);
+
+        socklen_t flen = sizeof(*from);
+        ssize_t r = recvfrom(sockfd, buf, cap, 0,
+                             (struct sockaddr *)from, &flen);
+        if (r >= 4 &&
+            from->sin_addr.s_addr == server_addr.sin_addr.s_addr) {
+            if (retries == 0)
+                *rtt = (int64_t)(now_usec() - sent);
+            return r;
+        }
+    }
+    return -1;
+}
+
+/*
+ * accept_oack – Check the server's OACK against what we asked for and
+ *               fill `granted` with the parameters to use.  Returns 0,
+ *               or -1 (after telling the server) if it granted
+ *               something we never requested, or not exactly the byte
+ *               range asked for (`range_len` >= 0) or delta block size.
+ */
+static int accept_oack(int sockfd, const uint8_t *buf, ssize_t n,
+                       struct sockaddr_in *tid, TransferOptions *granted,
+                       long long range_off, long long range_len, int delta)
+{
+    int parsed = options_parse((const char *)buf + 2, (const char *)buf + n,
+                               granted);
+    int range_ok = range_len < 0
+                 ? !granted->range
+                 : granted->range && granted->range_off == range_off &&
+                   granted->range_len == range_len;
+
+    if (parsed < 0 || !range_ok ||
+        granted->blksize > g_block_size ||
+        granted->windowsize > g_window_size ||
+        (granted->sack && !g_sack) ||
+        (granted->exthdr && !g_exthdr) ||
+        (granted->multicast && !g_multicast) ||
+        granted->fec_k > g_fec_k || granted->fec_m > g_fec_m ||
+        granted->delta != delta ||
+        (granted->compress && granted->compress != g_compress) ||
+        (granted->gcm && !g_gcm) ||
+        (granted->rollover >= 0 && granted->rollover != g_rollover) ||
+        (granted->timeout > 0 && granted->timeout != g_timeout)) {
+        send_error(sockfd, tid, ERR_OPTION_REFUSED, "Bad OACK");
+        fprintf(stderr, "  Server sent an unacceptable OACK.\n");
         return -1;
     }
+    return 0;
+}
 
-    /* ---- Send WRQ packet ---------------------------------------- */
-    uint8_t req_buf[MAX_PACKET_SIZE];
-    memset(req_buf, 0, sizeof(req_buf));
+/*
+ * apply_defaults – Fill in what the server left out of its reply: a
+ *                  plain ACK / DATA reply or a partial OACK means the
+ *                  "enhanced" mode defaults for the missing options.
+ */
+static void apply_defaults(TransferOptions *granted)
+{
+    if (granted->blksize <= 0)    granted->blksize    = ENHANCED_BLOCK_SIZE;
+    if (granted->timeout <= 0)    granted->timeout    = TIMEOUT_SEC;
+    if (granted->windowsize <= 0) granted->windowsize = 1;
+}
 
-    uint16_t op = htons(OP_WRQ);
-    memcpy(req_buf, &op, 2);
+/*
+ * granted_format – Block numbering for the transfer: 32-bit with
+ *                  "exthdr", otherwise 16-bit rolling over to 0 unless
+ *                  the server echoed "rollover".
+ */
+static BlockFormat granted_format(const TransferOptions *granted)
+{
+    BlockFormat fmt;
+    fmt.ext      = granted->exthdr;
+    fmt.rollover = granted->rollover > 0 ? granted->rollover : 0;
+    return fmt;
+}
 
-    /* Extract base filename */
-    const char *base = strrchr(filename, '/');
-    base = base ? base + 1 : filename;
+/*
+ * print_server_error – Report an ERROR packet received from the server.
+ */
+static void print_server_error(const uint8_t *buf, ssize_t n)
+{
+    char msg[MAX_FILENAME];
+    copy_peer_error(msg, buf, n);
+    fprintf(stderr, "  Server error %u: %s\n",
+            ntohs(*(const uint16_t *)(buf + 2)), msg);
+}
 
-    size_t off = 2;
-    memcpy(req_buf + off, base, strlen(base) + 1);
-    off += strlen(base) + 1;
-    memcpy(req_buf + off, "enhanced", 9);  /* mode = "enhanced" */
-    off += 9;
+/* Consumer wrapper that shows on the terminal how much of a download
+ * has arrived, against the size the OACK announced */
+typedef struct {
+    BlockConsumer consume;              /* The real consumer              */
+    void         *arg;
+    FileStream   *fs;                   /* For the stream's base offset   */
+    long long     total;                /* tsize                          */
+    int           shown;                /* Last percentage printed, or -1 */
+} Progress;
+
+static int progress_consume(void *arg, uint64_t offset,
+                            const uint8_t *payload, int len)
+{
+    Progress *p = (Progress *)arg;
+    int       n = p->consume(p->arg, offset, payload, len);
+
+    if (n >= 0) {
+        long long done = (long long)(p->fs->base + offset) + n;
+        int       pct  = done >= p->total ? 100
+                                          : (int)(done * 100 / p->total);
+        if (pct != p->shown) {
+            printf("\r  %3d%%  %lld of %lld bytes", pct, done, p->total);
+            fflush(stdout);
+            p->shown = pct;
+        }
+    }
+    return n;
+}
 
-    sendto(sockfd, req_buf, off, 0,
-           (struct sockaddr *)&server_addr, addr_len);
+/*
+ * receive_stream – Run the window receiver for one unicast transfer
+ *                  from `tid` into `fs`, through the journal `ck` when
+ *                  one is given.  `first` is the DATA 1 the server
+ *                  answered the RRQ with when it sent no OACK (NULL
+ *                  otherwise).  Failures are reported prefixed with
+ *                  `who`; a plain download (empty `who`) of known
+ *                  size shows its progress on a terminal.  Returns the
+ *                  XFER_* status and stores the number of blocks taken
+ *                  in `*blocks`.
+ */
+static int receive_stream(int sockfd, FileStream *fs, Checkpoint *ck,
+                          struct sockaddr_in *tid,
+                          const TransferOptions *granted, int64_t rtt,
+                          const uint8_t *first, ssize_t first_len,
+                          const char *who, uint32_t *blocks)
+{
+    WindowReceiver rx;
+    FecDecoder     fec;
+    memset(&fec, 0, sizeof(fec));
+    if (file_stream_set_codec(fs, granted->compress, 0) < 0 ||
+        (granted->gcm && file_stream_set_gcm(fs, granted->gcm_salt) < 0)) {
+        send_error(sockfd, tid, ERR_UNDEFINED, "Out of memory");
+        fprintf(stderr, "  %sOut of memory\n", who);
+        *blocks = 0;
+        return XFER_FAILED;
+    }
+    Progress progress = {
+        ck ? checkpoint_consume : file_stream_consume,
+        ck ? (void *)ck : (void *)fs, fs, granted->tsize, -1
+    };
+    CryptoStream cs;
+    if (crypto_stream_open(&cs, &g_crypto, fs, ck, 0,
+                           granted->windowsize) == 0) {
+        progress.consume = crypto_consume;
+        progress.arg     = &cs;
+    }
+    if (granted->tsize > 0 && !*who && isatty(STDOUT_FILENO))
+        receiver_init(&rx, sockfd, tid, sizeof(*tid),
+                      granted->blksize, granted->windowsize,
+                      progress_consume, &progress);
+    else
+        receiver_init(&rx, sockfd, tid, sizeof(*tid),
+                      granted->blksize, granted->windowsize,
+                      progress.consume, progress.arg);
+    if ((granted->sack && receiver_enable_sack(&rx) < 0) ||
+        (granted->fec_k > 0 &&
+         fec_decoder_init(&fec, granted->fec_k, granted->fec_m,
+                          granted->blksize, granted->windowsize) < 0)) {
+        send_error(sockfd, tid, ERR_UNDEFINED, "Out of memory");
+        fprintf(stderr, "  %sOut of memory\n", who);
+        receiver_free(&rx);
+        crypto_stream_close(&cs);
+        *blocks = 0;
+        return XFER_FAILED;
+    }
+    if (granted->fec_k > 0)
+        rx.fec = &fec;
+    if (cs.pool)
+        receiver_set_settler(&rx, crypto_settle, &cs);
+    receiver_set_timeout(&rx, granted->timeout);
+    rx.fmt = granted_format(granted);
+    if (rtt > 0)
+        rtt_sample(&rx.rtt, rtt);
+
+    /* Without options the server answered straight with DATA 1 */
+    if (first) {
+        rx.probe_sent = 0;      /* no ACK of ours preceded it */
+        receiver_on_packet(&rx, first, first_len, tid);
+    }
 
-    /* ---- Wait for ACK block 0 ----------------------------------- */
-    set_socket_timeout(sockfd, TIMEOUT_SEC, TIMEOUT_USEC);
+    if (g_offload)
+        receiver_enable_gro(&rx);
+    int status = rx.done ? rx.status : receiver_run(&rx);
+    if (progress.shown >= 0)
+        printf("\n");
+    if (status == XFER_FAILED && fs->error)
+        send_error(sockfd, tid, fs->error_code, fs->error);
+    if (status == XFER_TIMEOUT)
+        fprintf(stderr, "  %sTransfer timed out at block %u\n",
+                who, rx.expected);
+    else if (status == XFER_ABORTED)
+        fprintf(stderr, "  %sServer error: %s\n", who, rx.peer_error);
+    else if (status == XFER_FAILED)
+        fprintf(stderr, "  %s%s at block %u\n", who,
+                fs->error ? fs->error : "Transfer failed", rx.expected);
+    if (rx.fec)
+        printf("  %sFEC %d+%d rebuilt %u blocks\n", who,
+               granted->fec_k, granted->fec_m, fec.repaired);
+    if (fs->codec)
+        printf("  %s%s: %llu bytes received as %llu (%u blocks stored)\n",
+               who, CODEC_NAMES[fs->codec], (unsigned long long)fs->zplain,
+               (unsigned long long)fs->zcoded, fs->zstored);
+    if (rx.coalesced)
+        printf("  %sGRO: %u blocks arrived coalesced\n", who, rx.coalesced);
+    if (cs.chunks)
+        printf("  %scrypto: %u chunks opened by the pool\n", who,
+               cs.chunks);
+    if (rx.rejected)
+        printf("  %s%u blocks failed authentication and were sent again\n",
+               who, rx.rejected);
+
+    *blocks = rx.blocks;
+    receiver_free(&rx);
+    fec_decoder_free(&fec);
+    crypto_stream_close(&cs);
+    return status;
+}
+
+/* ================================================================== */
+/*  Upload (WRQ)                                                       */
+/* ================================================================== */
 
-    AckPacket ack;
+/*
+ * send_file – WRQ `base` and send the `file_size` bytes of `fd`: the
+ *             file itself, or with `delta` > 0 a delta stream at that
+ *             block size (which the server must accept as such).
+ *             Returns 0 on success, -1 on failure.
+ */
+static int send_file(int sockfd, int fd, const char *base,
+                     long long file_size, int delta)
+{
+    /* ---- Send WRQ, wait for OACK or ACK block 0 ------------------ */
+    uint8_t req_buf[MAX_REQUEST_SIZE];
+    size_t  req_len = build_request(req_buf, sizeof(req_buf), OP_WRQ,
+                                    base, file_size, 0, -1,
+                                    delta > 0 ? -1 : 0, delta);
+
+    uint8_t reply[MAX_REQUEST_SIZE];
     struct sockaddr_in from;
-    socklen_t flen = sizeof(from);
-    ssize_t r = recvfrom(sockfd, &ack, sizeof(ack), 0,
-                         (struct sockaddr *)&from, &flen);
-    if (r < (ssize_t)sizeof(ack) ||
-        ntohs(ack.opcode) != OP_ACK ||
-        ntohs(ack.block_num) != 0) {
+    int64_t rtt;
+    ssize_t r = await_reply(sockfd, req_buf, req_len,
+                            reply, sizeof(reply), &from, &rtt);
+    uint16_t opcode = r >= 4 ? ntohs(*(uint16_t *)reply) : 0;
+
+    TransferOptions granted;
+    options_init(&granted);
+
+    int ok = 1;
+    if (opcode == OP_OACK) {
+        ok = accept_oack(sockfd, reply, r, &from, &granted, 0, -1,
+                         delta) == 0;
+    } else if (opcode == OP_ERROR) {
+        print_server_error(reply, r);
+        ok = 0;
+    } else if (opcode != OP_ACK || ntohs(*(uint16_t *)(reply + 2)) != 0) {
         fprintf(stderr, "upload: did not receive ACK 0 from server\n");
-        fclose(fp);
+        ok = 0;
+    } else if (delta > 0) {
+        /* No OACK: the server would take the delta for the file */
+        send_error(sockfd, &from, ERR_OPTION_REFUSED, "Delta refused");
+        ok = 0;
+    }
+    if (!ok)
+        return -1;
+    if (granted.resume > file_size) {
+        send_error(sockfd, &from, ERR_OPTION_REFUSED, "Bad resume offset");
+        fprintf(stderr, "  Server sent an unacceptable OACK.\n");
         return -1;
     }
+    apply_defaults(&granted);
 
     /* From now on, talk to the server's child TID (ephemeral port) */
-    struct sockaddr_in tid_addr = from;
-
-    printf("  Server ready.  Uploading \"%s\" …\n", base);
+    printf("  Server ready.  Uploading %s\"%s\" (%lld bytes, block %d, "
+           "window %d) …\n", delta > 0 ? "delta of " : "",
+           base, file_size, granted.blksize, granted.windowsize);
+    if (granted.resume > 0)
+        printf("  Resuming at byte %lld\n", granted.resume);
 
     /* ---- Send DATA packets -------------------------------------- */
-    uint8_t  raw[ENHANCED_BLOCK_SIZE];
-    uint8_t  enc[ENHANCED_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint8_t  pkt[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint16_t block = 1;
+    FileStream   fs;
+    WindowSender tx;
+    if (file_stream_init(&fs, fd, granted.blksize, 1) < 0)
+        return -1;
+    if (file_stream_set_codec(&fs, granted.compress, 1) < 0 ||
+        (granted.gcm && file_stream_set_gcm(&fs, granted.gcm_salt) < 0)) {
+        send_error(sockfd, &from, ERR_UNDEFINED, "Out of memory");
+        file_stream_free(&fs);
+        return -1;
+    }
+    if (granted.resume > 0 && file_stream_skip(&fs, granted.resume) < 0) {
+        send_error(sockfd, &from, ERR_UNDEFINED, fs.error);
+        fprintf(stderr, "upload: %s\n", fs.error);
+        file_stream_free(&fs);
+        return -1;
+    }
+    CryptoStream cs;
+    int pooled = crypto_stream_open(&cs, &g_crypto, &fs, NULL, 1,
+                                    granted.windowsize) == 0;
+    if (sender_init(&tx, sockfd, &from, sizeof(from), granted.blksize,
+                    granted.windowsize,
+                    pooled ? crypto_produce : file_stream_produce,
+                    pooled ? (void *)&cs : (void *)&fs) < 0) {
+        crypto_stream_close(&cs);
+        file_stream_free(&fs);
+        return -1;
+    }
+    sender_set_timeout(&tx, granted.timeout);
+    if (rtt > 0)
+        rtt_sample(&tx.rtt, rtt);
+    sender_set_congestion(&tx, g_congestion, g_pacing, 0);
+    if (g_offload)
+        sender_enable_gso(&tx);
+    tx.sack = granted.sack;
+    tx.fmt  = granted_format(&granted);
+
+    FecEncoder fec;
+    memset(&fec, 0, sizeof(fec));
+    if (granted.fec_k > 0) {
+        if (fec_encoder_init(&fec, granted.fec_k, granted.fec_m,
+                             granted.blksize) < 0) {
+            sender_free(&tx);
+            crypto_stream_close(&cs);
+            file_stream_free(&fs);
+            return -1;
+        }
+        tx.fec = &fec;
+    }
 
-    /* MD5 running context */
-    EVP_MD_CTX *md5_ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(md5_ctx, EVP_md5(), NULL);
+    int status = sender_run(&tx);
+    if (status == XFER_TIMEOUT)
+        fprintf(stderr, "upload: transfer timed out at block %u\n",
+                tx.base);
+    else if (status == XFER_ABORTED)
+        fprintf(stderr, "  Server error: %s\n", tx.peer_error);
+    else if (status == XFER_FAILED)
+        fprintf(stderr, "upload: %s\n", fs.error ? fs.error : "failed");
 
-    while (1) {
-        int bytes_read = (int)fread(raw, 1, g_block_size, fp);
-        if (bytes_read < 0) break;
+    crypto_stream_close(&cs);   /* its MD5 now covers every block   */
 
-        EVP_DigestUpdate(md5_ctx, raw, bytes_read);
+    /* Final MD5 */
+    char hex[33];
+    file_stream_md5(&fs, hex);
+
+    printf("  Upload complete – %u blocks sent (%u resent).\n",
+           tx.blocks, tx.retransmits);
+    if (tx.fec)
+        printf("  FEC %d+%d: %u parity blocks sent\n",
+               granted.fec_k, granted.fec_m, fec.parities);
+    if (fs.codec)
+        printf("  %s: %llu bytes sent as %llu (%u blocks stored)\n",
+               CODEC_NAMES[fs.codec], (unsigned long long)fs.zplain,
+               (unsigned long long)fs.zcoded, fs.zstored);
+    if (tx.segmented)
+        printf("  GSO: %u blocks sent in offloaded runs\n", tx.segmented);
+    if (tx.refused)
+        printf("  %u packets refused by a full socket buffer\n", tx.refused);
+    if (cs.chunks)
+        printf("  crypto: %u chunks, %u sealed inline\n", cs.chunks,
+               cs.helped);
+    if (delta == 0)             /* a delta's MD5 is not the file's */
+        printf("  MD5: %s\n", hex);
+
+    sender_free(&tx);
+    fec_encoder_free(&fec);
+    file_stream_free(&fs);
+    return status == XFER_OK ? 0 : -1;
+}
 
-        /* Encrypt */
-        int enc_len = aes_encrypt(raw, bytes_read, enc);
-        if (enc_len < 0) {
-            fprintf(stderr, "upload: encryption error\n");
-            break;
-        }
+/*
+ * fetch_signature – RRQ the signature of the server's copy of `base` at
+ *                   delta block size `block` into an anonymous file, on
+ *                   a socket of its own.  Returns its descriptor, or -1
+ *                   if the server has no copy or cannot send one.
+ */
+static int fetch_signature(const char *base, int block)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("upload: socket");
+        return -1;
+    }
 
-        /* Build DATA packet */
-        uint16_t net_op  = htons(OP_DATA);
-        uint16_t net_blk = htons(block);
-        memcpy(pkt, &net_op, 2);
-        memcpy(pkt + 2, &net_blk, 2);
-        memcpy(pkt + 4, enc, enc_len);
-        int pkt_len = 4 + enc_len;
-
-        /* Send + wait ACK with retransmit */
-        int retries = 0;
-        int acked   = 0;
-        while (retries < MAX_RETRIES) {
-            sendto(sockfd, pkt, pkt_len, 0,
-                   (struct sockaddr *)&tid_addr, addr_len);
-
-            AckPacket a;
-            struct sockaddr_in afrom;
-            socklen_t al = sizeof(afrom);
-            ssize_t ar = recvfrom(sockfd, &a, sizeof(a), 0,
-                                  (struct sockaddr *)&afrom, &al);
-            if (ar >= (ssize_t)sizeof(a) &&
-                ntohs(a.opcode) == OP_ACK &&
-                ntohs(a.block_num) == block) {
-                acked = 1;
-                break;
+    uint8_t req_buf[MAX_REQUEST_SIZE];
+    size_t  req_len = build_request(req_buf, sizeof(req_buf), OP_RRQ,
+                                    base, 0, 0, -1, -1, block);
+
+    uint8_t reply[MAX_REQUEST_SIZE];
+    struct sockaddr_in tid;
+    int64_t rtt;
+    ssize_t r = await_reply(sockfd, req_buf, req_len,
+                            reply, sizeof(reply), &tid, &rtt);
+    uint16_t opcode = r >= 4 ? ntohs(*(uint16_t *)reply) : 0;
+
+    TransferOptions granted;
+    options_init(&granted);
+
+    int sig = -1;
+    if (opcode == OP_ERROR) {
+        if (ntohs(*(uint16_t *)(reply + 2)) != ERR_FILE_NOT_FOUND)
+            print_server_error(reply, r);
+    } else if (opcode != OP_OACK) {
+        /* DATA 1 of the file itself: the server knows no "delta" */
+        if (r >= 4)
+            send_error(sockfd, &tid, ERR_OPTION_REFUSED, "Delta refused");
+    } else if (accept_oack(sockfd, reply, r, &tid, &granted,
+                           0, -1, block) == 0) {
+        apply_defaults(&granted);
+
+        FileStream fs;
+        uint32_t   blocks;
+        sig = delta_tempfile();
+        if (sig >= 0 && file_stream_init(&fs, sig, granted.blksize, 0) == 0) {
+            send_ack(sockfd, &tid, sizeof(tid), 0);
+            if (receive_stream(sockfd, &fs, NULL, &tid, &granted, rtt,
+                               NULL, 0, "[signature] ", &blocks) != XFER_OK) {
+                close(sig);
+                sig = -1;
             }
-
-            retries++;
-            printf("  block %u – retransmit %d/%d\n",
-                   block, retries, MAX_RETRIES);
+            file_stream_free(&fs);
+        } else if (sig >= 0) {
+            send_error(sockfd, &tid, ERR_UNDEFINED, "Out of memory");
+            close(sig);
+            sig = -1;
         }
+    }
 
-        if (!acked) {
-            fprintf(stderr, "upload: transfer timed out at block %u\n",
-                    block);
-            break;
+    close(sockfd);
+    return sig;
+}
+
+/*
+ * upload_delta – Send `fd` as a delta against the server's copy of
+ *                `base`.  Returns 0 on success, -1 if the caller should
+ *                fall back to a full upload.
+ */
+static int upload_delta(int sockfd, int fd, const char *base,
+                        long long file_size)
+{
+    int block = delta_block_size(file_size);
+    int sig   = fetch_signature(base, block);
+    if (sig < 0)
+        return -1;
+
+    struct stat st;
+    uint8_t    *map = MAP_FAILED;
+    if (fstat(sig, &st) == 0 && st.st_size > 0)
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, sig, 0);
+
+    DeltaStats ds;
+    int        dfd = delta_tempfile();
+    int        rc  = -1;
+    if (map == MAP_FAILED || dfd < 0 ||
+        delta_encode(fd, map, st.st_size, dfd, &ds) < 0) {
+        fprintf(stderr, "upload: cannot compute delta\n");
+    } else {
+        printf("  Delta: %llu bytes match the server's copy, %llu "
+               "literal – %llu bytes to send\n",
+               (unsigned long long)ds.copied,
+               (unsigned long long)ds.literal,
+               (unsigned long long)ds.length);
+        rc = send_file(sockfd, dfd, base, (long long)ds.length, block);
+        if (rc == 0) {
+            char hex[33];
+            file_md5(fd, hex);
+            printf("  MD5: %s\n", hex);
         }
+    }
 
-        /* Last block? */
-        if (bytes_read < g_block_size)
-            break;
+    if (map != MAP_FAILED)
+        munmap(map, st.st_size);
+    if (dfd >= 0)
+        close(dfd);
+    close(sig);
+    return rc;
+}
 
-        block++;
+static int upload_file(int sockfd, const char *filename)
+{
+    /* Open the local file */
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        perror("upload: open");
+        return -1;
     }
 
-    /* Final MD5 */
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    EVP_DigestFinal_ex(md5_ctx, digest, NULL);
-    EVP_MD_CTX_free(md5_ctx);
+    /* Extract base filename */
+    const char *base = strrchr(filename, '/');
+    base = base ? base + 1 : filename;
 
-    char hex[33];
-    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
-        sprintf(hex + i * 2, "%02x", digest[i]);
-    hex[32] = '\0';
+    struct stat st;
+    long long   file_size = fstat(fd, &st) == 0 ? st.st_size : 0;
 
-    printf("  Upload complete – %u blocks sent.\n", block);
-    printf("  MD5: %s\n", hex);
+    int rc = -1;
+    if (g_delta) {
+        rc = upload_delta(sockfd, fd, base, file_size);
+        if (rc < 0)
+            printf("  Sending the whole file.\n");
+    }
+    if (rc < 0)
+        rc = send_file(sockfd, fd, base, file_size, 0);
 
-    fclose(fp);
-    return 0;
+    close(fd);
+    return rc;
 }
 
 /* ================================================================== */
 /*  Download (RRQ)                                                     */
 /* ================================================================== */
 
-static int download_file(int sockfd, const char *filename)
+/*
+ * download_multicast – Collect a file the server streams to a group
+ *                      (RFC 2090) into `fd`, as master client when the
+ *                      OACK says so.  Returns the XFER_* status.
+ */
+static int download_multicast(int sockfd, int fd,
+                              struct sockaddr_in *tid,
+                              const TransferOptions *granted, int64_t rtt)
 {
-    /* ---- Send RRQ packet ---------------------------------------- */
-    uint8_t req_buf[MAX_PACKET_SIZE];
-    memset(req_buf, 0, sizeof(req_buf));
+    struct sockaddr_in group;
+    int                master;
+    if (mcast_parse(granted->mcast, &group, &master) < 0 ||
+        granted->tsize < 0) {
+        send_error(sockfd, tid, ERR_OPTION_REFUSED, "Bad multicast option");
+        fprintf(stderr, "  Server sent an unusable multicast option.\n");
+        return XFER_FAILED;
+    }
 
-    uint16_t op = htons(OP_RRQ);
-    memcpy(req_buf, &op, 2);
+    int groupfd = mcast_join(&group, mcast_local_addr(tid));
+    if (groupfd < 0) {
+        perror("download: join group");
+        send_error(sockfd, tid, ERR_UNDEFINED, "Cannot join group");
+        return XFER_FAILED;
+    }
+    printf("  Multicast group %s:%u%s\n", inet_ntoa(group.sin_addr),
+           ntohs(group.sin_port), master ? " (master client)" : "");
+
+    FileStream    fs;
+    McastReceiver rx;
+    if (file_stream_init(&fs, fd, granted->blksize, 0) < 0) {
+        close(groupfd);
+        return XFER_FAILED;
+    }
+    if (mcast_receiver_init(&rx, sockfd, groupfd, tid, sizeof(*tid),
+                            granted->blksize, granted->windowsize,
+                            granted->tsize, file_stream_consume, &fs) < 0) {
+        send_error(sockfd, tid, ERR_UNDEFINED, "Out of memory");
+        file_stream_free(&fs);
+        close(groupfd);
+        return XFER_FAILED;
+    }
+    mcast_receiver_set_timeout(&rx, granted->timeout);
+    if (rtt > 0)
+        rtt_sample(&rx.rtt, rtt);
+    rx.fmt = granted_format(granted);
+    if (master) {
+        rx.master = 1;
+        mcast_send_ack(&rx, 0);
+    }
 
-    size_t off = 2;
-    memcpy(req_buf + off, filename, strlen(filename) + 1);
-    off += strlen(filename) + 1;
-    memcpy(req_buf + off, "enhanced", 9);
-    off += 9;
+    int status = mcast_receiver_run(&rx);
+    if (status == XFER_TIMEOUT)
+        fprintf(stderr, "  Transfer timed out with %u of %u blocks\n",
+                rx.received, rx.total);
+    else if (status == XFER_ABORTED)
+        fprintf(stderr, "  Server error: %s\n", rx.peer_error);
+    else if (status == XFER_FAILED)
+        fprintf(stderr, "  %s\n", fs.error ? fs.error : "Transfer failed");
 
-    sendto(sockfd, req_buf, off, 0,
-           (struct sockaddr *)&server_addr, addr_len);
+    char hex[33];
+    file_md5(fd, hex);
+    printf("  Download complete – %u blocks received (%u duplicates).\n",
+           rx.received, rx.duplicates);
+    printf("  MD5: %s\n", hex);
 
-    printf("  Downloading \"%s\" …\n", filename);
+    mcast_receiver_free(&rx);
+    file_stream_free(&fs);
+    close(groupfd);
+    return status;
+}
 
-    /* ---- Open output file --------------------------------------- */
-    FILE *fp = fopen(filename, "wb");
-    if (!fp) {
-        perror("download: fopen");
-        return -1;
-    }
+/* ---- Parallel range downloads ------------------------------------ */
 
-    set_socket_timeout(sockfd, TIMEOUT_SEC, TIMEOUT_USEC);
+/* One byte range of the file, fetched by its own thread and TID */
+typedef struct {
+    pthread_t   thread;
+    const char *filename;
+    int         fd;             /* Shared output file (pwrite)    */
+    int         index;
+    long long   off;            /* First byte of the range        */
+    long long   len;            /* Bytes in the range             */
+    int         status;         /* XFER_* result                  */
+    uint32_t    blocks;         /* Blocks received                */
+} RangeStream;
 
-    uint8_t  recv_buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint8_t  dec_buf[ENHANCED_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint16_t expected_block = 1;
+/*
+ * range_stream_run – Thread body: RRQ one range from the server on a
+ *                    socket of its own and write it into the shared
+ *                    output file.
+ */
+static void *range_stream_run(void *arg)
+{
+    RangeStream *rs = (RangeStream *)arg;
+    char who[24];
+    snprintf(who, sizeof(who), "[range %d] ", rs->index);
+    rs->status = XFER_FAILED;
 
-    /* MD5 running context */
-    EVP_MD_CTX *md5_ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(md5_ctx, EVP_md5(), NULL);
+    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sockfd < 0) {
+        perror("download: socket");
+        return NULL;
+    }
 
-    struct sockaddr_in tid_addr;
-    int tid_set = 0;
+    uint8_t req_buf[MAX_REQUEST_SIZE];
+    size_t  req_len = build_request(req_buf, sizeof(req_buf), OP_RRQ,
+                                    rs->filename, 0, rs->off, rs->len, -1,
+                                    0);
+
+    uint8_t reply[MAX_REQUEST_SIZE];
+    struct sockaddr_in tid;
+    int64_t rtt;
+    ssize_t r = await_reply(sockfd, req_buf, req_len,
+                            reply, sizeof(reply), &tid, &rtt);
+    uint16_t opcode = r >= 4 ? ntohs(*(uint16_t *)reply) : 0;
+
+    TransferOptions granted;
+    options_init(&granted);
+
+    if (opcode == OP_ERROR) {
+        print_server_error(reply, r);
+    } else if (opcode != OP_OACK) {
+        fprintf(stderr, "  %sNo OACK from server.\n", who);
+    } else if (accept_oack(sockfd, reply, r, &tid, &granted,
+                           rs->off, rs->len, 0) == 0) {
+        apply_defaults(&granted);
+        send_ack(sockfd, &tid, sizeof(tid), 0);
+
+        FileStream fs;
+        if (file_stream_init(&fs, rs->fd, granted.blksize, 0) == 0) {
+            file_stream_set_range(&fs, rs->off, rs->len);
+            rs->status = receive_stream(sockfd, &fs, NULL, &tid, &granted,
+                                        rtt, NULL, 0, who, &rs->blocks);
+            file_stream_free(&fs);
+        }
+    }
+    close(sockfd);
+    return NULL;
+}
 
-    while (1) {
-        struct sockaddr_in from;
-        socklen_t flen = sizeof(from);
-        ssize_t n = recvfrom(sockfd, recv_buf, sizeof(recv_buf), 0,
-                             (struct sockaddr *)&from, &flen);
-        if (n < 4) {
-            /* Check for ERROR packet or timeout */
-            if (n >= 4) {
-                uint16_t opc = ntohs(*(uint16_t *)recv_buf);
-                if (opc == OP_ERROR) {
-                    uint16_t ec = ntohs(*(uint16_t *)(recv_buf + 2));
-                    fprintf(stderr, "  Server error %u: %s\n",
-                            ec, (char *)(recv_buf + 4));
-                    break;
-                }
-            }
+/*
+ * download_ranges – Fetch `file_size` bytes of `filename` into `fd` as
+ *                   `streams` byte ranges in parallel, each over its
+ *                   own server TID.  Returns the XFER_* status (the
+ *                   first failure, if any).
+ */
+static int download_ranges(int fd, const char *filename,
+                           long long file_size, int block_size,
+                           int streams)
+{
+    RangeStream rs[MAX_STREAMS];
 
-            /* Timeout – request retransmit by re-sending last ACK */
-            if (expected_block > 1) {
-                AckPacket ack;
-                ack.opcode    = htons(OP_ACK);
-                ack.block_num = htons(expected_block - 1);
-                sendto(sockfd, &ack, sizeof(ack), 0,
-                       (struct sockaddr *)&tid_addr, addr_len);
-            }
-            continue;
-        }
+    /* Ranges start on block boundaries so the server reads whole blocks */
+    long long chunk = (file_size + streams - 1) / streams;
+    chunk = (chunk + block_size - 1) / block_size * block_size;
 
-        /* Capture the server's ephemeral TID on first DATA packet */
-        if (!tid_set) {
-            tid_addr = from;
-            tid_set  = 1;
-        }
+    if (ftruncate(fd, (off_t)file_size) < 0) {
+        perror("download: ftruncate");
+        return XFER_FAILED;
+    }
 
-        uint16_t opcode   = ntohs(*(uint16_t *)recv_buf);
-        if (opcode == OP_ERROR) {
-            uint16_t ec = ntohs(*(uint16_t *)(recv_buf + 2));
-            fprintf(stderr, "  Server error %u: %s\n",
-                    ec, (char *)(recv_buf + 4));
+    int started = 0;
+    for (int i = 0; i < streams; i++) {
+        long long off = (long long)i * chunk;
+        if (off >= file_size && i > 0)
+            break;
+        rs[i].filename = filename;
+        rs[i].fd       = fd;
+        rs[i].index    = i;
+        rs[i].off      = off;
+        rs[i].len      = file_size - off < chunk ? file_size - off : chunk;
+        rs[i].status   = XFER_FAILED;
+        rs[i].blocks   = 0;
+        if (pthread_create(&rs[i].thread, NULL, range_stream_run,
+                           &rs[i]) != 0) {
+            perror("download: pthread_create");
             break;
         }
+        started++;
+    }
 
-        uint16_t block_no = ntohs(*(uint16_t *)(recv_buf + 2));
+    int      status = started > 0 ? XFER_OK : XFER_FAILED;
+    uint32_t blocks = 0;
+    for (int i = 0; i < started; i++) {
+        pthread_join(rs[i].thread, NULL);
+        blocks += rs[i].blocks;
+        if (status == XFER_OK && rs[i].status != XFER_OK)
+            status = rs[i].status;
+    }
+    if (started < streams && status == XFER_OK &&
+        (long long)started * chunk < file_size)
+        status = XFER_FAILED;
 
-        if (opcode == OP_DATA && block_no == expected_block) {
-            int enc_len = (int)(n - 4);
-            int dec_len = aes_decrypt(recv_buf + 4, enc_len, dec_buf);
-            if (dec_len < 0) {
-                fprintf(stderr, "  Decryption error at block %u\n",
-                        block_no);
-                break;
-            }
+    char hex[33];
+    file_md5(fd, hex);
+    printf("  Download complete – %u blocks received over %d streams.\n",
+           blocks, started);
+    printf("  MD5: %s\n", hex);
+    return status;
+}
+
+static int download_file(int sockfd, const char *filename)
+{
+    printf("  Downloading \"%s\" …\n", filename);
+
+    /* ---- Open output file --------------------------------------- */
+    int fd = open(filename, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        perror("download: open");
+        return -1;
+    }
 
-            fwrite(dec_buf, 1, dec_len, fp);
-            EVP_DigestUpdate(md5_ctx, dec_buf, dec_len);
+    /* The journal of an interrupted download lets us resume where it
+     * stopped; otherwise the file starts empty. */
+    Checkpoint ck;
+    checkpoint_init(&ck, filename, fd, -1);
+    long long resume = (long long)checkpoint_load(&ck);
+    if (resume == 0 && ftruncate(fd, 0) < 0) {
+        perror("download: ftruncate");
+        close(fd);
+        return -1;
+    }
+    if (resume > 0)
+        printf("  Resuming at byte %lld\n", resume);
 
-            /* Send ACK */
-            AckPacket ack;
-            ack.opcode    = htons(OP_ACK);
-            ack.block_num = htons(expected_block);
-            sendto(sockfd, &ack, sizeof(ack), 0,
-                   (struct sockaddr *)&tid_addr, addr_len);
+    /* ---- Send RRQ packet ---------------------------------------- */
+    uint8_t req_buf[MAX_REQUEST_SIZE];
+    size_t  req_len = build_request(req_buf, sizeof(req_buf),
+                                    OP_RRQ, filename, 0, 0, -1,
+                                    resume > 0 ? resume : -1, 0);
+
+    /* ---- First reply: OACK, DATA block 1, or ERROR --------------- */
+    size_t   cap = DATA_PACKET_SIZE(g_block_size > ENHANCED_BLOCK_SIZE
+                                    ? g_block_size : ENHANCED_BLOCK_SIZE);
+    uint8_t *reply = malloc(cap);
+    if (!reply) {
+        checkpoint_free(&ck);
+        close(fd);
+        return -1;
+    }
 
-            /* Last block? */
-            if (dec_len < g_block_size)
-                break;
+    struct sockaddr_in tid_addr;
+    int64_t rtt;
+    ssize_t r = await_reply(sockfd, req_buf, req_len, reply, cap,
+                            &tid_addr, &rtt);
+    uint16_t opcode = r >= 4 ? ntohs(*(uint16_t *)reply) : 0;
+
+    TransferOptions granted;
+    options_init(&granted);
+
+    int ok = 1;
+    int streams = 1;
+    if (opcode == OP_OACK) {
+        ok = accept_oack(sockfd, reply, r, &tid_addr, &granted, 0, -1,
+                         0) == 0;
+
+        /* Resuming needs the server to start at our offset of the same
+         * file; if it cannot, throw the partial file away and restart */
+        if (ok && granted.resume != (resume > 0 ? resume : -1)) {
+            send_error(sockfd, &tid_addr, ERR_OPTION_REFUSED,
+                       "Cannot resume");
+            free(reply);
+            checkpoint_free(&ck);
+            close(fd);
+            if (resume == 0) {
+                fprintf(stderr, "  Server sent an unacceptable OACK.\n");
+                return -1;
+            }
+            printf("  Server cannot resume; starting over\n");
+            unlink(ck.path);
+            return download_file(sockfd, filename);
+        }
+        if (ok && resume > 0 && granted.tsize != ck.size) {
+            send_error(sockfd, &tid_addr, ERR_OPTION_REFUSED,
+                       "File changed");
+            free(reply);
+            checkpoint_free(&ck);
+            close(fd);
+            printf("  File changed on the server; starting over\n");
+            unlink(ck.path);
+            return download_file(sockfd, filename);
+        }
 
-            expected_block++;
+        /* Reserve the whole file now, so a disk that cannot hold it
+         * fails the download before the first block */
+        if (ok && granted.tsize > 0 && preallocate(fd, granted.tsize) < 0) {
+            send_error(sockfd, &tid_addr, ERR_DISK_FULL, "Disk full");
+            fprintf(stderr, "  Not enough disk space for %lld bytes.\n",
+                    granted.tsize);
+            ok = 0;
         }
+
+        /* A large file is worth splitting: the OACK told us its size,
+         * so drop this transfer (RFC 2349 allows ERROR 8 here) and
+         * fetch it as ranges instead. */
+        long long min_range = (long long)MIN_RANGE_BLOCKS *
+                              (granted.blksize > 0 ? granted.blksize
+                                                   : ENHANCED_BLOCK_SIZE);
+        if (ok && !granted.multicast && resume == 0 && granted.tsize > 0 &&
+            g_streams > 1) {
+            long long fit = granted.tsize / min_range;
+            streams = fit < g_streams ? (int)fit : g_streams;
+        }
+        if (ok && streams > 1)
+            send_error(sockfd, &tid_addr, ERR_OPTION_REFUSED,
+                       "Fetching by ranges");
+        else if (ok && !granted.multicast)
+            send_ack(sockfd, &tid_addr, sizeof(tid_addr), 0);
+    } else if (opcode == OP_ERROR) {
+        print_server_error(reply, r);
+        ok = 0;
+    } else if (opcode != OP_DATA) {
+        fprintf(stderr, "  No response from server.\n");
+        ok = 0;
+    } else if (resume > 0) {
+        /* No options understood: the server sends from block 1 */
+        resume = 0;
+        ok = ftruncate(fd, 0) == 0;
+    }
+    if (!ok) {
+        free(reply);
+        checkpoint_free(&ck);
+        close(fd);
+        return -1;
+    }
+    apply_defaults(&granted);
+    if (resume == 0)
+        ck.size = granted.tsize;
+    if (granted.tsize >= 0)
+        printf("  Size: %lld bytes, block %d, window %d\n",
+               granted.tsize, granted.blksize, granted.windowsize);
+
+    if (streams > 1) {
+        free(reply);
+        printf("  Fetching in %d parallel ranges\n", streams);
+        int status = download_ranges(fd, filename, granted.tsize,
+                                     granted.blksize, streams);
+        close(fd);
+        return status == XFER_OK ? 0 : -1;
     }
 
-    /* Final MD5 */
-    unsigned char digest[MD5_DIGEST_LENGTH];
-    EVP_DigestFinal_ex(md5_ctx, digest, NULL);
-    EVP_MD_CTX_free(md5_ctx);
+    if (granted.multicast) {
+        free(reply);
+        int status = download_multicast(sockfd, fd, &tid_addr, &granted, rtt);
+        close(fd);
+        return status == XFER_OK ? 0 : -1;
+    }
+
+    FileStream fs;
+    if (file_stream_init(&fs, fd, granted.blksize, 1) < 0) {
+        free(reply);
+        checkpoint_free(&ck);
+        close(fd);
+        return -1;
+    }
+    checkpoint_attach(&ck, &fs, resume);
+
+    uint32_t blocks;
+    int status = receive_stream(sockfd, &fs, &ck, &tid_addr, &granted, rtt,
+                                opcode == OP_DATA ? reply : NULL, r,
+                                "", &blocks);
+    free(reply);
+
+    checkpoint_finish(&ck, status == XFER_OK);
+    if (status != XFER_OK && ck.offset > 0)
+        printf("  Checkpoint at byte %llu – download again to resume.\n",
+               (unsigned long long)ck.offset);
 
+    /* Final MD5 */
     char hex[33];
-    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
-        sprintf(hex + i * 2, "%02x", digest[i]);
-    hex[32] = '\0';
+    file_stream_md5(&fs, hex);
 
-    printf("  Download complete – %u blocks received.\n", expected_block);
+    printf("  Download complete – %u blocks received.\n", blocks);
     printf("  MD5: %s\n", hex);
 
-    fclose(fp);
-    return 0;
+    file_stream_free(&fs);
+    checkpoint_free(&ck);
+    close(fd);
+    return status == XFER_OK ? 0 : -1;
 }
 
 /* ================================================================== */
@@ -367,15 +1127,125 @@ static void print_menu(void)
 
 int main(int argc, char *argv[])
 {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s <server_ip> [port]\n", argv[0]);
+    int c;
+    int crypto_threads = 0;
+    while ((c = getopt(argc, argv, "b:t:w:c:p:Gr:MP:F:DZ:E:NX:")) != -1) {
+        switch (c) {
+        case 'b':
+            g_block_size = atoi(optarg);
+            if (g_block_size < MIN_BLOCK_SIZE ||
+                g_block_size > MAX_BLOCK_SIZE) {
+                fprintf(stderr, "Block size must be %d-%d\n",
+                        MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 't':
+            g_timeout = atoi(optarg);
+            if (g_timeout < 1 || g_timeout > MAX_TIMEOUT_SEC) {
+                fprintf(stderr, "Timeout must be 1-%d seconds\n",
+                        MAX_TIMEOUT_SEC);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'w':
+            g_window_size = atoi(optarg);
+            if (g_window_size < 1 || g_window_size > 65535) {
+                fprintf(stderr, "Window size must be 1-65535\n");
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'G':
+            g_sack = 0;
+            break;
+        case 'M':
+            g_multicast = 1;
+            break;
+        case 'P':
+            g_streams = atoi(optarg);
+            if (g_streams < 1 || g_streams > MAX_STREAMS) {
+                fprintf(stderr, "Streams must be 1-%d\n", MAX_STREAMS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'F':
+            if (sscanf(optarg, "%d,%d", &g_fec_k, &g_fec_m) != 2 ||
+                g_fec_k < 1 || g_fec_k > FEC_MAX_GROUP || g_fec_m < 1 ||
+                g_fec_m > g_fec_k || g_fec_m > FEC_MAX_PARITY) {
+                fprintf(stderr, "FEC must be K,M with K 1-%d and M 1-%d "
+                        "(M <= K)\n", FEC_MAX_GROUP, FEC_MAX_PARITY);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'D':
+            g_delta = 1;
+            break;
+        case 'N':
+            g_offload = 0;
+            break;
+        case 'X':
+            crypto_threads = atoi(optarg);
+            if (crypto_threads < 0 || crypto_threads > CRYPTO_MAX_THREADS) {
+                fprintf(stderr, "Crypto threads must be 0-%d\n",
+                        CRYPTO_MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'Z':
+            g_compress = codec_find(optarg, strlen(optarg));
+            if (g_compress < 0) {
+                fprintf(stderr, "Unknown compression: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'E':
+            if (strcasecmp(optarg, "gcm") != 0 &&
+                strcasecmp(optarg, "cbc") != 0) {
+                fprintf(stderr, "Cipher must be gcm or cbc\n");
+                return EXIT_FAILURE;
+            }
+            g_gcm = strcasecmp(optarg, "gcm") == 0;
+            break;
+        case 'r':
+            if (strcmp(optarg, "0") != 0 && strcmp(optarg, "1") != 0) {
+                fprintf(stderr, "Rollover must be 0 or 1\n");
+                return EXIT_FAILURE;
+            }
+            g_rollover = atoi(optarg);
+            g_exthdr   = 0;
+            break;
+        case 'c':
+            g_congestion = cc_find(optarg);
+            if (!g_congestion) {
+                fprintf(stderr, "Unknown congestion control: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            g_pacing = pacer_find(optarg);
+            if (g_pacing < 0) {
+                fprintf(stderr, "Unknown pacing mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            argc = 0;           /* force the usage message */
+            break;
+        }
+    }
+
+    if (argc - optind < 1) {
+        fprintf(stderr, "Usage: %s [-b blksize] [-t timeout] [-w window] [-G] "
+                "[-r 0|1] [-M] [-P streams] [-F K,M] [-D] [-Z deflate] "
+                "[-E gcm|cbc] [-N] [-X threads] [-c aimd|vegas|fixed] "
+                "[-p user|txtime|off] <server_ip> [port]\n", argv[0]);
         return EXIT_FAILURE;
     }
 
-    const char *server_ip = argv[1];
+    const char *server_ip = argv[optind];
     uint16_t port = TFTP_PORT;
-    if (argc >= 3)
-        port = (uint16_t)atoi(argv[2]);
+    if (argc - optind >= 2)
+        port = (uint16_t)atoi(argv[optind + 1]);
 
     /* Create socket */
     int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
@@ -393,12 +1263,29 @@ int main(int argc, char *argv[])
         close(sockfd);
         return EXIT_FAILURE;
     }
+    if (crypto_pool_start(&g_crypto, crypto_threads) < 0) {
+        perror("crypto pool");
+        close(sockfd);
+        return EXIT_FAILURE;
+    }
 
     printf("========================================\n");
     printf("  Enhanced TFTP Client\n");
     printf("  Server   : %s:%u\n", server_ip, port);
-    printf("  Encryption: AES-256-CBC\n");
+    printf("  Encryption: %s\n", g_gcm ? "AES-256-GCM" : "AES-256-CBC");
     printf("  Block size: %d bytes\n", g_block_size);
+    printf("  Window    : %d blocks\n", g_window_size);
+    printf("  Congestion: %s\n", g_congestion->name);
+    if (g_streams > 1)
+        printf("  Streams   : %d\n", g_streams);
+    if (g_fec_k > 0)
+        printf("  FEC       : %d+%d\n", g_fec_k, g_fec_m);
+    if (g_delta)
+        printf("  Uploads   : delta-sync\n");
+    if (g_crypto.nthreads > 0)
+        printf("  Crypto    : %d threads\n", g_crypto.nthreads);
+    if (g_compress)
+        printf("  Compress  : %s\n", CODEC_NAMES[g_compress]);
     printf("========================================\n");
 
     char input[MAX_FILENAME];
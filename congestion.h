@@ -0,0 +1,291 @@
+/*
+ * congestion.h
+ * =====================================================================
+ * Enhanced TFTP – congestion control and packet pacing
+ *
+ * Used by the WindowSender in transport.h.  The negotiated windowsize
+ * is only an upper bound; the congestion controller decides how many
+ * blocks may actually be in flight (cwnd), and the pacer spreads those
+ * blocks over one smoothed RTT instead of bursting a whole window at
+ * line rate into switch and socket buffers.
+ *
+ * Controllers are pluggable through a small ops table:
+ *   • "aimd"  – Reno-style slow start, +1 block per RTT, halve on loss.
+ *   • "vegas" – delay-based: grows while few blocks sit in queues
+ *               (RTT close to the path minimum) and backs off as the
+ *               RTT inflates, before any loss occurs.
+ *   • "fixed" – no control: cwnd is always the negotiated window.
+ *
+ * Pacing modes:
+ *   • PACE_USER   – the sender waits between packets itself.
+ *   • PACE_TXTIME – every packet carries an SO_TXTIME departure time
+ *                   and the fq qdisc holds it until then.
+ *   • PACE_OFF    – send as fast as the window allows.
+ * =====================================================================
+ */
+
+#ifndef CONGESTION_H
+#define CONGESTION_H
+
+#include "udp_file_transfer.h"
+#include <linux/net_tstamp.h>
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define CC_INITIAL_WINDOW   10          /* Blocks before the first ACK      */
+#define CC_MIN_WINDOW       2           /* Floor after a loss               */
+#define VEGAS_ALPHA         2           /* Grow while fewer queued blocks   */
+#define VEGAS_BETA          4           /* Shrink when more are queued      */
+#define VEGAS_GAMMA         1           /* Leave slow start above this      */
+
+#define PACE_OFF            0
+#define PACE_USER           1
+#define PACE_TXTIME         2
+#define PACE_BURST_USEC     500         /* Idle credit the pacer may spend  */
+
+/* ------------------------------------------------------------------ */
+/*  Types                                                              */
+/* ------------------------------------------------------------------ */
+
+typedef struct CongestionControl CongestionControl;
+
+typedef struct {
+    const char *name;
+    /* `acked` new blocks were acknowledged; `rtt` is the sample they
+       produced in µs, or 0 if Karn's rule withheld one.               */
+    void (*on_ack)(CongestionControl *cc, int acked, int64_t rtt);
+    void (*on_loss)(CongestionControl *cc);     /* duplicate ACKs    */
+    void (*on_timeout)(CongestionControl *cc);  /* retransmit timer  */
+} CongestionOps;
+
+struct CongestionControl {
+    const CongestionOps *ops;
+    double              cwnd;           /* Blocks allowed in flight       */
+    double              ssthresh;       /* Slow-start threshold           */
+    int                 max_window;     /* Negotiated windowsize          */
+    int64_t             base_rtt;       /* Lowest RTT seen (µs), Vegas    */
+};
+
+typedef struct {
+    int                 mode;           /* PACE_*                         */
+    uint64_t            next_ns;        /* Earliest departure of next pkt */
+    uint64_t            interval_ns;    /* Gap between packets, 0 = none  */
+} Pacer;
+
+/* ------------------------------------------------------------------ */
+/*  Shared window arithmetic                                           */
+/* ------------------------------------------------------------------ */
+
+static inline void cc_clamp(CongestionControl *cc)
+{
+    if (cc->cwnd < 1)                cc->cwnd = 1;
+    if (cc->cwnd > cc->max_window)   cc->cwnd = cc->max_window;
+}
+
+/* Multiplicative decrease shared by every loss-reacting controller */
+static inline void cc_halve(CongestionControl *cc)
+{
+    cc->ssthresh = cc->cwnd / 2;
+    if (cc->ssthresh < CC_MIN_WINDOW) cc->ssthresh = CC_MIN_WINDOW;
+    cc->cwnd = cc->ssthresh;
+    cc_clamp(cc);
+}
+
+static inline void cc_restart(CongestionControl *cc)
+{
+    cc->ssthresh = cc->cwnd / 2;
+    if (cc->ssthresh < CC_MIN_WINDOW) cc->ssthresh = CC_MIN_WINDOW;
+    cc->cwnd = 1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  AIMD                                                               */
+/* ------------------------------------------------------------------ */
+
+static inline void aimd_on_ack(CongestionControl *cc, int acked,
+                               int64_t rtt)
+{
+    (void)rtt;
+    if (cc->cwnd < cc->ssthresh)
+        cc->cwnd += acked;                      /* slow start         */
+    else
+        cc->cwnd += (double)acked / cc->cwnd;   /* +1 block per RTT   */
+    cc_clamp(cc);
+}
+
+static const CongestionOps CC_AIMD = {
+    "aimd", aimd_on_ack, cc_halve, cc_restart
+};
+
+/* ------------------------------------------------------------------ */
+/*  Vegas (delay-based)                                                */
+/* ------------------------------------------------------------------ */
+
+static inline void vegas_on_ack(CongestionControl *cc, int acked,
+                                int64_t rtt)
+{
+    if (rtt <= 0) return;
+    if (cc->base_rtt == 0 || rtt < cc->base_rtt)
+        cc->base_rtt = rtt;
+
+    /* Blocks this flow keeps queued along the path */
+    double queued = cc->cwnd * (double)(rtt - cc->base_rtt) / rtt;
+
+    if (cc->cwnd < cc->ssthresh) {
+        if (queued > VEGAS_GAMMA)
+            cc->ssthresh = cc->cwnd;            /* leave slow start   */
+        else
+            cc->cwnd += acked;
+    } else if (queued < VEGAS_ALPHA) {
+        cc->cwnd += (double)acked / cc->cwnd;
+    } else if (queued > VEGAS_BETA) {
+        cc->cwnd -= (double)acked / cc->cwnd;
+        if (cc->cwnd < CC_MIN_WINDOW) cc->cwnd = CC_MIN_WINDOW;
+    }
+    cc_clamp(cc);
+}
+
+static const CongestionOps CC_VEGAS = {
+    "vegas", vegas_on_ack, cc_halve, cc_restart
+};
+
+/* ------------------------------------------------------------------ */
+/*  Fixed window                                                       */
+/* ------------------------------------------------------------------ */
+
+static inline void fixed_on_ack(CongestionControl *cc, int acked,
+                                int64_t rtt)
+{
+    (void)acked; (void)rtt;
+    cc->cwnd = cc->max_window;
+}
+
+static inline void fixed_on_event(CongestionControl *cc)
+{
+    cc->cwnd = cc->max_window;
+}
+
+static const CongestionOps CC_FIXED = {
+    "fixed", fixed_on_ack, fixed_on_event, fixed_on_event
+};
+
+/* ------------------------------------------------------------------ */
+/*  Controller API                                                     */
+/* ------------------------------------------------------------------ */
+
+/*
+ * cc_find – Look up a controller by name.  Returns NULL if unknown.
+ */
+static inline const CongestionOps *cc_find(const char *name)
+{
+    static const CongestionOps *all[] = { &CC_AIMD, &CC_VEGAS, &CC_FIXED };
+
+    for (size_t i = 0; i < sizeof(all) / sizeof(all[0]); i++)
+        if (strcasecmp(name, all[i]->name) == 0)
+            return all[i];
+    return NULL;
+}
+
+/*
+ * cc_init – Start `ops` on a path whose negotiated window is
+ *           `max_window` blocks.
+ */
+static inline void cc_init(CongestionControl *cc, const CongestionOps *ops,
+                           int max_window)
+{
+    memset(cc, 0, sizeof(*cc));
+    cc->ops        = ops ? ops : &CC_AIMD;
+    cc->max_window = max_window;
+    cc->ssthresh   = max_window;
+    cc->cwnd       = cc->ops == &CC_FIXED ? max_window : CC_INITIAL_WINDOW;
+    cc_clamp(cc);
+}
+
+/*
+ * pacer_find – Map "off" / "user" / "txtime" to a PACE_* mode, or -1.
+ */
+static inline int pacer_find(const char *name)
+{
+    if (strcasecmp(name, "off")    == 0) return PACE_OFF;
+    if (strcasecmp(name, "user")   == 0) return PACE_USER;
+    if (strcasecmp(name, "txtime") == 0) return PACE_TXTIME;
+    return -1;
+}
+
+/* Whole blocks the controller currently allows in flight */
+static inline int cc_window(const CongestionControl *cc)
+{
+    return (int)cc->cwnd;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Pacer                                                              */
+/* ------------------------------------------------------------------ */
+
+static inline uint64_t now_nsec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * pacer_enable_txtime – Ask the kernel to honour per-packet departure
+ *                       times on `sockfd`.  Returns 0 on success; on
+ *                       failure the caller should fall back to
+ *                       PACE_USER.  (Timestamps are only enforced when
+ *                       the egress qdisc is fq.)
+ */
+static inline int pacer_enable_txtime(int sockfd)
+{
+    struct sock_txtime cfg = { .clockid = CLOCK_MONOTONIC, .flags = 0 };
+    return setsockopt(sockfd, SOL_SOCKET, SO_TXTIME, &cfg, sizeof(cfg));
+}
+
+/*
+ * pacer_update – Spread `cwnd` blocks evenly over one smoothed RTT.  In
+ *                slow start the rate is doubled so the window can still
+ *                grow within an RTT.
+ */
+static inline void pacer_update(Pacer *p, const CongestionControl *cc,
+                                int64_t srtt_us)
+{
+    if (p->mode == PACE_OFF || srtt_us <= 0 || cc->cwnd < 1) {
+        p->interval_ns = 0;
+        return;
+    }
+
+    double gain = cc->cwnd < cc->ssthresh ? 2.0 : 1.25;
+    p->interval_ns = (uint64_t)(srtt_us * 1000.0 / (cc->cwnd * gain));
+}
+
+/*
+ * pacer_delay – Nanoseconds to wait before the next packet may leave
+ *               (always 0 unless pacing in userspace).
+ */
+static inline uint64_t pacer_delay(const Pacer *p, uint64_t now)
+{
+    if (p->mode != PACE_USER || p->next_ns <= now)
+        return 0;
+    return p->next_ns - now;
+}
+
+/*
+ * pacer_stamp – Account for one departing packet and return its
+ *               departure time.  Unused idle time is only banked up to
+ *               PACE_BURST_USEC so an idle sender can't later burst.
+ */
+static inline uint64_t pacer_stamp(Pacer *p, uint64_t now)
+{
+    uint64_t floor = now - (uint64_t)PACE_BURST_USEC * 1000;
+    if (p->next_ns < floor)
+        p->next_ns = floor;
+
+    uint64_t departure = p->next_ns > now ? p->next_ns : now;
+    p->next_ns += p->interval_ns;
+    return departure;
+}
+
+#endif /* CONGESTION_H */
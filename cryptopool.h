@@ -0,0 +1,765 @@
+/*
+ * cryptopool.h
+ * =====================================================================
+ * Enhanced TFTP – crypto worker pool for windowed transfers
+ *
+ * A transfer encrypts or decrypts every block on the thread that runs
+ * its window, so one session never goes faster than one core's AES.
+ * Blocks are independent of each other – CBC restarts from the shared
+ * IV and GCM takes its nonce from the block's offset – so a pool of
+ * threads can work on a window's worth of them at once:
+ *
+ *   • Chunks – a stream is cut into chunks of whole blocks, about
+ *              CRYPTO_CHUNK_BYTES each, and every chunk is one job.
+ *              Each of the stream's chunk slots keeps its own cipher
+ *              context, so keys are expanded once per slot and no two
+ *              threads ever share a context.
+ *   • Sending – the producer keeps a chunk per slot ahead of the window
+ *               queued.  A worker reads its chunk with one pread() and
+ *               seals every block of it; the producer hands the
+ *               ciphertext out in order (and feeds the running MD5).
+ *   • Receiving – the consumer copies each block into the open chunk
+ *                 and queues it once full.  A worker decrypts it and
+ *                 writes it with one pwrite(); crypto_settle takes the
+ *                 chunks back in order, so the MD5 and the checkpoint
+ *                 (checkpoint.h) only ever cover bytes on disk.  The
+ *                 receiver ACKs no block before it is settled, so one
+ *                 that fails its tag is never written nor ACKed: it
+ *                 and the blocks after it are sent again.  Only GCM
+ *                 streams qualify: the receiver must know each block's
+ *                 plaintext length when it arrives, and there it is the
+ *                 ciphertext's minus the tag.
+ *   • Waiting – the settler never waits: it takes back what is done
+ *               and the receiver asks again (SETTLE_POLL_USEC).  Nor
+ *               does a producer marked `nowait` (one on a reactor
+ *               worker): a chunk still queued is run on the spot, one
+ *               a thread has makes it answer PRODUCE_AGAIN with
+ *               `waiting` set, and the caller comes back after
+ *               CRYPTO_POLL_USEC.  Other producers wait, running their
+ *               other queued chunks meanwhile, so a busy pool slows no
+ *               transfer below what its own thread manages.
+ *   • Closing – a stream drops its queued chunks and leaves the ones a
+ *               thread has to finish on their own: the slots, and a
+ *               dup() of the file, live in a CryptoRing that the last
+ *               of them frees.
+ *
+ * Compressed streams keep their own thread: how a block deflates
+ * depends on the blocks before it.
+ * =====================================================================
+ */
+
+#ifndef CRYPTOPOOL_H
+#define CRYPTOPOOL_H
+
+#include "udp_file_transfer.h"
+#include "checkpoint.h"
+#include "transport.h"
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define CRYPTO_MAX_THREADS  64          /* -X upper bound                 */
+#define CRYPTO_CHUNK_BYTES  65536       /* Plaintext per job, ≥ 1 block   */
+#define CRYPTO_MAX_DEPTH    8           /* Chunk slots per sending stream */
+#define CRYPTO_RECV_DEPTH   64          /* … and at most per receiving one*/
+#define CRYPTO_POLL_USEC    100         /* Retry of a `nowait` stream     */
+
+/* Where a chunk slot stands */
+#define CHUNK_FREE          0
+#define CHUNK_QUEUED        1           /* Waiting for a thread           */
+#define CHUNK_RUNNING       2
+#define CHUNK_DONE          3
+
+/* ------------------------------------------------------------------ */
+/*  The pool                                                           */
+/* ------------------------------------------------------------------ */
+
+typedef struct CryptoRing   CryptoRing;
+typedef struct CryptoChunk  CryptoChunk;
+
+struct CryptoChunk {
+    CryptoRing     *ring;
+    CryptoChunk    *next;               /* Queue link                     */
+    int             state;              /* CHUNK_*, under the pool lock   */
+    int             stale;              /* Dropped; freed once done       */
+    uint64_t        offset;             /* Stream byte of its first block */
+    int             count;              /* Blocks in it                   */
+    int             good;               /* Receiving: leading blocks that */
+                                        /* passed their tag               */
+    int             last;               /* Ends with the final block      */
+    BlockCipher     cipher;             /* This slot's own context        */
+    uint8_t        *plain;              /* count × block_size, contiguous */
+    uint8_t        *wire;               /* count × CryptoRing.stride      */
+    int            *len;                /* Ciphertext length per block    */
+    int            *raw;                /* Plaintext length per block     */
+    const char     *error;              /* Why the chunk failed, or NULL  */
+    int             err;                /* errno of a failed write        */
+};
+
+/* What the pool's threads use of a stream; it outlives a stream that
+ * closes while a thread still has one of its chunks                  */
+struct CryptoRing {
+    int             fd;                 /* The stream's file, dup()ed     */
+    int             block_size;
+    uint64_t        base;               /* As in the FileStream           */
+    uint64_t        end;
+    int             encrypt;            /* Sending (1) or receiving (0)   */
+    int             chunk;              /* Blocks per chunk               */
+    int             stride;             /* Wire bytes per block slot      */
+    int             depth;              /* Chunk slots                    */
+    int             orphaned;           /* Stream closed (pool lock)      */
+    CryptoChunk     slots[];
+};
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  work;               /* A chunk was queued             */
+    pthread_cond_t  done;               /* A worker finished a chunk      */
+    CryptoChunk    *head, *tail;        /* FIFO of queued chunks          */
+    pthread_t      *threads;
+    int             nthreads;
+    int             stop;
+} CryptoPool;
+
+typedef struct {
+    CryptoPool     *pool;               /* NULL = not open                */
+    CryptoRing     *ring;
+    FileStream     *fs;
+    Checkpoint     *ck;                 /* Receiving: journal, or NULL    */
+    int             nowait;             /* Never wait for a pool thread   */
+    int             waiting;            /* Stopped on a busy chunk        */
+    int             head;               /* Oldest slot in use             */
+    int             used;               /* Slots queued, running or done  */
+    int             pos;                /* Block within the head (send)   */
+                                        /* or open (receive) chunk        */
+    uint64_t        want;               /* Stream byte expected next      */
+    uint64_t        ahead;              /* Sending: next chunk to queue   */
+    uint64_t        size;               /* Sending: stream bytes expected */
+    int             eof;                /* Final block is in a chunk      */
+    uint32_t        settled;            /* Receiving: blocks on disk      */
+    unsigned        chunks;             /* Chunks queued                  */
+    unsigned        helped;             /* Chunks its own thread ran      */
+} CryptoStream;
+
+/* Pop the oldest queued chunk; the pool lock is held */
+static inline CryptoChunk *crypto_pop(CryptoPool *p)
+{
+    CryptoChunk *c = p->head;
+    if (c) {
+        p->head = c->next;
+        if (!p->head)
+            p->tail = NULL;
+        c->state = CHUNK_RUNNING;
+    }
+    return c;
+}
+
+/* Take a queued chunk back out of the FIFO; the pool lock is held */
+static inline void crypto_unlink(CryptoPool *p, CryptoChunk *c)
+{
+    CryptoChunk **pp   = &p->head;
+    CryptoChunk  *prev = NULL;
+    while (*pp && *pp != c) {
+        prev = *pp;
+        pp   = &(*pp)->next;
+    }
+    if (!*pp)
+        return;
+    *pp = c->next;
+    if (p->tail == c)
+        p->tail = prev;
+    c->state = CHUNK_RUNNING;
+}
+
+/* Read a sending chunk from the file and seal each of its blocks */
+static inline void crypto_seal_chunk(CryptoChunk *c)
+{
+    const CryptoRing *r    = c->ring;
+    int               bs   = r->block_size;
+    uint64_t          pos  = r->base + c->offset;
+    uint64_t          want = (uint64_t)r->chunk * bs;
+    uint64_t          got  = 0;
+
+    if (pos >= r->end)
+        want = 0;
+    else if (r->end - pos < want)
+        want = r->end - pos;
+    while (got < want) {
+        ssize_t n = pread(r->fd, c->plain + got, want - got,
+                          (off_t)(pos + got));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            c->error = "Read failed";
+            return;
+        }
+        if (n == 0)
+            break;
+        got += (uint64_t)n;
+    }
+
+    uint64_t done = 0;
+    for (c->count = 0; c->count < r->chunk; ) {
+        int n   = got - done < (uint64_t)bs ? (int)(got - done) : bs;
+        int len = cipher_encrypt(&c->cipher, c->offset + done,
+                                 c->plain + done, n,
+                                 c->wire + (size_t)c->count * r->stride);
+        if (len < 0) {
+            c->error = "Encryption failed";
+            return;
+        }
+        c->len[c->count] = len;
+        c->raw[c->count] = n;
+        c->count++;
+        done += (uint64_t)n;
+        if (n < bs) {
+            c->last = 1;
+            break;
+        }
+    }
+}
+
+/* Decrypt a received chunk up to the first block that fails its tag
+ * and write what passed where it belongs – unless its stream has
+ * closed meanwhile, and the file may be someone else's              */
+static inline void crypto_open_chunk(CryptoChunk *c)
+{
+    CryptoRing *r     = c->ring;
+    int         bs    = r->block_size;
+    size_t      total = 0;
+
+    for (c->good = 0; c->good < c->count; c->good++) {
+        int i = c->good;
+        int n = cipher_decrypt(&c->cipher, c->offset + (uint64_t)i * bs,
+                               c->wire + (size_t)i * r->stride, c->len[i],
+                               c->plain + (size_t)i * bs);
+        if (n != c->raw[i])
+            break;
+        total += (size_t)n;
+    }
+    if (__atomic_load_n(&r->orphaned, __ATOMIC_RELAXED))
+        return;
+    for (size_t off = 0; off < total; ) {
+        ssize_t n = pwrite(r->fd, c->plain + off, total - off,
+                           (off_t)(r->base + c->offset + off));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            c->err = n < 0 ? errno : EIO;
+            return;
+        }
+        off += (size_t)n;
+    }
+}
+
+static inline void crypto_run(CryptoChunk *c)
+{
+    if (c->ring->encrypt)
+        crypto_seal_chunk(c);
+    else
+        crypto_open_chunk(c);
+}
+
+static inline void crypto_ring_free(CryptoRing *r)
+{
+    for (int i = 0; i < r->depth; i++) {
+        cipher_free(&r->slots[i].cipher);
+        free(r->slots[i].plain);
+        free(r->slots[i].wire);
+        free(r->slots[i].len);
+        free(r->slots[i].raw);
+    }
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+/* Whether a thread still has a chunk of `r`; the pool lock is held */
+static inline int crypto_ring_busy(const CryptoRing *r)
+{
+    for (int i = 0; i < r->depth; i++)
+        if (r->slots[i].state == CHUNK_RUNNING)
+            return 1;
+    return 0;
+}
+
+static inline void *crypto_worker(void *arg)
+{
+    CryptoPool *p = (CryptoPool *)arg;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (!p->head && !p->stop)
+            pthread_cond_wait(&p->work, &p->lock);
+        CryptoChunk *c = crypto_pop(p);
+        if (!c)
+            break;
+        pthread_mutex_unlock(&p->lock);
+        crypto_run(c);
+        pthread_mutex_lock(&p->lock);
+        c->state = CHUNK_DONE;
+
+        /* The last chunk of a closed stream takes its ring along */
+        CryptoRing *r = c->ring;
+        if (r->orphaned && !crypto_ring_busy(r)) {
+            pthread_mutex_unlock(&p->lock);
+            crypto_ring_free(r);
+            pthread_mutex_lock(&p->lock);
+            continue;
+        }
+        pthread_cond_broadcast(&p->done);
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+/*
+ * crypto_pool_start – Start `nthreads` crypto workers.  Returns 0, or
+ *                     -1 if none could be started (0 threads leaves
+ *                     the pool off).
+ */
+static inline int crypto_pool_start(CryptoPool *p, int nthreads)
+{
+    memset(p, 0, sizeof(*p));
+    if (nthreads <= 0)
+        return 0;
+    p->threads = calloc(nthreads, sizeof(*p->threads));
+    if (!p->threads)
+        return -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work, NULL);
+    pthread_cond_init(&p->done, NULL);
+    for (int i = 0; i < nthreads; i++) {
+        if (pthread_create(&p->threads[i], NULL, crypto_worker, p) != 0) {
+            perror("crypto: pthread_create");
+            break;
+        }
+        p->nthreads++;
+    }
+    return p->nthreads > 0 ? 0 : -1;
+}
+
+/* Stop the workers once the queue is empty (every stream closed) */
+static inline void crypto_pool_stop(CryptoPool *p)
+{
+    if (!p->threads)
+        return;
+    pthread_mutex_lock(&p->lock);
+    p->stop = 1;
+    pthread_cond_broadcast(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    for (int i = 0; i < p->nthreads; i++)
+        pthread_join(p->threads[i], NULL);
+    free(p->threads);
+    p->threads  = NULL;
+    p->nthreads = 0;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Streams                                                            */
+/* ------------------------------------------------------------------ */
+
+static inline CryptoChunk *crypto_slot(CryptoStream *cs, int i)
+{
+    return &cs->ring->slots[(cs->head + i) % cs->ring->depth];
+}
+
+static inline void crypto_queue(CryptoStream *cs, CryptoChunk *c)
+{
+    CryptoPool *p = cs->pool;
+
+    c->next  = NULL;
+    c->stale = 0;
+    c->error = NULL;
+    c->err   = 0;
+    pthread_mutex_lock(&p->lock);
+    c->state = CHUNK_QUEUED;
+    if (p->tail)
+        p->tail->next = c;
+    else
+        p->head = c;
+    p->tail = c;
+    pthread_cond_signal(&p->work);
+    pthread_mutex_unlock(&p->lock);
+    cs->used++;
+    cs->chunks++;
+}
+
+/* Give the oldest slot in use back */
+static inline void crypto_release(CryptoStream *cs)
+{
+    crypto_slot(cs, 0)->state = CHUNK_FREE;
+    cs->head = (cs->head + 1) % cs->ring->depth;
+    cs->used--;
+}
+
+/*
+ * crypto_await – Return once chunk `c` of the stream is done.  Still
+ *                queued, it is run here; while a worker has it, the
+ *                stream's other queued chunks are.
+ */
+static inline void crypto_await(CryptoStream *cs, CryptoChunk *c)
+{
+    CryptoPool *p = cs->pool;
+
+    pthread_mutex_lock(&p->lock);
+    while (c->state != CHUNK_DONE) {
+        CryptoChunk *run = NULL;
+        if (c->state == CHUNK_QUEUED)
+            run = c;
+        for (int i = 0; !run && i < cs->used; i++)
+            if (crypto_slot(cs, i)->state == CHUNK_QUEUED)
+                run = crypto_slot(cs, i);
+        if (!run) {
+            pthread_cond_wait(&p->done, &p->lock);
+            continue;
+        }
+        crypto_unlink(p, run);
+        pthread_mutex_unlock(&p->lock);
+        crypto_run(run);
+        cs->helped++;
+        pthread_mutex_lock(&p->lock);
+        run->state = CHUNK_DONE;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * crypto_ready – Whether chunk `c` is done.  A `nowait` stream runs it
+ *                here if it is still queued, but never waits for a
+ *                thread that has it; others wait (crypto_await).
+ */
+static inline int crypto_ready(CryptoStream *cs, CryptoChunk *c)
+{
+    CryptoPool *p = cs->pool;
+
+    if (!cs->nowait) {
+        crypto_await(cs, c);
+        return 1;
+    }
+    pthread_mutex_lock(&p->lock);
+    int state = c->state;
+    if (state == CHUNK_QUEUED)
+        crypto_unlink(p, c);
+    pthread_mutex_unlock(&p->lock);
+    if (state != CHUNK_QUEUED)
+        return state == CHUNK_DONE;
+
+    crypto_run(c);
+    cs->helped++;
+    pthread_mutex_lock(&p->lock);
+    c->state = CHUNK_DONE;
+    pthread_mutex_unlock(&p->lock);
+    return 1;
+}
+
+/* Whether chunk `c` is done, without running or waiting for it */
+static inline int crypto_done(CryptoStream *cs, const CryptoChunk *c)
+{
+    pthread_mutex_lock(&cs->pool->lock);
+    int done = c->state == CHUNK_DONE;
+    pthread_mutex_unlock(&cs->pool->lock);
+    return done;
+}
+
+/* Drop every chunk in use: a queued one at once, one a thread has once
+ * it is done (it stays in its slot, stale, until then)               */
+static inline void crypto_discard(CryptoStream *cs)
+{
+    CryptoPool *p = cs->pool;
+
+    pthread_mutex_lock(&p->lock);
+    for (int i = 0; i < cs->used; i++) {
+        CryptoChunk *c = crypto_slot(cs, i);
+        if (c->state == CHUNK_QUEUED) {
+            crypto_unlink(p, c);
+            c->state = CHUNK_DONE;
+        }
+        c->stale = 1;
+    }
+    pthread_mutex_unlock(&p->lock);
+    cs->pos = 0;
+}
+
+/* Free the dropped chunks at the head that are done; 0 while one is
+ * still in a thread's hands                                          */
+static inline int crypto_skip_stale(CryptoStream *cs)
+{
+    while (cs->used > 0 && crypto_slot(cs, 0)->stale) {
+        if (!crypto_ready(cs, crypto_slot(cs, 0)))
+            return 0;
+        crypto_release(cs);
+    }
+    return 1;
+}
+
+/*
+ * crypto_stream_close – Drop what is queued and detach the stream.  It
+ *                       never waits: a chunk a thread still has frees
+ *                       the ring when it finishes.
+ */
+static inline void crypto_stream_close(CryptoStream *cs)
+{
+    CryptoPool *p = cs->pool;
+    CryptoRing *r = cs->ring;
+    if (!p)
+        return;
+
+    if (r) {
+        pthread_mutex_lock(&p->lock);
+        for (int i = 0; i < r->depth; i++)
+            if (r->slots[i].state == CHUNK_QUEUED) {
+                crypto_unlink(p, &r->slots[i]);
+                r->slots[i].state = CHUNK_FREE;
+            }
+        int busy = crypto_ring_busy(r);
+        __atomic_store_n(&r->orphaned, busy, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&p->lock);
+        if (!busy)
+            crypto_ring_free(r);
+    }
+    cs->ring = NULL;
+    cs->pool = NULL;
+}
+
+/*
+ * crypto_stream_open – Run the blocks of `fs` through pool `p`: sealed
+ *                      for crypto_produce (`encrypt` set) or opened for
+ *                      crypto_consume and crypto_settle, which also keep
+ *                      the journal `ck` (may be NULL).  A receiving
+ *                      stream has slots for a `window` of blocks.
+ *                      Returns 0, or -1 when the stream stays on its
+ *                      own thread: the pool is off, the stream
+ *                      compressed, a receiving stream not GCM, or
+ *                      memory short.
+ */
+static inline int crypto_stream_open(CryptoStream *cs, CryptoPool *p,
+                                     FileStream *fs, Checkpoint *ck,
+                                     int encrypt, int window)
+{
+    memset(cs, 0, sizeof(*cs));
+    if (p->nthreads == 0 || fs->codec != CODEC_NONE ||
+        (!encrypt && !fs->cipher.gcm))
+        return -1;
+
+    int bs    = fs->block_size;
+    int chunk = bs < CRYPTO_CHUNK_BYTES ? CRYPTO_CHUNK_BYTES / bs : 1;
+    int depth = encrypt ? p->nthreads + 1 : window / chunk + 3;
+    int cap   = encrypt ? CRYPTO_MAX_DEPTH : CRYPTO_RECV_DEPTH;
+    if (depth > cap)
+        depth = cap;
+
+    CryptoRing *r = calloc(1, sizeof(*r) +
+                              (size_t)depth * sizeof(r->slots[0]));
+    if (!r)
+        return -1;
+    r->fd         = -1;
+    r->block_size = bs;
+    r->base       = fs->base;
+    r->end        = fs->end;
+    r->encrypt    = encrypt;
+    r->chunk      = chunk;
+    r->stride     = bs + EVP_MAX_BLOCK_LENGTH;
+    r->depth      = depth;
+    cs->pool = p;               /* from here on close() cleans up      */
+    cs->ring = r;
+    cs->fs   = fs;
+    cs->ck   = ck;
+    cs->size = fs->end - fs->base;
+    struct stat st;
+    if (encrypt && fstat(fs->fd, &st) == 0 &&
+        (uint64_t)st.st_size < fs->end)
+        cs->size = (uint64_t)st.st_size > fs->base
+                   ? (uint64_t)st.st_size - fs->base : 0;
+
+    r->fd = dup(fs->fd);
+    for (int i = 0; i < depth; i++) {
+        CryptoChunk *c = &r->slots[i];
+        c->ring   = r;
+        c->plain  = malloc((size_t)chunk * bs);
+        c->wire   = malloc((size_t)chunk * r->stride);
+        c->len    = calloc(chunk, sizeof(int));
+        c->raw    = calloc(chunk, sizeof(int));
+        cipher_clone(&c->cipher, &fs->cipher);
+        if (!c->plain || !c->wire || !c->len || !c->raw || r->fd < 0) {
+            crypto_stream_close(cs);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Queue chunks ahead of the window until every slot is in use */
+static inline void crypto_fill(CryptoStream *cs)
+{
+    while (!cs->eof && cs->used < cs->ring->depth) {
+        CryptoChunk *c = crypto_slot(cs, cs->used);
+        c->offset = cs->ahead;
+        c->count  = 0;
+        c->last   = 0;
+        crypto_queue(cs, c);
+        cs->ahead += (uint64_t)cs->ring->chunk * cs->fs->block_size;
+        if (cs->ahead > cs->size)
+            cs->eof = 1;        /* this chunk ends short: the last one */
+    }
+}
+
+/*
+ * crypto_produce – BlockProducer: the sealed block at stream byte
+ *                  `offset`, from the chunk the pool made of it.  A
+ *                  request out of order (a restarted sender) drops
+ *                  what is queued and starts again there.  A `nowait`
+ *                  stream answers PRODUCE_AGAIN while a thread still
+ *                  has the chunk.
+ */
+static inline int crypto_produce(void *arg, uint64_t offset,
+                                 uint8_t *payload, int *raw_len)
+{
+    CryptoStream *cs = (CryptoStream *)arg;
+    FileStream   *fs = cs->fs;
+
+    if (offset != cs->want || (cs->used == 0 && cs->eof)) {
+        crypto_discard(cs);
+        cs->want  = offset;
+        cs->ahead = offset;
+        cs->eof   = 0;
+    }
+    cs->waiting = !crypto_skip_stale(cs);
+    if (cs->waiting)
+        return PRODUCE_AGAIN;
+    crypto_fill(cs);
+
+    CryptoChunk *c = crypto_slot(cs, 0);
+    cs->waiting = !crypto_ready(cs, c);
+    if (cs->waiting)
+        return PRODUCE_AGAIN;
+    if (c->error) {
+        fs->error = c->error;
+        return -1;
+    }
+
+    int i   = cs->pos;
+    int len = c->len[i];        /* the slot may be refilled below      */
+    memcpy(payload, c->wire + (size_t)i * cs->ring->stride, len);
+    *raw_len = c->raw[i];
+    if (fs->md5)
+        EVP_DigestUpdate(fs->md5, c->plain + (size_t)i * fs->block_size,
+                         c->raw[i]);
+    cs->want += (uint64_t)fs->block_size;
+    if (++cs->pos == c->count) {
+        if (c->last)
+            cs->eof = 1;        /* a short read ended it early         */
+        crypto_release(cs);
+        cs->pos = 0;
+        crypto_fill(cs);
+    }
+    return len;
+}
+
+/* Queue the open receiving chunk as it stands */
+static inline void crypto_seal_open(CryptoStream *cs, int last)
+{
+    CryptoChunk *c = crypto_slot(cs, cs->used);
+    c->count = cs->pos;
+    c->last  = last;
+    cs->pos  = 0;
+    crypto_queue(cs, c);
+}
+
+/*
+ * crypto_settle – BlockSettler: take back the received chunks that are
+ *                 done, oldest first – their bytes are on disk, so they
+ *                 join the MD5 and the journal – and report in
+ *                 `*settled` how many blocks are.  With nothing in the
+ *                 pool the open chunk is queued as it stands, so a
+ *                 window smaller than a chunk still settles.  A block
+ *                 that fails its tag drops every block after it too:
+ *                 SETTLE_REJECTED, and they are consumed again.  Never
+ *                 waits; -1 with `fs->error` set if a write failed.
+ */
+static inline int crypto_settle(void *arg, uint32_t *settled)
+{
+    CryptoStream *cs = (CryptoStream *)arg;
+    FileStream   *fs = cs->fs;
+
+    if (cs->pos > 0 && cs->used == 0)
+        crypto_seal_open(cs, 0);
+    while (cs->used > 0) {
+        CryptoChunk *c = crypto_slot(cs, 0);
+        if (!crypto_done(cs, c))
+            break;
+        if (c->stale) {
+            crypto_release(cs);
+            continue;
+        }
+        if (c->err) {
+            file_stream_write_failed(fs, c->err);
+            return -1;
+        }
+
+        uint64_t end = c->offset;
+        for (int i = 0; i < c->good; i++) {
+            if (fs->md5)
+                EVP_DigestUpdate(fs->md5,
+                                 c->plain + (size_t)i * fs->block_size,
+                                 c->raw[i]);
+            end += (uint64_t)c->raw[i];
+        }
+        int forged = c->good < c->count;
+        cs->settled += (uint32_t)c->good;
+        crypto_release(cs);
+        if (cs->ck)
+            checkpoint_advance(cs->ck, fs->base + end);
+        if (forged) {
+            crypto_discard(cs);
+            cs->want = (uint64_t)cs->settled * fs->block_size;
+            *settled = cs->settled;
+            return SETTLE_REJECTED;
+        }
+    }
+    *settled = cs->settled;
+    return 0;
+}
+
+/*
+ * crypto_consume – BlockConsumer: add one received block to the open
+ *                  chunk and queue the chunk once full.  Returns the
+ *                  block's plaintext length at once, CONSUME_AGAIN if
+ *                  every slot is still in use; whether the block passed
+ *                  its tag and made it to disk is crypto_settle's to
+ *                  tell, and until then the receiver doesn't ACK it.
+ */
+static inline int crypto_consume(void *arg, uint64_t offset,
+                                 const uint8_t *payload, int len)
+{
+    CryptoStream *cs = (CryptoStream *)arg;
+    FileStream   *fs = cs->fs;
+    int           n  = len - GCM_TAG_LEN;
+
+    if (offset != cs->want) {
+        fs->error = "Block out of order";
+        return -1;
+    }
+    if (n < 0 || n > fs->block_size) {
+        fs->error = "Block authentication failed";
+        return -1;
+    }
+    if (cs->pos == 0 && cs->used == cs->ring->depth)
+        return CONSUME_AGAIN;
+
+    CryptoChunk *c = crypto_slot(cs, cs->used);
+    if (cs->pos == 0)
+        c->offset = offset;
+    memcpy(c->wire + (size_t)cs->pos * cs->ring->stride, payload, len);
+    c->len[cs->pos] = len;
+    c->raw[cs->pos] = n;
+    cs->want += (uint64_t)fs->block_size;
+
+    int final = n < fs->block_size;
+    if (++cs->pos == cs->ring->chunk || final)
+        crypto_seal_open(cs, final);
+    return n;
+}
+
+#endif /* CRYPTOPOOL_H */
@@ -0,0 +1,769 @@
+/*
+ * delta.h
+ * =====================================================================
+ * Enhanced TFTP – delta-sync uploads ("delta" option)
+ *
+ * Most uploads revise a file the server already holds.  Like rsync,
+ * the client fetches a signature of the server's copy (the basis) and
+ * uploads only what differs:
+ *
+ *   1. RRQ with delta=<S>: instead of the file the server sends its
+ *      signature – for every S-byte block of the basis a rolling
+ *      checksum and a strong (truncated MD5) checksum:
+ *
+ *          "TFTPSIG1" | S (4) | basis size (8) | basis MD5 (16) |
+ *          { rolling (4) | strong (8) } per block
+ *
+ *   2. The client slides a window over its file.  Wherever the rolling
+ *      checksum – and then the strong one – matches a basis block it
+ *      emits a copy instruction, elsewhere the literal bytes:
+ *
+ *          "TFTPDLT1" | basis MD5 (16) | S (4) | size (8) | MD5 (16) |
+ *          { 'C' | first block (4) | blocks (4) }   copy from basis
+ *          { 'L' | length (4) | bytes }             literal data
+ *          'E'                                      end
+ *
+ *   3. WRQ with delta=<S> carries that stream as ordinary (encrypted,
+ *      windowed) DATA.  The server rebuilds the file block by block
+ *      from the basis and the literals into a side file and checks the
+ *      result against the MD5 in the header before it replaces the
+ *      original – a failure is an ERROR on the last block, so the
+ *      client knows to upload in full.
+ *
+ * The basis is the current file in FILE_STORAGE_DIR or, failing that,
+ * its latest backup.  All integers are big-endian.
+ * =====================================================================
+ */
+
+#ifndef DELTA_H
+#define DELTA_H
+
+#include "udp_file_transfer.h"
+#include "transport.h"
+#include <sys/mman.h>
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define DELTA_MIN_BLOCK     512         /* Smallest delta block size        */
+#define DELTA_MAX_BLOCK     65536       /* Largest delta block size         */
+#define DELTA_STRONG_LEN    8           /* Bytes of MD5 kept per block      */
+
+#define DELTA_SIG_MAGIC     "TFTPSIG1"
+#define DELTA_SIG_HDR_LEN   36          /* magic + S + size + MD5           */
+#define DELTA_SIG_ENTRY     (4 + DELTA_STRONG_LEN)
+
+#define DELTA_MAGIC         "TFTPDLT1"
+#define DELTA_HDR_LEN       52          /* magic + basis MD5 + S + size+MD5 */
+#define DELTA_OP_COPY       'C'
+#define DELTA_OP_LITERAL    'L'
+#define DELTA_OP_END        'E'
+#define DELTA_MAX_LITERAL   (1 << 30)   /* Longest single literal run       */
+
+/* ------------------------------------------------------------------ */
+/*  Checksums                                                          */
+/* ------------------------------------------------------------------ */
+
+static inline void put_u32(uint8_t *p, uint32_t v)
+{
+    uint32_t net = htonl(v);
+    memcpy(p, &net, 4);
+}
+
+static inline uint32_t get_u32(const uint8_t *p)
+{
+    uint32_t net;
+    memcpy(&net, p, 4);
+    return ntohl(net);
+}
+
+/*
+ * delta_block_size – rsync's rule of thumb: about √size, rounded up to
+ *                    a multiple of 64 and kept within bounds.
+ */
+static inline int delta_block_size(long long size)
+{
+    long long s = 1;
+    while (s * s < size)
+        s++;
+    s = (s + 63) / 64 * 64;
+    if (s < DELTA_MIN_BLOCK) s = DELTA_MIN_BLOCK;
+    if (s > DELTA_MAX_BLOCK) s = DELTA_MAX_BLOCK;
+    return (int)s;
+}
+
+/* Rolling checksum state: a = Σ x, b = Σ (len - i) x, both mod 2^16 */
+typedef struct {
+    uint32_t a, b;
+    uint32_t len;
+} RollSum;
+
+static inline void rollsum_init(RollSum *r, const uint8_t *p, uint32_t len)
+{
+    r->a = r->b = 0;
+    r->len = len;
+    for (uint32_t i = 0; i < len; i++) {
+        r->a += p[i];
+        r->b += (len - i) * p[i];
+    }
+    r->a &= 0xffff;
+    r->b &= 0xffff;
+}
+
+/* Slide the window one byte: `out` leaves, `in` enters */
+static inline void rollsum_roll(RollSum *r, uint8_t out, uint8_t in)
+{
+    r->a = (r->a - out + in) & 0xffff;
+    r->b = (r->b - r->len * out + r->a) & 0xffff;
+}
+
+static inline uint32_t rollsum_value(const RollSum *r)
+{
+    return r->a | r->b << 16;
+}
+
+static inline void delta_strong(const uint8_t *p, size_t len,
+                                uint8_t out[DELTA_STRONG_LEN])
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    EVP_Digest(p, len, digest, NULL, EVP_md5(), NULL);
+    memcpy(out, digest, DELTA_STRONG_LEN);
+}
+
+/*
+ * delta_tempfile – An anonymous read/write file (already unlinked).
+ *                  Returns its descriptor, or -1.
+ */
+static inline int delta_tempfile(void)
+{
+    FILE *f = tmpfile();
+    if (!f)
+        return -1;
+    int fd = dup(fileno(f));
+    fclose(f);
+    return fd;
+}
+
+/* Buffered sequential writer for building signatures and deltas */
+typedef struct {
+    int         fd;
+    uint64_t    off;                    /* Bytes written so far           */
+    size_t      used;
+    int         failed;
+    uint8_t     buf[65536];
+} DeltaWriter;
+
+static inline void delta_flush(DeltaWriter *w)
+{
+    for (size_t done = 0; done < w->used && !w->failed; ) {
+        ssize_t n = pwrite(w->fd, w->buf + done, w->used - done,
+                           (off_t)(w->off - w->used + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            w->failed = 1;
+        else
+            done += n;
+    }
+    w->used = 0;
+}
+
+static inline void delta_write(DeltaWriter *w, const void *p, size_t len)
+{
+    const uint8_t *src = p;
+    while (len > 0) {
+        size_t n = sizeof(w->buf) - w->used;
+        if (n > len) n = len;
+        memcpy(w->buf + w->used, src, n);
+        w->used += n;
+        w->off  += n;
+        src     += n;
+        len     -= n;
+        if (w->used == sizeof(w->buf))
+            delta_flush(w);
+    }
+}
+
+/* ================================================================== */
+/*  Server side: signature                                             */
+/* ================================================================== */
+
+/*
+ * delta_signature – Write the signature of the basis `fd` at block size
+ *                   `block` to a new anonymous file.  Returns its
+ *                   descriptor, or -1.
+ */
+static inline int delta_signature(int fd, int block)
+{
+    int out = delta_tempfile();
+    if (out < 0)
+        return -1;
+
+    uint8_t    *buf = malloc(block);
+    DeltaWriter *w  = malloc(sizeof(*w));
+    EVP_MD_CTX *md5 = EVP_MD_CTX_new();
+    if (!buf || !w || !md5) {
+        free(buf);
+        free(w);
+        EVP_MD_CTX_free(md5);
+        close(out);
+        return -1;
+    }
+    EVP_DigestInit_ex(md5, EVP_md5(), NULL);
+    w->fd     = out;
+    w->off    = DELTA_SIG_HDR_LEN;      /* header last: it needs the MD5 */
+    w->used   = 0;
+    w->failed = 0;
+
+    uint64_t size = 0;
+    for (;;) {
+        int got = 0;
+        while (got < block) {
+            ssize_t n = pread(fd, buf + got, block - got,
+                              (off_t)(size + got));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (n < 0) w->failed = 1;
+                break;
+            }
+            got += (int)n;
+        }
+        if (got == 0 || w->failed)
+            break;
+
+        RollSum r;
+        uint8_t entry[DELTA_SIG_ENTRY];
+        rollsum_init(&r, buf, got);
+        put_u32(entry, rollsum_value(&r));
+        delta_strong(buf, got, entry + 4);
+        delta_write(w, entry, sizeof(entry));
+        EVP_DigestUpdate(md5, buf, got);
+        size += got;
+        if (got < block)
+            break;
+    }
+    delta_flush(w);
+
+    uint8_t hdr[DELTA_SIG_HDR_LEN];
+    memcpy(hdr, DELTA_SIG_MAGIC, 8);
+    put_u32(hdr + 8, (uint32_t)block);
+    put_u64(hdr + 12, size);
+    EVP_DigestFinal_ex(md5, hdr + 20, NULL);
+    int ok = !w->failed &&
+             pwrite(out, hdr, sizeof(hdr), 0) == (ssize_t)sizeof(hdr);
+
+    EVP_MD_CTX_free(md5);
+    free(w);
+    free(buf);
+    if (!ok) {
+        close(out);
+        return -1;
+    }
+    return out;
+}
+
+/* ================================================================== */
+/*  Client side: encoding                                              */
+/* ================================================================== */
+
+typedef struct {
+    uint64_t    copied;                 /* Bytes sent as copy instructions*/
+    uint64_t    literal;                /* Bytes sent literally           */
+    uint64_t    length;                 /* Size of the delta stream       */
+} DeltaStats;
+
+/* Signature entries, hashed by rolling checksum */
+typedef struct {
+    const uint8_t *entries;
+    uint32_t       count;
+    uint32_t       block;               /* Delta block size               */
+    size_t         last_len;            /* Length of the last basis block */
+    uint32_t       mask;
+    int32_t       *head;                /* Bucket → first entry, -1 none  */
+    int32_t       *next;                /* Entry → next in bucket         */
+} SigIndex;
+
+static inline uint32_t sig_bucket(const SigIndex *ix, uint32_t weak)
+{
+    return (weak * 2654435761u) >> 7 & ix->mask;
+}
+
+static inline int sig_index_init(SigIndex *ix, const uint8_t *entries,
+                                 uint32_t count, uint32_t block,
+                                 size_t last_len)
+{
+    uint32_t buckets = 16;
+    while (buckets < count * 2)
+        buckets *= 2;
+
+    ix->entries  = entries;
+    ix->count    = count;
+    ix->block    = block;
+    ix->last_len = last_len;
+    ix->mask     = buckets - 1;
+    ix->head     = malloc(buckets * sizeof(int32_t));
+    ix->next     = malloc((count + 1) * sizeof(int32_t));
+    if (!ix->head || !ix->next) {
+        free(ix->head);
+        free(ix->next);
+        return -1;
+    }
+    memset(ix->head, 0xff, buckets * sizeof(int32_t));
+    /* Insert backwards so each chain lists the lowest block first */
+    for (uint32_t i = count; i-- > 0; ) {
+        uint32_t b = sig_bucket(ix, get_u32(entries + i * DELTA_SIG_ENTRY));
+        ix->next[i] = ix->head[b];
+        ix->head[b] = (int32_t)i;
+    }
+    return 0;
+}
+
+static inline void sig_index_free(SigIndex *ix)
+{
+    free(ix->head);
+    free(ix->next);
+}
+
+/*
+ * sig_match – The basis block whose checksums match the window `p` of
+ *             `len` bytes (rolling checksum `weak`), preferring `hint`
+ *             (the block after the previous match).  -1 if none.
+ */
+static inline int64_t sig_match(const SigIndex *ix, uint32_t weak,
+                                const uint8_t *p, size_t len,
+                                int64_t hint)
+{
+    uint8_t strong[DELTA_STRONG_LEN];
+    int     have_strong = 0;
+
+    for (int32_t i = ix->head[sig_bucket(ix, weak)]; i >= 0;
+         i = ix->next[i]) {
+        const uint8_t *e = ix->entries + (size_t)i * DELTA_SIG_ENTRY;
+        size_t elen = (uint32_t)i + 1 == ix->count ? ix->last_len
+                                                   : ix->block;
+        if (get_u32(e) != weak || elen != len)
+            continue;
+        if (!have_strong) {
+            delta_strong(p, len, strong);
+            have_strong = 1;
+        }
+        if (memcmp(e + 4, strong, DELTA_STRONG_LEN) != 0)
+            continue;
+        if (hint >= 0 && i != hint && (uint32_t)hint < ix->count &&
+            get_u32(ix->entries + hint * DELTA_SIG_ENTRY) == weak &&
+            memcmp(ix->entries + hint * DELTA_SIG_ENTRY + 4, strong,
+                   DELTA_STRONG_LEN) == 0)
+            return hint;
+        return i;
+    }
+    return -1;
+}
+
+/* Emit pending literal bytes, in runs of at most DELTA_MAX_LITERAL */
+static inline void delta_emit_literal(DeltaWriter *w, DeltaStats *st,
+                                      const uint8_t *p, uint64_t len)
+{
+    while (len > 0) {
+        uint32_t n = len > DELTA_MAX_LITERAL ? DELTA_MAX_LITERAL
+                                             : (uint32_t)len;
+        uint8_t  op[5] = { DELTA_OP_LITERAL };
+        put_u32(op + 1, n);
+        delta_write(w, op, sizeof(op));
+        delta_write(w, p, n);
+        st->literal += n;
+        p   += n;
+        len -= n;
+    }
+}
+
+static inline void delta_emit_copy(DeltaWriter *w, uint32_t first,
+                                   uint32_t count)
+{
+    uint8_t op[9] = { DELTA_OP_COPY };
+    put_u32(op + 1, first);
+    put_u32(op + 5, count);
+    delta_write(w, op, sizeof(op));
+}
+
+/*
+ * delta_encode – Compare the local file `fd` with the signature `sig`
+ *                (`sig_len` bytes, from delta_signature) and write the
+ *                delta stream to `out_fd`.  Returns 0 and fills `st`,
+ *                or -1 if the signature is malformed or I/O fails.
+ */
+static inline int delta_encode(int fd, const uint8_t *sig, size_t sig_len,
+                               int out_fd, DeltaStats *st)
+{
+    memset(st, 0, sizeof(*st));
+    if (sig_len < DELTA_SIG_HDR_LEN ||
+        memcmp(sig, DELTA_SIG_MAGIC, 8) != 0 ||
+        (sig_len - DELTA_SIG_HDR_LEN) % DELTA_SIG_ENTRY != 0)
+        return -1;
+
+    uint32_t block      = get_u32(sig + 8);
+    uint64_t basis_size = get_u64(sig + 12);
+    uint32_t count      = (uint32_t)((sig_len - DELTA_SIG_HDR_LEN) /
+                                     DELTA_SIG_ENTRY);
+    if (block < DELTA_MIN_BLOCK || block > DELTA_MAX_BLOCK ||
+        (basis_size + block - 1) / block != count)
+        return -1;
+    size_t   last_len = count ? basis_size - (uint64_t)(count - 1) * block
+                            : 0;
+
+    struct stat sb;
+    if (fstat(fd, &sb) < 0)
+        return -1;
+    size_t         size = (size_t)sb.st_size;
+    const uint8_t *data = NULL;
+    if (size > 0) {
+        data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED)
+            return -1;
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    }
+
+    SigIndex     ix;
+    DeltaWriter *w = malloc(sizeof(*w));
+    if (!w || sig_index_init(&ix, sig + DELTA_SIG_HDR_LEN, count, block,
+                                    last_len) < 0) {
+        free(w);
+        if (data) munmap((void *)data, size);
+        return -1;
+    }
+    w->fd     = out_fd;
+    w->off    = 0;
+    w->used   = 0;
+    w->failed = 0;
+
+    uint8_t hdr[DELTA_HDR_LEN];
+    memcpy(hdr, DELTA_MAGIC, 8);
+    memcpy(hdr + 8, sig + 20, MD5_DIGEST_LENGTH);
+    put_u32(hdr + 24, block);
+    put_u64(hdr + 28, size);
+    EVP_Digest(data ? data : (const uint8_t *)"", size, hdr + 36, NULL,
+               EVP_md5(), NULL);
+    delta_write(w, hdr, sizeof(hdr));
+
+    size_t   pos = 0, lit = 0;          /* window start, pending literal */
+    int64_t  run_first = -1;            /* copy run being extended       */
+    uint32_t run_len = 0;
+    RollSum  r;
+    int      rolling = 0;
+
+    while (count > 0 && pos < size) {
+        size_t len = size - pos < block ? size - pos : block;
+        if (len < block) {
+            /* Past the last full window only the basis' short last
+               block can match, and only at the very end of the file */
+            if (last_len == block || size - pos < last_len)
+                break;
+            pos     = size - last_len;
+            len     = last_len;
+            rolling = 0;
+        }
+        if (!rolling) {
+            rollsum_init(&r, data + pos, (uint32_t)len);
+            rolling = 1;
+        }
+
+        int64_t hint = run_first >= 0 ? run_first + run_len : -1;
+        int64_t hit  = sig_match(&ix, rollsum_value(&r), data + pos, len,
+                                 hint);
+        if (hit >= 0) {
+            if (lit < pos) {
+                if (run_first >= 0)
+                    delta_emit_copy(w, (uint32_t)run_first, run_len);
+                run_first = -1;
+                delta_emit_literal(w, st, data + lit, pos - lit);
+            }
+            if (run_first >= 0 && hit == run_first + run_len) {
+                run_len++;
+            } else {
+                if (run_first >= 0)
+                    delta_emit_copy(w, (uint32_t)run_first, run_len);
+                run_first = hit;
+                run_len   = 1;
+            }
+            st->copied += len;
+            pos    += len;
+            lit     = pos;
+            rolling = 0;
+            continue;
+        }
+
+        if (len < block)
+            break;                      /* the tail missed as well */
+        if (pos + block < size)
+            rollsum_roll(&r, data[pos], data[pos + block]);
+        else
+            rolling = 0;
+        pos++;
+    }
+
+    if (run_first >= 0)
+        delta_emit_copy(w, (uint32_t)run_first, run_len);
+    delta_emit_literal(w, st, data + lit, size - lit);
+
+    uint8_t end = DELTA_OP_END;
+    delta_write(w, &end, 1);
+    delta_flush(w);
+
+    int failed = w->failed;
+    st->length = w->off;
+    free(w);
+    sig_index_free(&ix);
+    if (data) munmap((void *)data, size);
+    return failed ? -1 : 0;
+}
+
+/* ================================================================== */
+/*  Server side: rebuilding                                            */
+/* ================================================================== */
+
+/* Where the parser is in the delta stream */
+#define DELTA_ST_HEADER     0
+#define DELTA_ST_OP         1
+#define DELTA_ST_LITERAL    2
+#define DELTA_ST_END        3
+
+typedef struct {
+    FileStream *fs;                     /* Decrypts; writes the new file  */
+    int         basis_fd;
+    uint64_t    basis_size;
+    uint8_t     basis_md5[MD5_DIGEST_LENGTH];
+    uint32_t    block;                  /* Negotiated delta block size    */
+    uint8_t    *copy_buf;               /* One delta block                */
+
+    int         state;                  /* DELTA_ST_*                     */
+    uint8_t     pending[DELTA_HDR_LEN]; /* Header / op bytes so far       */
+    int         pending_len;
+    uint32_t    literal_left;
+    uint64_t    size;                   /* Declared size of the new file  */
+    uint8_t     md5[MD5_DIGEST_LENGTH]; /* Declared MD5 of the new file   */
+    uint64_t    out;                    /* Bytes of the new file written  */
+
+    uint64_t    copied;                 /* Bytes taken from the basis     */
+    uint64_t    literal;                /* Bytes received literally       */
+} DeltaApplier;
+
+/*
+ * delta_applier_init – Rebuild a file into `fs` (its fd and running
+ *                      MD5) from the basis `basis_fd` and the delta
+ *                      stream that arrives through delta_consume.
+ *                      Returns 0, or -1 if the basis can't be read.
+ */
+static inline int delta_applier_init(DeltaApplier *da, FileStream *fs,
+                                     int basis_fd, int block)
+{
+    memset(da, 0, sizeof(*da));
+    da->fs       = fs;
+    da->basis_fd = basis_fd;
+    da->block    = (uint32_t)block;
+    da->copy_buf = malloc(block);
+
+    struct stat st;
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!da->copy_buf || !ctx || fstat(basis_fd, &st) < 0) {
+        EVP_MD_CTX_free(ctx);
+        free(da->copy_buf);
+        da->copy_buf = NULL;
+        return -1;
+    }
+    da->basis_size = (uint64_t)st.st_size;
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    long long n = md5_update_fd(ctx, basis_fd, UINT64_MAX);
+    EVP_DigestFinal_ex(ctx, da->basis_md5, NULL);
+    EVP_MD_CTX_free(ctx);
+    return n == (long long)da->basis_size ? 0 : -1;
+}
+
+static inline void delta_applier_free(DeltaApplier *da)
+{
+    free(da->copy_buf);
+    da->copy_buf = NULL;
+}
+
+/* Append `len` bytes to the new file */
+static inline int delta_put(DeltaApplier *da, const uint8_t *p, size_t len)
+{
+    if (da->out + len > da->size) {
+        da->fs->error = "Delta overruns declared size";
+        return -1;
+    }
+    for (size_t done = 0; done < len; ) {
+        ssize_t n = pwrite(da->fs->fd, p + done, len - done,
+                           (off_t)(da->out + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == ENOSPC || errno == EDQUOT)) {
+            da->fs->error      = "Disk full";
+            da->fs->error_code = ERR_DISK_FULL;
+            return -1;
+        }
+        if (n <= 0) {
+            da->fs->error = "Write failed";
+            return -1;
+        }
+        done += n;
+    }
+    if (da->fs->md5)
+        EVP_DigestUpdate(da->fs->md5, p, len);
+    da->out += len;
+    return 0;
+}
+
+/* Copy `count` basis blocks from `first` into the new file */
+static inline int delta_copy(DeltaApplier *da, uint32_t first,
+                             uint32_t count)
+{
+    uint64_t off = (uint64_t)first * da->block;
+    uint64_t end = off + (uint64_t)count * da->block;
+    if (count == 0 || off >= da->basis_size ||
+        end - da->block >= da->basis_size) {
+        da->fs->error = "Delta copies beyond the basis";
+        return -1;
+    }
+    if (end > da->basis_size)
+        end = da->basis_size;
+
+    while (off < end) {
+        size_t  want = end - off < da->block ? end - off : da->block;
+        ssize_t n = pread(da->basis_fd, da->copy_buf, want, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            da->fs->error = "Read failed";
+            return -1;
+        }
+        if (delta_put(da, da->copy_buf, n) < 0)
+            return -1;
+        off += n;
+    }
+    da->copied += end - (uint64_t)first * da->block;
+    return 0;
+}
+
+/* The whole header or instruction is in `pending`: act on it */
+static inline int delta_execute(DeltaApplier *da)
+{
+    const uint8_t *p = da->pending;
+    da->pending_len = 0;
+
+    if (da->state == DELTA_ST_HEADER) {
+        if (memcmp(p, DELTA_MAGIC, 8) != 0 ||
+            get_u32(p + 24) != da->block) {
+            da->fs->error = "Bad delta header";
+            return -1;
+        }
+        if (memcmp(p + 8, da->basis_md5, MD5_DIGEST_LENGTH) != 0) {
+            da->fs->error = "Basis changed";
+            return -1;
+        }
+        da->size = get_u64(p + 28);
+        memcpy(da->md5, p + 36, MD5_DIGEST_LENGTH);
+        if (preallocate(da->fs->fd, (long long)da->size) < 0) {
+            da->fs->error      = "Disk full";
+            da->fs->error_code = ERR_DISK_FULL;
+            return -1;
+        }
+        da->state = DELTA_ST_OP;
+        return 0;
+    }
+
+    switch (p[0]) {
+    case DELTA_OP_COPY:
+        return delta_copy(da, get_u32(p + 1), get_u32(p + 5));
+    case DELTA_OP_LITERAL:
+        da->literal_left = get_u32(p + 1);
+        if (da->literal_left > 0)
+            da->state = DELTA_ST_LITERAL;
+        return 0;
+    default: {                          /* DELTA_OP_END */
+        unsigned char digest[MD5_DIGEST_LENGTH];
+        EVP_MD_CTX   *tmp = EVP_MD_CTX_new();
+        int ok = tmp && da->fs->md5 && EVP_MD_CTX_copy_ex(tmp, da->fs->md5) &&
+                 EVP_DigestFinal_ex(tmp, digest, NULL);
+        EVP_MD_CTX_free(tmp);
+        if (da->out != da->size || !ok ||
+            memcmp(digest, da->md5, MD5_DIGEST_LENGTH) != 0) {
+            da->fs->error = "Delta result does not match its MD5";
+            return -1;
+        }
+        da->state = DELTA_ST_END;
+        return 0;
+    }
+    }
+}
+
+/* Bytes the header or the instruction starting with `op` takes */
+static inline int delta_needed(const DeltaApplier *da)
+{
+    if (da->state == DELTA_ST_HEADER)
+        return DELTA_HDR_LEN;
+    if (da->pending_len == 0)
+        return 1;
+    switch (da->pending[0]) {
+    case DELTA_OP_COPY:     return 9;
+    case DELTA_OP_LITERAL:  return 5;
+    case DELTA_OP_END:      return 1;
+    default:                return -1;
+    }
+}
+
+/*
+ * delta_consume – BlockConsumer: decode one block of the delta stream
+ *                 and apply the instructions in it, which may straddle
+ *                 blocks.  The stream must end (with 'E') in the
+ *                 transfer's final, short block.
+ */
+static inline int delta_consume(void *arg, uint64_t offset,
+                                const uint8_t *payload, int len)
+{
+    DeltaApplier *da = (DeltaApplier *)arg;
+    FileStream   *fs = da->fs;
+
+    const uint8_t *p;
+    int            dec_len = file_stream_decode(fs, offset, payload, len,
+                                                &p);
+    if (dec_len < 0)
+        return -1;
+
+    const uint8_t *end = p + dec_len;
+    while (p < end) {
+        if (da->state == DELTA_ST_END) {
+            fs->error = "Data after end of delta";
+            return -1;
+        }
+        if (da->state == DELTA_ST_LITERAL) {
+            size_t n = (size_t)(end - p) < da->literal_left
+                     ? (size_t)(end - p) : da->literal_left;
+            if (delta_put(da, p, n) < 0)
+                return -1;
+            da->literal      += n;
+            da->literal_left -= (uint32_t)n;
+            p += n;
+            if (da->literal_left == 0)
+                da->state = DELTA_ST_OP;
+            continue;
+        }
+
+        da->pending[da->pending_len++] = *p++;
+        int need = delta_needed(da);
+        if (need < 0) {
+            fs->error = "Bad delta instruction";
+            return -1;
+        }
+        if (da->pending_len == need && delta_execute(da) < 0)
+            return -1;
+    }
+
+    if (dec_len < fs->block_size && da->state != DELTA_ST_END) {
+        fs->error = "Truncated delta";
+        return -1;
+    }
+    return dec_len;
+}
+
+#endif /* DELTA_H */
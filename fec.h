@@ -0,0 +1,503 @@
+/*
+ * fec.h
+ * =====================================================================
+ * Enhanced TFTP – forward error correction ("fec" option)
+ *
+ * On lossy links every lost block costs a retransmission round trip.
+ * With "fec=K,M" the sender follows every K DATA blocks with M parity
+ * blocks, so the receiver can rebuild a lost block without asking:
+ *
+ *     DATA 1 … DATA K | PARITY 0 … PARITY M-1 | DATA K+1 … DATA 2K | …
+ *
+ * Parity j is the XOR of the group's blocks whose index i (0-based
+ * within the group) has i % M == j, so the M parities interleave: a
+ * group survives up to M losses as long as no two fall in the same
+ * stride.  Parities are computed over the wire payload (ciphertext),
+ * each block zero-extended to the longest one, and carry the XOR of the
+ * payload lengths so a short final block comes back at its own length.
+ *
+ *     PARITY = opcode(2) | first block(4) | j(1) | count(1) |
+ *              length xor(2) | xor of payloads
+ *
+ * `first` is the group's first block (always 32 bits, whatever the
+ * DATA format) and `count` the blocks in it – K, or fewer for the group
+ * that ends the file.  Parity packets are never acknowledged or resent;
+ * the window transport (transport.h) treats them as pure overhead.
+ *
+ * The XOR kernel picks AVX2, SSE2 or NEON at run time where available
+ * and falls back to 64-bit words.
+ * =====================================================================
+ */
+
+#ifndef FEC_H
+#define FEC_H
+
+#include "udp_file_transfer.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define FEC_MAX_GROUP       64          /* K: data blocks per group         */
+#define FEC_MAX_PARITY      8           /* M: parity blocks per group       */
+#define PARITY_HDR_LEN      10          /* op(2)+first(4)+j(1)+cnt(1)+len(2)*/
+
+/* Largest DATA payload (ciphertext) of a session, which is also the
+ * largest parity payload.                                             */
+#define FEC_PAYLOAD_SIZE(blksize) \
+    (DATA_PACKET_SIZE(blksize) - XDATA_HDR_LEN)
+
+/* ------------------------------------------------------------------ */
+/*  XOR kernels                                                        */
+/* ------------------------------------------------------------------ */
+
+typedef void (*FecXorFn)(uint8_t *dst, const uint8_t *src, size_t len);
+
+/* dst ^= src, eight bytes at a time */
+static inline void fec_xor_scalar(uint8_t *dst, const uint8_t *src,
+                                  size_t len)
+{
+    size_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t a, b;
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++)
+        dst[i] ^= src[i];
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse2")))
+static inline void fec_xor_sse2(uint8_t *dst, const uint8_t *src,
+                                size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+        for (int k = 0; k < 64; k += 16) {
+            __m128i a = _mm_loadu_si128((const __m128i *)(dst + i + k));
+            __m128i b = _mm_loadu_si128((const __m128i *)(src + i + k));
+            _mm_storeu_si128((__m128i *)(dst + i + k), _mm_xor_si128(a, b));
+        }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static inline void fec_xor_avx2(uint8_t *dst, const uint8_t *src,
+                                size_t len)
+{
+    size_t i = 0;
+    for (; i + 128 <= len; i += 128)
+        for (int k = 0; k < 128; k += 32) {
+            __m256i a = _mm256_loadu_si256((const __m256i *)(dst + i + k));
+            __m256i b = _mm256_loadu_si256((const __m256i *)(src + i + k));
+            _mm256_storeu_si256((__m256i *)(dst + i + k),
+                                _mm256_xor_si256(a, b));
+        }
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+#elif defined(__ARM_NEON)
+static inline void fec_xor_neon(uint8_t *dst, const uint8_t *src,
+                                size_t len)
+{
+    size_t i = 0;
+    for (; i + 64 <= len; i += 64)
+        for (int k = 0; k < 64; k += 16)
+            vst1q_u8(dst + i + k, veorq_u8(vld1q_u8(dst + i + k),
+                                           vld1q_u8(src + i + k)));
+    fec_xor_scalar(dst + i, src + i, len - i);
+}
+#endif
+
+/*
+ * fec_xor_select – The fastest XOR kernel this CPU runs, and its name
+ *                  in `*name` (for logs and the benchmark).
+ */
+static inline FecXorFn fec_xor_select(const char **name)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        if (name) *name = "avx2";
+        return fec_xor_avx2;
+    }
+    if (__builtin_cpu_supports("sse2")) {
+        if (name) *name = "sse2";
+        return fec_xor_sse2;
+    }
+#elif defined(__ARM_NEON)
+    if (name) *name = "neon";
+    return fec_xor_neon;
+#endif
+    if (name) *name = "scalar";
+    return fec_xor_scalar;
+}
+
+/* dst ^= src with the selected kernel */
+static inline void fec_xor(uint8_t *dst, const uint8_t *src, size_t len)
+{
+    static FecXorFn impl;           /* every thread picks the same one  */
+    if (!impl)
+        impl = fec_xor_select(NULL);
+    impl(dst, src, len);
+}
+
+/* ================================================================== */
+/*  Encoder (sending side)                                             */
+/* ================================================================== */
+
+typedef struct {
+    int         k, m;
+    int         size;                   /* Payload capacity               */
+    uint32_t    first;                  /* First block of the open group  */
+    int         count;                  /* Blocks folded in so far        */
+    int         closed;                 /* Parities ready; next add resets*/
+    uint8_t    *parity;                 /* m × (PARITY_HDR_LEN + size)    */
+    int         plen[FEC_MAX_PARITY];   /* Longest payload in each stride */
+    uint16_t    lxor[FEC_MAX_PARITY];   /* XOR of the payload lengths     */
+
+    unsigned    groups;                 /* Groups closed                  */
+    unsigned    parities;               /* Parity packets built           */
+} FecEncoder;
+
+/*
+ * fec_encoder_init – Prepare to protect groups of `k` blocks with `m`
+ *                    parities each.  Returns 0, or -1 if the parity
+ *                    buffers can't be allocated.
+ */
+static inline int fec_encoder_init(FecEncoder *e, int k, int m,
+                                   int block_size)
+{
+    memset(e, 0, sizeof(*e));
+    e->k    = k;
+    e->m    = m;
+    e->size = FEC_PAYLOAD_SIZE(block_size);
+    e->parity = malloc((size_t)m * (PARITY_HDR_LEN + e->size));
+    return e->parity ? 0 : -1;
+}
+
+static inline void fec_encoder_free(FecEncoder *e)
+{
+    free(e->parity);
+    e->parity = NULL;
+}
+
+static inline uint8_t *fec_encoder_slot(const FecEncoder *e, int j)
+{
+    return e->parity + (size_t)j * (PARITY_HDR_LEN + e->size);
+}
+
+/*
+ * fec_encoder_add – Fold the payload of `block` (blocks must come in
+ *                   order, each once) into its stride's parity.  `last`
+ *                   marks the final block of the file.  Returns 1 when
+ *                   this block closes the group and its parities are
+ *                   ready (fec_encoder_parity), 0 otherwise.
+ */
+static inline int fec_encoder_add(FecEncoder *e, uint32_t block,
+                                  const uint8_t *payload, int len, int last)
+{
+    if (e->closed || e->count == 0) {
+        e->first  = block;
+        e->count  = 0;
+        e->closed = 0;
+        memset(e->plen, 0, sizeof(e->plen));
+        memset(e->lxor, 0, sizeof(e->lxor));
+    }
+    if (len > e->size)
+        len = e->size;
+
+    int      j = e->count % e->m;
+    uint8_t *p = fec_encoder_slot(e, j) + PARITY_HDR_LEN;
+    if (len > e->plen[j]) {
+        memset(p + e->plen[j], 0, len - e->plen[j]);
+        e->plen[j] = len;
+    }
+    fec_xor(p, payload, len);
+    e->lxor[j] ^= (uint16_t)len;
+    e->count++;
+
+    if (e->count < e->k && !last)
+        return 0;
+    e->closed = 1;
+    e->groups++;
+    return 1;
+}
+
+/*
+ * fec_encoder_parity – Parity packet `j` of the group just closed, with
+ *                      its length in `*len`; NULL if no block of the
+ *                      group fell in that stride.
+ */
+static inline const uint8_t *fec_encoder_parity(FecEncoder *e, int j,
+                                                int *len)
+{
+    if (!e->closed || j >= e->m || j >= e->count)
+        return NULL;
+
+    uint8_t *pkt = fec_encoder_slot(e, j);
+    uint16_t op  = htons(OP_PARITY);
+    uint32_t net = htonl(e->first);
+    uint16_t lx  = htons(e->lxor[j]);
+    memcpy(pkt, &op, 2);
+    memcpy(pkt + 2, &net, 4);
+    pkt[6] = (uint8_t)j;
+    pkt[7] = (uint8_t)e->count;
+    memcpy(pkt + 8, &lx, 2);
+
+    e->parities++;
+    *len = PARITY_HDR_LEN + e->plen[j];
+    return pkt;
+}
+
+/* ================================================================== */
+/*  Decoder (receiving side)                                           */
+/* ================================================================== */
+
+/* One group's blocks and parities as they arrive */
+typedef struct {
+    uint32_t    group;                  /* (first - 1) / k                */
+    int         used;                   /* Slot holds `group`             */
+    uint64_t    have;                   /* Bit i: block first + i is here */
+    uint8_t     parity_have;            /* Bit j: parity j is here        */
+    int         count;                  /* Blocks in the group (parity)   */
+    int         plen[FEC_MAX_PARITY];
+    uint16_t    lxor[FEC_MAX_PARITY];
+    int        *len;                    /* k payload lengths              */
+    uint8_t    *data;                   /* k × size payloads              */
+    uint8_t    *parity;                 /* m × size parity payloads       */
+} FecGroup;
+
+typedef struct {
+    int         k, m;
+    int         size;                   /* Payload capacity               */
+    int         ngroups;                /* Groups a window can span       */
+    FecGroup   *groups;
+    uint8_t    *store;                  /* Backing memory of every group  */
+    int        *lens;
+
+    unsigned    repaired;               /* Blocks rebuilt from parity     */
+} FecDecoder;
+
+/*
+ * fec_decoder_init – Prepare to rebuild blocks of groups of `k` with `m`
+ *                    parities, keeping as many groups as a window of
+ *                    `window` blocks can span.  Returns 0 or -1.
+ */
+static inline int fec_decoder_init(FecDecoder *d, int k, int m,
+                                   int block_size, int window)
+{
+    memset(d, 0, sizeof(*d));
+    d->k       = k;
+    d->m       = m;
+    d->size    = FEC_PAYLOAD_SIZE(block_size);
+    d->ngroups = window / k + 2;
+
+    size_t per = (size_t)(k + m) * d->size;
+    d->groups = calloc(d->ngroups, sizeof(FecGroup));
+    d->store  = malloc(per * d->ngroups);
+    d->lens   = calloc((size_t)d->ngroups * k, sizeof(int));
+    if (!d->groups || !d->store || !d->lens) {
+        free(d->groups);
+        free(d->store);
+        free(d->lens);
+        memset(d, 0, sizeof(*d));
+        return -1;
+    }
+    for (int g = 0; g < d->ngroups; g++) {
+        d->groups[g].data   = d->store + per * g;
+        d->groups[g].parity = d->groups[g].data + (size_t)k * d->size;
+        d->groups[g].len    = d->lens + (size_t)g * k;
+    }
+    return 0;
+}
+
+static inline void fec_decoder_free(FecDecoder *d)
+{
+    free(d->groups);
+    free(d->store);
+    free(d->lens);
+    d->groups = NULL;
+    d->store  = NULL;
+    d->lens   = NULL;
+}
+
+/*
+ * fec_decoder_reset – Forget every group held: what they were rebuilt
+ *                     from may have been forged.
+ */
+static inline void fec_decoder_reset(FecDecoder *d)
+{
+    for (int g = 0; g < d->ngroups; g++)
+        d->groups[g].used = 0;
+}
+
+/* Group number of `block` */
+static inline uint32_t fec_group_of(const FecDecoder *d, uint32_t block)
+{
+    return (block - 1) / (uint32_t)d->k;
+}
+
+/* The slot of the group holding `block`, or NULL if it isn't held */
+static inline FecGroup *fec_find(const FecDecoder *d, uint32_t block)
+{
+    uint32_t  gi = fec_group_of(d, block);
+    FecGroup *g  = &d->groups[gi % d->ngroups];
+    return g->used && g->group == gi ? g : NULL;
+}
+
+/* The slot for the group of `block`, recycling an older group's slot.
+ * NULL if the slot already holds a newer group (`block` is stale).   */
+static inline FecGroup *fec_claim(FecDecoder *d, uint32_t block)
+{
+    uint32_t  gi = fec_group_of(d, block);
+    FecGroup *g  = &d->groups[gi % d->ngroups];
+
+    if (g->used && g->group == gi)
+        return g;
+    if (g->used && (int32_t)(gi - g->group) < 0)
+        return NULL;
+    g->group       = gi;
+    g->used        = 1;
+    g->have        = 0;
+    g->parity_have = 0;
+    g->count       = d->k;
+    return g;
+}
+
+/*
+ * fec_store_data – Keep a copy of the payload of `block` for rebuilding
+ *                  its group's other blocks.
+ */
+static inline void fec_store_data(FecDecoder *d, uint32_t block,
+                                  const uint8_t *payload, int len)
+{
+    FecGroup *g = fec_claim(d, block);
+    int       i = (int)((block - 1) % (uint32_t)d->k);
+    if (!g || (g->have & (1ull << i)) || len > d->size)
+        return;
+    memcpy(g->data + (size_t)i * d->size, payload, len);
+    g->len[i] = len;
+    g->have  |= 1ull << i;
+}
+
+/*
+ * fec_lookup – The held payload of `block` and its length, or NULL.
+ */
+static inline const uint8_t *fec_lookup(const FecDecoder *d, uint32_t block,
+                                        int *len)
+{
+    FecGroup *g = fec_find(d, block);
+    int       i = (int)((block - 1) % (uint32_t)d->k);
+    if (!g || !(g->have & (1ull << i)))
+        return NULL;
+    *len = g->len[i];
+    return g->data + (size_t)i * d->size;
+}
+
+/*
+ * fec_repair – Rebuild every block of the group of `block` that is the
+ *              only one missing from a stride whose parity is here.
+ *              Returns the number of blocks rebuilt.
+ */
+static inline int fec_repair(FecDecoder *d, uint32_t block)
+{
+    FecGroup *g = fec_find(d, block);
+    int       rebuilt = 0;
+    if (!g)
+        return 0;
+
+    for (int j = 0; j < d->m; j++) {
+        if (!(g->parity_have & (1u << j)))
+            continue;
+
+        int missing = -1, holes = 0;
+        for (int i = j; i < g->count; i += d->m)
+            if (!(g->have & (1ull << i))) {
+                missing = i;
+                holes++;
+            }
+        if (holes != 1)
+            continue;
+
+        uint8_t *out = g->data + (size_t)missing * d->size;
+        int      len = g->lxor[j];
+        memcpy(out, g->parity + (size_t)j * d->size, g->plen[j]);
+        for (int i = j; i < g->count; i += d->m) {
+            if (i == missing)
+                continue;
+            fec_xor(out, g->data + (size_t)i * d->size, g->len[i]);
+            len ^= g->len[i];
+        }
+        if (len > g->plen[j])
+            continue;           /* corrupt parity: leave it to ARQ      */
+        g->len[missing] = len;
+        g->have        |= 1ull << missing;
+        d->repaired++;
+        rebuilt++;
+    }
+    return rebuilt;
+}
+
+/*
+ * fec_store_parity – Keep a PARITY packet.  Returns the first block of
+ *                    its group, or 0 if the packet is malformed, stale
+ *                    or a duplicate.
+ */
+static inline uint32_t fec_store_parity(FecDecoder *d, const uint8_t *pkt,
+                                        ssize_t n)
+{
+    if (n < PARITY_HDR_LEN || n - PARITY_HDR_LEN > d->size)
+        return 0;
+
+    uint32_t net;
+    uint16_t lx;
+    memcpy(&net, pkt + 2, 4);
+    memcpy(&lx, pkt + 8, 2);
+    uint32_t first = ntohl(net);
+    int      j     = pkt[6];
+    int      count = pkt[7];
+
+    if (first == 0 || (first - 1) % (uint32_t)d->k != 0 ||
+        j >= d->m || count < 1 || count > d->k)
+        return 0;
+
+    FecGroup *g = fec_claim(d, first);
+    if (!g || (g->parity_have & (1u << j)))
+        return 0;
+    memcpy(g->parity + (size_t)j * d->size, pkt + PARITY_HDR_LEN,
+           n - PARITY_HDR_LEN);
+    g->plen[j]      = (int)(n - PARITY_HDR_LEN);
+    g->lxor[j]      = ntohs(lx);
+    g->count        = count;
+    g->parity_have |= 1u << j;
+    return first;
+}
+
+/*
+ * fec_may_repair – True while a hole at `missing` may still be filled
+ *                  from parity: the stride's parity has not arrived yet
+ *                  and `block` is from the same group (parity follows
+ *                  the group's last block, so a later group's block
+ *                  means it was lost too).
+ */
+static inline int fec_may_repair(const FecDecoder *d, uint32_t missing,
+                                 uint32_t block)
+{
+    if (fec_group_of(d, missing) != fec_group_of(d, block))
+        return 0;
+
+    FecGroup *g = fec_find(d, missing);
+    int       j = (int)((missing - 1) % (uint32_t)d->k) % d->m;
+    return !g || !(g->parity_have & (1u << j));
+}
+
+#endif /* FEC_H */
@@ -0,0 +1,430 @@
+/*
+ * multicast.h
+ * =====================================================================
+ * Enhanced TFTP – multicast downloads (RFC 2090 "multicast" option)
+ *
+ * Many clients RRQ the same file at once; the server streams its blocks
+ * to one group address instead of once per client.  The OACK tells each
+ * client where to listen:
+ *
+ *     multicast = "<group addr>,<port>,<mc>"
+ *
+ * with mc = 1 for the single "master client".  Only the master sends
+ * ACKs, which drive the sender exactly as in a unicast transfer (window,
+ * congestion control, retransmission).  Everyone else just collects the
+ * blocks going by.  When the master has the whole file the server names
+ * the next client master with a fresh OACK; its first ACK points the
+ * sender back at the first block it is missing, so clients that joined
+ * late catch up on what they missed.  Clients that complete the file
+ * while not master say so with an ACK of the final block.
+ *
+ * Blocks arrive in any order, so the client writes each one at its own
+ * offset and keeps a bitmap of what it has.  With 16-bit block numbers
+ * a multicast file is limited to 65535 blocks (numbers never roll over);
+ * "exthdr" lifts the limit.
+ * =====================================================================
+ */
+
+#ifndef MULTICAST_H
+#define MULTICAST_H
+
+#include "udp_file_transfer.h"
+#include "transport.h"
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define MCAST_DEFAULT_PORT  1758        /* First group port (RFC 2090)      */
+#define MCAST_MAX_SESSIONS  64          /* Group ports used in rotation     */
+#define MCAST_MAX_CLIENTS   256         /* Clients sharing one session      */
+
+/* ------------------------------------------------------------------ */
+/*  Option value and sockets                                           */
+/* ------------------------------------------------------------------ */
+
+/*
+ * mcast_format – Build the "addr,port,mc" value of an OACK.
+ */
+static inline void mcast_format(char *out, size_t cap,
+                                const struct sockaddr_in *group, int master)
+{
+    char addr[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &group->sin_addr, addr, sizeof(addr));
+    snprintf(out, cap, "%s,%u,%d", addr, ntohs(group->sin_port),
+             master ? 1 : 0);
+}
+
+/*
+ * mcast_parse – Decode an "addr,port,mc" value into `group` and
+ *               `*master`.  Returns 0, or -1 if it is malformed.
+ */
+static inline int mcast_parse(const char *val, struct sockaddr_in *group,
+                              int *master)
+{
+    char addr[INET_ADDRSTRLEN];
+    unsigned port;
+    int mc;
+
+    if (sscanf(val, "%15[^,],%u,%d", addr, &port, &mc) != 3 ||
+        port == 0 || port > 65535 || (mc != 0 && mc != 1))
+        return -1;
+
+    memset(group, 0, sizeof(*group));
+    group->sin_family = AF_INET;
+    group->sin_port   = htons((uint16_t)port);
+    if (inet_pton(AF_INET, addr, &group->sin_addr) != 1 ||
+        !IN_MULTICAST(ntohl(group->sin_addr.s_addr)))
+        return -1;
+    *master = mc;
+    return 0;
+}
+
+/*
+ * mcast_local_addr – The local address this host uses to reach `peer`,
+ *                    i.e. the interface to send or join a group on.
+ */
+static inline struct in_addr mcast_local_addr(const struct sockaddr_in *peer)
+{
+    struct in_addr     any = { .s_addr = htonl(INADDR_ANY) };
+    struct sockaddr_in local;
+    socklen_t          len = sizeof(local);
+
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return any;
+    if (connect(fd, (const struct sockaddr *)peer, sizeof(*peer)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&local, &len) < 0) {
+        close(fd);
+        return any;
+    }
+    close(fd);
+    return local.sin_addr;
+}
+
+/*
+ * mcast_enable_send – Send `sockfd`'s group traffic out of `iface`, and
+ *                     loop it back so clients on this host hear it too.
+ */
+static inline int mcast_enable_send(int sockfd, struct in_addr iface)
+{
+    unsigned char loop = 1;
+    setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop));
+    return setsockopt(sockfd, IPPROTO_IP, IP_MULTICAST_IF,
+                      &iface, sizeof(iface));
+}
+
+/*
+ * mcast_join – Open a socket on `group`'s port and join the group on
+ *              `iface`.  Several clients on one host may listen at
+ *              once.  Returns the socket, or -1.
+ */
+static inline int mcast_join(const struct sockaddr_in *group,
+                             struct in_addr iface)
+{
+    int fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+        return -1;
+
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_addr   = group->sin_addr;
+    local.sin_port   = group->sin_port;
+
+    struct ip_mreq mreq;
+    mreq.imr_multiaddr = group->sin_addr;
+    mreq.imr_interface = iface;
+
+    if (bind(fd, (struct sockaddr *)&local, sizeof(local)) < 0 ||
+        setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                   &mreq, sizeof(mreq)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Block number of a multicast DATA / ACK packet.  16-bit numbers never
+ * wrap in a multicast session, so they are absolute.                 */
+static inline uint32_t mcast_block(const BlockFormat *f, const uint8_t *p)
+{
+    if (f->ext) {
+        uint32_t net;
+        memcpy(&net, p, 4);
+        return ntohl(net);
+    }
+    uint16_t net;
+    memcpy(&net, p, 2);
+    return ntohs(net);
+}
+
+/* Blocks in a file of `size` bytes (the last one is always short) */
+static inline uint32_t mcast_blocks(long long size, int block_size)
+{
+    return (uint32_t)(size / block_size) + 1;
+}
+
+/* ================================================================== */
+/*  Client side                                                        */
+/* ================================================================== */
+
+typedef struct {
+    int                 sockfd;         /* Our unicast TID socket         */
+    int                 groupfd;        /* Joined to the group            */
+    struct sockaddr_in  peer;           /* Server session TID             */
+    socklen_t           peer_len;
+    int                 block_size;
+    int                 window;         /* ACK every `window` blocks      */
+    int                 timeout;        /* Give-up floor (s)              */
+    BlockFormat         fmt;
+    BlockConsumer       consume;
+    void               *arg;
+
+    uint32_t            total;          /* Blocks in the file             */
+    uint8_t            *have;           /* One bit per block received     */
+    uint32_t            received;       /* Distinct blocks written        */
+    uint32_t            first_missing;  /* Lowest block not yet received  */
+    int                 master;         /* We send the ACKs               */
+    int                 since_ack;      /* In-order blocks since last ACK */
+    int                 retries;        /* Timeouts without traffic       */
+    RttEstimator        rtt;
+    uint64_t            deadline;       /* Re-ACK / give-up timer         */
+    uint64_t            last_progress;  /* Last DATA from the session     */
+    int                 done;
+    int                 status;         /* XFER_* once done               */
+
+    unsigned            duplicates;     /* Blocks we already had          */
+    char                peer_error[MAX_FILENAME];
+} McastReceiver;
+
+/*
+ * mcast_receiver_init – Prepare `r` to collect a `size`-byte file from
+ *                       the session at `peer`, hearing DATA on
+ *                       `groupfd`.  Returns -1 if the block bitmap can't
+ *                       be allocated.
+ */
+static inline int mcast_receiver_init(McastReceiver *r, int sockfd,
+                                      int groupfd,
+                                      const struct sockaddr_in *peer,
+                                      socklen_t peer_len, int block_size,
+                                      int window, long long size,
+                                      BlockConsumer consume, void *arg)
+{
+    memset(r, 0, sizeof(*r));
+    r->sockfd        = sockfd;
+    r->groupfd       = groupfd;
+    r->peer          = *peer;
+    r->peer_len      = peer_len;
+    r->block_size    = block_size;
+    r->window        = window < 1 ? 1 : window;
+    r->timeout       = TIMEOUT_SEC;
+    r->consume       = consume;
+    r->arg           = arg;
+    r->total         = mcast_blocks(size, block_size);
+    r->first_missing = 1;
+
+    r->have = calloc((size_t)r->total / 8 + 1, 1);
+    if (!r->have)
+        return -1;
+
+    rtt_init(&r->rtt, r->timeout);
+    r->last_progress = now_usec();
+    r->deadline      = r->last_progress + r->rtt.rto;
+    set_socket_buffers(groupfd, r->window * DATA_PACKET_SIZE(block_size));
+    return 0;
+}
+
+/*
+ * mcast_receiver_set_timeout – Apply a negotiated "timeout" option (see
+ *                              sender_set_timeout).
+ */
+static inline void mcast_receiver_set_timeout(McastReceiver *r, int sec)
+{
+    r->timeout  = sec;
+    rtt_init(&r->rtt, sec);
+    r->deadline = now_usec() + r->rtt.rto;
+}
+
+static inline void mcast_receiver_free(McastReceiver *r)
+{
+    free(r->have);
+    r->have = NULL;
+}
+
+static inline int mcast_has(const McastReceiver *r, uint32_t block)
+{
+    return r->have[block / 8] & (1u << (block % 8));
+}
+
+/* ACK `block` to the session in the negotiated format */
+static inline void mcast_send_ack(McastReceiver *r, uint32_t block)
+{
+    uint8_t  pkt[2 + 4];
+    uint16_t op = htons(OP_ACK);
+
+    memcpy(pkt, &op, 2);
+    int len = 2 + block_put(&r->fmt, pkt + 2, block);
+    sendto(r->sockfd, pkt, len, 0,
+           (struct sockaddr *)&r->peer, r->peer_len);
+    r->since_ack = 0;
+}
+
+/*
+ * mcast_receiver_flush – Call once both sockets are drained: the master
+ *                        acknowledges what arrived (see receiver_flush).
+ */
+static inline void mcast_receiver_flush(McastReceiver *r)
+{
+    if (r->master && !r->done && r->since_ack > 0)
+        mcast_send_ack(r, r->first_missing - 1);
+}
+
+static inline void mcast_on_data(McastReceiver *r, const uint8_t *buf,
+                                 ssize_t n)
+{
+    int hdr = data_hdr_len(&r->fmt);
+    if (n < hdr)
+        return;
+
+    uint32_t block = mcast_block(&r->fmt, buf + 2);
+    if (block < 1 || block > r->total)
+        return;
+    if (r->fmt.ext && get_u64(buf + 6) != block_offset(block,
+                                                       r->block_size))
+        return;
+
+    uint32_t expected = r->first_missing;
+    r->last_progress  = now_usec();
+    r->retries        = 0;
+
+    if (mcast_has(r, block)) {
+        r->duplicates++;
+    } else {
+        if (r->consume(r->arg, block_offset(block, r->block_size),
+                       buf + hdr, (int)(n - hdr)) < 0) {
+            r->status = XFER_FAILED;
+            r->done   = 1;
+            return;
+        }
+        r->have[block / 8] |= 1u << (block % 8);
+        r->received++;
+        while (r->first_missing <= r->total && mcast_has(r, r->first_missing))
+            r->first_missing++;
+    }
+
+    if (r->received == r->total) {
+        /* Tells the server we need no turn as master */
+        mcast_send_ack(r, r->total);
+        r->status = XFER_OK;
+        r->done   = 1;
+        return;
+    }
+
+    if (!r->master)
+        return;
+    if (block != expected)
+        mcast_send_ack(r, r->first_missing - 1);  /* gap or duplicate */
+    else if (++r->since_ack >= r->window)
+        mcast_send_ack(r, r->first_missing - 1);
+}
+
+/*
+ * mcast_on_packet – Handle one datagram from either socket.  An OACK
+ *                   with mc = 1 makes us master: the ACK of our first
+ *                   missing block tells the server where to resume.
+ */
+static inline void mcast_on_packet(McastReceiver *r, const uint8_t *buf,
+                                   ssize_t n,
+                                   const struct sockaddr_in *from)
+{
+    if (n < 4 || !same_peer(from, &r->peer))
+        return;                 /* other sessions share the group      */
+
+    uint16_t opcode = ntohs(*(const uint16_t *)buf);
+    if (opcode == OP_DATA) {
+        mcast_on_data(r, buf, n);
+    } else if (opcode == OP_OACK) {
+        TransferOptions    opts;
+        struct sockaddr_in group;
+        int                mc = 0;
+
+        if (options_parse((const char *)buf + 2, (const char *)buf + n,
+                          &opts) < 0 || !opts.multicast ||
+            mcast_parse(opts.mcast, &group, &mc) < 0 || !mc)
+            return;
+        r->master   = 1;
+        r->retries  = 0;
+        r->deadline = now_usec() + r->rtt.rto;
+        mcast_send_ack(r, r->first_missing - 1);
+    } else if (opcode == OP_ERROR) {
+        copy_peer_error(r->peer_error, buf, n);
+        r->status = XFER_ABORTED;
+        r->done   = 1;
+    }
+}
+
+/*
+ * mcast_on_timeout – The master re-ACKs with backoff; anyone gives up
+ *                    after MAX_RETRIES silent timeouts and at least
+ *                    `timeout` seconds without a block.
+ */
+static inline void mcast_on_timeout(McastReceiver *r)
+{
+    if (peer_gone(++r->retries, r->last_progress, r->timeout)) {
+        r->status = XFER_TIMEOUT;
+        r->done   = 1;
+        return;
+    }
+    rtt_backoff(&r->rtt);
+    r->deadline = now_usec() + r->rtt.rto;
+    if (r->master)
+        mcast_send_ack(r, r->first_missing - 1);
+}
+
+/*
+ * mcast_receiver_run – Blocking driver: collect the whole file and
+ *                      return the final XFER_* status.
+ */
+static inline int mcast_receiver_run(McastReceiver *r)
+{
+    RxBatch rx;
+    if (rx_batch_init(&rx, DATA_PACKET_SIZE(r->block_size)) < 0)
+        return XFER_FAILED;
+
+    while (!r->done) {
+        uint64_t now = now_usec();
+        if (now >= r->deadline) {
+            mcast_on_timeout(r);
+            continue;
+        }
+
+        uint64_t        usec = r->deadline - now;
+        struct pollfd   pfd[2] = { { .fd = r->sockfd,  .events = POLLIN },
+                                   { .fd = r->groupfd, .events = POLLIN } };
+        struct timespec ts = { .tv_sec  = (time_t)(usec / 1000000),
+                               .tv_nsec = (long)(usec % 1000000) * 1000 };
+        if (ppoll(pfd, 2, &ts, NULL) <= 0)
+            continue;
+
+        r->deadline = now_usec() + r->rtt.rto;
+        for (int i = 0; i < 2 && !r->done; i++) {
+            int n;
+            do {
+                n = rx_batch_fill(&rx, pfd[i].fd);
+                for (int j = 0; j < n && !r->done; j++)
+                    mcast_on_packet(r, rx_batch_data(&rx, j),
+                                    rx_batch_len(&rx, j), rx_batch_from(&rx, j));
+            } while (!rx_batch_drained(&rx) && !r->done);
+        }
+        mcast_receiver_flush(r);
+    }
+
+    rx_batch_free(&rx);
+    return r->status;
+}
+
+#endif /* MULTICAST_H */
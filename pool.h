@@ -0,0 +1,158 @@
+/*
+ * pool.h
+ * =====================================================================
+ * Enhanced TFTP – fixed-capacity object pool with admission control
+ *
+ * The server takes a session object for every request it accepts.
+ * Allocating those one at a time leaves nothing to stop a burst of
+ * requests from growing the process without bound, so they come from
+ * a pool sized once at start-up:
+ *
+ *   • Storage – `cap` objects of `size` bytes in one zeroed mapping,
+ *               touched only as they are first used.
+ *   • Free list – a Treiber stack of object indices.  Its head packs
+ *                 the top index with a counter that every push and pop
+ *                 bumps, so one 64-bit compare-and-swap takes or gives
+ *                 back an object and a stale head (ABA) cannot win.
+ *                 Any thread may take or give back; none ever blocks.
+ *   • Watermarks – once `high` objects are out the pool turns busy and
+ *                  refuses every taker, until returns bring it down to
+ *                  `low`.  The gap keeps a pool at its limit from
+ *                  flapping between accepting and refusing on every
+ *                  request.
+ * =====================================================================
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include "udp_file_transfer.h"
+#include <sys/mman.h>
+
+typedef struct {
+    uint8_t    *mem;                    /* cap × size bytes               */
+    size_t      size;                   /* Per object, cache-line aligned */
+    unsigned    cap;
+    uint32_t   *next;                   /* Free list link: index + 1      */
+    uint64_t    head;                   /* Counter << 32 | (top index + 1)*/
+    unsigned    used;                   /* Objects out (atomic)           */
+    unsigned    high;                   /* Turn busy at this many out     */
+    unsigned    low;                    /* Accept again at this many      */
+    int         busy;                   /* Refusing takers (atomic)       */
+    unsigned    refused;                /* Takers turned away (atomic)    */
+} ObjPool;
+
+/*
+ * pool_init – Make room for `cap` objects of `size` bytes, all free.
+ *             `high` and `low` are the watermarks (0 = cap, and 3/4 of
+ *             high).  Returns 0, or -1 if the memory cannot be had.
+ */
+static inline int pool_init(ObjPool *p, unsigned cap, size_t size,
+                            unsigned high, unsigned low)
+{
+    memset(p, 0, sizeof(*p));
+    p->size = (size + 63) & ~(size_t)63;
+    p->cap  = cap;
+    p->high = high == 0 || high > cap ? cap : high;
+    p->low  = low == 0 || low >= p->high ? p->high - p->high / 4 : low;
+    if (p->low >= p->high)
+        p->low = p->high - 1;
+
+    p->mem  = mmap(NULL, p->size * cap, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    p->next = malloc(cap * sizeof(*p->next));
+    if (p->mem == MAP_FAILED || !p->next) {
+        if (p->mem != MAP_FAILED)
+            munmap(p->mem, p->size * cap);
+        free(p->next);
+        p->mem  = NULL;
+        p->next = NULL;
+        return -1;
+    }
+    for (unsigned i = 0; i < cap; i++)
+        p->next[i] = i + 1 < cap ? i + 2 : 0;
+    p->head = cap > 0 ? 1 : 0;
+    return 0;
+}
+
+static inline void pool_destroy(ObjPool *p)
+{
+    if (p->mem)
+        munmap(p->mem, p->size * p->cap);
+    free(p->next);
+    p->mem  = NULL;
+    p->next = NULL;
+}
+
+/* Pop an index off the free list; -1 if it is empty */
+static inline int pool_pop(ObjPool *p)
+{
+    uint64_t head = __atomic_load_n(&p->head, __ATOMIC_ACQUIRE);
+    for (;;) {
+        uint32_t top = (uint32_t)head;
+        if (top == 0)
+            return -1;
+        uint32_t next = __atomic_load_n(&p->next[top - 1],
+                                        __ATOMIC_RELAXED);
+        uint64_t want = ((head >> 32) + 1) << 32 | next;
+        if (__atomic_compare_exchange_n(&p->head, &head, want, 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return (int)top - 1;
+    }
+}
+
+static inline void pool_push(ObjPool *p, unsigned idx)
+{
+    uint64_t head = __atomic_load_n(&p->head, __ATOMIC_RELAXED);
+    for (;;) {
+        __atomic_store_n(&p->next[idx], (uint32_t)head, __ATOMIC_RELAXED);
+        uint64_t want = ((head >> 32) + 1) << 32 | (idx + 1);
+        if (__atomic_compare_exchange_n(&p->head, &head, want, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+    }
+}
+
+/*
+ * pool_get – Take a zeroed object, or NULL while the pool is busy or
+ *            empty.  `*turned_busy` is set if this take reached the
+ *            high watermark.
+ */
+static inline void *pool_get(ObjPool *p, int *turned_busy)
+{
+    *turned_busy = 0;
+    int idx = __atomic_load_n(&p->busy, __ATOMIC_RELAXED) ? -1
+                                                          : pool_pop(p);
+    if (idx < 0) {
+        __atomic_add_fetch(&p->refused, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (__atomic_add_fetch(&p->used, 1, __ATOMIC_RELAXED) >= p->high)
+        *turned_busy = !__atomic_exchange_n(&p->busy, 1, __ATOMIC_RELAXED);
+
+    void *obj = p->mem + (size_t)idx * p->size;
+    memset(obj, 0, p->size);
+    return obj;
+}
+
+/*
+ * pool_put – Give back an object from pool_get.  Returns 1 if this
+ *            brought a busy pool down to its low watermark, so it
+ *            accepts again.
+ */
+static inline int pool_put(ObjPool *p, void *obj)
+{
+    size_t idx = (size_t)((uint8_t *)obj - p->mem) / p->size;
+    pool_push(p, (unsigned)idx);
+    if (__atomic_sub_fetch(&p->used, 1, __ATOMIC_RELAXED) <= p->low &&
+        __atomic_load_n(&p->busy, __ATOMIC_RELAXED))
+        return __atomic_exchange_n(&p->busy, 0, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static inline unsigned pool_used(const ObjPool *p)
+{
+    return __atomic_load_n(&p->used, __ATOMIC_RELAXED);
+}
+
+#endif /* POOL_H */
@@ -0,0 +1,525 @@
+/*
+ * reactor.h
+ * =====================================================================
+ * Enhanced TFTP – event-driven server core
+ *
+ * A fixed pool of worker threads, each with its own epoll set and one
+ * timerfd, serves every transfer.  A transfer is a ReactorTask: the
+ * socket of its TID, a deadline, and a handler that the worker calls
+ * when the socket turns readable or the deadline passes.  The handler
+ * moves the transfer's state machine on (transport.h's *_poll) and
+ * either sets its next deadline or reports that it is finished.
+ *
+ *   • Tasks are handed to the least-loaded worker through a queue and
+ *     an eventfd, and stay on that worker, so a task's state is only
+ *     ever touched by one thread – no locks on the data path.
+ *   • Each worker keeps its deadlines in a binary min-heap and arms its
+ *     timerfd (CLOCK_MONOTONIC, absolute, microsecond resolution, which
+ *     the pacer needs) for the earliest one.
+ *   • Workers share nothing.  Each has a receive batch of its own
+ *     (batchio.h, IO_BATCH buffers sized for the largest DATA packet
+ *     or GRO run), so a session costs its own state plus its window – not
+ *     a thread stack.
+ *   • A task may also wait on something that completes elsewhere on
+ *     its worker – a disk read on the worker's io_uring (uring.h) –
+ *     and is then kicked: called with REACTOR_IO in the same round.
+ *   • A worker may be pinned to one CPU, and a task may be started on
+ *     the worker it was created on (reactor_add) – the server runs one
+ *     listening socket per worker that way, so a request is parsed and
+ *     served on the same core.
+ * =====================================================================
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include "udp_file_transfer.h"
+#include "batchio.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sched.h>
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Why a handler is being called */
+#define REACTOR_START       0x01        /* First call, on its worker        */
+#define REACTOR_READ        0x02        /* Socket has datagrams queued      */
+#define REACTOR_TIMER       0x04        /* Deadline has passed              */
+#define REACTOR_IO          0x08        /* Disk I/O it waited on completed  */
+
+#define REACTOR_MAX_WORKERS 256
+#define REACTOR_MAX_EVENTS  64          /* epoll events taken per wait      */
+#define REACTOR_BUF_SIZE    GRO_BUF_SIZE  /* ≥ DATA_PACKET_SIZE(MAX_BLOCK_SIZE) */
+
+/* ------------------------------------------------------------------ */
+/*  Tasks and workers                                                  */
+/* ------------------------------------------------------------------ */
+
+typedef struct ReactorTask   ReactorTask;
+typedef struct ReactorWorker ReactorWorker;
+
+/*
+ * ReactorHandler – Advance the task after `events` (REACTOR_*).  Return
+ *                  0 to keep it – with reactor_set_timer() if it needs
+ *                  waking without input – or 1 once it is finished; the
+ *                  worker then drops it and calls its ReactorRelease.
+ */
+typedef int  (*ReactorHandler)(ReactorTask *t, int events);
+typedef void (*ReactorRelease)(ReactorTask *t);
+
+struct ReactorTask {
+    int             fd;                 /* Socket watched once the START  */
+                                        /* call returns 0; -1 = none      */
+    ReactorHandler  handle;
+    ReactorRelease  release;            /* Frees the task                 */
+    uint64_t        deadline;           /* now_usec() time, 0 = none      */
+    int             heap_idx;           /* Slot in the timer heap, or -1  */
+    ReactorWorker  *worker;             /* Owner, set on submit           */
+    ReactorTask    *next;               /* Hand-off / closed list link    */
+    ReactorTask    *kick_next;          /* Kicked list link               */
+    int             kicked;             /* REACTOR_IO call pending        */
+    int             closed;             /* Finished, release pending      */
+};
+
+struct ReactorWorker {
+    pthread_t       thread;
+    int             epfd;
+    int             timerfd;
+    int             wakefd;             /* eventfd: tasks queued / stop   */
+    pthread_mutex_t lock;               /* Guards `queue`                 */
+    ReactorTask    *queue;              /* Submitted, not yet started     */
+    ReactorTask    *closed;             /* Finished during this round     */
+    ReactorTask    *kicked;             /* Owed a REACTOR_IO call         */
+    ReactorTask   **heap;               /* Tasks with a deadline          */
+    int             nheap;
+    int             heap_cap;
+    uint64_t        armed;              /* Deadline on the timerfd, 0 off */
+    int             load;               /* Live tasks (atomic)            */
+    int             cpu;                /* Pinned to this CPU, -1 = none  */
+    RxBatch         rx;                 /* Receive batch, REACTOR_BUF_SIZE */
+    struct UringEngine *uring;          /* Disk I/O ring (uring.h), or NULL */
+    volatile int   *running;
+};
+
+typedef struct {
+    ReactorWorker  *workers;
+    int             nworkers;
+    volatile int    running;
+} Reactor;
+
+/* ------------------------------------------------------------------ */
+/*  Timer heap                                                         */
+/* ------------------------------------------------------------------ */
+
+static inline void reactor_heap_put(ReactorWorker *w, int i, ReactorTask *t)
+{
+    w->heap[i]  = t;
+    t->heap_idx = i;
+}
+
+static inline void reactor_heap_up(ReactorWorker *w, int i)
+{
+    ReactorTask *t = w->heap[i];
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (w->heap[parent]->deadline <= t->deadline)
+            break;
+        reactor_heap_put(w, i, w->heap[parent]);
+        i = parent;
+    }
+    reactor_heap_put(w, i, t);
+}
+
+static inline void reactor_heap_down(ReactorWorker *w, int i)
+{
+    ReactorTask *t = w->heap[i];
+    for (;;) {
+        int child = 2 * i + 1;
+        if (child >= w->nheap)
+            break;
+        if (child + 1 < w->nheap &&
+            w->heap[child + 1]->deadline < w->heap[child]->deadline)
+            child++;
+        if (t->deadline <= w->heap[child]->deadline)
+            break;
+        reactor_heap_put(w, i, w->heap[child]);
+        i = child;
+    }
+    reactor_heap_put(w, i, t);
+}
+
+static inline void reactor_heap_remove(ReactorWorker *w, ReactorTask *t)
+{
+    int i = t->heap_idx;
+    t->heap_idx = -1;
+    if (--w->nheap == i)
+        return;
+
+    ReactorTask *last = w->heap[w->nheap];
+    reactor_heap_put(w, i, last);
+    reactor_heap_up(w, i);
+    reactor_heap_down(w, last->heap_idx);
+}
+
+/*
+ * reactor_set_timer – Call the task with REACTOR_TIMER once now_usec()
+ *                     reaches `deadline` (0 cancels).  Only from the
+ *                     task's own handler.
+ */
+static inline int reactor_set_timer(ReactorTask *t, uint64_t deadline)
+{
+    ReactorWorker *w = t->worker;
+
+    if (t->heap_idx >= 0) {
+        uint64_t old = t->deadline;
+        t->deadline  = deadline;
+        if (deadline == 0)
+            reactor_heap_remove(w, t);
+        else if (deadline < old)
+            reactor_heap_up(w, t->heap_idx);
+        else
+            reactor_heap_down(w, t->heap_idx);
+        return 0;
+    }
+    t->deadline = deadline;
+    if (deadline == 0)
+        return 0;
+
+    if (w->nheap == w->heap_cap) {
+        int           cap  = w->heap_cap ? w->heap_cap * 2 : 64;
+        ReactorTask **heap = realloc(w->heap, cap * sizeof(*heap));
+        if (!heap)
+            return -1;
+        w->heap     = heap;
+        w->heap_cap = cap;
+    }
+    reactor_heap_put(w, w->nheap++, t);
+    reactor_heap_up(w, w->nheap - 1);
+    return 0;
+}
+
+/* Point the timerfd at the earliest deadline */
+static inline void reactor_arm(ReactorWorker *w)
+{
+    uint64_t next = w->nheap > 0 ? w->heap[0]->deadline : 0;
+    if (next == w->armed)
+        return;
+
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    if (next) {
+        its.it_value.tv_sec  = (time_t)(next / 1000000);
+        its.it_value.tv_nsec = (long)(next % 1000000) * 1000;
+        if (its.it_value.tv_sec == 0 && its.it_value.tv_nsec == 0)
+            its.it_value.tv_nsec = 1;   /* all-zero would disarm        */
+    }
+    timerfd_settime(w->timerfd, TFD_TIMER_ABSTIME, &its, NULL);
+    w->armed = next;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Worker loop                                                        */
+/* ------------------------------------------------------------------ */
+
+/*
+ * reactor_dispatch – Call the task's handler; once it reports that it is
+ *                    finished, unhook it.  It is released after the
+ *                    round, since the same epoll batch may still hold an
+ *                    event for it.
+ */
+static inline void reactor_dispatch(ReactorWorker *w, ReactorTask *t,
+                                    int events)
+{
+    if (t->closed)
+        return;
+    int done = t->handle(t, events);
+
+    if ((events & REACTOR_START) && !done && t->fd >= 0) {
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = t };
+        if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, t->fd, &ev) < 0) {
+            perror("reactor: epoll_ctl");
+            done = 1;
+        }
+        if (done)
+            t->fd = -1;
+    }
+    if (!done)
+        return;
+
+    if (t->fd >= 0 && !(events & REACTOR_START))
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, t->fd, NULL);
+    reactor_set_timer(t, 0);
+    t->closed = 1;
+    t->next   = w->closed;
+    w->closed = t;
+}
+
+/*
+ * reactor_kick – Call `t` with REACTOR_IO later in this round, once.
+ *                For completions that arrive on another task (the
+ *                worker's io_uring); only from the worker's thread.
+ */
+static inline void reactor_kick(ReactorTask *t)
+{
+    ReactorWorker *w = t->worker;
+    if (t->kicked || t->closed)
+        return;
+    t->kicked    = 1;
+    t->kick_next = w->kicked;
+    w->kicked    = t;
+}
+
+static inline void reactor_run_kicked(ReactorWorker *w)
+{
+    while (w->kicked) {
+        ReactorTask *t = w->kicked;
+        w->kicked = t->kick_next;
+        t->kicked = 0;
+        reactor_dispatch(w, t, REACTOR_IO);
+    }
+}
+
+/* Release the tasks that finished during the last round */
+static inline void reactor_reap(ReactorWorker *w)
+{
+    while (w->closed) {
+        ReactorTask *t = w->closed;
+        w->closed = t->next;
+        __atomic_sub_fetch(&w->load, 1, __ATOMIC_RELAXED);
+        t->release(t);
+    }
+}
+
+/* Start every task the listener has queued, oldest first */
+static inline void reactor_take(ReactorWorker *w)
+{
+    uint64_t count;
+    if (read(w->wakefd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("reactor: eventfd");
+
+    pthread_mutex_lock(&w->lock);
+    ReactorTask *list = w->queue;
+    w->queue = NULL;
+    pthread_mutex_unlock(&w->lock);
+
+    ReactorTask *fifo = NULL;
+    while (list) {
+        ReactorTask *t = list;
+        list    = t->next;
+        t->next = fifo;
+        fifo    = t;
+    }
+    while (fifo) {
+        ReactorTask *t = fifo;
+        fifo = t->next;
+        reactor_dispatch(w, t, REACTOR_START);
+    }
+}
+
+/*
+ * reactor_expire – Run the tasks whose deadline has passed.  A task that
+ *                  sets a deadline already in the past runs again on the
+ *                  next round, not in this loop, so it cannot starve the
+ *                  socket events.
+ */
+static inline void reactor_expire(ReactorWorker *w)
+{
+    uint64_t expirations;
+    if (read(w->timerfd, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+        perror("reactor: timerfd");
+    w->armed = 0;
+
+    uint64_t now    = now_usec();
+    int      budget = w->nheap;
+    while (budget-- > 0 && w->nheap > 0 && w->heap[0]->deadline <= now) {
+        ReactorTask *t = w->heap[0];
+        reactor_heap_remove(w, t);
+        t->deadline = 0;
+        reactor_dispatch(w, t, REACTOR_TIMER);
+    }
+}
+
+static void *reactor_worker(void *arg)
+{
+    ReactorWorker     *w = (ReactorWorker *)arg;
+    struct epoll_event ev[REACTOR_MAX_EVENTS];
+
+    if (w->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0)
+            fprintf(stderr, "reactor: cannot pin a worker to CPU %d\n",
+                    w->cpu);
+    }
+
+    while (*w->running) {
+        reactor_arm(w);
+        int n = epoll_wait(w->epfd, ev, REACTOR_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("reactor: epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n && *w->running; i++) {
+            if (ev[i].data.ptr == &w->wakefd)
+                reactor_take(w);
+            else if (ev[i].data.ptr == &w->timerfd)
+                reactor_expire(w);
+            else
+                reactor_dispatch(w, (ReactorTask *)ev[i].data.ptr,
+                                 REACTOR_READ);
+        }
+        reactor_run_kicked(w);
+        reactor_reap(w);
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Pool                                                               */
+/* ------------------------------------------------------------------ */
+
+/*
+ * reactor_start – Create `nworkers` workers and start their threads.
+ *                 With `pin`, worker i is bound to the i-th CPU this
+ *                 process may run on (wrapping round).  Returns 0, or
+ *                 -1 with a message on stderr.
+ */
+static inline int reactor_start(Reactor *r, int nworkers, int pin)
+{
+    if (nworkers < 1)
+        nworkers = 1;
+    if (nworkers > REACTOR_MAX_WORKERS)
+        nworkers = REACTOR_MAX_WORKERS;
+
+    r->running  = 1;
+    r->nworkers = 0;
+    r->workers  = calloc(nworkers, sizeof(ReactorWorker));
+    if (!r->workers) {
+        perror("reactor: calloc");
+        return -1;
+    }
+
+    cpu_set_t allowed;
+    int       ncpus = 0;
+    CPU_ZERO(&allowed);
+    if (pin && sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+        ncpus = CPU_COUNT(&allowed);
+
+    for (int i = 0, cpu = -1; i < nworkers; i++) {
+        ReactorWorker *w = &r->workers[i];
+        w->running = &r->running;
+        w->cpu     = -1;
+        if (ncpus > 0) {
+            do
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            while (!CPU_ISSET(cpu, &allowed));
+            w->cpu = cpu;
+        }
+        w->epfd    = epoll_create1(EPOLL_CLOEXEC);
+        w->timerfd = timerfd_create(CLOCK_MONOTONIC,
+                                    TFD_NONBLOCK | TFD_CLOEXEC);
+        w->wakefd  = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        pthread_mutex_init(&w->lock, NULL);
+        if (w->epfd < 0 || w->timerfd < 0 || w->wakefd < 0 ||
+            rx_batch_init(&w->rx, REACTOR_BUF_SIZE) < 0) {
+            perror("reactor: worker");
+            return -1;
+        }
+
+        struct epoll_event ev = { .events = EPOLLIN };
+        ev.data.ptr = &w->wakefd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->wakefd, &ev);
+        ev.data.ptr = &w->timerfd;
+        epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->timerfd, &ev);
+
+        if (pthread_create(&w->thread, NULL, reactor_worker, w) != 0) {
+            perror("reactor: pthread_create");
+            return -1;
+        }
+        r->nworkers++;
+    }
+    return 0;
+}
+
+/*
+ * reactor_post – Hand `t` to worker `w` from any thread.  Its handler is
+ *                first called there with REACTOR_START.
+ */
+static inline void reactor_post(ReactorWorker *w, ReactorTask *t)
+{
+    t->worker   = w;
+    t->deadline = 0;
+    t->heap_idx = -1;
+    t->kicked   = 0;
+    t->closed   = 0;
+    __atomic_add_fetch(&w->load, 1, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&w->lock);
+    t->next  = w->queue;
+    w->queue = t;
+    pthread_mutex_unlock(&w->lock);
+
+    uint64_t one = 1;
+    if (write(w->wakefd, &one, sizeof(one)) < 0)
+        perror("reactor: eventfd");
+}
+
+/* Hand `t` to the worker with the fewest live tasks */
+static inline void reactor_submit(Reactor *r, ReactorTask *t)
+{
+    ReactorWorker *w = &r->workers[0];
+    for (int i = 1; i < r->nworkers; i++)
+        if (__atomic_load_n(&r->workers[i].load, __ATOMIC_RELAXED) <
+            __atomic_load_n(&w->load, __ATOMIC_RELAXED))
+            w = &r->workers[i];
+    reactor_post(w, t);
+}
+
+/*
+ * reactor_add – Start `t` on worker `w` right away.  Only from a task
+ *               already running on `w`, which keeps the new task on the
+ *               same core and off every queue.
+ */
+static inline void reactor_add(ReactorWorker *w, ReactorTask *t)
+{
+    t->worker   = w;
+    t->deadline = 0;
+    t->heap_idx = -1;
+    t->kicked   = 0;
+    t->closed   = 0;
+    __atomic_add_fetch(&w->load, 1, __ATOMIC_RELAXED);
+    reactor_dispatch(w, t, REACTOR_START);
+}
+
+/* Live tasks across all workers */
+static inline int reactor_load(const Reactor *r)
+{
+    int load = 0;
+    for (int i = 0; i < r->nworkers; i++)
+        load += __atomic_load_n(&r->workers[i].load, __ATOMIC_RELAXED);
+    return load;
+}
+
+/*
+ * reactor_stop – Stop the workers and wait for them.  Tasks still open
+ *                are abandoned, as the process is about to exit.
+ */
+static inline void reactor_stop(Reactor *r)
+{
+    r->running = 0;
+    for (int i = 0; i < r->nworkers; i++) {
+        uint64_t one = 1;
+        if (write(r->workers[i].wakefd, &one, sizeof(one)) < 0)
+            perror("reactor: eventfd");
+    }
+    for (int i = 0; i < r->nworkers; i++)
+        pthread_join(r->workers[i].thread, NULL);
+}
+
+#endif /* REACTOR_H */
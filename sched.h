@@ -0,0 +1,435 @@
+/*
+ * sched.h
+ * =====================================================================
+ * Enhanced TFTP – fair sharing of the server's egress bandwidth
+ *
+ * Every download pumps DATA as fast as its window and congestion
+ * controller allow, so a few bulk transfers can fill the link while a
+ * small fetch waits behind them.  With a scheduler (-R), each sender
+ * asks it before sending (a SendGate, transport.h):
+ *
+ *   • Link – a token bucket at the configured egress rate.  Nothing
+ *            leaves faster than that in total.
+ *   • Deficit round robin – while the link is contended, each bulk
+ *     download may send SCHED_QUANTUM bytes × its weight per round.
+ *     A round lasts as long as the link needs to carry the quanta of
+ *     the flows that asked in the round before, so every backlogged
+ *     flow gets its weighted share however large its window.  A flow
+ *     that has used its quantum waits for the next round, unless the
+ *     link has half its burst spare; it may then borrow, so an idle
+ *     link is never held back.
+ *   • Clients and subnets – optional token buckets per client address
+ *     and per /24, shared by all of that host's or subnet's downloads.
+ *   • Fast lane – a download of at most `fast_max` bytes skips the
+ *     rounds and the host buckets, and bulk flows leave part of the
+ *     link's burst to the fast flows in progress, so small fetches go
+ *     through even while bulk transfers saturate the link.
+ *
+ * A flow takes its budget in leases of SCHED_LEASE bytes, so the lock
+ * is only taken once per lease, not per packet.  Budgets, rounds and
+ * buckets can be dumped at any time (sched_dump, SIGUSR1 at the
+ * server).
+ * =====================================================================
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+#include "udp_file_transfer.h"
+#include "transport.h"
+#include <pthread.h>
+
+#define SCHED_QUANTUM       (64 * 1024) /* Bytes per flow per round       */
+#define SCHED_LEASE         (16 * 1024) /* Bytes granted per admission    */
+#define SCHED_BURST_NS      10000000ull /* Buckets bank 10 ms of rate     */
+#define SCHED_FAST_KB       1024        /* Default fast-lane size         */
+#define SCHED_HOSTS         256         /* Client / subnet hash buckets   */
+#define SCHED_MIN_WAIT_NS   20000ull    /* Shortest hold: 20 µs           */
+
+typedef struct {
+    uint64_t            rate;           /* Bytes/s, 0 = unlimited         */
+    int64_t             tokens;         /* Bytes that may leave now       */
+    int64_t             burst;          /* Most tokens banked             */
+    uint64_t            stamp;          /* Refilled up to (ns)            */
+} TokenBucket;
+
+/* A client address or /24 subnet with a bucket of its own */
+typedef struct SchedHost {
+    struct SchedHost   *next;           /* Hash chain                     */
+    uint32_t            addr;           /* Host order; subnets end in .0  */
+    int                 subnet;
+    unsigned            flows;          /* Downloads charging it          */
+    TokenBucket         bucket;
+} SchedHost;
+
+struct Scheduler;
+
+typedef struct SchedFlow {
+    struct SchedFlow   *prev, *next;    /* Scheduler's flow list          */
+    struct Scheduler   *sched;          /* NULL = not attached            */
+    SendGate            gate;           /* For WindowSender.gate          */
+    struct in_addr      addr;
+    SchedHost          *client;         /* Buckets it charges, or NULL    */
+    SchedHost          *subnet;
+    int                 fast;           /* In the fast lane               */
+    int                 weight;
+    int64_t             deficit;        /* DRR: bytes left this round     */
+    uint64_t            round;          /* Round the deficit belongs to   */
+    int64_t             lease;          /* Granted, not yet sent          */
+    uint64_t            bytes;          /* Sent                           */
+    unsigned            holds;          /* Times told to wait             */
+    unsigned            borrowed;       /* Leases lent by an idle link    */
+} SchedFlow;
+
+typedef struct Scheduler {
+    pthread_mutex_t     lock;
+    int                 enabled;
+    TokenBucket         link;
+    uint64_t            client_rate;    /* Bytes/s per client, 0 = none   */
+    uint64_t            subnet_rate;    /* Bytes/s per /24, 0 = none      */
+    long long           fast_max;       /* Fast-lane size (bytes)         */
+    uint64_t            round;
+    uint64_t            round_end;      /* ns                             */
+    unsigned            weight_now;     /* Weights sharing this round     */
+    unsigned            weight_next;    /* Weights that asked in it       */
+    unsigned            fast_flows;
+    SchedFlow          *flows;
+    unsigned            nflows;
+    SchedHost          *hosts[SCHED_HOSTS];
+} Scheduler;
+
+/* ------------------------------------------------------------------ */
+/*  Token buckets                                                      */
+/* ------------------------------------------------------------------ */
+
+static inline void bucket_init(TokenBucket *b, uint64_t rate, uint64_t now)
+{
+    b->rate   = rate;
+    b->burst  = (int64_t)(rate * SCHED_BURST_NS / 1000000000ull);
+    if (b->burst < 4 * SCHED_LEASE)
+        b->burst = 4 * SCHED_LEASE;
+    b->tokens = b->burst;
+    b->stamp  = now;
+}
+
+/* Add what the rate earned since the last refill.  The time a partial
+ * byte would need stays unspent, so slow buckets are not shortchanged. */
+static inline void bucket_refill(TokenBucket *b, uint64_t now)
+{
+    if (b->rate == 0 || now <= b->stamp)
+        return;
+    uint64_t dt = now - b->stamp;
+    if (dt >= 1000000000ull) {
+        b->tokens = b->burst;
+        b->stamp  = now;
+        return;
+    }
+    uint64_t add = dt * b->rate / 1000000000ull;
+    b->tokens += (int64_t)add;
+    b->stamp  += add * 1000000000ull / b->rate;
+    if (b->tokens >= b->burst) {
+        b->tokens = b->burst;
+        b->stamp  = now;
+    }
+}
+
+/* Nanoseconds until `len` bytes may leave; 0 = now.  More than the
+ * burst only waits for a full bucket, which then goes into debt.     */
+static inline uint64_t bucket_delay(const TokenBucket *b, int64_t len)
+{
+    if (len > b->burst)
+        len = b->burst;
+    if (b->rate == 0 || b->tokens >= len)
+        return 0;
+    return (uint64_t)(len - b->tokens) * 1000000000ull / b->rate + 1;
+}
+
+static inline void bucket_take(TokenBucket *b, int64_t len)
+{
+    if (b->rate)
+        b->tokens -= len;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Scheduler                                                          */
+/* ------------------------------------------------------------------ */
+
+/*
+ * sched_init – Set up the scheduler.  Rates are in bytes per second, 0
+ *              for no limit; with all three 0 it stays off.  Downloads
+ *              of at most `fast_max` bytes use the fast lane.
+ */
+static inline void sched_init(Scheduler *sc, uint64_t link_rate,
+                              uint64_t client_rate, uint64_t subnet_rate,
+                              long long fast_max)
+{
+    memset(sc, 0, sizeof(*sc));
+    pthread_mutex_init(&sc->lock, NULL);
+    sc->enabled     = link_rate || client_rate || subnet_rate;
+    sc->client_rate = client_rate;
+    sc->subnet_rate = subnet_rate;
+    sc->fast_max    = fast_max;
+    bucket_init(&sc->link, link_rate, now_nsec());
+}
+
+static inline void sched_destroy(Scheduler *sc)
+{
+    for (int i = 0; i < SCHED_HOSTS; i++)
+        while (sc->hosts[i]) {
+            SchedHost *h = sc->hosts[i];
+            sc->hosts[i] = h->next;
+            free(h);
+        }
+    pthread_mutex_destroy(&sc->lock);
+}
+
+/* The bucket of a client or subnet, created on first use; the caller
+ * holds the lock                                                     */
+static inline SchedHost *sched_host(Scheduler *sc, uint32_t addr,
+                                    int subnet, uint64_t rate, uint64_t now)
+{
+    unsigned    idx = (addr * 2654435761u + (unsigned)subnet) % SCHED_HOSTS;
+    SchedHost  *h   = sc->hosts[idx];
+    while (h && !(h->addr == addr && h->subnet == subnet))
+        h = h->next;
+    if (!h) {
+        h = calloc(1, sizeof(*h));
+        if (!h)
+            return NULL;
+        h->addr   = addr;
+        h->subnet = subnet;
+        bucket_init(&h->bucket, rate, now);
+        h->next   = sc->hosts[idx];
+        sc->hosts[idx] = h;
+    }
+    h->flows++;
+    return h;
+}
+
+static inline void sched_host_put(Scheduler *sc, SchedHost *h)
+{
+    if (!h || --h->flows > 0)
+        return;
+    unsigned    idx = (h->addr * 2654435761u + (unsigned)h->subnet) %
+                      SCHED_HOSTS;
+    SchedHost **pp  = &sc->hosts[idx];
+    while (*pp != h)
+        pp = &(*pp)->next;
+    *pp = h->next;
+    free(h);
+}
+
+static inline uint64_t sched_admit(void *arg, uint64_t now);
+static inline void     sched_charge(void *arg, int len);
+
+/*
+ * sched_attach – Register a download from `addr` that will send about
+ *                `bytes` bytes (-1 if unknown), with a DRR weight.  Its
+ *                WindowSender's gate is then `&f->gate`.  Returns 0, or
+ *                -1 if the scheduler is off.
+ */
+static inline int sched_attach(Scheduler *sc, SchedFlow *f,
+                               struct in_addr addr, long long bytes,
+                               int weight)
+{
+    if (!sc->enabled)
+        return -1;
+
+    uint64_t now  = now_nsec();
+    uint32_t host = ntohl(addr.s_addr);
+
+    memset(f, 0, sizeof(*f));
+    f->addr   = addr;
+    f->weight = weight < 1 ? 1 : weight;
+    f->fast   = bytes >= 0 && bytes <= sc->fast_max;
+    f->gate   = (SendGate){ sched_admit, sched_charge, f };
+
+    pthread_mutex_lock(&sc->lock);
+    if (!f->fast && sc->client_rate)
+        f->client = sched_host(sc, host, 0, sc->client_rate, now);
+    if (!f->fast && sc->subnet_rate)
+        f->subnet = sched_host(sc, host & 0xFFFFFF00u, 1, sc->subnet_rate,
+                               now);
+    f->next = sc->flows;
+    if (sc->flows)
+        sc->flows->prev = f;
+    sc->flows = f;
+    sc->nflows++;
+    sc->fast_flows += f->fast;
+    f->sched = sc;
+    pthread_mutex_unlock(&sc->lock);
+    return 0;
+}
+
+static inline void sched_detach(SchedFlow *f)
+{
+    Scheduler *sc = f->sched;
+    if (!sc)
+        return;
+    pthread_mutex_lock(&sc->lock);
+    if (f->prev) f->prev->next = f->next; else sc->flows = f->next;
+    if (f->next) f->next->prev = f->prev;
+    sc->nflows--;
+    sc->fast_flows -= f->fast;
+    sched_host_put(sc, f->client);
+    sched_host_put(sc, f->subnet);
+    pthread_mutex_unlock(&sc->lock);
+    f->sched = NULL;
+}
+
+/* Start a new DRR round once the last one has run its length */
+static inline void sched_roll(Scheduler *sc, uint64_t now)
+{
+    if (now < sc->round_end)
+        return;
+    sc->round++;
+    sc->weight_now  = sc->weight_next ? sc->weight_next : 1;
+    sc->weight_next = 0;
+    sc->round_end   = now + (uint64_t)sc->weight_now * SCHED_QUANTUM *
+                            1000000000ull / sc->link.rate;
+}
+
+/* Grant `f` a lease, or return how long it must wait; the caller
+ * holds the lock                                                     */
+static inline uint64_t sched_grant(Scheduler *sc, SchedFlow *f,
+                                   uint64_t now)
+{
+    int64_t need   = SCHED_LEASE - f->lease;    /* lease ≤ 0: pay debts */
+    int     borrow = 0;
+
+    bucket_refill(&sc->link, now);
+    if (f->client)
+        bucket_refill(&f->client->bucket, now);
+    if (f->subnet)
+        bucket_refill(&f->subnet->bucket, now);
+
+    /* Deficit round robin shares a rate-limited link between bulk
+       flows; a surplus is not banked past the round it was given in */
+    if (sc->link.rate && !f->fast) {
+        sched_roll(sc, now);
+        if (f->round != sc->round) {
+            f->round    = sc->round;
+            f->deficit  = (f->deficit < 0 ? f->deficit : 0) +
+                          (int64_t)f->weight * SCHED_QUANTUM;
+            sc->weight_next += (unsigned)f->weight;
+        }
+        if (f->deficit < need) {
+            if (sc->link.tokens < sc->link.burst / 2)
+                return sc->round_end - now;
+            borrow = 1;
+        }
+    }
+
+    /* Bulk flows leave the fast lane a lease per fast flow in progress,
+       up to half the link's burst                                     */
+    int64_t reserve = 0;
+    if (!f->fast && sc->link.rate) {
+        reserve = (int64_t)sc->fast_flows * SCHED_LEASE;
+        if (reserve > sc->link.burst / 2)
+            reserve = sc->link.burst / 2;
+    }
+
+    uint64_t wait = bucket_delay(&sc->link, need + reserve);
+    if (f->client) {
+        uint64_t w = bucket_delay(&f->client->bucket, need);
+        wait = w > wait ? w : wait;
+    }
+    if (f->subnet) {
+        uint64_t w = bucket_delay(&f->subnet->bucket, need);
+        wait = w > wait ? w : wait;
+    }
+    if (wait > 0)
+        return wait;
+
+    bucket_take(&sc->link, need);
+    if (f->client)
+        bucket_take(&f->client->bucket, need);
+    if (f->subnet)
+        bucket_take(&f->subnet->bucket, need);
+    if (!f->fast)
+        f->deficit -= need;
+    f->lease    += need;
+    f->borrowed += borrow;
+    return 0;
+}
+
+/*
+ * sched_admit – SendGate: 0 while the flow holds a lease or can be
+ *               granted one, else the nanoseconds until it may ask
+ *               again.
+ */
+static inline uint64_t sched_admit(void *arg, uint64_t now)
+{
+    SchedFlow *f = (SchedFlow *)arg;
+    if (f->lease > 0)
+        return 0;
+
+    Scheduler *sc = f->sched;
+    pthread_mutex_lock(&sc->lock);
+    uint64_t wait = sched_grant(sc, f, now);
+    pthread_mutex_unlock(&sc->lock);
+
+    if (wait == 0)
+        return 0;
+    f->holds++;
+    return wait > SCHED_MIN_WAIT_NS ? wait : SCHED_MIN_WAIT_NS;
+}
+
+/* SendGate: a packet of `len` bytes left against the lease */
+static inline void sched_charge(void *arg, int len)
+{
+    SchedFlow *f = (SchedFlow *)arg;
+    f->lease -= len;
+    f->bytes += (uint64_t)len;
+}
+
+/* Print a bucket's rate and what it holds now ("-" = unlimited) */
+static inline void sched_print_bucket(const char *what,
+                                      const TokenBucket *b)
+{
+    if (b->rate)
+        printf("%s %.1f Mbit/s, %lld of %lld bytes banked", what,
+               b->rate * 8 / 1e6, (long long)b->tokens,
+               (long long)b->burst);
+    else
+        printf("%s -", what);
+}
+
+/*
+ * sched_dump – Print the budgets the scheduler enforces right now: the
+ *              link, each download's lane, weight, deficit and lease,
+ *              and every client and subnet bucket in use.
+ */
+static inline void sched_dump(Scheduler *sc)
+{
+    pthread_mutex_lock(&sc->lock);
+    bucket_refill(&sc->link, now_nsec());
+
+    print_timestamp();
+    sched_print_bucket("SCHED   link", &sc->link);
+    printf("; round %llu shared by weight %u; %u downloads (%u fast)\n",
+           (unsigned long long)sc->round, sc->weight_now, sc->nflows,
+           sc->fast_flows);
+    for (const SchedFlow *f = sc->flows; f; f = f->next) {
+        print_timestamp();
+        printf("SCHED   flow %s: %s, weight %d, deficit %lld, lease %lld, "
+               "%llu bytes sent, held %u times, %u leases borrowed\n",
+               inet_ntoa(f->addr), f->fast ? "fast lane" : "bulk",
+               f->weight, (long long)f->deficit, (long long)f->lease,
+               (unsigned long long)f->bytes, f->holds, f->borrowed);
+    }
+    for (int i = 0; i < SCHED_HOSTS; i++)
+        for (const SchedHost *h = sc->hosts[i]; h; h = h->next) {
+            struct in_addr a = { htonl(h->addr) };
+            print_timestamp();
+            printf("SCHED   %s %s%s (%u downloads):", h->subnet ? "subnet"
+                                                             : "client",
+                   inet_ntoa(a), h->subnet ? "/24" : "", h->flows);
+            sched_print_bucket("", &h->bucket);
+            printf("\n");
+        }
+    fflush(stdout);
+    pthread_mutex_unlock(&sc->lock);
+}
+
+#endif /* SCHED_H */
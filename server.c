@@ -6,30 +6,104 @@
  * Features
  * --------
  *   • Listens on a UDP port for RRQ / WRQ / DELETE requests.
- *   • Transfers files in configurable block sizes (up to 4 KB).
- *   • AES-256-CBC encryption on all DATA payloads.
+ *   • Transfers files in configurable block sizes (4 KB by default).
+ *   • RFC 2347 option negotiation with OACK: blksize (up to 65464),
+ *     timeout, tsize and windowsize (many blocks per round trip).
+ *   • Files beyond 65535 blocks: 16-bit block numbers roll over (to 0,
+ *     or to the negotiated "rollover" value), or with "exthdr" DATA
+ *     carries 32-bit block numbers and 64-bit offsets.
+ *   • RFC 2090 multicast downloads (-m group[:port]): clients fetching
+ *     the same file share one stream to a group address.
+ *   • "range" option: a RRQ may ask for one byte range of a file, so a
+ *     client can fetch a large file over several TIDs (and threads)
+ *     at once.
+ *   • Resumable transfers ("resume" option): uploads keep an on-disk
+ *     checkpoint journal, so an interrupted WRQ – even across a server
+ *     restart – continues from the last durable offset; a RRQ can
+ *     start at the offset the client already holds.
+ *   • Forward error correction ("fec" option): parity blocks after
+ *     every group of DATA blocks let the receiver rebuild lost blocks
+ *     without a retransmission round trip.
+ *   • Per-block compression ("compress" option): blocks are deflated
+ *     before encryption, except those that don't compress.
+ *   • Delta-sync uploads ("delta" option): a RRQ fetches the rolling
+ *     and strong checksums of the stored copy (or its latest backup),
+ *     a WRQ then carries only copy instructions and changed bytes.
+ *   • Congestion control (AIMD or delay-based Vegas) and paced sending
+ *     for "enhanced" clients.
+ *   • Encryption of all DATA payloads: AES-256-GCM with a key per
+ *     session and a tag per block ("gcm" option), or AES-256-CBC under
+ *     the shared key for clients that don't ask for it and multicast.
+ *     A download the block cache serves is keyed per file instead.
  *   • Automatic backup of every uploaded file.
  *   • File recovery from backup on demand.
  *   • MD5 integrity verification after upload.
- *   • Multithreaded – each client request is handled in its own thread.
+ *   • Event-driven – a fixed pool of epoll workers (-t, one per CPU by
+ *     default) runs every transfer as a state machine (reactor.h).
+ *     Each worker is pinned to a core and reads requests from its own
+ *     SO_REUSEPORT socket on the server port, optionally steered by a
+ *     BPF program (-B).
+ *   • Batched I/O (batchio.h): DATA leaves in sendmmsg() batches and
+ *     ACKs and requests are read with recvmmsg().  Downloads use UDP
+ *     GSO and uploads accept GRO runs where the kernel allows (-N
+ *     turns both off).
+ *   • Optional io_uring file I/O (-U, uring.h): downloads read ahead
+ *     and uploads write behind on a ring per worker, so a slow disk
+ *     stalls one session instead of the whole worker.
+ *   • Optional zero-copy downloads (-z): files are mapped and each block
+ *     is encrypted straight from the page cache into its packet, which
+ *     large windows then send with MSG_ZEROCOPY.
+ *   • Hot-file block cache (blockcache.h): encrypted blocks are shared by
+ *     every download of the same file, within a memory budget (-C MB,
+ *     0 = off); uploads and deletes drop the blocks they replace.
+ *     A miss is read once: a session that meets another's fill retries
+ *     on a short timer instead of parking its worker.
+ *   • Fair egress scheduling (sched.h, -R link[,client[,subnet[,fast]]]
+ *     in Mbit/s): downloads share the link by deficit round robin under
+ *     per-client and per-/24 token buckets, and small ones take a fast
+ *     lane past bulk transfers.  SIGUSR1 prints the budgets in force.
+ *   • Crypto pipeline (cryptopool.h, -X threads): a download's blocks
+ *     are read and encrypted a chunk at a time by a pool of threads
+ *     ahead of its window, and a GCM upload's are decrypted and written
+ *     the same way, so one large transfer can use several cores.  A
+ *     session never waits for the pool on its worker: it is run again
+ *     shortly instead.
+ *   • Admission control (pool.h): sessions come from a fixed pool
+ *     (-S max[,high,low]); past the high watermark new requests get a
+ *     "Server busy, retry later" error until the low one is reached.
  *   • Compatible with standard TFTP RRQ/WRQ (512-byte block mode).
  *
  * Compile
  * -------
- *   gcc -Wall -Wextra -pthread -o server server.c -lssl -lcrypto
+ *   gcc -Wall -Wextra -pthread -o server server.c -lssl -lcrypto -lz
  *
  * Run
  * ---
- *   ./server [port]          (default port: 6969)
+ *   ./server [-c aimd|vegas|fixed] [-p user|txtime|off]
+ *            [-m group[:port]] [-t workers] [-B] [-N] [-U] [-z]
+ *            [-S max[,high[,low]]] [-C cache_mb] [-X threads]
+ *            [-R link[,client[,subnet[,fast_kb]]]] [port]
+ *                            (default port: 6969)
  * =====================================================================
  */
 
 #include "udp_file_transfer.h"
+#include "transport.h"
+#include "multicast.h"
+#include "checkpoint.h"
+#include "delta.h"
+#include "reactor.h"
+#include "uring.h"
+#include "pool.h"
+#include "blockcache.h"
+#include "sched.h"
+#include "cryptopool.h"
 #include <dirent.h>
 #include <signal.h>
+#include <linux/filter.h>
 
 /* ------------------------------------------------------------------ */
-/*  Per-client context passed to the handler thread                    */
+/*  Per-client context of one request                                  */
 /* ------------------------------------------------------------------ */
 typedef struct {
     int                sockfd;          /* Dedicated socket for this TID  */
@@ -39,17 +113,63 @@ typedef struct {
     char               filename[MAX_FILENAME];
     char               mode[MAX_MODE];
     int                block_size;      /* Negotiated block size          */
+    int                window;          /* Negotiated window size         */
+    int                timeout;         /* Negotiated timeout (seconds)   */
+    int                strict;          /* octet/netascii: RFC 7440 peer  */
+    int                sack;            /* Negotiated selective ACKs      */
+    BlockFormat        fmt;             /* Negotiated block numbering     */
+    int                range;           /* RRQ serves a byte range only   */
+    long long          range_off;       /* Granted range, clamped to the  */
+    long long          range_len;       /* file                           */
+    long long          resume;          /* Transfer starts at this byte   */
+    int                fec_k;           /* FEC group size, 0 = off        */
+    int                fec_m;           /* FEC parity blocks per group    */
+    int                delta;           /* Delta block size, 0 = off      */
+    int                codec;           /* Block compression, CODEC_*     */
+    int                gcm;             /* AES-256-GCM, salt in opts      */
+    TransferOptions    opts;            /* Options requested by client    */
 } ClientContext;
 
 /* ------------------------------------------------------------------ */
 /*  Global flag for graceful shutdown                                   */
 /* ------------------------------------------------------------------ */
 static volatile int running = 1;
+static volatile int dump_sched = 0;
+
+/* Congestion controller and pacing applied to every RRQ */
+static const CongestionOps *g_congestion = &CC_AIMD;
+static int                  g_pacing     = PACE_USER;
+
+/* UDP GSO for RRQ DATA and GRO for WRQ DATA, unless -N */
+static int                  g_offload    = 1;
+
+/* Session file I/O through each worker's io_uring (-U) */
+static int                  g_uring      = 0;
+
+/* RRQ blocks encrypted from a mapping, large windows sent MSG_ZEROCOPY
+   (-z); smaller windows do not amortise the completion notifications */
+#define ZEROCOPY_MIN_WINDOW 32
+static int                  g_zerocopy   = 0;
+
+/* Every session comes from here; its watermarks admit requests (-S) */
+#define SESSION_POOL        4096
+static ObjPool              g_sessions;
+
+/* Encrypted blocks shared by every RRQ of the same file (-C MB) */
+static BlockCache           g_cache;
+
+/* Shares the link between downloads (-R) */
+static Scheduler            g_sched;
+
+/* Threads that encrypt and decrypt for the sessions' own (-X) */
+static CryptoPool           g_crypto;
 
 static void handle_signal(int sig)
 {
-    (void)sig;
-    running = 0;
+    if (sig == SIGUSR1)
+        dump_sched = 1;
+    else
+        running = 0;
 }
 
 /* ================================================================== */
@@ -94,15 +214,14 @@ static void backup_file(const char *src_path, const char *filename)
 }
 
 /*
- * recover_file – Restore the *latest* backup of `filename` into the
- *                storage directory.  Returns 0 on success.
+ * latest_backup – Path of the newest backup of `filename` into
+ *                 `latest`.  Returns 0, or -1 if there is none.
  */
-static int recover_file(const char *filename)
+static int latest_backup(const char *filename, char *latest, size_t cap)
 {
     DIR *dir = opendir(BACKUP_DIR);
     if (!dir) return -1;
 
-    char latest[512] = {0};
     long latest_ts = 0;
 
     struct dirent *entry;
@@ -115,13 +234,23 @@ static int recover_file(const char *filename)
         long ts = atol(entry->d_name + flen + 1);
         if (ts > latest_ts) {
             latest_ts = ts;
-            snprintf(latest, sizeof(latest), "%s%s",
-                     BACKUP_DIR, entry->d_name);
+            snprintf(latest, cap, "%s%s", BACKUP_DIR, entry->d_name);
         }
     }
     closedir(dir);
 
-    if (latest_ts == 0) return -1;  /* no backup found */
+    return latest_ts == 0 ? -1 : 0;  /* no backup found */
+}
+
+/*
+ * recover_file – Restore the *latest* backup of `filename` into the
+ *                storage directory.  Returns 0 on success.
+ */
+static int recover_file(const char *filename)
+{
+    char latest[512];
+    if (latest_backup(filename, latest, sizeof(latest)) < 0)
+        return -1;
 
     char dest[512];
     build_filepath(dest, sizeof(dest), FILE_STORAGE_DIR, filename);
@@ -145,219 +274,1318 @@ static int recover_file(const char *filename)
 }
 
 /* ================================================================== */
-/*  RRQ handler – send a file to the client                            */
+/*  Option negotiation (RFC 2347)                                      */
 /* ================================================================== */
 
-static void handle_rrq(ClientContext *ctx)
+/*
+ * negotiate_options – Settle the transfer parameters from the options
+ *                     the client asked for and build the OACK in `oack`.
+ *                     `file_size` answers a RRQ's tsize query (ignored
+ *                     for WRQ, where the client's value is echoed).
+ *                     Returns the OACK length, or 0 when no option was
+ *                     accepted and the reply must be plain TFTP.
+ */
+static int negotiate_options(ClientContext *ctx, long long file_size,
+                             uint8_t *oack, size_t cap)
 {
-    char filepath[512];
-    build_filepath(filepath, sizeof(filepath),
-                   FILE_STORAGE_DIR, ctx->filename);
+    TransferOptions accepted;
+    options_init(&accepted);
 
-    FILE *fp = fopen(filepath, "rb");
+    ctx->window  = 1;
+    ctx->timeout = TIMEOUT_SEC;
 
-    /* If the file is missing, attempt recovery from backup */
-    if (!fp) {
-        print_timestamp();
-        printf("RRQ     %s not found – attempting recovery…\n",
-               ctx->filename);
-        if (recover_file(ctx->filename) == 0)
-            fp = fopen(filepath, "rb");
+    if (ctx->opts.blksize > 0) {
+        ctx->block_size = ctx->opts.blksize < MAX_BLOCK_SIZE
+                        ? ctx->opts.blksize : MAX_BLOCK_SIZE;
+        accepted.blksize = ctx->block_size;
+    }
+    if (ctx->opts.timeout > 0) {
+        ctx->timeout     = ctx->opts.timeout;
+        accepted.timeout = ctx->timeout;
+    }
+    if (ctx->opts.tsize >= 0) {
+        accepted.tsize = ctx->opcode == OP_RRQ ? file_size
+                                               : ctx->opts.tsize;
+    }
+    if (ctx->opts.windowsize > 0) {
+        ctx->window = ctx->opts.windowsize < MAX_WINDOW_SIZE
+                    ? ctx->opts.windowsize : MAX_WINDOW_SIZE;
+        accepted.windowsize = ctx->window;
+    }
+    if (ctx->opts.sack > 0 && !ctx->strict) {
+        ctx->sack     = 1;
+        accepted.sack = 1;
+    }
+    if (ctx->opts.exthdr > 0) {
+        ctx->fmt.ext    = 1;
+        accepted.exthdr = 1;
+    } else if (ctx->opts.rollover >= 0) {
+        ctx->fmt.rollover = ctx->opts.rollover;
+        accepted.rollover = ctx->fmt.rollover;
+    }
+    if (ctx->opts.range && ctx->opcode == OP_RRQ && !ctx->strict) {
+        long long off = ctx->opts.range_off < file_size
+                      ? ctx->opts.range_off : file_size;
+        long long len = file_size - off;
+        if (ctx->opts.range_len < len)
+            len = ctx->opts.range_len;
+        ctx->range          = 1;
+        ctx->range_off      = off;
+        ctx->range_len      = len;
+        accepted.range      = 1;
+        accepted.range_off  = off;
+        accepted.range_len  = len;
+    }
+    if (ctx->opts.resume >= 0 && !ctx->strict && !ctx->range) {
+        /* RRQ: the client's offset; WRQ: what handle_wrq's journal
+         * allows, already in ctx->resume */
+        if (ctx->opcode == OP_RRQ)
+            ctx->resume = ctx->opts.resume < file_size
+                        ? ctx->opts.resume : file_size;
+        accepted.resume = ctx->resume;
     }
 
-    if (!fp) {
-        send_error(ctx->sockfd, &ctx->client_addr,
-                   ERR_FILE_NOT_FOUND, "File not found");
-        print_timestamp();
-        printf("RRQ     %s – ERROR file not found\n", ctx->filename);
-        return;
+    if (ctx->opts.fec_k > 0 && !ctx->strict) {
+        ctx->fec_k = ctx->opts.fec_k < FEC_MAX_GROUP
+                   ? ctx->opts.fec_k : FEC_MAX_GROUP;
+        ctx->fec_m = ctx->opts.fec_m < FEC_MAX_PARITY
+                   ? ctx->opts.fec_m : FEC_MAX_PARITY;
+        if (ctx->fec_m > ctx->fec_k)
+            ctx->fec_m = ctx->fec_k;
+        accepted.fec_k = ctx->fec_k;
+        accepted.fec_m = ctx->fec_m;
+    }
+    if (ctx->delta > 0)     /* set by the handler once it has a basis */
+        accepted.delta = ctx->delta;
+    if (ctx->opts.compress > CODEC_NONE && !ctx->strict) {
+        ctx->codec        = ctx->opts.compress;
+        accepted.compress = ctx->codec;
+    }
+    if (ctx->opts.gcm && !ctx->strict) {
+        ctx->gcm     = 1;
+        accepted.gcm = 1;
+        memcpy(accepted.gcm_salt, ctx->opts.gcm_salt, GCM_SALT_LEN);
     }
 
-    print_timestamp();
-    printf("RRQ     sending %s (block %d bytes)\n",
-           ctx->filename, ctx->block_size);
+    uint16_t net_op = htons(OP_OACK);
+    memcpy(oack, &net_op, 2);
+    size_t len = options_encode(oack, 2, cap, &accepted);
+    return len > 2 ? (int)len : 0;
+}
 
-    uint8_t  raw_buf[ENHANCED_BLOCK_SIZE];
-    uint8_t  enc_buf[ENHANCED_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint8_t  pkt_buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint16_t block = 1;
-    int      bytes_read;
+/* ================================================================== */
+/*  Multicast sessions (RFC 2090)                                      */
+/* ================================================================== */
 
-    set_socket_timeout(ctx->sockfd, TIMEOUT_SEC, TIMEOUT_USEC);
+/* One file being streamed to a group.  members[0] is the master client;
+ * RRQs for the same file that arrive meanwhile join at the end.      */
+typedef struct McastSession {
+    struct McastSession *next;
+    char                 filename[MAX_FILENAME];
+    int                  sockfd;            /* Session TID                */
+    int                  fd;                /* File being streamed        */
+    struct sockaddr_in   group;
+    int                  block_size;        /* Every member must have     */
+    int                  window;            /*   negotiated the same      */
+    int                  timeout;           /*   parameters               */
+    int                  strict;
+    BlockFormat          fmt;
+    uint32_t             last;              /* Final block number         */
+    uint8_t              oack[MAX_REQUEST_SIZE];  /* minus "multicast"    */
+    int                  oack_len;
+    struct sockaddr_in   members[MCAST_MAX_CLIENTS];
+    int                  nmembers;
+} McastSession;
+
+static int                g_mcast;          /* -m given                   */
+static struct sockaddr_in g_mcast_group;    /* Group and its first port   */
+static unsigned           g_mcast_started;  /* Sessions so far (ports)    */
+static McastSession      *g_mcast_sessions;
+static pthread_mutex_t    g_mcast_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    while (1) {
-        bytes_read = (int)fread(raw_buf, 1, ctx->block_size, fp);
-        if (bytes_read < 0) break;
+/*
+ * mcast_send_oack – Send the session's OACK to `to`, naming it master
+ *                   client or not.
+ */
+static void mcast_send_oack(const McastSession *ms,
+                            const struct sockaddr_in *to, int master)
+{
+    uint8_t pkt[MAX_REQUEST_SIZE];
+    char    val[MAX_MCAST_OPTION];
+
+    memcpy(pkt, ms->oack, ms->oack_len);
+    mcast_format(val, sizeof(val), &ms->group, master);
+    size_t len = option_append_str(pkt, ms->oack_len, sizeof(pkt),
+                                   "multicast", val);
+    sendto(ms->sockfd, pkt, len, 0,
+           (const struct sockaddr *)to, sizeof(*to));
+}
 
-        /* Encrypt the block */
-        int enc_len = aes_encrypt(raw_buf, bytes_read, enc_buf);
-        if (enc_len < 0) {
-            send_error(ctx->sockfd, &ctx->client_addr,
-                       ERR_UNDEFINED, "Encryption failed");
-            break;
-        }
+/* Index of `addr` among the members, or -1.  Call with the lock held. */
+static int mcast_find_member(const McastSession *ms,
+                             const struct sockaddr_in *addr)
+{
+    for (int i = 0; i < ms->nmembers; i++)
+        if (same_peer(&ms->members[i], addr))
+            return i;
+    return -1;
+}
+
+/* Forget a member that has the whole file or has gone away */
+static void mcast_drop(McastSession *ms, const struct sockaddr_in *addr)
+{
+    pthread_mutex_lock(&g_mcast_lock);
+    int i = mcast_find_member(ms, addr);
+    if (i >= 0) {
+        memmove(&ms->members[i], &ms->members[i + 1],
+                (ms->nmembers - i - 1) * sizeof(ms->members[0]));
+        ms->nmembers--;
+    }
+    pthread_mutex_unlock(&g_mcast_lock);
+}
 
-        /* Build DATA packet: opcode(2) + block#(2) + encrypted data */
-        uint16_t net_op  = htons(OP_DATA);
-        uint16_t net_blk = htons(block);
-        memcpy(pkt_buf, &net_op, 2);
-        memcpy(pkt_buf + 2, &net_blk, 2);
-        memcpy(pkt_buf + 4, enc_buf, enc_len);
-        int pkt_len = 4 + enc_len;
+/* Unlink `ms` so no further RRQ joins it.  Call with the lock held. */
+static void mcast_unlink(McastSession *ms)
+{
+    McastSession **pp = &g_mcast_sessions;
+    while (*pp && *pp != ms)
+        pp = &(*pp)->next;
+    if (*pp)
+        *pp = ms->next;
+}
+
+/*
+ * mcast_next_master – Pick the member that has waited longest as the
+ *                     next master.  Returns 0 once everyone is served;
+ *                     the session is then closed to new members.
+ */
+static int mcast_next_master(McastSession *ms, struct sockaddr_in *master)
+{
+    pthread_mutex_lock(&g_mcast_lock);
+    int more = ms->nmembers > 0;
+    if (more)
+        *master = ms->members[0];
+    else
+        mcast_unlink(ms);
+    pthread_mutex_unlock(&g_mcast_lock);
+    return more;
+}
+
+/* End the session early and tell every member why */
+static void mcast_abort(McastSession *ms, const char *msg)
+{
+    pthread_mutex_lock(&g_mcast_lock);
+    mcast_unlink(ms);
+    for (int i = 0; i < ms->nmembers; i++)
+        send_error(ms->sockfd, &ms->members[i], ERR_UNDEFINED, msg);
+    ms->nmembers = 0;
+    pthread_mutex_unlock(&g_mcast_lock);
+}
+
+/* A packet from anyone but the master: only "I have it all" (an ACK of
+ * the final block) and ERROR matter.                                 */
+static void mcast_on_member_packet(McastSession *ms, const uint8_t *buf,
+                                   ssize_t n,
+                                   const struct sockaddr_in *from)
+{
+    uint16_t opcode = ntohs(*(const uint16_t *)buf);
 
-        /* Send with retransmission */
-        int retries = 0;
-        while (retries < MAX_RETRIES) {
-            sendto(ctx->sockfd, pkt_buf, pkt_len, 0,
-                   (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
+    if ((opcode == OP_ACK && n >= 2 + block_field_len(&ms->fmt) &&
+         mcast_block(&ms->fmt, buf + 2) >= ms->last) ||
+        opcode == OP_ERROR)
+        mcast_drop(ms, from);
+}
+
+/*
+ * mcast_handshake – Name `tx->peer` master and wait for its first ACK,
+ *                   which says how much of the file it already holds.
+ *                   Returns that block, or -1 if it never answers.  The
+ *                   wait is MAX_RETRIES backed-off RTOs, not the usual
+ *                   `timeout` floor: a client whose final ACK was lost
+ *                   has left, and every other member is waiting.
+ */
+static int64_t mcast_handshake(McastSession *ms, WindowSender *tx)
+{
+    uint8_t  buf[MAX_REQUEST_SIZE];
+    uint64_t wait = (uint64_t)tx->rtt.rto;
+
+    for (int retries = 0; retries < MAX_RETRIES; retries++, wait *= 2) {
+        uint64_t sent = now_usec();
+        mcast_send_oack(ms, &tx->peer, 1);
+
+        uint64_t until = sent + wait;
+        for (uint64_t now; (now = now_usec()) < until; ) {
+            if (!wait_readable(ms->sockfd, until - now))
+                continue;
 
-            /* Wait for ACK */
-            AckPacket ack;
             struct sockaddr_in from;
             socklen_t flen = sizeof(from);
-            ssize_t r = recvfrom(ctx->sockfd, &ack, sizeof(ack), 0,
+            ssize_t n = recvfrom(ms->sockfd, buf, sizeof(buf), MSG_DONTWAIT,
                                  (struct sockaddr *)&from, &flen);
-            if (r >= (ssize_t)sizeof(ack) &&
-                ntohs(ack.opcode) == OP_ACK &&
-                ntohs(ack.block_num) == block) {
-                break;  /* ACK received */
+            if (n < 4)
+                continue;
+            if (!same_peer(&from, &tx->peer)) {
+                mcast_on_member_packet(ms, buf, n, &from);
+                continue;
             }
 
-            retries++;
-            print_timestamp();
-            printf("RRQ     block %u – retry %d/%d\n",
-                   block, retries, MAX_RETRIES);
+            uint16_t opcode = ntohs(*(uint16_t *)buf);
+            if (opcode == OP_ACK && n >= 2 + block_field_len(&ms->fmt)) {
+                if (retries == 0)           /* Karn: unambiguous sample */
+                    rtt_sample(&tx->rtt, (int64_t)(now_usec() - sent));
+                return mcast_block(&ms->fmt, buf + 2);
+            }
+            if (opcode == OP_ERROR)
+                return -1;
         }
+    }
+    return -1;
+}
 
-        if (retries == MAX_RETRIES) {
-            print_timestamp();
-            printf("RRQ     %s – transfer timed out at block %u\n",
-                   ctx->filename, block);
-            break;
+/*
+ * mcast_stream – Send to the group, paced by the master's ACKs, until
+ *                the master has the whole file or stops answering.  A
+ *                master that ACKs beyond what we sent already had those
+ *                blocks, so the sender skips ahead.
+ */
+static void mcast_stream(McastSession *ms, WindowSender *tx)
+{
+    RxBatch rx;
+    if (rx_batch_init(&rx, MAX_REQUEST_SIZE) < 0) {
+        tx->status = XFER_FAILED;
+        tx->done   = 1;
+        return;
+    }
+
+    sender_pump(tx);
+    while (!tx->done) {
+        uint64_t now = now_usec();
+        if (tx->deadline && now >= tx->deadline) {
+            sender_on_timeout(tx);
+            sender_pump(tx);
+            continue;
+        }
+        if (!wait_readable(ms->sockfd, sender_wait(tx, now))) {
+            sender_pump(tx);
+            continue;
         }
 
-        /* Last block? (raw bytes < block_size means EOF) */
-        if (bytes_read < ctx->block_size)
-            break;
+        int got;
+        do {
+            got = rx_batch_fill(&rx, ms->sockfd);
+            for (int i = 0; i < got && !tx->done; i++) {
+                const uint8_t            *buf  = rx_batch_data(&rx, i);
+                int                       n    = rx_batch_len(&rx, i);
+                const struct sockaddr_in *from = rx_batch_from(&rx, i);
+                if (n < 4)
+                    continue;
+                if (!same_peer(from, &tx->peer)) {
+                    mcast_on_member_packet(ms, buf, n, from);
+                    continue;
+                }
+
+                uint16_t opcode = ntohs(*(uint16_t *)buf);
+                if (opcode == OP_ACK && n >= 2 + block_field_len(&tx->fmt)) {
+                    uint32_t block = mcast_block(&tx->fmt, buf + 2);
+                    if (block >= ms->last) {
+                        tx->status = XFER_OK;
+                        tx->done   = 1;
+                    } else if (block >= tx->next) {
+                        sender_restart(tx, block);
+                    } else {
+                        sender_on_ack(tx, block);
+                    }
+                } else if (opcode == OP_ERROR) {
+                    sender_on_packet(tx, buf, n, from);
+                }
+            }
+        } while (!rx_batch_drained(&rx) && !tx->done);
+        sender_pump(tx);
+    }
+    rx_batch_free(&rx);
+}
+
+/*
+ * mcast_serve – Run a session until every member has the file: each
+ *               master in turn drives the stream from the first block
+ *               it is missing.
+ */
+static void mcast_serve(McastSession *ms, int fd)
+{
+    FileStream   fs;
+    WindowSender tx;
+    if (file_stream_init(&fs, fd, ms->block_size, 0) < 0) {
+        mcast_abort(ms, "Out of memory");
+        return;
+    }
+    if (sender_init(&tx, ms->sockfd, &ms->members[0], sizeof(ms->group),
+                    ms->block_size, ms->window,
+                    file_stream_produce, &fs) < 0) {
+        mcast_abort(ms, "Out of memory");
+        file_stream_free(&fs);
+        return;
+    }
+    tx.dest     = ms->group;
+    tx.dest_len = sizeof(ms->group);
+    tx.fmt      = ms->fmt;
+    sender_set_timeout(&tx, ms->timeout);
+    sender_set_congestion(&tx, g_congestion, g_pacing, ms->strict);
+
+    struct sockaddr_in master;
+    unsigned           served = 0;
+    while (mcast_next_master(ms, &master)) {
+        tx.peer     = master;
+        tx.peer_len = sizeof(master);
+
+        int64_t have = mcast_handshake(ms, &tx);
+        if (have >= 0 && (uint32_t)have < ms->last) {
+            sender_restart(&tx, (uint32_t)have);
+            mcast_stream(ms, &tx);
+            if (tx.status == XFER_FAILED) {
+                mcast_abort(ms, fs.error ? fs.error : "Transfer failed");
+                break;
+            }
+        }
+
+        print_timestamp();
+        printf("MCAST   %s – master %s:%d %s\n", ms->filename,
+               inet_ntoa(master.sin_addr), ntohs(master.sin_port),
+               have >= 0 && tx.status == XFER_OK ? "complete" : "gone");
+        mcast_drop(ms, &master);
+        served++;
+    }
+
+    print_timestamp();
+    printf("MCAST   %s – session over (%u masters, %u blocks sent, "
+           "%u resent)\n", ms->filename, served, tx.blocks,
+           tx.retransmits);
+
+    sender_free(&tx);
+    file_stream_free(&fs);
+}
+
+/*
+ * mcast_thread – A session streams for as long as members keep joining,
+ *                so it runs on a thread of its own rather than on a
+ *                reactor worker.  It owns the file and the socket.
+ */
+static void *mcast_thread(void *arg)
+{
+    McastSession *ms = (McastSession *)arg;
+
+    mcast_serve(ms, ms->fd);
+    close(ms->fd);
+    close(ms->sockfd);
+    free(ms);
+    return NULL;
+}
 
-        block++;
+/*
+ * handle_mcast_rrq – Serve a RRQ carrying the "multicast" option: join
+ *                    the session already streaming this file, or start
+ *                    one on its own thread, which then takes `*fd` and
+ *                    the request's socket (both set to -1).  Returns -1
+ *                    (with `ctx` untouched) when multicast is declined
+ *                    and the RRQ should be served by unicast instead.
+ */
+static int handle_mcast_rrq(ClientContext *ctx, int *fd, long long file_size)
+{
+    TransferOptions requested = ctx->opts;
+    uint8_t         oack[MAX_REQUEST_SIZE];
+
+    if (!g_mcast || requested.tsize < 0)
+        return -1;
+
+    /* The master's ACKs stay cumulative; "multicast" is added per member */
+    ctx->opts.sack      = 0;
+    ctx->opts.multicast = 0;
+    ctx->opts.fec_k     = 0;
+    ctx->opts.compress  = CODEC_NONE;
+    ctx->opts.gcm       = 0;            /* one key for the whole group    */
+    int      oack_len = negotiate_options(ctx, file_size, oack, sizeof(oack));
+    uint32_t last     = mcast_blocks(file_size, ctx->block_size);
+
+    pthread_mutex_lock(&g_mcast_lock);
+
+    McastSession *ms = g_mcast_sessions;
+    while (ms && strcmp(ms->filename, ctx->filename) != 0)
+        ms = ms->next;
+
+    if (ms) {
+        int idx = mcast_find_member(ms, &ctx->client_addr);
+        int ok  = ms->block_size == ctx->block_size &&
+                  ms->window == ctx->window && ms->timeout == ctx->timeout &&
+                  ms->strict == ctx->strict && ms->fmt.ext == ctx->fmt.ext &&
+                  (idx >= 0 || ms->nmembers < MCAST_MAX_CLIENTS);
+        if (ok) {
+            if (idx < 0)
+                ms->members[idx = ms->nmembers++] = ctx->client_addr;
+            mcast_send_oack(ms, &ctx->client_addr, idx == 0);
+            print_timestamp();
+            printf("MCAST   %s – %s:%d joined (%d waiting)\n", ctx->filename,
+                   inet_ntoa(ctx->client_addr.sin_addr),
+                   ntohs(ctx->client_addr.sin_port), ms->nmembers);
+        }
+        pthread_mutex_unlock(&g_mcast_lock);
+        if (!ok)
+            ctx->opts = requested;
+        return ok ? 0 : -1;
     }
 
-    fclose(fp);
+    /* 16-bit block numbers must not wrap within a multicast session */
+    ms = (!ctx->fmt.ext && last > 65535) ? NULL : calloc(1, sizeof(*ms));
+    if (!ms) {
+        pthread_mutex_unlock(&g_mcast_lock);
+        ctx->opts = requested;
+        return -1;
+    }
+    snprintf(ms->filename, MAX_FILENAME, "%s", ctx->filename);
+    ms->sockfd     = ctx->sockfd;
+    ms->group      = g_mcast_group;
+    ms->group.sin_port = htons(ntohs(g_mcast_group.sin_port) +
+                               g_mcast_started++ % MCAST_MAX_SESSIONS);
+    ms->block_size = ctx->block_size;
+    ms->window     = ctx->window;
+    ms->timeout    = ctx->timeout;
+    ms->strict     = ctx->strict;
+    ms->fmt        = ctx->fmt;
+    ms->last       = last;
+    ms->oack_len   = oack_len;
+    memcpy(ms->oack, oack, oack_len);
+    ms->members[0] = ctx->client_addr;
+    ms->nmembers   = 1;
+    ms->next       = g_mcast_sessions;
+    g_mcast_sessions = ms;
+    pthread_mutex_unlock(&g_mcast_lock);
+
+    mcast_enable_send(ms->sockfd, mcast_local_addr(&ctx->client_addr));
+
+    char group[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &ms->group.sin_addr, group, sizeof(group));
     print_timestamp();
-    printf("RRQ     %s – transfer complete (%u blocks)\n",
-           ctx->filename, block);
+    printf("MCAST   streaming %s to %s:%u (%lld bytes, block %d, "
+           "window %d)\n", ctx->filename, group, ntohs(ms->group.sin_port),
+           file_size, ms->block_size, ms->window);
+
+    ms->fd      = *fd;
+    *fd         = -1;
+    ctx->sockfd = -1;
+
+    pthread_t      tid;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&tid, &attr, mcast_thread, ms) != 0) {
+        perror("pthread_create");
+        mcast_abort(ms, "Server busy");
+        close(ms->fd);
+        close(ms->sockfd);
+        free(ms);
+    }
+    pthread_attr_destroy(&attr);
+    return 0;
 }
 
 /* ================================================================== */
-/*  WRQ handler – receive a file from the client                       */
+/*  Sessions                                                           */
 /* ================================================================== */
 
-static void handle_wrq(ClientContext *ctx)
+/* Where a session's state machine stands */
+typedef enum {
+    SESSION_OACK,                       /* RRQ: OACK out, awaiting ACK 0  */
+    SESSION_SEND,                       /* RRQ: WindowSender running      */
+    SESSION_RECV,                       /* WRQ: WindowReceiver running    */
+    SESSION_FLUSH                       /* WRQ: last writes still on disk */
+} SessionPhase;
+
+/* Requests are read by one listening socket per worker, all bound to
+ * the server port with SO_REUSEPORT; a shard's sessions run on its own
+ * worker.                                                            */
+#define PENDING_BUCKETS     1024
+
+typedef struct Shard {
+    ReactorTask        task;            /* The shard's listening socket   */
+    int                index;
+    RxBatch            rx;              /* Requests taken per recvmmsg()  */
+    struct Session    *pending[PENDING_BUCKETS];  /* See pending_find()   */
+} Shard;
+
+/* One request from its first packet to its last.  What a handler thread
+ * used to keep on its stack lives here, and a reactor worker moves it
+ * on one event at a time.                                            */
+typedef struct Session {
+    ReactorTask        task;            /* First: handlers cast it back   */
+    Shard             *shard;           /* Where the request came in      */
+    struct Session    *pending_next;    /* Unanswered-request table       */
+    int                pending;         /* Listed there                   */
+    uint64_t           request_hash;    /* Of the request datagram        */
+    ClientContext      ctx;
+    SessionPhase       phase;
+    char               filepath[512];
+    int                fd;              /* File, signature or rebuild     */
+    long long          file_size;
+    uint8_t            oack[MAX_REQUEST_SIZE];
+    int                oack_len;
+    int                oack_retries;    /* RRQ: OACK resends so far       */
+    uint64_t           oack_sent;
+    FileStream         fs;
+    UringFile          uf;              /* Its io_uring side, if any      */
+    CacheFile          cf;              /* RRQ: its block cache side      */
+    SchedFlow          flow;            /* RRQ: its share of the link     */
+    CryptoStream       cs;              /* Its blocks on the crypto pool  */
+    union {
+        WindowSender   tx;              /* RRQ                            */
+        WindowReceiver rx;              /* WRQ                            */
+    };
+    union {
+        FecEncoder     fec_tx;
+        FecDecoder     fec_rx;
+    };
+    Checkpoint         ck;              /* WRQ journal                    */
+    DeltaApplier       da;              /* WRQ delta rebuild              */
+    int                basis;           /* Delta basis, -1 = none         */
+    char               rebuild[520];    /* "<file>.delta"                 */
+} Session;
+
+/*
+ * Requests whose client has not yet spoken on the new TID.  A client
+ * that hears nothing sends the same request again; while the first copy
+ * is listed here the shard drops the repeat instead of opening a second
+ * session and socket for it.  The repeat has the same source address,
+ * so SO_REUSEPORT delivers it to the same shard and the table needs no
+ * lock.
+ */
+static unsigned pending_bucket(const struct sockaddr_in *addr)
 {
-    ensure_directory(FILE_STORAGE_DIR);
+    return (ntohl(addr->sin_addr.s_addr) * 31u + ntohs(addr->sin_port)) %
+           PENDING_BUCKETS;
+}
 
-    char filepath[512];
-    build_filepath(filepath, sizeof(filepath),
-                   FILE_STORAGE_DIR, ctx->filename);
+/* FNV-1a of a request datagram */
+static uint64_t request_hash(const uint8_t *buf, ssize_t len)
+{
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (ssize_t i = 0; i < len; i++)
+        h = (h ^ buf[i]) * 0x100000001b3ull;
+    return h;
+}
 
-    FILE *fp = fopen(filepath, "wb");
-    if (!fp) {
-        send_error(ctx->sockfd, &ctx->client_addr,
-                   ERR_ACCESS_DENIED, "Cannot create file");
+/* True if `addr` already has this exact request waiting for an answer */
+static int pending_find(const Shard *sh, const struct sockaddr_in *addr,
+                        uint64_t hash)
+{
+    for (const Session *s = sh->pending[pending_bucket(addr)]; s;
+         s = s->pending_next)
+        if (s->request_hash == hash && same_peer(&s->ctx.client_addr, addr))
+            return 1;
+    return 0;
+}
+
+static void pending_add(Session *s)
+{
+    Session **head = &s->shard->pending[pending_bucket(&s->ctx.client_addr)];
+    s->pending_next = *head;
+    *head           = s;
+    s->pending      = 1;
+}
+
+/* The client has answered (or the session is over): a repeat of the
+ * request from now on is a new request.                              */
+static void pending_drop(Session *s)
+{
+    if (!s->pending)
         return;
+    Session **pp = &s->shard->pending[pending_bucket(&s->ctx.client_addr)];
+    while (*pp && *pp != s)
+        pp = &(*pp)->pending_next;
+    if (*pp)
+        *pp = s->pending_next;
+    s->pending = 0;
+}
+
+/* Release everything a session holds; each part may never have been
+ * set up, which the *_free calls accept.                             */
+static void session_free(Session *s)
+{
+    if (s->ctx.opcode == OP_RRQ) {
+        sender_free(&s->tx);
+        fec_encoder_free(&s->fec_tx);
+    } else {
+        receiver_free(&s->rx);
+        fec_decoder_free(&s->fec_rx);
     }
+    delta_applier_free(&s->da);
+    sched_detach(&s->flow);
+    cache_file_close(&s->cf);
+    uring_file_close(&s->uf);
+    crypto_stream_close(&s->cs);
+    file_stream_free(&s->fs);
+    checkpoint_free(&s->ck);
+    if (s->fd >= 0)
+        close(s->fd);
+    if (s->basis >= 0)
+        close(s->basis);
+    if (s->ctx.sockfd >= 0)
+        close(s->ctx.sockfd);
+    if (pool_put(&g_sessions, s)) {
+        print_timestamp();
+        printf("BUSY    over – %u sessions, accepting requests again "
+               "(%u refused so far)\n", pool_used(&g_sessions),
+               __atomic_load_n(&g_sessions.refused, __ATOMIC_RELAXED));
+    }
+}
 
-    /* Send initial ACK (block 0) to tell the client we're ready */
-    AckPacket ack0;
-    ack0.opcode    = htons(OP_ACK);
-    ack0.block_num = htons(0);
-    sendto(ctx->sockfd, &ack0, sizeof(ack0), 0,
-           (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
+/* ================================================================== */
+/*  RRQ handler – send a file to the client                            */
+/* ================================================================== */
+
+/*
+ * rrq_finish – Log how the download ended.
+ */
+static void rrq_finish(Session *s)
+{
+    ClientContext *ctx = &s->ctx;
+    WindowSender  *tx  = &s->tx;
 
     print_timestamp();
-    printf("WRQ     receiving %s\n", ctx->filename);
-
-    uint8_t  recv_buf[MAX_PACKET_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint8_t  dec_buf[ENHANCED_BLOCK_SIZE + EVP_MAX_BLOCK_LENGTH];
-    uint16_t expected_block = 1;
-
-    /* MD5 running context */
-    EVP_MD_CTX *md5_ctx = EVP_MD_CTX_new();
-    EVP_DigestInit_ex(md5_ctx, EVP_md5(), NULL);
-
-    set_socket_timeout(ctx->sockfd, TIMEOUT_SEC, TIMEOUT_USEC);
-
-    while (1) {
-        struct sockaddr_in from;
-        socklen_t flen = sizeof(from);
-        ssize_t n = recvfrom(ctx->sockfd, recv_buf, sizeof(recv_buf), 0,
-                             (struct sockaddr *)&from, &flen);
-        if (n < 4) {
-            /* Timeout or tiny packet – could be a lost ACK scenario;
-               the client will retransmit.                              */
-            continue;
+    switch (tx->status) {
+    case XFER_OK:
+        printf("RRQ     %s – transfer complete (%u blocks, %u resent, "
+               "srtt %.2f ms)\n", ctx->filename, tx->blocks,
+               tx->retransmits, tx->rtt.srtt / 1000.0);
+        if (tx->fec) {
+            print_timestamp();
+            printf("RRQ     %s – FEC %d+%d: %u parity blocks sent\n",
+                   ctx->filename, ctx->fec_k, ctx->fec_m,
+                   s->fec_tx.parities);
+        }
+        if (s->fs.codec) {
+            print_timestamp();
+            printf("RRQ     %s – %s: %llu bytes sent as %llu, %u blocks "
+                   "stored\n", ctx->filename, CODEC_NAMES[s->fs.codec],
+                   (unsigned long long)s->fs.zplain,
+                   (unsigned long long)s->fs.zcoded, s->fs.zstored);
+        }
+        if (tx->segmented) {
+            print_timestamp();
+            printf("RRQ     %s – GSO: %u blocks sent in offloaded runs\n",
+                   ctx->filename, tx->segmented);
+        }
+        if (tx->refused) {
+            print_timestamp();
+            printf("RRQ     %s – %u packets refused by a full socket "
+                   "buffer\n", ctx->filename, tx->refused);
+        }
+        if (s->uf.reads_async) {
+            print_timestamp();
+            printf("RRQ     %s – io_uring: %u blocks read ahead\n",
+                   ctx->filename, s->uf.reads_async);
+        }
+        if (s->cs.chunks) {
+            print_timestamp();
+            printf("RRQ     %s – crypto: %u chunks, %u sealed inline\n",
+                   ctx->filename, s->cs.chunks, s->cs.helped);
+        }
+        if (s->cf.cache) {
+            print_timestamp();
+            printf("RRQ     %s – cache: %u blocks hit (%u after waiting "
+                   "for another's read), %u read\n", ctx->filename,
+                   s->cf.hits, s->cf.joined, s->cf.misses);
+        }
+        if (s->flow.sched) {
+            print_timestamp();
+            printf("RRQ     %s – sched: %s lane, held %u times, %u leases "
+                   "borrowed\n", ctx->filename,
+                   s->flow.fast ? "fast" : "bulk", s->flow.holds,
+                   s->flow.borrowed);
+        }
+        if (tx->slot_zc) {
+            print_timestamp();
+            printf("RRQ     %s – zero-copy: %u sends, %u copied%s\n",
+                   ctx->filename, tx->zc.done, tx->zc.copied,
+                   tx->zerocopy ? "" : " (fell back to copying)");
         }
+        break;
+    case XFER_TIMEOUT:
+        printf("RRQ     %s – transfer timed out at block %u\n",
+               ctx->filename, tx->base);
+        break;
+    case XFER_ABORTED:
+        printf("RRQ     %s – aborted by client: %s\n",
+               ctx->filename, tx->peer_error);
+        break;
+    default:
+        send_error(ctx->sockfd, &ctx->client_addr, ERR_UNDEFINED,
+                   s->fs.error ? s->fs.error : "Transfer failed");
+        printf("RRQ     %s – %s at block %u\n", ctx->filename,
+               s->fs.error ? s->fs.error : "transfer failed", tx->next);
+        break;
+    }
+}
+
+/*
+ * rrq_step – Run the sender on what has arrived or what is due; returns
+ *            1 once the download is over.  A block another session is
+ *            caching, or one the crypto pool is still sealing, is looked
+ *            for again shortly.
+ */
+static int rrq_step(Session *s)
+{
+    uint64_t next = sender_poll(&s->tx, &s->task.worker->rx);
+    if (s->cf.waiting && next > now_usec() + CACHE_RETRY_USEC)
+        next = now_usec() + CACHE_RETRY_USEC;
+    if (s->cs.waiting && next > now_usec() + CRYPTO_POLL_USEC)
+        next = now_usec() + CRYPTO_POLL_USEC;
+    if (!s->tx.done) {
+        reactor_set_timer(&s->task, next);
+        return 0;
+    }
+    rrq_finish(s);
+    return 1;
+}
 
-        uint16_t opcode   = ntohs(*(uint16_t *)recv_buf);
-        uint16_t block_no = ntohs(*(uint16_t *)(recv_buf + 2));
+/*
+ * rrq_send – Options are settled: set up the sender and start the first
+ *            window.  `rtt` is the OACK round trip, 0 if unknown.
+ */
+static int rrq_send(Session *s, int64_t rtt)
+{
+    ClientContext *ctx = &s->ctx;
 
-        if (opcode != OP_DATA) {
+    print_timestamp();
+    if (ctx->range)
+        printf("RRQ     sending %s bytes %lld-%lld of %lld (block %d, "
+               "window %d%s%s)\n", ctx->filename, ctx->range_off,
+               ctx->range_off + ctx->range_len, s->file_size,
+               ctx->block_size, ctx->window, ctx->sack ? ", SACK" : "",
+               ctx->fmt.ext ? ", 32-bit blocks" : "");
+    else if (ctx->resume > 0)
+        printf("RRQ     resuming %s at byte %lld of %lld (block %d, "
+               "window %d%s%s)\n", ctx->filename, ctx->resume,
+               s->file_size, ctx->block_size, ctx->window,
+               ctx->sack ? ", SACK" : "",
+               ctx->fmt.ext ? ", 32-bit blocks" : "");
+    else
+        printf("RRQ     sending %s (%lld bytes, block %d, window %d%s%s)\n",
+               ctx->filename, s->file_size, ctx->block_size, ctx->window,
+               ctx->sack ? ", SACK" : "",
+               ctx->fmt.ext ? ", 32-bit blocks" : "");
+
+    if (file_stream_init(&s->fs, s->fd, ctx->block_size, 0) < 0 ||
+        file_stream_set_codec(&s->fs, ctx->codec, 1) < 0 ||
+        (ctx->gcm && file_stream_set_gcm(&s->fs, ctx->opts.gcm_salt) < 0) ||
+        sender_init(&s->tx, ctx->sockfd, &ctx->client_addr, ctx->addr_len,
+                    ctx->block_size, ctx->window,
+                    file_stream_produce, &s->fs) < 0 ||
+        (ctx->fec_k > 0 && fec_encoder_init(&s->fec_tx, ctx->fec_k,
+                                            ctx->fec_m,
+                                            ctx->block_size) < 0)) {
+        send_error(ctx->sockfd, &ctx->client_addr,
+                   ERR_UNDEFINED, "Out of memory");
+        return 1;
+    }
+    if (ctx->range)
+        file_stream_set_range(&s->fs, ctx->range_off, ctx->range_len);
+    else if (ctx->resume > 0)
+        file_stream_skip(&s->fs, ctx->resume);
+    if (g_zerocopy)
+        file_stream_map(&s->fs);        /* falls back to reading if not */
+    if (!s->fs.map &&
+        uring_file_open(&s->uf, s->task.worker->uring, &s->task,
+                        &s->fs, NULL) == 0) {
+        s->tx.produce = uring_produce;
+        s->tx.arg     = &s->uf;
+    }
+    if (!ctx->delta && cache_file_open(&s->cf, &g_cache, &s->fs,
+                                       s->tx.produce, s->tx.arg) == 0) {
+        s->tx.produce = cache_produce;
+        s->tx.arg     = &s->cf;
+    }
+    if (s->tx.produce == file_stream_produce && !s->fs.map &&
+        crypto_stream_open(&s->cs, &g_crypto, &s->fs, NULL, 1,
+                           ctx->window) == 0) {
+        s->cs.nowait  = 1;      /* never wait on a reactor worker      */
+        s->tx.produce = crypto_produce;
+        s->tx.arg     = &s->cs;
+    }
+
+    WindowSender *tx = &s->tx;
+    sender_set_timeout(tx, ctx->timeout);
+    if (rtt > 0)
+        rtt_sample(&tx->rtt, rtt);
+    sender_set_congestion(tx, g_congestion, g_pacing, ctx->strict);
+    if (g_offload)
+        sender_enable_gso(tx);
+    if (s->fs.map && ctx->window >= ZEROCOPY_MIN_WINDOW)
+        sender_enable_zerocopy(tx);
+    tx->sack = ctx->sack;
+    tx->fmt  = ctx->fmt;
+    if (ctx->fec_k > 0)
+        tx->fec = &s->fec_tx;
+
+    /* What is left to send decides the lane */
+    long long bytes = ctx->range      ? ctx->range_len
+                    : ctx->resume > 0 ? s->file_size - ctx->resume
+                                      : s->file_size;
+    if (sched_attach(&g_sched, &s->flow, ctx->client_addr.sin_addr, bytes,
+                     1) == 0)
+        tx->gate = &s->flow.gate;
+
+    s->phase = SESSION_SEND;
+    return rrq_step(s);
+}
+
+/*
+ * rrq_await – Wait for the ACK 0 that accepts our OACK, resending the
+ *             OACK on timeout.  DATA starts as soon as it arrives.
+ */
+static int rrq_await(Session *s, int events)
+{
+    ClientContext *ctx = &s->ctx;
+    RxBatch       *rx  = &s->task.worker->rx;
+
+    if (events & REACTOR_READ) {
+        int n;
+        do {
+            n = rx_batch_fill(rx, ctx->sockfd);
+            for (int i = 0; i < n; i++) {
+                const uint8_t *buf = rx_batch_data(rx, i);
+                if (rx_batch_len(rx, i) < 4 ||
+                    !same_peer(rx_batch_from(rx, i), &ctx->client_addr))
+                    continue;
+
+                /* rrq_send refills the worker's batch; the client sends
+                 * nothing after ACK 0 that this loop would still need */
+                uint16_t opcode = ntohs(*(uint16_t *)buf);
+                if (opcode == OP_ACK && ntohs(*(uint16_t *)(buf + 2)) == 0)
+                    return rrq_send(s, s->oack_retries == 0
+                                       ? (int64_t)(now_usec() - s->oack_sent)
+                                       : 0);
+                if (opcode == OP_ERROR) {
+                    n = -1;     /* client refused our options */
+                    break;
+                }
+            }
+        } while (n >= 0 && !rx_batch_drained(rx));
+        if (n >= 0)
+            return 0;
+    } else if (++s->oack_retries < MAX_RETRIES) {
+        s->oack_sent = now_usec();
+        sendto(ctx->sockfd, s->oack, s->oack_len, 0,
+               (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
+        reactor_set_timer(&s->task,
+                          s->oack_sent + (uint64_t)ctx->timeout * 1000000);
+        return 0;
+    }
+
+    print_timestamp();
+    printf("RRQ     %s – client did not accept options\n", ctx->filename);
+    return 1;
+}
+
+/*
+ * rrq_start – Open the file (or build its signature) and negotiate.
+ *             Sends the OACK, or without options the first window.
+ */
+static int rrq_start(Session *s)
+{
+    ClientContext *ctx = &s->ctx;
+    build_filepath(s->filepath, sizeof(s->filepath),
+                   FILE_STORAGE_DIR, ctx->filename);
+
+    s->fd = open(s->filepath, O_RDONLY);
+
+    /* If the file is missing, attempt recovery from backup */
+    if (s->fd < 0) {
+        print_timestamp();
+        printf("RRQ     %s not found – attempting recovery…\n",
+               ctx->filename);
+        if (recover_file(ctx->filename) == 0)
+            s->fd = open(s->filepath, O_RDONLY);
+    }
+
+    if (s->fd < 0) {
+        send_error(ctx->sockfd, &ctx->client_addr,
+                   ERR_FILE_NOT_FOUND, "File not found");
+        print_timestamp();
+        printf("RRQ     %s – ERROR file not found\n", ctx->filename);
+        return 1;
+    }
+
+    /* A delta client wants the file's signature, not the file */
+    if (ctx->opts.delta >= DELTA_MIN_BLOCK &&
+        ctx->opts.delta <= DELTA_MAX_BLOCK && !ctx->strict) {
+        int sig = delta_signature(s->fd, ctx->opts.delta);
+        close(s->fd);
+        s->fd = sig;
+        if (sig < 0) {
             send_error(ctx->sockfd, &ctx->client_addr,
-                       ERR_ILLEGAL_OP, "Expected DATA packet");
-            break;
+                       ERR_UNDEFINED, "Cannot build signature");
+            return 1;
         }
+        ctx->delta          = ctx->opts.delta;
+        ctx->opts.multicast = 0;
+        ctx->opts.range     = 0;
+        ctx->opts.resume    = -1;
+        print_timestamp();
+        printf("RRQ     %s – delta signature, block %d\n",
+               ctx->filename, ctx->delta);
+    }
 
-        if (block_no == expected_block) {
-            int enc_len = (int)(n - 4);
-            int dec_len = aes_decrypt(recv_buf + 4, enc_len, dec_buf);
-            if (dec_len < 0) {
-                send_error(ctx->sockfd, &ctx->client_addr,
-                           ERR_UNDEFINED, "Decryption failed");
-                break;
-            }
-            fwrite(dec_buf, 1, dec_len, fp);
-            EVP_DigestUpdate(md5_ctx, dec_buf, dec_len);
-
-            /* Send ACK */
-            AckPacket ack;
-            ack.opcode    = htons(OP_ACK);
-            ack.block_num = htons(expected_block);
-            sendto(ctx->sockfd, &ack, sizeof(ack), 0,
-                   (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
-
-            /* Last block? */
-            if (dec_len < ctx->block_size) {
-                /* Compute final MD5 */
-                unsigned char digest[MD5_DIGEST_LENGTH];
-                EVP_DigestFinal_ex(md5_ctx, digest, NULL);
-                char hex[33];
-                for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
-                    sprintf(hex + i * 2, "%02x", digest[i]);
-                hex[32] = '\0';
-
-                print_timestamp();
-                printf("WRQ     %s – complete, MD5: %s\n",
-                       ctx->filename, hex);
-                break;
-            }
+    struct stat st;
+    s->file_size = fstat(s->fd, &st) == 0 ? st.st_size : 0;
+
+    if (ctx->opts.multicast && !ctx->opts.range && ctx->opts.resume < 0 &&
+        handle_mcast_rrq(ctx, &s->fd, s->file_size) == 0)
+        return 1;
+
+    /* A GCM download the cache can serve takes the file's salt in place
+       of the client's, so downloads from the same first byte share one
+       key and their blocks (negotiate_options clamps the start alike) */
+    if (ctx->opts.gcm && !ctx->delta && ctx->opts.compress == CODEC_NONE) {
+        long long base = ctx->opts.range        ? ctx->opts.range_off
+                       : ctx->opts.resume >= 0  ? ctx->opts.resume : 0;
+        if (base > s->file_size)
+            base = s->file_size;
+        block_cache_salt(&g_cache, s->fd, (uint64_t)base,
+                         ctx->opts.gcm_salt);
+    }
+
+    s->oack_len = negotiate_options(ctx, s->file_size,
+                                    s->oack, sizeof(s->oack));
+    if (s->oack_len == 0)
+        return rrq_send(s, 0);
 
-            expected_block++;
-        } else if (block_no < expected_block) {
-            /* Duplicate – re-ACK */
-            AckPacket ack;
-            ack.opcode    = htons(OP_ACK);
-            ack.block_num = htons(block_no);
-            sendto(ctx->sockfd, &ack, sizeof(ack), 0,
-                   (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
+    s->phase     = SESSION_OACK;
+    s->oack_sent = now_usec();
+    sendto(ctx->sockfd, s->oack, s->oack_len, 0,
+           (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
+    reactor_set_timer(&s->task,
+                      s->oack_sent + (uint64_t)ctx->timeout * 1000000);
+    return 0;
+}
+
+/* ================================================================== */
+/*  WRQ handler – receive a file from the client                       */
+/* ================================================================== */
+
+/*
+ * wrq_finish – Log how the upload ended, then keep the file: install a
+ *              delta rebuild over the old copy and back it up.
+ */
+static void wrq_finish(Session *s)
+{
+    ClientContext  *ctx    = &s->ctx;
+    WindowReceiver *rx     = &s->rx;
+    int             status = rx->status;
+
+    print_timestamp();
+    switch (status) {
+    case XFER_OK: {
+        char hex[33];
+        file_stream_md5(&s->fs, hex);
+        printf("WRQ     %s – complete, MD5: %s\n", ctx->filename, hex);
+        if (s->basis >= 0) {
+            print_timestamp();
+            printf("WRQ     %s – delta: %llu bytes copied, %llu literal\n",
+                   ctx->filename, (unsigned long long)s->da.copied,
+                   (unsigned long long)s->da.literal);
+        }
+        if (rx->fec) {
+            print_timestamp();
+            printf("WRQ     %s – FEC %d+%d rebuilt %u blocks\n",
+                   ctx->filename, ctx->fec_k, ctx->fec_m,
+                   s->fec_rx.repaired);
         }
+        if (s->fs.codec) {
+            print_timestamp();
+            printf("WRQ     %s – %s: %llu bytes received as %llu, %u "
+                   "blocks stored\n", ctx->filename,
+                   CODEC_NAMES[s->fs.codec],
+                   (unsigned long long)s->fs.zplain,
+                   (unsigned long long)s->fs.zcoded, s->fs.zstored);
+        }
+        if (rx->coalesced) {
+            print_timestamp();
+            printf("WRQ     %s – GRO: %u blocks arrived coalesced\n",
+                   ctx->filename, rx->coalesced);
+        }
+        if (s->uf.writes_async) {
+            print_timestamp();
+            printf("WRQ     %s – io_uring: %u chunks written\n",
+                   ctx->filename, s->uf.writes_async);
+        }
+        if (s->cs.chunks) {
+            print_timestamp();
+            printf("WRQ     %s – crypto: %u chunks opened by the pool\n",
+                   ctx->filename, s->cs.chunks);
+        }
+        if (rx->rejected) {
+            print_timestamp();
+            printf("WRQ     %s – %u blocks failed authentication and "
+                   "were sent again\n", ctx->filename, rx->rejected);
+        }
+        break;
+    }
+    case XFER_TIMEOUT:
+        printf("WRQ     %s – transfer timed out at block %u\n",
+               ctx->filename, rx->expected);
+        break;
+    case XFER_ABORTED:
+        printf("WRQ     %s – aborted by client: %s\n",
+               ctx->filename, rx->peer_error);
+        break;
+    default:
+        if (s->fs.error)
+            send_error(ctx->sockfd, &ctx->client_addr,
+                       s->fs.error_code, s->fs.error);
+        printf("WRQ     %s – %s at block %u\n", ctx->filename,
+               s->fs.error ? s->fs.error : "transfer failed", rx->expected);
+        break;
     }
 
-    EVP_MD_CTX_free(md5_ctx);
-    fclose(fp);
+    crypto_stream_close(&s->cs);        /* a failed upload drops the rest */
+    checkpoint_finish(&s->ck, status == XFER_OK);
+    if (status != XFER_OK && s->ck.offset > 0) {
+        print_timestamp();
+        printf("WRQ     %s – checkpoint at byte %llu\n", ctx->filename,
+               (unsigned long long)s->ck.offset);
+    }
+
+    close(s->fd);
+    s->fd = -1;
+    if (s->basis >= 0) {
+        close(s->basis);
+        s->basis = -1;
+        if (status == XFER_OK && rename(s->rebuild, s->filepath) < 0) {
+            perror("wrq_finish: rename");
+            status = XFER_FAILED;
+        }
+        if (status != XFER_OK)
+            unlink(s->rebuild);
+    }
+    block_cache_forget(&g_cache, s->filepath);
 
     /* Back up the received file */
-    backup_file(filepath, ctx->filename);
+    if (status == XFER_OK)
+        backup_file(s->filepath, ctx->filename);
+}
+
+/*
+ * wrq_flush – The client is done, the disk may not be: wait for the
+ *             ring to write everything (each completion kicks the
+ *             session), then finish.  A write that failed after the
+ *             last ACK still fails the upload and is reported with an
+ *             ERROR packet.
+ */
+static int wrq_flush(Session *s)
+{
+    if (uring_file_busy(&s->uf)) {
+        receiver_drain(&s->rx, &s->task.worker->rx);    /* discarded */
+        return 0;
+    }
+    if (s->uf.error && s->rx.status == XFER_OK) {
+        file_stream_write_failed(&s->fs, s->uf.error);
+        s->rx.status = XFER_FAILED;
+    }
+    if (s->uf.error)
+        s->ck.written = s->ck.offset;   /* the tail may not be on disk */
+    wrq_finish(s);
+    return 1;
+}
+
+/*
+ * wrq_step – Run the receiver on what has arrived or what is due;
+ *            returns 1 once the upload is over.
+ */
+static int wrq_step(Session *s)
+{
+    uint64_t next = receiver_poll(&s->rx, &s->task.worker->rx);
+    if (!s->rx.done) {
+        reactor_set_timer(&s->task, next);
+        return 0;
+    }
+    if (uring_file_flush(&s->uf)) {
+        s->phase = SESSION_FLUSH;
+        reactor_set_timer(&s->task, 0);
+        return 0;
+    }
+    return wrq_flush(s);
+}
+
+/*
+ * wrq_start – Open the target (or its delta rebuild), check that it can
+ *             fit, and answer with OACK or ACK 0.
+ */
+static int wrq_start(Session *s)
+{
+    ClientContext *ctx = &s->ctx;
+
+    ensure_directory(FILE_STORAGE_DIR);
+    build_filepath(s->filepath, sizeof(s->filepath),
+                   FILE_STORAGE_DIR, ctx->filename);
+
+    /* A delta upload is rebuilt beside the basis – the stored file, or
+       else its latest backup – and replaces the file once verified    */
+    if (ctx->opts.delta >= DELTA_MIN_BLOCK &&
+        ctx->opts.delta <= DELTA_MAX_BLOCK && !ctx->strict) {
+        char latest[512];
+        s->basis = open(s->filepath, O_RDONLY);
+        if (s->basis < 0 &&
+            latest_backup(ctx->filename, latest, sizeof(latest)) == 0)
+            s->basis = open(latest, O_RDONLY);
+    }
+    if (s->basis >= 0) {
+        snprintf(s->rebuild, sizeof(s->rebuild), "%s.delta", s->filepath);
+        ctx->delta       = ctx->opts.delta;
+        ctx->opts.resume = -1;
+    }
+
+    /* Downloads of the file being replaced must not be served from
+       the cache once it changes                                      */
+    block_cache_forget(&g_cache, s->filepath);
+
+    int existed = s->basis >= 0 || access(s->filepath, F_OK) == 0;
+    s->fd = open(s->basis >= 0 ? s->rebuild : s->filepath,
+                 O_RDWR | O_CREAT, 0644);
+    if (s->fd < 0) {
+        send_error(ctx->sockfd, &ctx->client_addr,
+                   ERR_ACCESS_DENIED, "Cannot create file");
+        return 1;
+    }
+
+    /* The journal of an interrupted upload of the same size lets the
+       client resume; otherwise the file starts afresh                 */
+    checkpoint_init(&s->ck, s->filepath, s->fd, ctx->opts.tsize);
+    if (ctx->opts.resume >= 0 && ctx->opts.tsize >= 0 && !ctx->strict)
+        ctx->resume = (long long)checkpoint_load(&s->ck);
+
+    /* With tsize the size is known up front: refuse an upload that
+       cannot fit before the old file is touched, then reserve its
+       space in one piece (a delta's tsize is not the file's size)     */
+    long long size = s->basis >= 0 ? -1 : ctx->opts.tsize;
+    if (disk_room(s->fd, size) < 0) {
+        send_error(ctx->sockfd, &ctx->client_addr, ERR_DISK_FULL,
+                   "Disk full");
+        print_timestamp();
+        printf("WRQ     %s – ERROR disk full (%lld bytes)\n",
+               ctx->filename, size);
+        if (!existed)
+            unlink(s->filepath);
+        return 1;
+    }
+    /* The old contents go only once the space is reserved; truncating
+       also frees what was reserved past the end, so reserve again     */
+    int full = preallocate(s->fd, size) < 0;
+    if (!full && ctx->resume == 0) {
+        unlink(s->ck.path);
+        if (ftruncate(s->fd, 0) < 0) {
+            send_error(ctx->sockfd, &ctx->client_addr,
+                       ERR_ACCESS_DENIED, "Cannot truncate file");
+            if (!existed)
+                unlink(s->filepath);
+            return 1;
+        }
+        full = preallocate(s->fd, size) < 0;
+    }
+    if (full) {
+        send_error(ctx->sockfd, &ctx->client_addr, ERR_DISK_FULL,
+                   "Disk full");
+        print_timestamp();
+        printf("WRQ     %s – ERROR disk full (%lld bytes)\n",
+               ctx->filename, size);
+        if (!existed)
+            unlink(s->filepath);
+        return 1;
+    }
+
+    /* Reply with OACK, or ACK block 0 if no options were accepted,
+       to tell the client we're ready                                  */
+    s->oack_len = negotiate_options(ctx, -1, s->oack, sizeof(s->oack));
+
+    if (file_stream_init(&s->fs, s->fd, ctx->block_size, 1) < 0 ||
+        file_stream_set_codec(&s->fs, ctx->codec, 0) < 0 ||
+        (ctx->gcm && file_stream_set_gcm(&s->fs, ctx->opts.gcm_salt) < 0)) {
+        send_error(ctx->sockfd, &ctx->client_addr,
+                   ERR_UNDEFINED, "Out of memory");
+        return 1;
+    }
+    if (s->basis >= 0 &&
+        delta_applier_init(&s->da, &s->fs, s->basis, ctx->delta) < 0) {
+        send_error(ctx->sockfd, &ctx->client_addr,
+                   ERR_UNDEFINED, "Cannot read basis");
+        unlink(s->rebuild);
+        return 1;
+    }
+    checkpoint_attach(&s->ck, &s->fs, ctx->resume);
+
+    WindowReceiver *rx = &s->rx;
+    if (s->basis >= 0)
+        receiver_init(rx, ctx->sockfd, &ctx->client_addr, ctx->addr_len,
+                      ctx->block_size, ctx->window, delta_consume, &s->da);
+    else if (crypto_stream_open(&s->cs, &g_crypto, &s->fs, &s->ck, 0,
+                                ctx->window) == 0) {
+        receiver_init(rx, ctx->sockfd, &ctx->client_addr, ctx->addr_len,
+                      ctx->block_size, ctx->window, crypto_consume, &s->cs);
+        receiver_set_settler(rx, crypto_settle, &s->cs);
+    }
+    else if (uring_file_open(&s->uf, s->task.worker->uring, &s->task,
+                             &s->fs, &s->ck) == 0)
+        receiver_init(rx, ctx->sockfd, &ctx->client_addr, ctx->addr_len,
+                      ctx->block_size, ctx->window, uring_consume, &s->uf);
+    else
+        receiver_init(rx, ctx->sockfd, &ctx->client_addr, ctx->addr_len,
+                      ctx->block_size, ctx->window,
+                      checkpoint_consume, &s->ck);
+    if ((ctx->sack && receiver_enable_sack(rx) < 0) ||
+        (ctx->fec_k > 0 && fec_decoder_init(&s->fec_rx, ctx->fec_k,
+                                            ctx->fec_m, ctx->block_size,
+                                            ctx->window) < 0)) {
+        send_error(ctx->sockfd, &ctx->client_addr,
+                   ERR_UNDEFINED, "Out of memory");
+        if (s->basis >= 0)
+            unlink(s->rebuild);
+        return 1;
+    }
+    if (ctx->fec_k > 0)
+        rx->fec = &s->fec_rx;
+    if (g_offload)
+        receiver_enable_gro(rx);    /* the worker's batch takes GRO runs */
+
+    if (s->oack_len > 0)
+        sendto(ctx->sockfd, s->oack, s->oack_len, 0,
+               (struct sockaddr *)&ctx->client_addr, ctx->addr_len);
+    else
+        send_ack(ctx->sockfd, &ctx->client_addr, ctx->addr_len, 0);
+
+    print_timestamp();
+    if (s->basis >= 0)
+        printf("WRQ     receiving %s as delta (delta block %d, block %d "
+               "bytes, window %d%s%s)\n", ctx->filename, ctx->delta,
+               ctx->block_size, ctx->window, ctx->sack ? ", SACK" : "",
+               ctx->fmt.ext ? ", 32-bit blocks" : "");
+    else if (ctx->resume > 0)
+        printf("WRQ     resuming %s at byte %lld (block %d bytes, "
+               "window %d%s%s)\n", ctx->filename, ctx->resume,
+               ctx->block_size, ctx->window, ctx->sack ? ", SACK" : "",
+               ctx->fmt.ext ? ", 32-bit blocks" : "");
+    else
+        printf("WRQ     receiving %s (block %d bytes, window %d%s%s)\n",
+               ctx->filename, ctx->block_size, ctx->window,
+               ctx->sack ? ", SACK" : "",
+               ctx->fmt.ext ? ", 32-bit blocks" : "");
+
+    receiver_set_timeout(rx, ctx->timeout);
+    rx->strict = ctx->strict;
+    rx->fmt    = ctx->fmt;
+    if (s->oack_len > 0) {
+        rx->hello     = s->oack;
+        rx->hello_len = s->oack_len;
+    }
+
+    s->phase = SESSION_RECV;
+    reactor_set_timer(&s->task, rx->deadline);
+    return 0;
 }
 
 /* ================================================================== */
@@ -374,6 +1602,7 @@ static void handle_delete(ClientContext *ctx)
     memset(&dack, 0, sizeof(dack));
     dack.opcode = htons(OP_DACK);
 
+    block_cache_forget(&g_cache, filepath);
     if (remove(filepath) == 0) {
         dack.status = htons(0);
         strncpy(dack.message, "File deleted successfully",
@@ -394,26 +1623,42 @@ static void handle_delete(ClientContext *ctx)
 }
 
 /* ================================================================== */
-/*  Thread entry point                                                 */
+/*  Reactor entry points                                               */
 /* ================================================================== */
 
-static void *client_handler(void *arg)
+static int session_handle(ReactorTask *t, int events)
 {
-    ClientContext *ctx = (ClientContext *)arg;
+    Session *s = (Session *)t;
+
+    /* Anything on the new TID means the client got our answer */
+    if (events & REACTOR_READ)
+        pending_drop(s);
+
+    if (events & REACTOR_START) {
+        switch (s->ctx.opcode) {
+            case OP_RRQ:    return rrq_start(s);
+            case OP_WRQ:    return wrq_start(s);
+            case OP_DELETE: handle_delete(&s->ctx); return 1;
+            default:
+                send_error(s->ctx.sockfd, &s->ctx.client_addr,
+                           ERR_ILLEGAL_OP, "Unknown opcode");
+                return 1;
+        }
+    }
 
-    switch (ctx->opcode) {
-        case OP_RRQ:    handle_rrq(ctx);    break;
-        case OP_WRQ:    handle_wrq(ctx);    break;
-        case OP_DELETE: handle_delete(ctx); break;
-        default:
-            send_error(ctx->sockfd, &ctx->client_addr,
-                       ERR_ILLEGAL_OP, "Unknown opcode");
-            break;
+    switch (s->phase) {
+    case SESSION_OACK:  return rrq_await(s, events);
+    case SESSION_SEND:  return rrq_step(s);
+    case SESSION_FLUSH: return wrq_flush(s);
+    default:            return wrq_step(s);
     }
+}
 
-    close(ctx->sockfd);
-    free(ctx);
-    return NULL;
+static void session_release(ReactorTask *t)
+{
+    Session *s = (Session *)t;
+    pending_drop(s);
+    session_free(s);
 }
 
 /* ================================================================== */
@@ -421,12 +1666,17 @@ static void *client_handler(void *arg)
 /* ================================================================== */
 
 /*
- * parse_request – Extract opcode, filename, and mode from a raw
- *                 request buffer.  Returns the opcode, or -1 on error.
+ * parse_request – Extract opcode, filename, mode and any RFC 2347
+ *                 options from a raw request buffer.  Returns the
+ *                 opcode, -1 if the packet is malformed, or -2 if an
+ *                 option carries an invalid value.
  */
 static int parse_request(const uint8_t *buf, ssize_t len,
-                          char *filename, char *mode)
+                          char *filename, char *mode,
+                          TransferOptions *opts)
 {
+    options_init(opts);
+
     if (len < 4) return -1;
 
     uint16_t opcode = ntohs(*(uint16_t *)buf);
@@ -452,37 +1702,42 @@ static int parse_request(const uint8_t *buf, ssize_t len,
     flen = strnlen(p, end - p);
     strncpy(mode, p, MAX_MODE - 1);
     mode[MAX_MODE - 1] = '\0';
+    p += flen + 1;
+
+    /* Options: name\0value\0 pairs */
+    if (p < end && options_parse(p, end, opts) < 0)
+        return -2;
 
     return (int)opcode;
 }
 
 /* ================================================================== */
-/*  main                                                               */
+/*  Listener shards                                                    */
 /* ================================================================== */
 
-int main(int argc, char *argv[])
-{
-    uint16_t port = TFTP_PORT;
-    if (argc >= 2)
-        port = (uint16_t)atoi(argv[1]);
-
-    /* Ensure storage directories exist */
-    ensure_directory(FILE_STORAGE_DIR);
-    ensure_directory(BACKUP_DIR);
-
-    /* Set up signal handler for graceful shutdown */
-    signal(SIGINT,  handle_signal);
-    signal(SIGTERM, handle_signal);
+#define SHARD_BATCH         64          /* Requests read per wakeup       */
 
-    /* Create main listening socket */
-    int sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+/*
+ * shard_socket – A non-blocking UDP socket on `port`, shared with the
+ *                other shards through SO_REUSEPORT.  Returns -1 (with a
+ *                message) on failure.
+ */
+static int shard_socket(uint16_t port)
+{
+    int sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
     if (sockfd < 0) {
         perror("socket");
-        return EXIT_FAILURE;
+        return -1;
     }
 
     int opt = 1;
     setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt,
+                   sizeof(opt)) < 0) {
+        perror("SO_REUSEPORT");
+        close(sockfd);
+        return -1;
+    }
 
     struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
@@ -494,8 +1749,381 @@ int main(int argc, char *argv[])
              sizeof(server_addr)) < 0) {
         perror("bind");
         close(sockfd);
+        return -1;
+    }
+    return sockfd;
+}
+
+/*
+ * shard_steer – Attach a classic BPF program to the SO_REUSEPORT group
+ *               that picks the shard from the client's address and port
+ *               (sockets are numbered in bind order, so shard i is
+ *               socket i).  The kernel's own choice is a hash of the
+ *               same tuple; this one is fixed and spreads clients
+ *               evenly even behind one NAT address.
+ */
+static int shard_steer(int sockfd, int nshards)
+{
+    struct sock_filter code[] = {
+        /* A = source address ^ source port (no IP options assumed) */
+        BPF_STMT(BPF_LD  | BPF_W | BPF_ABS, SKF_NET_OFF + 12),
+        BPF_STMT(BPF_ST, 0),
+        BPF_STMT(BPF_LD  | BPF_H | BPF_ABS, SKF_NET_OFF + 20),
+        BPF_STMT(BPF_LDX | BPF_W | BPF_MEM, 0),
+        BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),
+        /* Fibonacci hash, then the shard index */
+        BPF_STMT(BPF_ALU | BPF_MUL | BPF_K, 0x9e3779b1),
+        BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16),
+        BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (uint32_t)nshards),
+        BPF_STMT(BPF_RET | BPF_A, 0),
+    };
+    struct sock_fprog prog = {
+        .len    = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    return setsockopt(sockfd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                      &prog, sizeof(prog));
+}
+
+/*
+ * shard_request – Turn one request datagram into a session and start it
+ *                 on this shard's worker.
+ */
+static void shard_request(Shard *sh, const uint8_t *buf, ssize_t n,
+                          struct sockaddr_in *client_addr,
+                          socklen_t addr_len)
+{
+    int sockfd = sh->task.fd;
+
+    /* A client that resends its request before hearing from the new
+       TID gets the session already opened for it, not a second one */
+    uint64_t hash = request_hash(buf, n);
+    if (pending_find(sh, client_addr, hash))
+        return;
+
+    /* Parse the request */
+    char filename[MAX_FILENAME] = {0};
+    char mode[MAX_MODE]         = {0};
+    TransferOptions opts;
+    int  opcode = parse_request(buf, n, filename, mode, &opts);
+    if (opcode == -2) {
+        send_error(sockfd, client_addr,
+                   ERR_OPTION_REFUSED, "Invalid option value");
+        return;
+    }
+    if (opcode < 0) {
+        send_error(sockfd, client_addr,
+                   ERR_ILLEGAL_OP, "Malformed request");
+        return;
+    }
+
+    /* Admission: the session comes from the pool, which turns new
+       requests away – cheaply, before any socket – while it is busy */
+    int      turned_busy;
+    Session *sess = pool_get(&g_sessions, &turned_busy);
+    if (turned_busy) {
+        print_timestamp();
+        printf("BUSY    %u sessions – refusing new requests\n",
+               pool_used(&g_sessions));
+    }
+    if (!sess) {
+        send_error(sockfd, client_addr, ERR_UNDEFINED,
+                   "Server busy, retry later");
+        return;
+    }
+
+    print_timestamp();
+    printf("REQUEST opcode=%d file=%s mode=%s from %s:%d shard=%d\n",
+           opcode, filename, mode,
+           inet_ntoa(client_addr->sin_addr),
+           ntohs(client_addr->sin_port), sh->index);
+
+    /* Determine block size: standard TFTP clients use "netascii"
+       or "octet" – we fall back to 512 for compatibility.         */
+    int blk_size = ENHANCED_BLOCK_SIZE;
+    int strict   = 0;
+    if (mode[0] != '\0' &&
+        (strcasecmp(mode, "octet") == 0 ||
+         strcasecmp(mode, "netascii") == 0)) {
+        blk_size = BLOCK_SIZE;  /* standard TFTP compat */
+        strict   = 1;
+    }
+
+    /* Create a new socket for the transfer (new TID) */
+    int child_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+    if (child_sock < 0) {
+        perror("socket (child)");
+        pool_put(&g_sessions, sess);
+        return;
+    }
+
+    /* Bind to an ephemeral port */
+    struct sockaddr_in child_addr;
+    memset(&child_addr, 0, sizeof(child_addr));
+    child_addr.sin_family      = AF_INET;
+    child_addr.sin_addr.s_addr = INADDR_ANY;
+    child_addr.sin_port        = 0;  /* OS picks port */
+    if (bind(child_sock, (struct sockaddr *)&child_addr,
+             sizeof(child_addr)) < 0) {
+        perror("bind (child)");
+        close(child_sock);
+        pool_put(&g_sessions, sess);
+        return;
+    }
+
+    /* Prepare the session; it runs on this shard's worker */
+    sess->task.fd      = child_sock;
+    sess->task.handle  = session_handle;
+    sess->task.release = session_release;
+    sess->shard        = sh;
+    sess->request_hash = hash;
+    sess->fd           = -1;
+    sess->basis        = -1;
+
+    ClientContext *ctx = &sess->ctx;
+    ctx->sockfd      = child_sock;
+    ctx->client_addr = *client_addr;
+    ctx->addr_len    = addr_len;
+    ctx->opcode      = (uint16_t)opcode;
+    ctx->block_size  = blk_size;
+    ctx->window      = 1;
+    ctx->timeout     = TIMEOUT_SEC;
+    ctx->strict      = strict;
+    ctx->opts        = opts;
+    snprintf(ctx->filename, MAX_FILENAME, "%s", filename);
+    snprintf(ctx->mode, MAX_MODE, "%s", mode);
+
+    pending_add(sess);
+    reactor_add(sh->task.worker, &sess->task);
+}
+
+/* The listening socket is readable: take a batch of requests.  The
+ * shard has a batch of its own, as starting a session runs it on the
+ * worker's.                                                          */
+static int shard_handle(ReactorTask *t, int events)
+{
+    Shard *sh = (Shard *)t;
+
+    if (events & REACTOR_START)
+        return 0;
+
+    for (int taken = 0; taken < SHARD_BATCH; taken += IO_BATCH) {
+        int n = rx_batch_fill(&sh->rx, t->fd);
+        for (int i = 0; i < n; i++) {
+            struct sockaddr_in client_addr = *rx_batch_from(&sh->rx, i);
+            if (rx_batch_len(&sh->rx, i) > 0)
+                shard_request(sh, rx_batch_data(&sh->rx, i),
+                              rx_batch_len(&sh->rx, i), &client_addr,
+                              sizeof(client_addr));
+        }
+        if (rx_batch_drained(&sh->rx))
+            break;
+    }
+    return 0;
+}
+
+/* Only reached if the socket could not be watched */
+static void shard_release(ReactorTask *t)
+{
+    fprintf(stderr, "Shard %d stopped listening\n", ((Shard *)t)->index);
+}
+
+/* ================================================================== */
+/*  main                                                               */
+/* ================================================================== */
+
+int main(int argc, char *argv[])
+{
+    int c;
+    int workers = 0;
+    int steer   = 0;
+    unsigned pool_cap = SESSION_POOL, pool_high = 0, pool_low = 0;
+    int      cache_mb = CACHE_DEFAULT_MB;
+    double   link_mbit = 0, client_mbit = 0, subnet_mbit = 0;
+    unsigned fast_kb = SCHED_FAST_KB;
+    int      crypto_threads = 0;
+    while ((c = getopt(argc, argv, "c:p:m:t:BNUzS:C:R:X:")) != -1) {
+        switch (c) {
+        case 'c':
+            g_congestion = cc_find(optarg);
+            if (!g_congestion) {
+                fprintf(stderr, "Unknown congestion control: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'p':
+            g_pacing = pacer_find(optarg);
+            if (g_pacing < 0) {
+                fprintf(stderr, "Unknown pacing mode: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'm': {
+            char *colon = strchr(optarg, ':');
+            memset(&g_mcast_group, 0, sizeof(g_mcast_group));
+            g_mcast_group.sin_family = AF_INET;
+            g_mcast_group.sin_port   = htons(colon ? (uint16_t)atoi(colon + 1)
+                                                   : MCAST_DEFAULT_PORT);
+            if (colon)
+                *colon = '\0';
+            if (inet_pton(AF_INET, optarg, &g_mcast_group.sin_addr) != 1 ||
+                !IN_MULTICAST(ntohl(g_mcast_group.sin_addr.s_addr)) ||
+                g_mcast_group.sin_port == 0) {
+                fprintf(stderr, "Not a multicast group: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            g_mcast = 1;
+            break;
+        }
+        case 't':
+            workers = atoi(optarg);
+            if (workers < 1 || workers > REACTOR_MAX_WORKERS) {
+                fprintf(stderr, "Invalid worker count: %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'B':
+            steer = 1;
+            break;
+        case 'N':
+            g_offload = 0;
+            break;
+        case 'U':
+            g_uring = 1;
+            break;
+        case 'z':
+            g_zerocopy = 1;
+            break;
+        case 'S':
+            if (sscanf(optarg, "%u,%u,%u", &pool_cap, &pool_high,
+                       &pool_low) < 1 || pool_cap < 1 ||
+                pool_cap > 1u << 24 || pool_high > pool_cap ||
+                (pool_low > 0 && pool_low >= (pool_high ? pool_high
+                                                        : pool_cap))) {
+                fprintf(stderr, "Invalid session pool: %s "
+                        "(max[,high[,low]])\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'C':
+            cache_mb = atoi(optarg);
+            if (cache_mb < 0 || cache_mb > 1 << 20) {
+                fprintf(stderr, "Invalid cache size: %s (MB)\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'R':
+            if (sscanf(optarg, "%lf,%lf,%lf,%u", &link_mbit, &client_mbit,
+                       &subnet_mbit, &fast_kb) < 1 || link_mbit < 0 ||
+                client_mbit < 0 || subnet_mbit < 0 || link_mbit > 1e6 ||
+                client_mbit > 1e6 || subnet_mbit > 1e6) {
+                fprintf(stderr, "Invalid rates: %s "
+                        "(link[,client[,subnet[,fast_kb]]] in Mbit/s)\n",
+                        optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'X':
+            crypto_threads = atoi(optarg);
+            if (crypto_threads < 0 || crypto_threads > CRYPTO_MAX_THREADS) {
+                fprintf(stderr, "Invalid crypto threads: %s (0-%d)\n",
+                        optarg, CRYPTO_MAX_THREADS);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Usage: %s [-c aimd|vegas|fixed] "
+                    "[-p user|txtime|off] [-m group[:port]] "
+                    "[-t workers] [-B] [-N] [-U] [-z] "
+                    "[-S max[,high[,low]]] [-C cache_mb] [-X threads] "
+                    "[-R link[,client[,subnet[,fast_kb]]]] [port]\n",
+                    argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint16_t port = TFTP_PORT;
+    if (argc - optind >= 1)
+        port = (uint16_t)atoi(argv[optind]);
+
+    /* Ensure storage directories exist */
+    ensure_directory(FILE_STORAGE_DIR);
+    ensure_directory(BACKUP_DIR);
+
+    if (pool_init(&g_sessions, pool_cap, sizeof(Session), pool_high,
+                  pool_low) < 0) {
+        perror("session pool");
+        return EXIT_FAILURE;
+    }
+    if (block_cache_init(&g_cache, (size_t)cache_mb << 20) < 0) {
+        perror("block cache");
         return EXIT_FAILURE;
     }
+    sched_init(&g_sched, (uint64_t)(link_mbit * 1e6 / 8),
+               (uint64_t)(client_mbit * 1e6 / 8),
+               (uint64_t)(subnet_mbit * 1e6 / 8),
+               (long long)fast_kb * 1024);
+    if (crypto_pool_start(&g_crypto, crypto_threads) < 0) {
+        perror("crypto pool");
+        return EXIT_FAILURE;
+    }
+
+    /* Set up signal handler for graceful shutdown */
+    signal(SIGINT,  handle_signal);
+    signal(SIGTERM, handle_signal);
+    signal(SIGUSR1, handle_signal);
+    if (g_zerocopy)
+        map_guard_install();
+
+    /* One listening socket per worker, all on the server port */
+    if (workers == 0)
+        workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > REACTOR_MAX_WORKERS)
+        workers = REACTOR_MAX_WORKERS;
+    Shard *shards = calloc(workers, sizeof(Shard));
+    if (!shards) {
+        perror("calloc");
+        return EXIT_FAILURE;
+    }
+    for (int i = 0; i < workers; i++) {
+        shards[i].index        = i;
+        shards[i].task.handle  = shard_handle;
+        shards[i].task.release = shard_release;
+        shards[i].task.fd      = shard_socket(port);
+        if (shards[i].task.fd < 0)
+            return EXIT_FAILURE;
+        if (rx_batch_init(&shards[i].rx, MAX_REQUEST_SIZE) < 0) {
+            perror("malloc");
+            return EXIT_FAILURE;
+        }
+    }
+    if (steer && workers > 1 && shard_steer(shards[0].task.fd, workers) < 0) {
+        perror("SO_ATTACH_REUSEPORT_CBPF");
+        steer = 0;
+    }
+
+    /* Each shard's worker is pinned to a core of its own */
+    Reactor reactor;
+    if (reactor_start(&reactor, workers, 1) < 0)
+        return EXIT_FAILURE;
+
+    /* Engines go in before the shards, so no session misses them; a
+       worker whose ring cannot be set up does plain pread/pwrite      */
+    UringEngine *engines = NULL;
+    int          nuring  = 0;
+    if (g_uring)
+        engines = calloc(reactor.nworkers, sizeof(UringEngine));
+    for (int i = 0; engines && i < reactor.nworkers; i++) {
+        if (uring_engine_init(&engines[i]) < 0) {
+            perror("io_uring");
+            break;
+        }
+        reactor.workers[i].uring = &engines[i];
+        reactor_post(&reactor.workers[i], &engines[i].task);
+        nuring++;
+    }
+    for (int i = 0; i < workers; i++)
+        reactor_post(&reactor.workers[i], &shards[i].task);
 
     print_timestamp();
     printf("========================================\n");
@@ -506,99 +2134,90 @@ int main(int argc, char *argv[])
     print_timestamp();
     printf("Backup  : %s\n", BACKUP_DIR);
     print_timestamp();
-    printf("Encryption : AES-256-CBC\n");
+    printf("Encryption : AES-256-GCM per session (\"gcm\", per file when "
+           "cached), else AES-256-CBC\n");
+    print_timestamp();
+    printf("Block size  : %d bytes (enhanced) / %d bytes (compat), "
+           "blksize up to %d\n",
+           ENHANCED_BLOCK_SIZE, BLOCK_SIZE, MAX_BLOCK_SIZE);
+    print_timestamp();
+    printf("Congestion  : %s, pacing %s\n", g_congestion->name,
+           g_pacing == PACE_TXTIME ? "txtime" :
+           g_pacing == PACE_USER   ? "user"   : "off");
+    print_timestamp();
+    printf("Workers     : %d (epoll, SO_REUSEPORT shards%s%s)\n",
+           reactor.nworkers, reactor.workers[0].cpu >= 0 ? ", pinned" : "",
+           steer ? ", BPF steering" : "");
+    print_timestamp();
+    printf("Sessions    : %u (busy at %u, accepting again at %u)\n",
+           g_sessions.cap, g_sessions.high, g_sessions.low);
+    print_timestamp();
+    if (nuring > 0)
+        printf("File I/O    : io_uring on %d of %d workers\n", nuring,
+               reactor.nworkers);
+    else
+        printf("File I/O    : pread/pwrite%s\n",
+               g_uring ? " (io_uring unavailable)" : "");
+    print_timestamp();
+    if (g_cache.budget > 0)
+        printf("Block cache : %d MB in %d shards\n", cache_mb, CACHE_SHARDS);
+    else
+        printf("Block cache : off\n");
     print_timestamp();
-    printf("Block size  : %d bytes (enhanced) / %d bytes (compat)\n",
-           ENHANCED_BLOCK_SIZE, BLOCK_SIZE);
+    if (g_sched.enabled) {
+        printf("Scheduler   :");
+        sched_print_bucket(" link", &g_sched.link);
+        printf(", per client %.1f, per /24 %.1f Mbit/s (0 = none), fast "
+               "lane up to %u KB\n", client_mbit, subnet_mbit, fast_kb);
+    } else {
+        printf("Scheduler   : off\n");
+    }
+    print_timestamp();
+    if (g_crypto.nthreads > 0)
+        printf("Crypto pool : %d threads, %d KB chunks\n",
+               g_crypto.nthreads, CRYPTO_CHUNK_BYTES / 1024);
+    else
+        printf("Crypto pool : off\n");
+    if (g_zerocopy) {
+        print_timestamp();
+        printf("Zero-copy   : mapped RRQ reads, MSG_ZEROCOPY from window "
+               "%d\n", ZEROCOPY_MIN_WINDOW);
+    }
+    if (g_mcast) {
+        print_timestamp();
+        printf("Multicast   : %s, ports from %u\n",
+               inet_ntoa(g_mcast_group.sin_addr),
+               ntohs(g_mcast_group.sin_port));
+    }
     print_timestamp();
     printf("========================================\n");
 
-    uint8_t recv_buf[MAX_PACKET_SIZE];
-
+    /* The shards do all the work; this thread only waits for a signal */
     while (running) {
-        struct sockaddr_in client_addr;
-        socklen_t addr_len = sizeof(client_addr);
-
-        /* Use a short timeout so we can check `running` periodically */
-        set_socket_timeout(sockfd, 1, 0);
-
-        ssize_t n = recvfrom(sockfd, recv_buf, sizeof(recv_buf), 0,
-                             (struct sockaddr *)&client_addr, &addr_len);
-        if (n <= 0) continue;
-
-        /* Parse the request */
-        char filename[MAX_FILENAME] = {0};
-        char mode[MAX_MODE]         = {0};
-        int  opcode = parse_request(recv_buf, n, filename, mode);
-        if (opcode < 0) {
-            send_error(sockfd, &client_addr,
-                       ERR_ILLEGAL_OP, "Malformed request");
-            continue;
+        pause();
+        if (dump_sched) {
+            dump_sched = 0;
+            sched_dump(&g_sched);
         }
+    }
 
+    reactor_stop(&reactor);
+    crypto_pool_stop(&g_crypto);
+    free(engines);
+    pool_destroy(&g_sessions);
+    if (g_cache.budget > 0) {
         print_timestamp();
-        printf("REQUEST opcode=%d file=%s mode=%s from %s:%d\n",
-               opcode, filename, mode,
-               inet_ntoa(client_addr.sin_addr),
-               ntohs(client_addr.sin_port));
-
-        /* Determine block size: standard TFTP clients use "netascii"
-           or "octet" – we fall back to 512 for compatibility.         */
-        int blk_size = ENHANCED_BLOCK_SIZE;
-        if (mode[0] != '\0' &&
-            (strcasecmp(mode, "octet") == 0 ||
-             strcasecmp(mode, "netascii") == 0)) {
-            blk_size = BLOCK_SIZE;  /* standard TFTP compat */
-        }
-
-        /* Create a new socket for the transfer (new TID) */
-        int child_sock = socket(AF_INET, SOCK_DGRAM, 0);
-        if (child_sock < 0) {
-            perror("socket (child)");
-            continue;
-        }
-
-        /* Bind to an ephemeral port */
-        struct sockaddr_in child_addr;
-        memset(&child_addr, 0, sizeof(child_addr));
-        child_addr.sin_family      = AF_INET;
-        child_addr.sin_addr.s_addr = INADDR_ANY;
-        child_addr.sin_port        = 0;  /* OS picks port */
-        if (bind(child_sock, (struct sockaddr *)&child_addr,
-                 sizeof(child_addr)) < 0) {
-            perror("bind (child)");
-            close(child_sock);
-            continue;
-        }
-
-        /* Prepare the per-client context */
-        ClientContext *ctx = calloc(1, sizeof(ClientContext));
-        if (!ctx) { close(child_sock); continue; }
-
-        ctx->sockfd      = child_sock;
-        ctx->client_addr = client_addr;
-        ctx->addr_len    = addr_len;
-        ctx->opcode      = (uint16_t)opcode;
-        ctx->block_size  = blk_size;
-        snprintf(ctx->filename, MAX_FILENAME, "%s", filename);
-        snprintf(ctx->mode, MAX_MODE, "%s", mode);
-
-        /* Spawn handler thread (detached) */
-        pthread_t tid;
-        pthread_attr_t attr;
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-        if (pthread_create(&tid, &attr, client_handler, ctx) != 0) {
-            perror("pthread_create");
-            close(child_sock);
-            free(ctx);
-        }
-
-        pthread_attr_destroy(&attr);
+        printf("Block cache : %llu hits (%llu waited), %llu misses, "
+               "%llu evicted\n", (unsigned long long)g_cache.hits,
+               (unsigned long long)g_cache.joined,
+               (unsigned long long)g_cache.misses,
+               (unsigned long long)g_cache.evictions);
     }
-
-    close(sockfd);
+    block_cache_destroy(&g_cache);
+    sched_destroy(&g_sched);
+    for (int i = 0; i < workers; i++)
+        close(shards[i].task.fd);
+    free(shards);
     print_timestamp();
     printf("Server shut down.\n");
     return EXIT_SUCCESS;
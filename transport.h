@@ -0,0 +1,1685 @@
+/*
+ * transport.h
+ * =====================================================================
+ * Enhanced TFTP – sliding-window DATA transport (RFC 7440)
+ *
+ * Shared by client and server:
+ *   • WindowSender   – keeps up to `window` DATA blocks in flight and
+ *                      slides on cumulative ACKs, going back to the
+ *                      last acknowledged block on loss (go-back-N).
+ *   • WindowReceiver – accepts blocks in order and ACKs the highest
+ *                      in-order block at every window boundary, on the
+ *                      final block, and whenever a gap is detected.
+ *
+ * With the "sack" option the receiver keeps blocks that arrive beyond a
+ * hole and answers with OP_SACK (cumulative block + bitmap of what it
+ * holds); the sender keeps a per-slot scoreboard and resends only the
+ * holes instead of the whole tail of the window.
+ *
+ * A window of 1 is exactly the classic stop-and-wait protocol, so peers
+ * that do not negotiate "windowsize" use the same code path.
+ *
+ * Between two "enhanced" peers the negotiated window is only a ceiling:
+ * a congestion controller (congestion.h) sets how much of it is used and
+ * a pacer spaces the blocks out.  For that the receiver also ACKs
+ * whenever its socket runs dry, and the sender reads three duplicate
+ * ACKs as loss rather than every ACK short of the newest block.  Plain
+ * RFC 7440 peers ("strict") only ACK at window boundaries, so they keep
+ * the full fixed window.
+ *
+ * Blocks are counted with 32 bits internally.  On the wire they are
+ * either the classic 16-bit numbers, which wrap after 65535 to 0 or to
+ * the negotiated "rollover" value, or with "exthdr" full 32-bit numbers
+ * plus the 64-bit file offset of each DATA block.  16-bit numbers are
+ * unwrapped against the block each end expects next, so arbitrarily
+ * large files work either way.
+ *
+ * With the "fec" option (fec.h) the sender follows every group of
+ * blocks with parity blocks and the receiver rebuilds a lost block from
+ * them.  While a hole may still be repaired that way the receiver holds
+ * back the gap ACK that would otherwise trigger a resend.
+ *
+ * A consumer may finish blocks in the background (cryptopool.h): its
+ * settler tells the receiver how far it got.  Only settled blocks are
+ * ACKed, the transfer is only over once the final block is settled,
+ * and blocks the settler turns down are asked for again.
+ *
+ * Retransmission timers adapt to the path: each end keeps an SRTT /
+ * RTTVAR estimate (RFC 6298, Karn's rule – no samples from
+ * retransmitted packets) and doubles its RTO on every timeout.
+ *
+ * Both machines are driven by three calls – *_pump / *_on_packet /
+ * *_on_timeout.  The blocking *_run() loops at the bottom are one way
+ * of feeding them; *_poll() does one non-blocking round for an event
+ * loop (the server's reactor.h).  Both move datagrams in batches
+ * (batchio.h): a pump leaves in one sendmmsg(), and queued ACKs or
+ * blocks are taken with recvmmsg().  With *_enable_gso / *_enable_gro
+ * runs of equal-length DATA packets also cross the UDP stack as one
+ * buffer each way.
+ * =====================================================================
+ */
+
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include "udp_file_transfer.h"
+#include "congestion.h"
+#include "fec.h"
+#include "batchio.h"
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+/* Result codes left in `status` once a transfer is done */
+#define XFER_OK             0
+#define XFER_TIMEOUT       -1           /* Peer stopped answering           */
+#define XFER_ABORTED       -2           /* Peer sent an ERROR packet        */
+#define XFER_FAILED        -3           /* Local read/write/crypto failure  */
+
+/* Retransmission timeout bounds (RFC 6298 with a LAN-friendly floor) */
+#define RTO_MIN_USEC        10000       /* 10 ms                            */
+#define RTO_MAX_USEC        60000000    /* 60 s                             */
+
+#define DUPACK_THRESHOLD    3           /* Duplicate ACKs that signal loss  */
+
+/* Sender scoreboard, one byte per slot */
+#define SLOT_RESENT         0x01        /* Sent more than once (Karn)       */
+#define SLOT_SACKED         0x02        /* Receiver holds it out of order   */
+#define SLOT_LOST           0x04        /* Waiting to be sent again         */
+
+/* ------------------------------------------------------------------ */
+/*  Block callbacks                                                    */
+/* ------------------------------------------------------------------ */
+
+/*
+ * BlockProducer – Write the wire form of the block starting at file
+ *                 byte `offset` into `payload` and return its length
+ *                 (-1 on error).  `*raw_len` receives the plaintext
+ *                 length; a block shorter than the block size ends the
+ *                 transfer.  Blocks are requested in order.  A producer
+ *                 whose read is still in flight returns PRODUCE_AGAIN;
+ *                 the pump stops and asks again on its next run.
+ */
+typedef int (*BlockProducer)(void *arg, uint64_t offset, uint8_t *payload,
+                             int *raw_len);
+
+#define PRODUCE_AGAIN       (-2)
+
+/*
+ * BlockConsumer – Take the wire form of the next in-order block, which
+ *                 starts at file byte `offset`, and return its plaintext
+ *                 length (-1 on error).  A consumer with no room left
+ *                 returns CONSUME_AGAIN; the receiver keeps the block
+ *                 (or lets the sender resend it) and offers it again
+ *                 once its settler has made progress.
+ */
+typedef int (*BlockConsumer)(void *arg, uint64_t offset,
+                             const uint8_t *payload, int len);
+
+#define CONSUME_AGAIN       (-2)
+
+/*
+ * BlockSettler – For a consumer that finishes blocks in the background:
+ *                report in `*settled` how many blocks from the first
+ *                are done for good, without waiting.  Returns 0,
+ *                SETTLE_REJECTED if the block after them turned out
+ *                bad (it and every later one are dropped and must be
+ *                sent again), or -1 on error.  The receiver ACKs no
+ *                further than the settled blocks, only ends the
+ *                transfer once the final block is settled, and polls
+ *                every SETTLE_POLL_USEC until then.
+ */
+typedef int (*BlockSettler)(void *arg, uint32_t *settled);
+
+#define SETTLE_REJECTED     1
+#define SETTLE_POLL_USEC    200
+
+/*
+ * SendGate – Shares the link with other senders.  `admit` returns the
+ *            nanoseconds to wait before the next DATA packet may leave
+ *            (0 = send it now); `charge` counts each packet sent.
+ */
+typedef struct {
+    uint64_t          (*admit)(void *arg, uint64_t now_ns);
+    void              (*charge)(void *arg, int len);
+    void               *arg;
+} SendGate;
+
+/* ------------------------------------------------------------------ */
+/*  State machines                                                     */
+/* ------------------------------------------------------------------ */
+
+/* How block numbers travel on the wire */
+typedef struct {
+    int                 ext;            /* "exthdr": 32-bit + offset      */
+    int                 rollover;       /* 16-bit: block after 65535      */
+} BlockFormat;
+
+/* Smoothed round-trip estimate and the retransmission timeout it yields */
+typedef struct {
+    int64_t             srtt;           /* Smoothed RTT (µs), 0 = none    */
+    int64_t             rttvar;         /* RTT variation (µs)             */
+    int64_t             rto;            /* Current timeout incl. backoff  */
+} RttEstimator;
+
+typedef struct {
+    int                 sockfd;
+    struct sockaddr_in  peer;           /* Peer TID (sends the ACKs)      */
+    socklen_t           peer_len;
+    struct sockaddr_in  dest;           /* Where DATA goes: peer or group */
+    socklen_t           dest_len;
+    int                 block_size;
+    int                 window;         /* Max blocks in flight           */
+    int                 timeout;        /* Initial RTO / give-up floor (s)*/
+    BlockProducer       produce;
+    void               *arg;
+
+    uint8_t            *slots;          /* window × slot_size packet ring */
+    int                *slot_len;       /* Packet length of each slot     */
+    uint64_t           *slot_sent;      /* Last transmission time (µs)    */
+    uint8_t            *slot_flags;     /* SLOT_* scoreboard bits         */
+    int                 slot_size;
+    int                 base_slot;      /* Ring index holding `base`      */
+    uint32_t            base;           /* Oldest unacknowledged block    */
+    uint32_t            next;           /* Next block to produce          */
+    int                 eof;            /* Final block has been produced  */
+    int                 lost;           /* Slots flagged SLOT_LOST        */
+    int                 retries;        /* Timeouts without progress      */
+    int                 strict;         /* Plain RFC 7440 receiver        */
+    int                 sack;           /* Receiver sends OP_SACK         */
+    BlockFormat         fmt;
+    int                 dupacks;        /* Duplicate ACKs in a row        */
+    int                 recovering;     /* Lost data; until `recover` ACKd*/
+    uint32_t            recover;        /* Newest block sent at the loss  */
+    RttEstimator        rtt;
+    CongestionControl   cc;
+    Pacer               pacer;
+    int                 paced;          /* Pump stopped by the pacer      */
+    int                 choked;         /* Pump stopped by a full socket  */
+    const SendGate     *gate;           /* Link share, or NULL            */
+    uint64_t            gated;          /* Held by the gate until (ns)    */
+    FecEncoder         *fec;            /* Parity per group, or NULL      */
+    TxBatch            *batch;          /* Open while pumping, else NULL  */
+    int                 gso;            /* Send runs with UDP_SEGMENT     */
+    int                 zerocopy;       /* Send with MSG_ZEROCOPY         */
+    uint32_t           *slot_zc;        /* Sends to finish before a slot  */
+                                        /* is rewritten; NULL = untracked */
+    ZcTracker           zc;
+    uint64_t            deadline;       /* Retransmit timer, 0 = stopped  */
+    uint64_t            last_progress;  /* When base last advanced        */
+    int                 done;
+    int                 status;         /* XFER_* once done               */
+
+    unsigned            blocks;         /* Distinct blocks produced       */
+    unsigned            retransmits;    /* DATA packets sent again        */
+    unsigned            segmented;      /* Packets sent in a GSO run      */
+    unsigned            refused;        /* Packets a full socket turned   */
+                                        /* away (DATA is sent again)      */
+    char                peer_error[MAX_FILENAME];
+} WindowSender;
+
+typedef struct {
+    int                 sockfd;
+    struct sockaddr_in  peer;           /* Peer TID                       */
+    socklen_t           peer_len;
+    int                 block_size;
+    int                 window;         /* ACK every `window` blocks      */
+    int                 timeout;        /* Initial RTO / give-up floor (s)*/
+    BlockConsumer       consume;
+    void               *arg;
+    BlockSettler        settle;         /* Background consumer, or NULL   */
+    void               *settle_arg;
+
+    const uint8_t      *hello;          /* OACK repeated until DATA flows */
+    int                 hello_len;
+    uint32_t            expected;       /* Next in-order block            */
+    uint32_t            settled;        /* Blocks the settler has done    */
+    uint32_t            acked;          /* Last block ACKed               */
+    int                 final;          /* Final block waits to settle    */
+    int                 since_ack;      /* In-order blocks not ACKed yet  */
+    int                 retries;        /* Timeouts without progress      */
+    int                 strict;         /* Plain RFC 7440 sender          */
+    int                 sack;           /* Hold out-of-order blocks       */
+    BlockFormat         fmt;
+    uint8_t            *held;           /* window × held_size reorder ring*/
+    int                *held_len;       /* Payload length, -1 = empty     */
+    int                 held_size;
+    int                 held_base;      /* Ring index of `expected`       */
+    int                 held_count;     /* Blocks waiting behind a hole   */
+    FecDecoder         *fec;            /* Rebuilds lost blocks, or NULL  */
+    int                 gro;            /* Socket delivers GRO runs       */
+    int                 fec_wait;       /* Gap ACK held back for parity   */
+    RttEstimator        rtt;
+    uint64_t            probe_sent;     /* Window-opening ACK sent (µs)   */
+    uint64_t            deadline;       /* Re-ACK timer                   */
+    uint64_t            last_progress;  /* When a block was last accepted */
+    int                 done;
+    int                 status;         /* XFER_* once done               */
+
+    unsigned            blocks;         /* In-order blocks accepted       */
+    unsigned            duplicates;     /* Out-of-order / repeated blocks */
+    unsigned            coalesced;      /* Blocks that came in a GRO run  */
+    unsigned            rejected;       /* Blocks the settler turned down */
+    char                peer_error[MAX_FILENAME];
+} WindowReceiver;
+
+/* ------------------------------------------------------------------ */
+/*  Helpers                                                            */
+/* ------------------------------------------------------------------ */
+
+/*
+ * send_ack – Build and send an ACK for `block` on `sockfd` to `dest`.
+ */
+static inline void send_ack(int sockfd, const struct sockaddr_in *dest,
+                            socklen_t dest_len, uint16_t block)
+{
+    AckPacket ack;
+    ack.opcode    = htons(OP_ACK);
+    ack.block_num = htons(block);
+    sendto(sockfd, &ack, sizeof(ack), 0,
+           (const struct sockaddr *)dest, dest_len);
+}
+
+/*
+ * same_peer – True if `a` and `b` name the same address and port (TID).
+ */
+static inline int same_peer(const struct sockaddr_in *a,
+                            const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+/* True if block `a` comes after block `b` (32-bit wraparound) */
+static inline int block_after(uint32_t a, uint32_t b)
+{
+    return (int32_t)(a - b) > 0;
+}
+
+/* Bytes from the start of the file to the first byte of `block` */
+static inline uint64_t block_offset(uint32_t block, int block_size)
+{
+    return (uint64_t)(block - 1) * (uint64_t)block_size;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Block numbers on the wire                                          */
+/* ------------------------------------------------------------------ */
+
+/* Bytes of the block number field that follows the opcode */
+static inline int block_field_len(const BlockFormat *f)
+{
+    return f->ext ? 4 : 2;
+}
+
+static inline int data_hdr_len(const BlockFormat *f)
+{
+    return f->ext ? XDATA_HDR_LEN : DATA_HDR_LEN;
+}
+
+/*
+ * block_wire16 – The 16-bit number of `block`.  With rollover 1 the
+ *                numbers cycle through 1..65535, so 0 only ever names
+ *                the ACK of the request.
+ */
+static inline uint16_t block_wire16(uint32_t block, int rollover)
+{
+    if (rollover == 1 && block > 0)
+        return (uint16_t)((block - 1) % 65535 + 1);
+    return (uint16_t)block;
+}
+
+/*
+ * block_unwrap16 – The block whose 16-bit number is `wire` that lies
+ *                  closest to `ref`.
+ */
+static inline uint32_t block_unwrap16(uint16_t wire, uint32_t ref,
+                                      int rollover)
+{
+    if (rollover != 1)
+        return ref + (int16_t)(wire - (uint16_t)ref);
+    if (wire == 0)
+        return 0;
+
+    int32_t d = (int32_t)wire - (int32_t)block_wire16(ref, 1);
+    if (d > 32767)       d -= 65535;
+    else if (d < -32767) d += 65535;
+    return ref + (uint32_t)d;
+}
+
+/* Write the block number field at `p`; returns its length. */
+static inline int block_put(const BlockFormat *f, uint8_t *p,
+                            uint32_t block)
+{
+    if (f->ext) {
+        uint32_t net = htonl(block);
+        memcpy(p, &net, 4);
+        return 4;
+    }
+    uint16_t net = htons(block_wire16(block, f->rollover));
+    memcpy(p, &net, 2);
+    return 2;
+}
+
+/* Read the block number field at `p`, unwrapping 16-bit numbers around
+ * `ref` (the block this end is currently waiting for).               */
+static inline uint32_t block_get(const BlockFormat *f, const uint8_t *p,
+                                 uint32_t ref)
+{
+    if (f->ext) {
+        uint32_t net;
+        memcpy(&net, p, 4);
+        return ntohl(net);
+    }
+    uint16_t net;
+    memcpy(&net, p, 2);
+    return block_unwrap16(ntohs(net), ref, f->rollover);
+}
+
+static inline void put_u64(uint8_t *p, uint64_t v)
+{
+    for (int i = 7; i >= 0; i--, v >>= 8)
+        p[i] = (uint8_t)v;
+}
+
+static inline uint64_t get_u64(const uint8_t *p)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < 8; i++)
+        v = v << 8 | p[i];
+    return v;
+}
+
+/*
+ * copy_peer_error – Save the message of an ERROR packet for the caller.
+ */
+static inline void copy_peer_error(char *dst, const uint8_t *buf,
+                                   ssize_t n)
+{
+    size_t len = n > 4 ? (size_t)(n - 4) : 0;
+    if (len >= MAX_FILENAME) len = MAX_FILENAME - 1;
+    memcpy(dst, buf + 4, len);
+    dst[len] = '\0';
+}
+
+/* ================================================================== */
+/*  Round-trip estimation (RFC 6298)                                   */
+/* ================================================================== */
+
+/*
+ * rtt_init – Start with no samples and an RTO of `sec` seconds.
+ */
+static inline void rtt_init(RttEstimator *e, int sec)
+{
+    e->srtt   = 0;
+    e->rttvar = 0;
+    e->rto    = (int64_t)sec * 1000000;
+}
+
+static inline void rtt_clamp(RttEstimator *e)
+{
+    if (e->rto < RTO_MIN_USEC) e->rto = RTO_MIN_USEC;
+    if (e->rto > RTO_MAX_USEC) e->rto = RTO_MAX_USEC;
+}
+
+/*
+ * rtt_sample – Fold one round-trip measurement into the estimate and
+ *              recompute the RTO (this also cancels any backoff).
+ */
+static inline void rtt_sample(RttEstimator *e, int64_t sample)
+{
+    if (sample < 1) sample = 1;
+
+    if (e->srtt == 0) {
+        e->srtt   = sample;
+        e->rttvar = sample / 2;
+    } else {
+        int64_t err = e->srtt - sample;
+        if (err < 0) err = -err;
+        e->rttvar = (3 * e->rttvar + err) / 4;
+        e->srtt   = (7 * e->srtt + sample) / 8;
+    }
+    e->rto = e->srtt + 4 * e->rttvar;
+    rtt_clamp(e);
+}
+
+/*
+ * rtt_backoff – Double the RTO after a timeout.
+ */
+static inline void rtt_backoff(RttEstimator *e)
+{
+    e->rto *= 2;
+    rtt_clamp(e);
+}
+
+/*
+ * rtt_restore – Undo the timeout backoff once the peer makes progress
+ *               again, even if Karn's rule left no fresh sample (after
+ *               going back N every block acknowledged was a resend).
+ */
+static inline void rtt_restore(RttEstimator *e)
+{
+    if (e->srtt == 0) return;
+    e->rto = e->srtt + 4 * e->rttvar;
+    rtt_clamp(e);
+}
+
+/*
+ * peer_gone – After MAX_RETRIES backed-off timeouts in a row, the peer
+ *             is given up on – but never before `timeout` seconds of
+ *             silence, so a short RTO on a LAN can't abort a transfer
+ *             over a brief hiccup.
+ */
+static inline int peer_gone(int retries, uint64_t last_progress,
+                            int timeout)
+{
+    return retries >= MAX_RETRIES &&
+           now_usec() - last_progress >= (uint64_t)timeout * 1000000;
+}
+
+/* ================================================================== */
+/*  Sender                                                             */
+/* ================================================================== */
+
+/*
+ * sender_init – Prepare `s` to stream blocks from `produce` to `peer`.
+ *               The default congestion controller is AIMD with
+ *               userspace pacing; see sender_set_congestion.  Returns 0
+ *               on success, -1 if the window can't be allocated.
+ */
+static inline int sender_init(WindowSender *s, int sockfd,
+                              const struct sockaddr_in *peer,
+                              socklen_t peer_len, int block_size,
+                              int window, BlockProducer produce,
+                              void *arg)
+{
+    memset(s, 0, sizeof(*s));
+    s->sockfd     = sockfd;
+    s->peer       = *peer;
+    s->peer_len   = peer_len;
+    s->dest       = *peer;
+    s->dest_len   = peer_len;
+    s->block_size = block_size;
+    s->window     = window < 1 ? 1 : window;
+    s->timeout    = TIMEOUT_SEC;
+    s->produce    = produce;
+    s->arg        = arg;
+    s->base       = 1;
+    s->next       = 1;
+    s->slot_size  = DATA_PACKET_SIZE(block_size);
+
+    s->last_progress = now_usec();
+    rtt_init(&s->rtt, s->timeout);
+    cc_init(&s->cc, &CC_AIMD, s->window);
+    s->pacer.mode = PACE_USER;
+
+    s->slots      = malloc((size_t)s->window * s->slot_size);
+    s->slot_len   = calloc(s->window, sizeof(int));
+    s->slot_sent  = calloc(s->window, sizeof(uint64_t));
+    s->slot_flags = calloc(s->window, 1);
+    if (!s->slots || !s->slot_len || !s->slot_sent || !s->slot_flags) {
+        free(s->slots);
+        free(s->slot_len);
+        free(s->slot_sent);
+        free(s->slot_flags);
+        s->slots      = NULL;
+        s->slot_len   = NULL;
+        s->slot_sent  = NULL;
+        s->slot_flags = NULL;
+        return -1;
+    }
+    set_socket_buffers(sockfd, s->window * s->slot_size);
+    return 0;
+}
+
+static inline void sender_free(WindowSender *s)
+{
+    free(s->slot_zc);
+    s->slot_zc = NULL;
+    free(s->slots);
+    free(s->slot_len);
+    free(s->slot_sent);
+    free(s->slot_flags);
+    s->slots      = NULL;
+    s->slot_len   = NULL;
+    s->slot_sent  = NULL;
+    s->slot_flags = NULL;
+}
+
+/*
+ * sender_set_timeout – Apply a negotiated "timeout" option: it becomes
+ *                      the RTO until the first RTT sample, and the
+ *                      minimum silence before giving up.
+ */
+static inline void sender_set_timeout(WindowSender *s, int sec)
+{
+    s->timeout = sec;
+    rtt_init(&s->rtt, sec);
+}
+
+/*
+ * sender_set_congestion – Choose the congestion controller (`ops`) and
+ *                         PACE_* mode.  A `strict` RFC 7440 receiver
+ *                         only ACKs at window boundaries, so it always
+ *                         gets the fixed negotiated window.
+ *                         PACE_TXTIME falls back to PACE_USER if the
+ *                         socket refuses SO_TXTIME.
+ */
+static inline void sender_set_congestion(WindowSender *s,
+                                         const CongestionOps *ops,
+                                         int pacing, int strict)
+{
+    s->strict = strict;
+    cc_init(&s->cc, strict ? &CC_FIXED : ops, s->window);
+
+    if (pacing == PACE_TXTIME && pacer_enable_txtime(s->sockfd) < 0)
+        pacing = PACE_USER;
+    s->pacer.mode = pacing;
+    pacer_update(&s->pacer, &s->cc, s->rtt.srtt);
+}
+
+/*
+ * sender_enable_gso – Send runs of equal-length packets as one UDP_SEGMENT
+ *                     buffer where the socket supports it.  Returns 1
+ *                     if it does.
+ */
+static inline int sender_enable_gso(WindowSender *s)
+{
+    s->gso = udp_gso_supported(s->sockfd);
+    return s->gso;
+}
+
+/*
+ * sender_enable_zerocopy – Send DATA with MSG_ZEROCOPY, straight from the
+ *                          window's slots; a slot is then only reused
+ *                          once the kernel reports it is done with its
+ *                          last send.  Worth it for large windows of
+ *                          large packets; if the kernel reports that it
+ *                          copied anyway, the sender goes back to plain
+ *                          sends.  Returns 1 if the socket allows it.
+ */
+static inline int sender_enable_zerocopy(WindowSender *s)
+{
+    s->slot_zc = calloc(s->window, sizeof(uint32_t));
+    if (!s->slot_zc || !udp_zerocopy_enable(s->sockfd)) {
+        free(s->slot_zc);
+        s->slot_zc = NULL;
+        return 0;
+    }
+    s->zerocopy = 1;
+    return 1;
+}
+
+/*
+ * sender_restart – Drop everything in flight and carry on with the
+ *                  block after `block`, e.g. when a new multicast master
+ *                  reports where its copy of the file ends.
+ */
+static inline void sender_restart(WindowSender *s, uint32_t block)
+{
+    s->base          = block + 1;
+    s->next          = block + 1;
+    s->base_slot     = 0;
+    s->eof           = 0;
+    s->lost          = 0;
+    s->retries       = 0;
+    s->dupacks       = 0;
+    s->recovering    = 0;
+    s->deadline      = 0;
+    s->done          = 0;
+    s->status        = XFER_OK;
+    s->last_progress = now_usec();
+    memset(s->slot_flags, 0, s->window);
+}
+
+/* Ring index of a produced, unacknowledged `block` */
+static inline int sender_slot(const WindowSender *s, uint32_t block)
+{
+    return (s->base_slot + (uint32_t)(block - s->base)) % s->window;
+}
+
+/* Blocks the sender may have in flight right now */
+static inline int sender_limit(const WindowSender *s)
+{
+    int cwnd = cc_window(&s->cc);
+    return cwnd < s->window ? cwnd : s->window;
+}
+
+/* Blocks still in the network: sent, not SACKed, not given up as lost */
+static inline int sender_pipe(const WindowSender *s)
+{
+    int pipe = 0;
+    for (uint32_t b = s->base; b != s->next; b++)
+        if (!(s->slot_flags[sender_slot(s, b)] & (SLOT_SACKED | SLOT_LOST)))
+            pipe++;
+    return pipe;
+}
+
+/* Oldest block waiting to be sent again; `next` if there is none */
+static inline uint32_t sender_first_lost(const WindowSender *s)
+{
+    if (s->lost > 0)
+        for (uint32_t b = s->base; b != s->next; b++)
+            if (s->slot_flags[sender_slot(s, b)] & SLOT_LOST)
+                return b;
+    return s->next;
+}
+
+/* A full socket buffer turned a packet away: a DATA block goes back
+ * to the lost list, to be sent again by a later pump rather than left
+ * for the retransmit timer.                                          */
+static inline void sender_refused(void *arg, uint32_t block)
+{
+    WindowSender *s = arg;
+
+    s->refused++;
+    s->choked = 1;
+    if (block == TX_UNTAGGED || block - s->base >= s->next - s->base)
+        return;
+
+    uint8_t *f = &s->slot_flags[sender_slot(s, block)];
+    if (!(*f & (SLOT_SACKED | SLOT_LOST))) {
+        *f |= SLOT_LOST;
+        s->lost++;
+    }
+}
+
+/* Send one datagram – DATA `block`, or TX_UNTAGGED – carrying its
+ * SO_TXTIME departure time if pacing is left to the kernel.  Inside a
+ * pump it joins the pump's batch.                                    */
+static inline void sender_send(WindowSender *s, const uint8_t *pkt,
+                               int len, uint64_t departure, uint32_t block)
+{
+    if (s->gate)
+        s->gate->charge(s->gate->arg, len);
+    if (s->batch) {
+        tx_batch_add(s->batch, pkt, len, departure, block);
+        return;
+    }
+
+    TxBatch one;
+    tx_batch_init(&one, s->sockfd, &s->dest, s->dest_len,
+                  s->pacer.mode == PACE_TXTIME);
+    one.refused     = sender_refused;
+    one.refused_arg = s;
+    tx_batch_add(&one, pkt, len, departure, block);
+    tx_batch_flush(&one);
+}
+
+/* Fold a freshly sent block into its FEC group; once the group is
+ * complete, send its parity blocks right behind it.                  */
+static inline void sender_send_parity(WindowSender *s, uint32_t block,
+                                      uint64_t now_ns)
+{
+    int      idx = sender_slot(s, block);
+    int      hdr = data_hdr_len(&s->fmt);
+    uint8_t *pkt = s->slots + (size_t)idx * s->slot_size;
+
+    if (!fec_encoder_add(s->fec, block, pkt + hdr, s->slot_len[idx] - hdr,
+                         s->eof))
+        return;
+
+    /* The parity buffers are reused by the next group, so they are
+     * copied, never sent zero-copy                                  */
+    int zerocopy = s->batch ? s->batch->zerocopy : 0;
+    if (zerocopy) {
+        tx_batch_flush(s->batch);
+        s->batch->zerocopy = 0;
+    }
+    for (int j = 0; j < s->fec->m; j++) {
+        int            len;
+        const uint8_t *par = fec_encoder_parity(s->fec, j, &len);
+        if (par)
+            sender_send(s, par, len, pacer_stamp(&s->pacer, now_ns),
+                        TX_UNTAGGED);
+    }
+    if (s->batch) {
+        tx_batch_flush(s->batch);
+        s->batch->zerocopy = zerocopy;
+    }
+}
+
+static inline void sender_transmit(WindowSender *s, uint32_t block,
+                                   uint64_t now_ns)
+{
+    int      idx       = sender_slot(s, block);
+    uint64_t departure = pacer_stamp(&s->pacer, now_ns);
+
+    sender_send(s, s->slots + (size_t)idx * s->slot_size,
+                s->slot_len[idx], departure, block);
+
+    /* Its send is numbered at most this, once the batch goes */
+    if (s->slot_zc && s->batch && s->batch->zerocopy)
+        s->slot_zc[idx] = s->zc.sent + s->batch->zc_sends +
+                          (uint32_t)s->batch->count;
+
+    s->slot_sent[idx] = departure / 1000;
+    if (s->deadline == 0)
+        s->deadline = departure / 1000 + s->rtt.rto;
+}
+
+/* Take the kernel's zero-copy reports; stop asking for zero-copy once
+ * it says it copied anyway                                           */
+static inline void sender_reap_zerocopy(WindowSender *s)
+{
+    if (zc_reap(&s->zc, s->sockfd) > 0)
+        s->zerocopy = 0;
+}
+
+/* Read the next block from the producer into the slot after the newest
+ * one.  Returns -1 (and ends the transfer) on failure, PRODUCE_AGAIN
+ * if the block is not ready yet.                                      */
+static inline int sender_produce(WindowSender *s)
+{
+    int      idx = sender_slot(s, s->next);
+    uint8_t *pkt = s->slots + (size_t)idx * s->slot_size;
+    int      hdr = data_hdr_len(&s->fmt);
+    uint64_t off = block_offset(s->next, s->block_size);
+    int      raw_len = 0;
+
+    /* The slot's last zero-copy send may still be in the kernel's hands */
+    if (s->slot_zc && !zc_released(&s->zc, s->slot_zc[idx])) {
+        sender_reap_zerocopy(s);
+        if (!zc_released(&s->zc, s->slot_zc[idx]))
+            return PRODUCE_AGAIN;
+    }
+
+    int enc_len = s->produce(s->arg, off, pkt + hdr, &raw_len);
+    if (enc_len == PRODUCE_AGAIN)
+        return PRODUCE_AGAIN;
+    if (enc_len < 0) {
+        s->status = XFER_FAILED;
+        s->done   = 1;
+        return -1;
+    }
+
+    uint16_t net_op = htons(OP_DATA);
+    memcpy(pkt, &net_op, 2);
+    int len = 2 + block_put(&s->fmt, pkt + 2, s->next);
+    if (s->fmt.ext)
+        put_u64(pkt + len, off);
+    s->slot_len[idx]   = hdr + enc_len;
+    s->slot_flags[idx] = 0;
+
+    if (raw_len < s->block_size)
+        s->eof = 1;
+
+    s->next++;
+    s->blocks++;
+    return 0;
+}
+
+/*
+ * sender_pump – Resend blocks marked lost, oldest first, then produce
+ *               and send new ones, until the congestion window is full,
+ *               the final block is out, or the pacer or the gate says
+ *               to wait (`paced` / `gated` is then set).  What it sends
+ *               leaves in one batch at the end; what a full socket
+ *               buffer refuses is marked lost and the pump stops
+ *               (`choked`), leaving it to the next.
+ */
+static inline void sender_pump(WindowSender *s)
+{
+    int      limit = sender_limit(s);
+    int      pipe  = sender_pipe(s);
+    uint64_t now   = now_nsec();
+    TxBatch  batch;
+
+    tx_batch_init(&batch, s->sockfd, &s->dest, s->dest_len,
+                  s->pacer.mode == PACE_TXTIME);
+    batch.gso      = s->gso;
+    batch.zerocopy = s->zerocopy && zc_room(&s->zc) > IO_BATCH_IOV;
+    batch.refused     = sender_refused;
+    batch.refused_arg = s;
+    s->batch       = &batch;
+    s->paced  = 0;
+    s->gated  = 0;
+    s->choked = 0;
+    while (!s->done && !s->choked && pipe < limit) {
+        uint32_t block = sender_first_lost(s);
+        int      fresh = block == s->next;
+
+        if (fresh && (s->eof || s->next - s->base >= (uint32_t)s->window))
+            break;
+        if (pacer_delay(&s->pacer, now) > 0) {
+            s->paced = 1;
+            break;
+        }
+        if (s->gate) {
+            uint64_t hold = s->gate->admit(s->gate->arg, now);
+            if (hold > 0) {
+                s->gated = now + hold;
+                break;
+            }
+        }
+
+        if (fresh) {
+            if (sender_produce(s) < 0)
+                break;
+        } else {
+            int idx = sender_slot(s, block);
+            s->slot_flags[idx] = (s->slot_flags[idx] & ~SLOT_LOST)
+                               | SLOT_RESENT;
+            s->lost--;
+            s->retransmits++;
+        }
+        sender_transmit(s, block, now);
+        if (fresh && s->fec)
+            sender_send_parity(s, block, now);
+        pipe++;
+    }
+    tx_batch_flush(&batch);
+    s->batch      = NULL;
+    s->gso        = batch.gso;      /* cleared if the kernel refused */
+    s->segmented += batch.segmented;
+    s->zc.sent   += batch.zc_sends;
+}
+
+/* Give up on every unacknowledged block the receiver doesn't hold; the
+ * next pump sends them again, oldest first.  Without SACK this is
+ * go-back-N.                                                         */
+static inline void sender_mark_all_lost(WindowSender *s)
+{
+    for (uint32_t b = s->base; b != s->next; b++) {
+        uint8_t *f = &s->slot_flags[sender_slot(s, b)];
+        if (!(*f & (SLOT_SACKED | SLOT_LOST))) {
+            *f |= SLOT_LOST;
+            s->lost++;
+        }
+    }
+    s->deadline = 0;            /* rearmed by the first resend          */
+}
+
+/* Enter loss recovery: the controller reacts once per window of data,
+ * however many duplicate ACKs, SACK holes or timeouts it produces.   */
+static inline void sender_congested(WindowSender *s, int timeout)
+{
+    if (timeout)
+        s->cc.ops->on_timeout(&s->cc);
+    else if (!s->recovering)
+        s->cc.ops->on_loss(&s->cc);
+
+    s->recovering = 1;
+    s->recover    = s->next - 1;
+    s->dupacks    = 0;
+    pacer_update(&s->pacer, &s->cc, s->rtt.srtt);
+}
+
+/*
+ * sender_on_ack – An ACK covers every block up to and including
+ *                 `block`.  ACKs that cover nothing new never trigger a
+ *                 retransmission on their own (no Sorcerer's
+ *                 Apprentice); without SACK, DUPACK_THRESHOLD of them in
+ *                 a row mean a block was lost.  A strict RFC 7440
+ *                 receiver only ACKs early when it hit a gap, so there
+ *                 any ACK short of the newest block restarts from there.
+ */
+static inline void sender_on_ack(WindowSender *s, uint32_t block)
+{
+    uint32_t covered  = block + 1 - s->base;
+    uint32_t inflight = s->next - s->base;
+
+    if (covered == 0) {
+        if (!s->strict && !s->sack && inflight && !s->recovering &&
+            ++s->dupacks >= DUPACK_THRESHOLD) {
+            sender_congested(s, 0);
+            sender_mark_all_lost(s);
+        }
+        return;
+    }
+    if (covered > inflight)
+        return;
+
+    /* Karn: only blocks sent exactly once yield an RTT sample */
+    uint64_t now    = now_usec();
+    int      idx    = sender_slot(s, block);
+    int64_t  sample = 0;
+    if (!(s->slot_flags[idx] & SLOT_RESENT)) {
+        sample = (int64_t)(now - s->slot_sent[idx]);
+        rtt_sample(&s->rtt, sample);
+    } else {
+        rtt_restore(&s->rtt);
+    }
+
+    for (uint32_t b = s->base; b != block + 1; b++)
+        if (s->slot_flags[sender_slot(s, b)] & SLOT_LOST)
+            s->lost--;
+
+    s->base          = block + 1;
+    s->base_slot     = (s->base_slot + covered) % s->window;
+    s->retries       = 0;
+    s->dupacks       = 0;
+    s->last_progress = now;
+
+    if (s->recovering && block_after(s->base, s->recover))
+        s->recovering = 0;
+    if (!s->recovering)
+        s->cc.ops->on_ack(&s->cc, covered, sample);
+    pacer_update(&s->pacer, &s->cc, s->rtt.srtt);
+
+    if (s->base == s->next) {
+        s->deadline = 0;
+        if (s->eof) {
+            s->status = XFER_OK;
+            s->done   = 1;
+        }
+        return;
+    }
+
+    s->deadline = now + s->rtt.rto;
+    if (s->strict)
+        sender_mark_all_lost(s);
+}
+
+/*
+ * sender_on_sack – Apply the cumulative part like an ACK, then mark the
+ *                  blocks the receiver holds beyond the first hole.  A
+ *                  hole with DUPACK_THRESHOLD or more SACKed blocks
+ *                  above it is taken as lost (RFC 6675) and only it is
+ *                  sent again.  A hole that was already resent is left
+ *                  to the retransmission timer.
+ */
+static inline void sender_on_sack(WindowSender *s, uint32_t block,
+                                  const uint8_t *bitmap, int bytes)
+{
+    sender_on_ack(s, block);
+    if (s->done || s->base != block + 1)
+        return;
+
+    uint32_t inflight = s->next - s->base;
+    for (int i = 0; i < bytes * 8; i++) {
+        uint32_t off = (uint32_t)i + 1;           /* base + 1 + i     */
+        if (off >= inflight)
+            break;
+        if (!(bitmap[i / 8] & (1u << (i % 8))))
+            continue;
+
+        uint8_t *f = &s->slot_flags[sender_slot(s, s->base + off)];
+        if (*f & SLOT_LOST)
+            s->lost--;
+        *f = (*f & ~SLOT_LOST) | SLOT_SACKED;
+    }
+
+    int above = 0, marked = 0;
+    for (uint32_t off = inflight; off-- > 0; ) {
+        uint8_t *f = &s->slot_flags[sender_slot(s, s->base + off)];
+        if (*f & SLOT_SACKED) {
+            above++;
+        } else if (above >= DUPACK_THRESHOLD &&
+                   !(*f & (SLOT_LOST | SLOT_RESENT))) {
+            *f |= SLOT_LOST;
+            s->lost++;
+            marked++;
+        }
+    }
+    if (marked)
+        sender_congested(s, 0);
+}
+
+static inline void sender_on_packet(WindowSender *s, const uint8_t *buf,
+                                    ssize_t n,
+                                    const struct sockaddr_in *from)
+{
+    if (n < 4) return;
+    if (!same_peer(from, &s->peer)) {
+        send_error(s->sockfd, (struct sockaddr_in *)from,
+                   ERR_UNKNOWN_TID, "Unknown transfer ID");
+        return;
+    }
+
+    uint16_t opcode = ntohs(*(const uint16_t *)buf);
+    int      hdr    = 2 + block_field_len(&s->fmt);
+    if (opcode == OP_ACK || (opcode == OP_SACK && s->sack)) {
+        if (n < hdr)
+            return;             /* e.g. a late classic ACK 0            */
+        uint32_t block = block_get(&s->fmt, buf + 2, s->base);
+        if (opcode == OP_ACK)
+            sender_on_ack(s, block);
+        else
+            sender_on_sack(s, block, buf + hdr, (int)(n - hdr));
+    } else if (opcode == OP_ERROR) {
+        copy_peer_error(s->peer_error, buf, n);
+        s->status = XFER_ABORTED;
+        s->done   = 1;
+    }
+}
+
+static inline void sender_on_timeout(WindowSender *s)
+{
+    if (peer_gone(++s->retries, s->last_progress, s->timeout)) {
+        s->status = XFER_TIMEOUT;
+        s->done   = 1;
+        return;
+    }
+    rtt_backoff(&s->rtt);
+    sender_congested(s, 1);
+
+    /* SACKs are advisory (RFC 2018): the receiver may have dropped what
+       it held, so after a timeout everything unacknowledged goes again */
+    for (uint32_t b = s->base; b != s->next; b++)
+        s->slot_flags[sender_slot(s, b)] &= ~SLOT_SACKED;
+    sender_mark_all_lost(s);
+}
+
+/*
+ * sender_wait – Microseconds until the sender next needs to run: the
+ *               pacer or the gate releasing a block, or the retransmit
+ *               timer.
+ */
+static inline uint64_t sender_wait(const WindowSender *s, uint64_t now)
+{
+    uint64_t wait = s->deadline ? (s->deadline > now ? s->deadline - now
+                                                     : 0)
+                                : (uint64_t)s->rtt.rto;
+    if (s->paced) {
+        uint64_t pace = (pacer_delay(&s->pacer, now_nsec()) + 999) / 1000;
+        if (pace < wait)
+            wait = pace;
+    }
+    if (s->gated) {
+        uint64_t ns   = now_nsec();
+        uint64_t gate = s->gated > ns ? (s->gated - ns + 999) / 1000 : 0;
+        if (gate < wait)
+            wait = gate;
+    }
+    return wait;
+}
+
+/* Hand every queued datagram to the sender, a batch at a time */
+static inline void sender_drain(WindowSender *s, RxBatch *rx)
+{
+    int n;
+    if (s->slot_zc)
+        sender_reap_zerocopy(s);
+    do {
+        n = rx_batch_fill(rx, s->sockfd);
+        for (int i = 0; i < n && !s->done; i++)
+            sender_on_packet(s, rx_batch_data(rx, i), rx_batch_len(rx, i),
+                             rx_batch_from(rx, i));
+    } while (!rx_batch_drained(rx) && !s->done);
+}
+
+/*
+ * sender_run – Blocking driver: stream the whole file and return the
+ *              final XFER_* status.
+ */
+static inline int sender_run(WindowSender *s)
+{
+    RxBatch rx;
+    if (rx_batch_init(&rx, MAX_REQUEST_SIZE) < 0)
+        return XFER_FAILED;
+
+    sender_pump(s);
+
+    while (!s->done) {
+        uint64_t now = now_usec();
+        if (s->deadline && now >= s->deadline) {
+            sender_on_timeout(s);
+            sender_pump(s);
+            continue;
+        }
+
+        if (!wait_readable(s->sockfd, sender_wait(s, now))) {
+            sender_pump(s);
+            continue;
+        }
+
+        /* Take every queued ACK before sending more */
+        sender_drain(s, &rx);
+        sender_pump(s);
+    }
+    rx_batch_free(&rx);
+    return s->status;
+}
+
+/*
+ * sender_poll – Non-blocking driver for an event loop: take every queued
+ *               ACK, run the retransmit timer if it has expired, and send
+ *               what the window allows.  Returns the now_usec() time at
+ *               which the sender next needs to run; `s->done` is set
+ *               once the transfer is over.
+ */
+static inline uint64_t sender_poll(WindowSender *s, RxBatch *rx)
+{
+    sender_drain(s, rx);
+    if (!s->done && s->deadline && now_usec() >= s->deadline)
+        sender_on_timeout(s);
+    sender_pump(s);
+
+    uint64_t now = now_usec();
+    return now + sender_wait(s, now);
+}
+
+/* ================================================================== */
+/*  Receiver                                                           */
+/* ================================================================== */
+
+/*
+ * receiver_init – Prepare `r` to accept blocks from `peer` and hand
+ *                 them to `consume`.
+ */
+static inline void receiver_init(WindowReceiver *r, int sockfd,
+                                 const struct sockaddr_in *peer,
+                                 socklen_t peer_len, int block_size,
+                                 int window, BlockConsumer consume,
+                                 void *arg)
+{
+    memset(r, 0, sizeof(*r));
+    r->sockfd     = sockfd;
+    r->peer       = *peer;
+    r->peer_len   = peer_len;
+    r->block_size = block_size;
+    r->window     = window < 1 ? 1 : window;
+    r->timeout    = TIMEOUT_SEC;
+    r->consume    = consume;
+    r->arg        = arg;
+    r->expected   = 1;
+
+    /* Our OACK / ACK 0 has just gone out: the first DATA block to come
+       back measures the round trip.                                   */
+    rtt_init(&r->rtt, r->timeout);
+    r->last_progress = now_usec();
+    r->probe_sent    = r->last_progress;
+    r->deadline      = r->last_progress + r->rtt.rto;
+
+    set_socket_buffers(sockfd, r->window * DATA_PACKET_SIZE(block_size));
+}
+
+/*
+ * receiver_set_timeout – Apply a negotiated "timeout" option (see
+ *                        sender_set_timeout).
+ */
+static inline void receiver_set_timeout(WindowReceiver *r, int sec)
+{
+    r->timeout  = sec;
+    rtt_init(&r->rtt, sec);
+    r->deadline = now_usec() + r->rtt.rto;
+}
+
+/*
+ * receiver_enable_sack – Keep blocks that arrive beyond a hole and
+ *                        report them with OP_SACK, so the sender only
+ *                        resends what is missing.  Returns -1 if the
+ *                        reorder buffer can't be allocated.
+ */
+static inline int receiver_enable_sack(WindowReceiver *r)
+{
+    r->held_size = DATA_PACKET_SIZE(r->block_size) - XDATA_HDR_LEN;
+    r->held      = malloc((size_t)r->window * r->held_size);
+    r->held_len  = malloc((size_t)r->window * sizeof(int));
+    if (!r->held || !r->held_len) {
+        free(r->held);
+        free(r->held_len);
+        r->held     = NULL;
+        r->held_len = NULL;
+        return -1;
+    }
+    for (int i = 0; i < r->window; i++)
+        r->held_len[i] = -1;
+    r->sack = 1;
+    return 0;
+}
+
+/*
+ * receiver_enable_gro – Let the socket hand over runs of DATA packets
+ *                       as one buffer (UDP_GRO).  Whoever drains it must
+ *                       then receive into GRO_BUF_SIZE buffers.  Returns
+ *                       1 if the socket accepted.
+ */
+static inline int receiver_enable_gro(WindowReceiver *r)
+{
+    r->gro = udp_gro_enable(r->sockfd);
+    return r->gro;
+}
+
+/*
+ * receiver_set_settler – The consumer finishes blocks in the background
+ *                        and `settle` reports how far it got; the
+ *                        transfer is over once the final block is done.
+ */
+static inline void receiver_set_settler(WindowReceiver *r,
+                                        BlockSettler settle, void *arg)
+{
+    r->settle     = settle;
+    r->settle_arg = arg;
+}
+
+static inline void receiver_free(WindowReceiver *r)
+{
+    free(r->held);
+    free(r->held_len);
+    r->held     = NULL;
+    r->held_len = NULL;
+}
+
+/* Ring index of the held block `d` places after `expected` */
+static inline int receiver_slot(const WindowReceiver *r, int d)
+{
+    return (r->held_base + d) % r->window;
+}
+
+/* The last block that may be ACKed: `expected - 1`, or with a settler
+ * the last one it has done                                           */
+static inline uint32_t receiver_ceiling(const WindowReceiver *r)
+{
+    return r->settle ? r->settled : r->expected - 1;
+}
+
+/*
+ * receiver_ack – Acknowledge everything up to the ceiling, as a SACK
+ *                listing the held blocks whenever there are any – unless
+ *                FEC may still fill the hole, when the SACK would only
+ *                make the sender resend it, or blocks before the hole
+ *                have yet to settle.
+ */
+static inline void receiver_ack(WindowReceiver *r)
+{
+    uint8_t  pkt[2 + 4 + MAX_SACK_BITMAP];
+    uint32_t ceiling = receiver_ceiling(r);
+    int      sack = r->held_count > 0 && !r->fec_wait &&
+                    ceiling == r->expected - 1;
+    uint16_t op  = htons(sack ? OP_SACK : OP_ACK);
+    int      len = 2;
+
+    memset(pkt, 0, sizeof(pkt));
+    memcpy(pkt, &op, 2);
+    len += block_put(&r->fmt, pkt + len, ceiling);
+
+    if (sack) {
+        uint8_t *bitmap = pkt + len;
+        for (int d = 1; d < r->window; d++) {
+            if (r->held_len[receiver_slot(r, d)] < 0)
+                continue;
+            bitmap[(d - 1) / 8] |= 1u << ((d - 1) % 8);
+            len = (int)(bitmap - pkt) + (d - 1) / 8 + 1;
+        }
+    }
+    sendto(r->sockfd, pkt, len, 0,
+           (struct sockaddr *)&r->peer, r->peer_len);
+    r->acked     = ceiling;
+    r->since_ack = (int)(r->expected - 1 - ceiling);
+}
+
+/*
+ * receiver_flush – Call once the socket has no more queued datagrams.
+ *                  An enhanced sender may be holding fewer blocks in
+ *                  flight than the window, so ACK what has arrived
+ *                  rather than wait for a window boundary that might
+ *                  never come – once it may be ACKed: repeating the
+ *                  last ACK would read as a duplicate.
+ */
+static inline void receiver_flush(WindowReceiver *r)
+{
+    if (!r->strict && !r->done && receiver_ceiling(r) != r->acked)
+        receiver_ack(r);
+}
+
+/* Keep an out-of-order block until the hole before it is filled */
+static inline void receiver_hold(WindowReceiver *r, uint32_t block,
+                                 const uint8_t *payload, int len)
+{
+    uint32_t d = block - r->expected;
+    if (d >= (uint32_t)r->window || d > MAX_SACK_BITMAP * 8 || len > r->held_size)
+        return;                 /* old duplicate or beyond the window   */
+
+    int idx = receiver_slot(r, d);
+    if (r->held_len[idx] >= 0)
+        return;
+    memcpy(r->held + (size_t)idx * r->held_size, payload, len);
+    r->held_len[idx] = len;
+    r->held_count++;
+}
+
+/* Hand block `expected` to the consumer.  Returns 1 once the final
+ * block is in, 0 if more follow, -1 on failure, CONSUME_AGAIN if the
+ * consumer has no room for it yet.                                   */
+static inline int receiver_deliver(WindowReceiver *r, const uint8_t *payload,
+                                   int len)
+{
+    int plain = r->consume(r->arg, block_offset(r->expected, r->block_size),
+                           payload, len);
+    if (plain == CONSUME_AGAIN)
+        return CONSUME_AGAIN;
+    if (plain < 0) {
+        r->status = XFER_FAILED;
+        r->done   = 1;
+        return -1;
+    }
+
+    r->expected++;
+    r->blocks++;
+    r->since_ack++;
+    r->fec_wait = 0;
+    if (r->sack)
+        r->held_base = receiver_slot(r, 1);
+
+    if (plain < r->block_size && r->settle) {
+        r->final = 1;           /* receiver_settle ends the transfer   */
+        return 1;
+    }
+    if (plain < r->block_size) {
+        receiver_ack(r);
+        r->status = XFER_OK;
+        r->done   = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* The hole is filled (or the consumer has room again): deliver what
+ * was held behind it, or what FEC rebuilt                            */
+static inline void receiver_release(WindowReceiver *r)
+{
+    while (!r->done && !r->final) {
+        const uint8_t *next = NULL;
+        int            next_len = -1;
+        int            idx = receiver_slot(r, 0);
+
+        if (r->held_count > 0 && r->held_len[idx] >= 0) {
+            next     = r->held + (size_t)idx * r->held_size;
+            next_len = r->held_len[idx];
+        }
+        if (!next && r->fec) {
+            idx  = -1;
+            next = fec_lookup(r->fec, r->expected, &next_len);
+        }
+        if (!next)
+            break;
+
+        int rc = receiver_deliver(r, next, next_len);
+        if (rc == CONSUME_AGAIN)
+            break;
+        if (idx >= 0 && r->held_count > 0 && r->held_len[idx] >= 0) {
+            r->held_len[idx] = -1;
+            r->held_count--;
+        }
+        if (rc != 0)
+            break;
+    }
+}
+
+static inline void receiver_on_data(WindowReceiver *r, uint32_t block,
+                                    const uint8_t *payload, int len)
+{
+    if (r->fec && block - r->expected < (uint32_t)(r->window + r->fec->k))
+        fec_store_data(r->fec, block, payload, len);
+
+    if (block != r->expected) {
+        r->duplicates++;
+        if (r->sack)
+            receiver_hold(r, block, payload, len);
+
+        /* A hole the group's parity may still fill is not reported yet */
+        if (r->fec && block_after(block, r->expected) &&
+            fec_may_repair(r->fec, r->expected, block)) {
+            r->fec_wait = 1;
+            return;
+        }
+
+        /* Duplicate or gap – tell the sender where we really are */
+        r->fec_wait = 0;
+        receiver_ack(r);
+        return;
+    }
+
+    /* The first block after a window-opening ACK measures the round
+       trip (the sender had been waiting for that ACK).               */
+    uint64_t now = now_usec();
+    if (r->probe_sent) {
+        rtt_sample(&r->rtt, (int64_t)(now - r->probe_sent));
+        r->probe_sent = 0;
+    } else if (r->retries) {
+        rtt_restore(&r->rtt);
+    }
+    r->retries       = 0;
+    r->last_progress = now;
+
+    int rc = receiver_deliver(r, payload, len);
+    if (rc == CONSUME_AGAIN && r->sack)
+        receiver_hold(r, block, payload, len);
+    if (rc != 0)
+        return;
+
+    receiver_release(r);
+    if (r->done || r->final)
+        return;
+
+    if (r->since_ack >= r->window && receiver_ceiling(r) != r->acked) {
+        receiver_ack(r);
+        r->probe_sent = now;
+    }
+}
+
+/*
+ * receiver_on_parity – Keep a PARITY packet and rebuild what it can.  If
+ *                      the block we wait for is still missing once its
+ *                      stride's parity is in, report the gap after all.
+ */
+static inline void receiver_on_parity(WindowReceiver *r, const uint8_t *buf,
+                                      ssize_t n)
+{
+    uint32_t first = fec_store_parity(r->fec, buf, n);
+    if (first == 0)
+        return;
+    fec_repair(r->fec, first);
+
+    int            len;
+    const uint8_t *payload = fec_lookup(r->fec, r->expected, &len);
+    if (payload) {
+        receiver_on_data(r, r->expected, payload, len);
+        return;
+    }
+
+    int later = fec_group_of(r->fec, first) != fec_group_of(r->fec,
+                                                            r->expected);
+    if (r->fec_wait &&
+        (later || !fec_may_repair(r->fec, r->expected, r->expected))) {
+        r->fec_wait = 0;
+        receiver_ack(r);
+    }
+}
+
+static inline void receiver_on_packet(WindowReceiver *r,
+                                      const uint8_t *buf, ssize_t n,
+                                      const struct sockaddr_in *from)
+{
+    if (n < 4) return;
+    if (!same_peer(from, &r->peer)) {
+        send_error(r->sockfd, (struct sockaddr_in *)from,
+                   ERR_UNKNOWN_TID, "Unknown transfer ID");
+        return;
+    }
+
+    r->deadline = now_usec() + r->rtt.rto;
+
+    uint16_t opcode = ntohs(*(const uint16_t *)buf);
+    int      hdr    = data_hdr_len(&r->fmt);
+    if (opcode == OP_DATA) {
+        /* Workers share one receive buffer sized for the largest block,
+           so a payload is only as long as this session's may be      */
+        if (n < hdr ||
+            n - hdr > DATA_PACKET_SIZE(r->block_size) - XDATA_HDR_LEN)
+            return;
+        uint32_t block = block_get(&r->fmt, buf + 2, r->expected);
+        if (r->fmt.ext &&
+            get_u64(buf + 6) != block_offset(block, r->block_size)) {
+            send_error(r->sockfd, &r->peer, ERR_ILLEGAL_OP,
+                       "Block offset mismatch");
+            r->status = XFER_FAILED;
+            r->done   = 1;
+            return;
+        }
+        receiver_on_data(r, block, buf + hdr, (int)(n - hdr));
+    } else if (opcode == OP_PARITY && r->fec) {
+        receiver_on_parity(r, buf, n);
+    } else if (opcode == OP_ERROR) {
+        copy_peer_error(r->peer_error, buf, n);
+        r->status = XFER_ABORTED;
+        r->done   = 1;
+    } else {
+        send_error(r->sockfd, &r->peer, ERR_ILLEGAL_OP,
+                   "Expected DATA packet");
+        r->status = XFER_FAILED;
+        r->done   = 1;
+    }
+}
+
+static inline void receiver_on_timeout(WindowReceiver *r)
+{
+    if (peer_gone(++r->retries, r->last_progress, r->timeout)) {
+        r->status = XFER_TIMEOUT;
+        r->done   = 1;
+        return;
+    }
+
+    rtt_backoff(&r->rtt);
+    r->deadline   = now_usec() + r->rtt.rto;
+    r->probe_sent = 0;          /* Karn: the next block may answer either */
+    r->fec_wait   = 0;          /* the parity isn't coming after all      */
+
+    /* Until the first block arrives our OACK may be what got lost */
+    if (r->expected == 1 && r->hello)
+        sendto(r->sockfd, r->hello, r->hello_len, 0,
+               (struct sockaddr *)&r->peer, r->peer_len);
+    else
+        receiver_ack(r);
+}
+
+/* The blocks after `settled` were turned down (a forged one among
+ * them): forget them and whatever was held or rebuilt, and ask for
+ * them again                                                         */
+static inline void receiver_rewind(WindowReceiver *r)
+{
+    uint32_t n = r->expected - 1 - r->settled;
+
+    r->rejected += n;
+    r->blocks   -= n;
+    r->expected  = r->settled + 1;
+    r->final     = 0;
+    r->fec_wait  = 0;
+    if (r->sack) {
+        for (int i = 0; i < r->window; i++)
+            r->held_len[i] = -1;
+        r->held_count = 0;
+        r->held_base  = 0;
+    }
+    if (r->fec)
+        fec_decoder_reset(r->fec);
+    receiver_ack(r);
+}
+
+/*
+ * receiver_settle – Ask the settler how far the consumer got, ACK the
+ *                   window it completes, give the consumer what it had
+ *                   no room for, and end the transfer once the final
+ *                   block is done.
+ */
+static inline void receiver_settle(WindowReceiver *r)
+{
+    uint32_t settled;
+
+    if (!r->settle || r->done)
+        return;
+    int rc = r->settle(r->settle_arg, &settled);
+    if (rc < 0) {
+        r->status = XFER_FAILED;
+        r->done   = 1;
+        return;
+    }
+    if (settled != r->settled) {
+        r->settled       = settled;
+        r->last_progress = now_usec();
+    }
+    if (rc == SETTLE_REJECTED) {
+        receiver_rewind(r);
+        return;
+    }
+    if (r->since_ack >= r->window && r->settled != r->acked) {
+        receiver_ack(r);
+        r->probe_sent = now_usec();
+    }
+    receiver_release(r);
+    if (r->final && !r->done && r->settled == r->expected - 1) {
+        receiver_ack(r);
+        r->status = XFER_OK;
+        r->done   = 1;
+    }
+}
+
+/* When the receiver next needs to run: its re-ACK timer, or sooner
+ * while the settler still has blocks                                 */
+static inline uint64_t receiver_wake(const WindowReceiver *r,
+                                     uint64_t now)
+{
+    if (r->settle && !r->done && r->settled != r->expected - 1 &&
+        now + SETTLE_POLL_USEC < r->deadline)
+        return now + SETTLE_POLL_USEC;
+    return r->deadline;
+}
+
+/* Hand every queued datagram to the receiver, a batch at a time */
+static inline void receiver_drain(WindowReceiver *r, RxBatch *rx)
+{
+    int n;
+    rx->max_seg = DATA_PACKET_SIZE(r->block_size);
+    do {
+        n = rx_batch_fill(rx, r->sockfd);
+        for (int i = 0; i < n && !r->done; i++)
+            receiver_on_packet(r, rx_batch_data(rx, i), rx_batch_len(rx, i),
+                               rx_batch_from(rx, i));
+        r->coalesced += rx->coalesced;
+    } while (!rx_batch_drained(rx) && !r->done);
+}
+
+/*
+ * receiver_poll – Non-blocking driver for an event loop: take every
+ *                 queued block, settle what the consumer finished, ACK
+ *                 what arrived, and run the re-ACK timer if it has
+ *                 expired.  Returns the now_usec() time
+ *                 at which the receiver next needs to run.
+ */
+static inline uint64_t receiver_poll(WindowReceiver *r, RxBatch *rx)
+{
+    receiver_drain(r, rx);
+    receiver_settle(r);
+    receiver_flush(r);
+    if (!r->done && now_usec() >= r->deadline)
+        receiver_on_timeout(r);
+    return receiver_wake(r, now_usec());
+}
+
+/*
+ * receiver_run – Blocking driver: accept the whole file and return the
+ *                final XFER_* status.
+ */
+static inline int receiver_run(WindowReceiver *r)
+{
+    size_t  cap = DATA_PACKET_SIZE(r->block_size);
+    RxBatch rx;
+    if (rx_batch_init(&rx, r->gro && cap < GRO_BUF_SIZE ? GRO_BUF_SIZE
+                                                        : cap) < 0)
+        return XFER_FAILED;
+
+    while (!r->done) {
+        uint64_t now = now_usec();
+        if (now >= r->deadline) {
+            receiver_on_timeout(r);
+            continue;
+        }
+        if (!wait_readable(r->sockfd, receiver_wake(r, now) - now)) {
+            receiver_settle(r);
+            receiver_flush(r);
+            continue;
+        }
+
+        receiver_drain(r, &rx);
+        receiver_settle(r);
+        receiver_flush(r);
+    }
+
+    rx_batch_free(&rx);
+    return r->status;
+}
+
+#endif /* TRANSPORT_H */
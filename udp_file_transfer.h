@@ -5,9 +5,15 @@
  *
  * Defines:
  *   • Wire-format packet structures (RRQ / WRQ / DATA / ACK / ERROR /
- *     DELETE / DACK)
- *   • AES-256-CBC encryption / decryption helpers
+ *     DELETE / DACK / OACK / SACK / PARITY)
+ *   • RFC 2347 option parsing / encoding (blksize, timeout, tsize,
+ *     windowsize – RFCs 2348, 2349, 7440 – multicast (RFC 2090),
+ *     rollover, and the "sack", "exthdr", "range", "resume", "fec",
+ *     "delta", "compress" and "gcm" extensions)
+ *   • Per-stream ciphers: AES-256-CBC, or AES-256-GCM with session keys
+ *   • Per-block compression (deflate) with an adaptive bypass
  *   • MD5 checksum helper
+ *   • File streams (read → encrypt / decrypt → write, one block a time)
  *   • Shared constants (port, timeouts, sizes, opcodes)
  *   • Utility function declarations used by both client and server
  * =====================================================================
@@ -19,26 +25,41 @@
 /* ------------------------------------------------------------------ */
 /*  Standard headers                                                   */
 /* ------------------------------------------------------------------ */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE             /* ppoll(), Linux socket options        */
+#endif
+#define _FILE_OFFSET_BITS   64  /* pread/pwrite past 2 GB on 32-bit     */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
+#include <ctype.h>
 #include <stdint.h>
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <time.h>
 #include <sys/stat.h>
+#include <sys/statvfs.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <pthread.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <sys/mman.h>
 
 /* OpenSSL for AES encryption and MD5 hashing */
 #include <openssl/evp.h>
 #include <openssl/aes.h>
 #include <openssl/md5.h>
 #include <openssl/rand.h>
+#include <openssl/hmac.h>
+
+/* zlib for per-block compression */
+#include <zlib.h>
 
 /* ------------------------------------------------------------------ */
 /*  Constants                                                          */
@@ -51,13 +72,33 @@
 
 /* Packet sizes */
 #define BLOCK_SIZE          512         /* Standard TFTP block size         */
-#define ENHANCED_BLOCK_SIZE 4096        /* Enhanced (larger) block size     */
-#define MAX_PACKET_SIZE     (ENHANCED_BLOCK_SIZE + 4)  /* data + header    */
+#define ENHANCED_BLOCK_SIZE 4096        /* Default for "enhanced" mode      */
+#define MIN_BLOCK_SIZE      8           /* RFC 2348 blksize lower bound     */
+#define MAX_BLOCK_SIZE      65464       /* RFC 2348 blksize upper bound     */
+#define MAX_REQUEST_SIZE    1024        /* RRQ/WRQ/OACK/ACK/ERROR packets   */
+#define MAX_MCAST_OPTION    32          /* "addr,port,mc" multicast value   */
+
+/* DATA headers: the classic opcode + 16-bit block, or with "exthdr" a
+ * 32-bit block and the 64-bit file offset of the block.               */
+#define DATA_HDR_LEN        4           /* opcode(2) + block#(2)            */
+#define XDATA_HDR_LEN       14          /* opcode(2) + block#(4) + off(8)   */
+
+/* A DATA packet carries one encrypted block: header + plaintext + up to
+ * one cipher block of padding.  Buffers are sized per session from the
+ * negotiated blksize with this macro (room for the larger header).    */
+#define DATA_PACKET_SIZE(blksize) \
+    (XDATA_HDR_LEN + (blksize) + EVP_MAX_BLOCK_LENGTH)
 
 /* Reliability */
 #define MAX_RETRIES         5           /* Retransmit attempts              */
 #define TIMEOUT_SEC         3           /* Seconds before retransmit        */
 #define TIMEOUT_USEC        0           /* Microsecond component            */
+#define MAX_TIMEOUT_SEC     255         /* RFC 2349 "timeout" upper bound   */
+
+/* Sliding window (RFC 7440 "windowsize" option) */
+#define DEFAULT_WINDOW_SIZE 16          /* Client's requested window        */
+#define MAX_WINDOW_SIZE     256         /* Largest window the server grants */
+#define MAX_SACK_BITMAP     (MAX_WINDOW_SIZE / 8)   /* SACK bitmap bytes    */
 
 /* Opcodes – first two match standard TFTP, rest are extensions */
 #define OP_RRQ              1           /* Read request                     */
@@ -67,6 +108,12 @@
 #define OP_ERROR            5           /* Error                            */
 #define OP_DELETE           6           /* Delete request  (extension)      */
 #define OP_DACK             7           /* Delete acknowledgment (ext.)     */
+#define OP_SACK             8           /* Selective acknowledgment (ext.)  */
+#define OP_PARITY           9           /* FEC parity block (extension)     */
+
+/* RFC 2347 assigns OACK opcode 6.  It only ever travels server → client,
+ * while DELETE only travels client → server, so the two never collide. */
+#define OP_OACK             6           /* Option acknowledgment            */
 
 /* Error codes (subset – mirrors standard TFTP) */
 #define ERR_UNDEFINED       0
@@ -77,6 +124,7 @@
 #define ERR_UNKNOWN_TID     5
 #define ERR_FILE_EXISTS     6
 #define ERR_NO_SUCH_USER    7
+#define ERR_OPTION_REFUSED  8           /* RFC 2347 option negotiation      */
 
 /* Directories the server uses */
 #define FILE_STORAGE_DIR    "./server_files/"
@@ -86,6 +134,26 @@
 #define AES_KEY_SIZE        32   /* 256 bits */
 #define AES_IV_SIZE         16   /* 128 bits */
 
+/* AES-256-GCM ("gcm" option).  The session key is derived from the
+ * shared key and a random salt the client picks; a block's nonce is its
+ * offset in the transfer, and a tag takes the place of the padding.   */
+#define GCM_SALT_LEN        16          /* Salt bytes (32 hex digits)       */
+#define GCM_NONCE_LEN       12          /* 4 zero bytes + 64-bit offset     */
+#define GCM_TAG_LEN         16          /* Appended to every block          */
+
+/* Block compression ("compress" option).  Each block is compressed on
+ * its own before encryption and starts with a flag byte saying whether
+ * the rest is deflated or stored as is.                               */
+#define CODEC_NONE          0
+#define CODEC_DEFLATE       1           /* Raw deflate (zlib)               */
+#define CODEC_LEVEL         1           /* Z_BEST_SPEED: links, not disks   */
+#define BLOCK_STORED        0           /* Flag: plaintext follows          */
+#define BLOCK_DEFLATED      1           /* Flag: deflate stream follows     */
+#define CODEC_MIN_GAIN      16          /* Keep a block only if it saves
+                                           at least 1/16 of its size       */
+#define CODEC_MAX_SKIP      64          /* Most blocks stored untried after
+                                           incompressible ones             */
+
 /* ------------------------------------------------------------------ */
 /*  Packet structures                                                  */
 /* ------------------------------------------------------------------ */
@@ -103,7 +171,7 @@ typedef struct __attribute__((packed)) {
 typedef struct __attribute__((packed)) {
     uint16_t opcode;                    /* OP_DATA                        */
     uint16_t block_num;                 /* 1-based block number           */
-    uint8_t  data[ENHANCED_BLOCK_SIZE]; /* file data                      */
+    uint8_t  data[];                    /* up to blksize (+ padding)      */
 } DataPacket;
 
 typedef struct __attribute__((packed)) {
@@ -111,12 +179,64 @@ typedef struct __attribute__((packed)) {
     uint16_t block_num;                 /* acknowledged block number      */
 } AckPacket;
 
+/* Negotiated with the "exthdr" option, for files beyond 65535 blocks.
+ * DATA names its block with 32 bits and carries the byte offset of its
+ * first plaintext byte; ACK and SACK carry 32-bit block numbers.     */
+typedef struct __attribute__((packed)) {
+    uint16_t opcode;                    /* OP_DATA                        */
+    uint32_t block_num;                 /* 1-based block number           */
+    uint64_t offset;                    /* (block_num - 1) × blksize      */
+    uint8_t  data[];                    /* up to blksize (+ padding)      */
+} XDataPacket;
+
+typedef struct __attribute__((packed)) {
+    uint16_t opcode;                    /* OP_ACK                         */
+    uint32_t block_num;                 /* acknowledged block number      */
+} XAckPacket;
+
+/* Negotiated with the "sack" option.  `block_num` is cumulative like an
+ * ACK; bit i of the bitmap (LSB first) reports block block_num + 2 + i
+ * as held out of order – block_num + 1 is the first hole by definition.
+ * Trailing zero bytes are omitted.                                    */
+typedef struct __attribute__((packed)) {
+    uint16_t opcode;                    /* OP_SACK                        */
+    uint16_t block_num;                 /* highest in-order block         */
+    uint8_t  bitmap[MAX_SACK_BITMAP];   /* blocks received beyond a hole  */
+} SackPacket;
+
 typedef struct __attribute__((packed)) {
     uint16_t opcode;                    /* OP_ERROR                       */
     uint16_t error_code;
     char     error_msg[MAX_FILENAME];   /* human-readable message         */
 } ErrorPacket;
 
+/* Options carried after the mode string of RRQ / WRQ and echoed back in
+ * OACK as "name\0value\0" pairs.  A zero field means "not present",
+ * except tsize, rollover and resume where 0 is meaningful and -1 marks
+ * absence.
+ * blksize counts plaintext bytes; the cipher may add up to one block. */
+typedef struct {
+    int       blksize;                  /* RFC 2348 block size            */
+    int       timeout;                  /* RFC 2349 seconds               */
+    long long tsize;                    /* RFC 2349 file size, -1 = none  */
+    int       windowsize;               /* RFC 7440 blocks per window     */
+    int       sack;                     /* 1 = selective ACKs (extension) */
+    int       rollover;                 /* Block after 65535, -1 = none   */
+    int       exthdr;                   /* 1 = 32-bit blocks (extension)  */
+    int       multicast;                /* RFC 2090 option present        */
+    char      mcast[MAX_MCAST_OPTION];  /* Its value: "" or addr,port,mc  */
+    int       range;                    /* RRQ byte range present (ext.)  */
+    long long range_off;                /* First byte of the range        */
+    long long range_len;                /* Bytes in the range             */
+    long long resume;                   /* Resume at byte, -1 = none      */
+    int       fec_k;                    /* FEC: data blocks per group     */
+    int       fec_m;                    /* FEC: parity blocks per group   */
+    int       delta;                    /* Delta-sync block size (ext.)   */
+    int       compress;                 /* CODEC_* for every block (ext.) */
+    int       gcm;                      /* AES-256-GCM requested (ext.)   */
+    uint8_t   gcm_salt[GCM_SALT_LEN];   /* Its session key salt           */
+} TransferOptions;
+
 typedef struct __attribute__((packed)) {
     uint16_t opcode;                    /* OP_DELETE                      */
     char     filename[MAX_FILENAME];    /* file to delete                 */
@@ -147,70 +267,143 @@ static const unsigned char SHARED_AES_IV[AES_IV_SIZE] = {
 /*  Utility function declarations                                      */
 /* ------------------------------------------------------------------ */
 
+/* A stream's cipher, keyed once and reused for every block: AES-256-CBC
+ * under the shared key and IV, or with "gcm" AES-256-GCM under a key of
+ * the session's own.                                                  */
+typedef struct {
+    EVP_CIPHER_CTX *ctx;                /* Created on first use           */
+    int             gcm;                /* AES-256-GCM, else CBC          */
+    int             dir;                /* Keyed to encrypt (1), decrypt  */
+                                        /*   (0), or not yet (-1)         */
+    unsigned char   key[AES_KEY_SIZE];
+} BlockCipher;
+
+static inline void cipher_init(BlockCipher *bc)
+{
+    memset(bc, 0, sizeof(*bc));
+    memcpy(bc->key, SHARED_AES_KEY, AES_KEY_SIZE);
+    bc->dir = -1;
+}
+
 /*
- * aes_encrypt – Encrypt `plaintext_len` bytes of `plaintext` into
- *               `ciphertext`.  Returns the ciphertext length on success,
- *               or -1 on failure.
+ * cipher_set_gcm – Switch to AES-256-GCM under HMAC-SHA256(shared key,
+ *                  `salt`).  A fresh salt per session means a fresh
+ *                  key, so block offsets never repeat a nonce under
+ *                  it.  Returns 0, or -1 on failure.
  */
-static inline int aes_encrypt(const unsigned char *plaintext,
-                               int plaintext_len,
-                               unsigned char *ciphertext)
+static inline int cipher_set_gcm(BlockCipher *bc, const uint8_t *salt)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return -1;
+    unsigned int len = 0;
 
-    int len = 0, ciphertext_len = 0;
+    if (!HMAC(EVP_sha256(), SHARED_AES_KEY, AES_KEY_SIZE,
+              salt, GCM_SALT_LEN, bc->key, &len) || len != AES_KEY_SIZE)
+        return -1;
+    bc->gcm = 1;
+    bc->dir = -1;
+    return 0;
+}
+
+static inline void cipher_free(BlockCipher *bc)
+{
+    if (bc->ctx) EVP_CIPHER_CTX_free(bc->ctx);
+    OPENSSL_cleanse(bc->key, sizeof(bc->key));
+    bc->ctx = NULL;
+    bc->dir = -1;
+}
 
-    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
-                           SHARED_AES_KEY, SHARED_AES_IV) != 1)
-        goto fail;
-    if (EVP_EncryptUpdate(ctx, ciphertext, &len,
-                          plaintext, plaintext_len) != 1)
-        goto fail;
-    ciphertext_len = len;
-    if (EVP_EncryptFinal_ex(ctx, ciphertext + len, &len) != 1)
-        goto fail;
-    ciphertext_len += len;
+/* A second context under the same key, for another thread to use */
+static inline void cipher_clone(BlockCipher *dst, const BlockCipher *src)
+{
+    *dst     = *src;
+    dst->ctx = NULL;
+    dst->dir = -1;
+}
 
-    EVP_CIPHER_CTX_free(ctx);
-    return ciphertext_len;
+/* Expand the key for `enc`, the first time it is used that way */
+static inline int cipher_key(BlockCipher *bc, int enc)
+{
+    if (bc->dir == enc)
+        return 0;
+    if (!bc->ctx && !(bc->ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+    if (EVP_CipherInit_ex(bc->ctx, bc->gcm ? EVP_aes_256_gcm()
+                                           : EVP_aes_256_cbc(),
+                          NULL, bc->key, NULL, enc) != 1)
+        return -1;
+    bc->dir = enc;
+    return 0;
+}
 
-fail:
-    EVP_CIPHER_CTX_free(ctx);
-    return -1;
+/* The IV of the block at transfer byte `off`: the GCM nonce, or the
+ * fixed CBC IV                                                        */
+static inline const uint8_t *cipher_iv(const BlockCipher *bc, uint64_t off,
+                                       uint8_t *nonce)
+{
+    if (!bc->gcm)
+        return SHARED_AES_IV;
+    memset(nonce, 0, GCM_NONCE_LEN - 8);
+    for (int i = 0; i < 8; i++)
+        nonce[GCM_NONCE_LEN - 1 - i] = (uint8_t)(off >> (8 * i));
+    return nonce;
 }
 
 /*
- * aes_decrypt – Decrypt `ciphertext_len` bytes of `ciphertext` into
- *               `plaintext`.  Returns the plaintext length on success,
- *               or -1 on failure.
+ * cipher_encrypt – Encrypt the `len` bytes at `in`, the block at byte
+ *                  `off` of the transfer, into `out`.  Returns the
+ *                  ciphertext length (CBC pads to 16 bytes, GCM appends
+ *                  the tag), or -1 on failure.
  */
-static inline int aes_decrypt(const unsigned char *ciphertext,
-                               int ciphertext_len,
-                               unsigned char *plaintext)
+static inline int cipher_encrypt(BlockCipher *bc, uint64_t off,
+                                 const uint8_t *in, int len, uint8_t *out)
 {
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    if (!ctx) return -1;
-
-    int len = 0, plaintext_len = 0;
+    uint8_t nonce[GCM_NONCE_LEN];
+    int     n = 0, fin = 0;
 
-    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL,
-                           SHARED_AES_KEY, SHARED_AES_IV) != 1)
-        goto fail;
-    if (EVP_DecryptUpdate(ctx, plaintext, &len,
-                          ciphertext, ciphertext_len) != 1)
-        goto fail;
-    plaintext_len = len;
-    if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) != 1)
-        goto fail;
-    plaintext_len += len;
+    if (cipher_key(bc, 1) < 0 ||
+        EVP_EncryptInit_ex(bc->ctx, NULL, NULL, NULL,
+                           cipher_iv(bc, off, nonce)) != 1 ||
+        EVP_EncryptUpdate(bc->ctx, out, &n, in, len) != 1 ||
+        EVP_EncryptFinal_ex(bc->ctx, out + n, &fin) != 1)
+        return -1;
+    n += fin;
+    if (bc->gcm) {
+        if (EVP_CIPHER_CTX_ctrl(bc->ctx, EVP_CTRL_GCM_GET_TAG,
+                                GCM_TAG_LEN, out + n) != 1)
+            return -1;
+        n += GCM_TAG_LEN;
+    }
+    return n;
+}
 
-    EVP_CIPHER_CTX_free(ctx);
-    return plaintext_len;
+/*
+ * cipher_decrypt – Decrypt the `len` bytes at `in`, the block at byte
+ *                  `off` of the transfer, into `out`.  Returns the
+ *                  plaintext length, or -1 if the padding or the GCM
+ *                  tag does not check out.
+ */
+static inline int cipher_decrypt(BlockCipher *bc, uint64_t off,
+                                 const uint8_t *in, int len, uint8_t *out)
+{
+    uint8_t nonce[GCM_NONCE_LEN];
+    int     n = 0, fin = 0;
 
-fail:
-    EVP_CIPHER_CTX_free(ctx);
-    return -1;
+    if (bc->gcm) {
+        if (len < GCM_TAG_LEN)
+            return -1;
+        len -= GCM_TAG_LEN;
+    }
+    if (cipher_key(bc, 0) < 0 ||
+        EVP_DecryptInit_ex(bc->ctx, NULL, NULL, NULL,
+                           cipher_iv(bc, off, nonce)) != 1 ||
+        EVP_DecryptUpdate(bc->ctx, out, &n, in, len) != 1)
+        return -1;
+    if (bc->gcm &&
+        EVP_CIPHER_CTX_ctrl(bc->ctx, EVP_CTRL_GCM_SET_TAG, GCM_TAG_LEN,
+                            (void *)(in + len)) != 1)
+        return -1;
+    if (EVP_DecryptFinal_ex(bc->ctx, out + n, &fin) != 1)
+        return -1;
+    return n + fin;
 }
 
 /*
@@ -232,6 +425,565 @@ static inline void compute_md5(const unsigned char *data, size_t len,
     out[MD5_DIGEST_LENGTH * 2] = '\0';
 }
 
+/* ------------------------------------------------------------------ */
+/*  File streams – the per-block work done by both ends of a transfer  */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    int         fd;
+    int         block_size;
+    uint64_t    base;                   /* File offset of block 1         */
+    uint64_t    end;                    /* Reads stop here (range end)    */
+    uint8_t    *buf;                    /* block_size + cipher padding    */
+    BlockCipher cipher;
+    const uint8_t *map;                 /* Whole file mapped, or NULL     */
+    size_t      map_len;
+    EVP_MD_CTX *md5;                    /* Running digest, or NULL        */
+    const char *error;                  /* Reason for the ERROR packet    */
+    int         error_code;             /* Its TFTP code (ERR_UNDEFINED)  */
+
+    int         codec;                  /* CODEC_* applied to each block  */
+    int         encode;                 /* zs deflates (1) or inflates (0)*/
+    z_stream   *zs;                     /* Reused between blocks          */
+    uint8_t    *zbuf;                   /* Deflated / inflated block      */
+    int         zskip;                  /* Blocks to store without trying */
+    int         zbackoff;               /* zskip after the next failure   */
+    uint64_t    zplain;                 /* Plaintext bytes coded          */
+    uint64_t    zcoded;                 /* Bytes they took, flags included*/
+    uint32_t    zstored;                /* Blocks sent or received stored */
+} FileStream;
+
+/*
+ * file_stream_init – Wrap the open file `fd` for block-sized transfers.
+ *                    Blocks are read and written at explicit offsets
+ *                    (pread / pwrite), so the stream keeps no file
+ *                    position of its own.  With `want_md5` set, every
+ *                    plaintext byte is also fed to a running MD5 (blocks
+ *                    must then be passed in order).  Returns 0 on
+ *                    success, -1 on error.
+ */
+static inline int file_stream_init(FileStream *fs, int fd,
+                                   int block_size, int want_md5)
+{
+    memset(fs, 0, sizeof(*fs));
+    fs->fd         = fd;
+    fs->block_size = block_size;
+    fs->end        = UINT64_MAX;
+    fs->buf        = malloc(block_size + EVP_MAX_BLOCK_LENGTH);
+    if (!fs->buf) return -1;
+    cipher_init(&fs->cipher);
+
+    if (want_md5) {
+        fs->md5 = EVP_MD_CTX_new();
+        if (!fs->md5) {
+            free(fs->buf);
+            fs->buf = NULL;
+            return -1;
+        }
+        EVP_DigestInit_ex(fs->md5, EVP_md5(), NULL);
+    }
+    return 0;
+}
+
+/*
+ * file_stream_set_range – Limit the stream to `len` bytes starting at
+ *                         file offset `off`: block 1 is read from (or
+ *                         written to) `off`, and the last block ends at
+ *                         `off + len` instead of at end of file.
+ */
+static inline void file_stream_set_range(FileStream *fs, uint64_t off,
+                                         uint64_t len)
+{
+    fs->base = off;
+    fs->end  = off + len;
+}
+
+/*
+ * file_stream_set_gcm – Encrypt or decrypt the stream with AES-256-GCM
+ *                       under the session key `salt` gives.  Returns 0,
+ *                       or -1 on failure.
+ */
+static inline int file_stream_set_gcm(FileStream *fs, const uint8_t *salt)
+{
+    return cipher_set_gcm(&fs->cipher, salt);
+}
+
+/*
+ * file_stream_set_codec – Compress (`encode` set) or decompress every
+ *                         block of the stream with `codec`.  Returns 0,
+ *                         or -1 if out of memory.
+ */
+static inline int file_stream_set_codec(FileStream *fs, int codec,
+                                        int encode)
+{
+    if (codec == CODEC_NONE)
+        return 0;
+
+    fs->zs   = calloc(1, sizeof(*fs->zs));
+    fs->zbuf = malloc(fs->block_size + 1);
+    int rc   = Z_MEM_ERROR;
+    if (fs->zs && fs->zbuf)
+        rc = encode ? deflateInit2(fs->zs, CODEC_LEVEL, Z_DEFLATED, -15,
+                                   8, Z_DEFAULT_STRATEGY)
+                    : inflateInit2(fs->zs, -15);
+    if (rc != Z_OK) {
+        free(fs->zs);
+        free(fs->zbuf);
+        fs->zs   = NULL;
+        fs->zbuf = NULL;
+        return -1;
+    }
+    fs->codec    = codec;
+    fs->encode   = encode;
+    fs->zbackoff = 1;
+    return 0;
+}
+
+static inline void file_stream_free(FileStream *fs)
+{
+    if (fs->map) munmap((void *)fs->map, fs->map_len);
+    fs->map = NULL;
+    if (fs->md5) EVP_MD_CTX_free(fs->md5);
+    cipher_free(&fs->cipher);
+    free(fs->buf);
+    fs->md5 = NULL;
+    fs->buf = NULL;
+    if (fs->zs) {
+        if (fs->encode)
+            deflateEnd(fs->zs);
+        else
+            inflateEnd(fs->zs);
+        free(fs->zs);
+    }
+    free(fs->zbuf);
+    fs->zs   = NULL;
+    fs->zbuf = NULL;
+}
+
+/*
+ * file_stream_md5 – Finish the running digest and store its 32-char hex
+ *                   form in `out` (must be >= 33 bytes).
+ */
+static inline void file_stream_md5(FileStream *fs, char *out)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+    EVP_DigestFinal_ex(fs->md5, digest, NULL);
+
+    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(out + i * 2, "%02x", digest[i]);
+    out[MD5_DIGEST_LENGTH * 2] = '\0';
+}
+
+/*
+ * md5_update_fd – Feed the first `len` bytes of file `fd` (fewer if it
+ *                 is shorter) to the digest `ctx`.  Returns the number
+ *                 of bytes hashed, or -1 on a read error.
+ */
+static inline long long md5_update_fd(EVP_MD_CTX *ctx, int fd,
+                                      uint64_t len)
+{
+    uint8_t  buf[65536];
+    uint64_t off = 0;
+
+    while (off < len) {
+        size_t  want = len - off < sizeof(buf) ? len - off : sizeof(buf);
+        ssize_t n    = pread(fd, buf, want, (off_t)off);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        if (n == 0)
+            break;
+        EVP_DigestUpdate(ctx, buf, n);
+        off += n;
+    }
+    return (long long)off;
+}
+
+/*
+ * file_md5 – MD5 of the whole file `fd` as 32 hex chars in `out` (must
+ *            be >= 33 bytes), for files written out of order.  Returns
+ *            0, or -1 on a read error.
+ */
+static inline int file_md5(int fd, char *out)
+{
+    unsigned char digest[MD5_DIGEST_LENGTH];
+
+    EVP_MD_CTX *ctx = EVP_MD_CTX_new();
+    if (!ctx) return -1;
+    EVP_DigestInit_ex(ctx, EVP_md5(), NULL);
+    long long n = md5_update_fd(ctx, fd, UINT64_MAX);
+    EVP_DigestFinal_ex(ctx, digest, NULL);
+    EVP_MD_CTX_free(ctx);
+
+    for (int i = 0; i < MD5_DIGEST_LENGTH; i++)
+        sprintf(out + i * 2, "%02x", digest[i]);
+    out[MD5_DIGEST_LENGTH * 2] = '\0';
+    return n < 0 ? -1 : 0;
+}
+
+/*
+ * file_stream_skip – Start the stream `off` bytes into the file, as when
+ *                    resuming a transfer: block 1 begins there, and the
+ *                    running MD5 (if any) first takes in the bytes
+ *                    before it.  Returns 0, or -1 if they cannot be read.
+ */
+static inline int file_stream_skip(FileStream *fs, uint64_t off)
+{
+    if (fs->md5 && md5_update_fd(fs->md5, fs->fd, off) != (long long)off) {
+        fs->error = "Read failed";
+        return -1;
+    }
+    fs->base = off;
+    return 0;
+}
+
+/*
+ * block_deflate – Compress the `n` plaintext bytes at `fs->buf + 1` for
+ *                 sending.  Returns the block to encrypt, flag byte
+ *                 first, and its length in `*len`: deflated into
+ *                 `fs->zbuf` if that saves enough, otherwise stored in
+ *                 place.  After a block that doesn't compress the next
+ *                 ones are stored without trying, for twice as many
+ *                 blocks each time, so incompressible files cost little.
+ */
+static inline const uint8_t *block_deflate(FileStream *fs, int n, int *len)
+{
+    z_stream *zs    = fs->zs;
+    int       limit = n - n / CODEC_MIN_GAIN;
+
+    if (fs->zskip > 0) {
+        fs->zskip--;
+    } else if (limit > 1) {
+        deflateReset(zs);
+        zs->next_in   = fs->buf + 1;
+        zs->avail_in  = (uInt)n;
+        zs->next_out  = fs->zbuf + 1;
+        zs->avail_out = (uInt)(limit - 1);
+        if (deflate(zs, Z_FINISH) == Z_STREAM_END) {
+            fs->zbuf[0]  = BLOCK_DEFLATED;
+            fs->zbackoff = 1;
+            *len = 1 + (int)zs->total_out;
+            fs->zplain += n;
+            fs->zcoded += *len;
+            return fs->zbuf;
+        }
+        fs->zskip    = fs->zbackoff;
+        fs->zbackoff = fs->zbackoff < CODEC_MAX_SKIP ? fs->zbackoff * 2
+                                                     : CODEC_MAX_SKIP;
+    }
+    fs->buf[0] = BLOCK_STORED;
+    *len = 1 + n;
+    fs->zplain += n;
+    fs->zcoded += *len;
+    fs->zstored++;
+    return fs->buf;
+}
+
+/*
+ * file_stream_decode – Decrypt the block received for stream byte
+ *                      `offset` and, with a codec, undo its
+ *                      compression.  Points `*plain` at the block's
+ *                      plaintext and returns its length, or -1 (with
+ *                      `fs->error` set) if it is not valid.  A payload
+ *                      longer than any block's ciphertext is refused
+ *                      before it is decrypted into `fs->buf`.
+ */
+static inline int file_stream_decode(FileStream *fs, uint64_t offset,
+                                     const uint8_t *payload, int len,
+                                     const uint8_t **plain)
+{
+    if (len < 0 || len > fs->block_size + EVP_MAX_BLOCK_LENGTH) {
+        fs->error = "Block too large";
+        return -1;
+    }
+
+    int dec_len = cipher_decrypt(&fs->cipher, offset, payload, len,
+                                 fs->buf);
+    if (dec_len < 0 || dec_len > fs->block_size + (fs->codec ? 1 : 0)) {
+        fs->error = fs->cipher.gcm ? "Block authentication failed"
+                                   : "Decryption failed";
+        return -1;
+    }
+    *plain = fs->buf;
+    if (fs->codec == CODEC_NONE)
+        return dec_len;
+
+    fs->zcoded += dec_len;
+
+    if (dec_len >= 1 && fs->buf[0] == BLOCK_STORED) {
+        *plain = fs->buf + 1;
+        fs->zstored++;
+        dec_len--;
+    } else if (dec_len >= 1 && fs->buf[0] == BLOCK_DEFLATED) {
+        z_stream *zs = fs->zs;
+        inflateReset(zs);
+        zs->next_in   = fs->buf + 1;
+        zs->avail_in  = (uInt)(dec_len - 1);
+        zs->next_out  = fs->zbuf;
+        zs->avail_out = (uInt)fs->block_size;
+        if (inflate(zs, Z_FINISH) != Z_STREAM_END || zs->avail_in != 0) {
+            fs->error = "Decompression failed";
+            return -1;
+        }
+        *plain  = fs->zbuf;
+        dec_len = (int)zs->total_out;
+    } else {
+        fs->error = "Bad block flag";
+        return -1;
+    }
+    fs->zplain += dec_len;
+    return dec_len;
+}
+
+/* Where a block's plaintext is read to, leaving room for the flag */
+static inline uint8_t *file_stream_plain(FileStream *fs)
+{
+    return fs->buf + (fs->codec ? 1 : 0);
+}
+
+/*
+ * file_stream_seal_from – Finish the block of `n` plaintext bytes at
+ *                         `block`, which starts at stream byte `offset`:
+ *                         add them to the MD5, compress if the stream
+ *                         has a codec (from file_stream_plain(), where
+ *                         they are copied first), and encrypt into
+ *                         `payload`.  Returns the ciphertext length, or
+ *                         -1.
+ */
+static inline int file_stream_seal_from(FileStream *fs, uint64_t offset,
+                                        const uint8_t *block, int n,
+                                        uint8_t *payload, int *raw_len)
+{
+    int len = n;
+
+    if (fs->md5)
+        EVP_DigestUpdate(fs->md5, block, n);
+    if (fs->codec) {
+        if (block != file_stream_plain(fs))
+            memcpy(file_stream_plain(fs), block, n);
+        block = block_deflate(fs, n, &len);
+    }
+
+    int enc_len = cipher_encrypt(&fs->cipher, offset, block, len, payload);
+    if (enc_len < 0) {
+        fs->error = "Encryption failed";
+        return -1;
+    }
+    *raw_len = n;
+    return enc_len;
+}
+
+/* file_stream_seal_from() for a block read to file_stream_plain() */
+static inline int file_stream_seal(FileStream *fs, uint64_t offset, int n,
+                                   uint8_t *payload, int *raw_len)
+{
+    return file_stream_seal_from(fs, offset, file_stream_plain(fs), n,
+                                 payload, raw_len);
+}
+
+/* Plaintext bytes of the block at stream byte `offset`: block_size, or
+ * fewer at the end of the range                                       */
+static inline int file_stream_want(const FileStream *fs, uint64_t offset)
+{
+    uint64_t pos = fs->base + offset;
+    if (pos >= fs->end)
+        return 0;
+    if (fs->end - pos < (uint64_t)fs->block_size)
+        return (int)(fs->end - pos);
+    return fs->block_size;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Mapped reads                                                       */
+/* ------------------------------------------------------------------ */
+
+/* Where a thread touching a mapping jumps if the file shrank under it */
+static __thread sigjmp_buf *map_guard;
+
+static inline void map_sigbus(int sig)
+{
+    if (map_guard)
+        siglongjmp(*map_guard, 1);
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+/*
+ * map_guard_install – Turn the SIGBUS a mapped file raises when another
+ *                     writer truncates it into a read error of the
+ *                     block being sealed.  Once per process, before
+ *                     any stream is mapped.
+ */
+static inline void map_guard_install(void)
+{
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = map_sigbus;
+    sa.sa_flags   = SA_NODEFER;     /* the jump skips the unblocking    */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGBUS, &sa, NULL);
+}
+
+/*
+ * file_stream_map – Map the whole file, so blocks are encrypted straight
+ *                   out of the page cache instead of being pread() into
+ *                   a buffer first.  The file's size now is where the
+ *                   stream ends.  Returns 0, or -1 (the stream keeps
+ *                   reading) for an empty or unmappable file.
+ */
+static inline int file_stream_map(FileStream *fs)
+{
+    struct stat st;
+    if (fstat(fs->fd, &st) < 0 || st.st_size <= 0)
+        return -1;
+    void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED,
+                     fs->fd, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+    fs->map     = map;
+    fs->map_len = (size_t)st.st_size;
+    return 0;
+}
+
+/* Seal the `n` mapped bytes at stream byte `offset`: no copy unless
+ * compressing                                                        */
+static inline int file_stream_seal_mapped(FileStream *fs, uint64_t offset,
+                                          int n, uint8_t *payload,
+                                          int *raw_len)
+{
+    sigjmp_buf jump;
+    if (sigsetjmp(jump, 0)) {
+        map_guard = NULL;
+        fs->error = "Read failed";      /* truncated while mapped       */
+        return -1;
+    }
+    map_guard = &jump;
+    int enc_len = file_stream_seal_from(fs, offset,
+                                        fs->map + fs->base + offset, n,
+                                        payload, raw_len);
+    map_guard = NULL;
+    return enc_len;
+}
+
+/*
+ * file_stream_produce – Read the block starting at byte `offset` of the
+ *                       stream, compress it if the stream has a codec,
+ *                       and encrypt it into `payload`.  Returns
+ *                       the ciphertext length and sets `*raw_len` to the
+ *                       plaintext length (short only at the end of the
+ *                       file or range).
+ */
+static inline int file_stream_produce(void *arg, uint64_t offset,
+                                      uint8_t *payload, int *raw_len)
+{
+    FileStream *fs = (FileStream *)arg;
+    uint64_t    pos = fs->base + offset;
+    int         want = file_stream_want(fs, offset);
+    int         bytes_read = 0;
+    uint8_t    *plain = file_stream_plain(fs);
+
+    if (fs->map) {
+        if (pos >= fs->map_len)
+            want = 0;
+        else if (fs->map_len - pos < (uint64_t)want)
+            want = (int)(fs->map_len - pos);
+        return file_stream_seal_mapped(fs, offset, want, payload,
+                                       raw_len);
+    }
+
+    while (bytes_read < want) {
+        ssize_t n = pread(fs->fd, plain + bytes_read,
+                          want - bytes_read,
+                          (off_t)(pos + bytes_read));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fs->error = "Read failed";
+            return -1;
+        }
+        if (n == 0)
+            break;
+        bytes_read += (int)n;
+    }
+    return file_stream_seal(fs, offset, bytes_read, payload, raw_len);
+}
+
+/* Record why a write failed (`err` is its errno); a full disk or quota
+ * is reported to the peer as ERR_DISK_FULL.                          */
+static inline void file_stream_write_failed(FileStream *fs, int err)
+{
+    if (err == ENOSPC || err == EDQUOT) {
+        fs->error      = "Disk full";
+        fs->error_code = ERR_DISK_FULL;
+    } else {
+        fs->error = "Write failed";
+    }
+}
+
+/* Write `len` plaintext bytes at file byte `pos`; 0, or -1 with
+ * `fs->error` set                                                    */
+static inline int file_stream_write(FileStream *fs, uint64_t pos,
+                                    const uint8_t *plain, int len)
+{
+    for (int done = 0; done < len; ) {
+        ssize_t n = pwrite(fs->fd, plain + done, len - done,
+                           (off_t)(pos + done));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            file_stream_write_failed(fs, n < 0 ? errno : EIO);
+            return -1;
+        }
+        done += (int)n;
+    }
+    return 0;
+}
+
+/*
+ * file_stream_consume – Decrypt (and decompress) one received block and
+ *                       write it at byte `offset` of the stream.  Returns the plaintext
+ *                       length.
+ */
+static inline int file_stream_consume(void *arg, uint64_t offset,
+                                      const uint8_t *payload, int len)
+{
+    FileStream    *fs = (FileStream *)arg;
+    const uint8_t *plain;
+
+    int dec_len = file_stream_decode(fs, offset, payload, len, &plain);
+    if (dec_len < 0 ||
+        file_stream_write(fs, fs->base + offset, plain, dec_len) < 0)
+        return -1;
+    if (fs->md5)
+        EVP_DigestUpdate(fs->md5, plain, dec_len);
+    return dec_len;
+}
+
+/*
+ * now_usec – Monotonic clock in microseconds (for RTT and deadlines).
+ */
+static inline uint64_t now_usec(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * wait_readable – Block until `sockfd` has a datagram or `usec` expires.
+ *                 Returns >0 if readable, 0 on timeout or signal.
+ */
+static inline int wait_readable(int sockfd, uint64_t usec)
+{
+    struct pollfd   pfd = { .fd = sockfd, .events = POLLIN };
+    struct timespec ts  = { .tv_sec  = (time_t)(usec / 1000000),
+                            .tv_nsec = (long)(usec % 1000000) * 1000 };
+    int r = ppoll(&pfd, 1, &ts, NULL);
+    return r > 0 ? r : 0;
+}
+
 /*
  * set_socket_timeout – Apply a receive-timeout to `sockfd`.
  */
@@ -254,6 +1006,46 @@ static inline void ensure_directory(const char *path)
     }
 }
 
+/*
+ * disk_room – Whether the file system holding `fd` can grow the file
+ *             to `size` bytes, counting the blocks it already has.
+ *             Returns 0, or -1 with errno set to ENOSPC if not.
+ */
+static inline int disk_room(int fd, long long size)
+{
+    struct statvfs vfs;
+    struct stat    st;
+    if (size <= 0 || fstatvfs(fd, &vfs) < 0 || fstat(fd, &st) < 0)
+        return 0;                       /* nothing to check against */
+
+    long long held = (long long)st.st_blocks * 512;
+    long long free_bytes = (long long)vfs.f_bavail * (long long)vfs.f_frsize;
+    if (size - held > free_bytes) {
+        errno = ENOSPC;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * preallocate – Reserve `size` bytes of disk for `fd` in one fallocate()
+ *               without changing its length, so the file is laid out
+ *               contiguously and a transfer that cannot fit fails
+ *               before it starts.  Returns 0, or -1 with errno ENOSPC
+ *               (or EFBIG, EDQUOT).  File systems without fallocate()
+ *               fall back to the free-space check of disk_room.
+ */
+static inline int preallocate(int fd, long long size)
+{
+    if (size <= 0)
+        return 0;
+    if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size) == 0)
+        return 0;
+    if (errno == ENOSPC || errno == EFBIG || errno == EDQUOT)
+        return -1;
+    return disk_room(fd, size);
+}
+
 /*
  * build_filepath – Safely concatenate a directory and a filename.
  */
@@ -280,6 +1072,243 @@ static inline void send_error(int sockfd,
            (struct sockaddr *)dest, sizeof(*dest));
 }
 
+/* Codec names as they appear in the "compress" option, by CODEC_* */
+static const char *const CODEC_NAMES[] = { "none", "deflate" };
+
+/*
+ * codec_find – CODEC_* for `name` (`len` bytes), or -1 if unknown.
+ */
+static inline int codec_find(const char *name, size_t len)
+{
+    for (int i = CODEC_DEFLATE;
+         i < (int)(sizeof(CODEC_NAMES) / sizeof(CODEC_NAMES[0])); i++)
+        if (strlen(CODEC_NAMES[i]) == len &&
+            strncasecmp(CODEC_NAMES[i], name, len) == 0)
+            return i;
+    return -1;
+}
+
+/*
+ * options_init – Reset `opts` to "no options present".
+ */
+static inline void options_init(TransferOptions *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->tsize    = -1;
+    opts->rollover = -1;
+    opts->resume   = -1;
+}
+
+/*
+ * options_parse – Decode the "name\0value\0" pairs between `p` and
+ *                 `end` into `opts`.  Unknown options are ignored as
+ *                 RFC 2347 requires.  Returns the number of recognised
+ *                 options, or -1 if a value is malformed.
+ */
+static inline int options_parse(const char *p, const char *end,
+                                TransferOptions *opts)
+{
+    int found = 0;
+
+    options_init(opts);
+    while (p < end) {
+        const char *name = p;
+        size_t nlen = strnlen(name, end - name);
+        if (name + nlen >= end) break;          /* truncated name      */
+        const char *val = name + nlen + 1;
+        size_t vlen = strnlen(val, end - val);
+        if (val + vlen >= end) break;           /* truncated value     */
+        p = val + vlen + 1;
+
+        char *stop;
+        long long v = strtoll(val, &stop, 10);
+        int numeric = stop != val && *stop == '\0';
+
+        if (strcasecmp(name, "blksize") == 0) {
+            if (!numeric || v < MIN_BLOCK_SIZE || v > 65535) return -1;
+            opts->blksize = (int)v;
+        } else if (strcasecmp(name, "timeout") == 0) {
+            if (!numeric || v < 1 || v > MAX_TIMEOUT_SEC) return -1;
+            opts->timeout = (int)v;
+        } else if (strcasecmp(name, "tsize") == 0) {
+            if (!numeric || v < 0) return -1;
+            opts->tsize = v;
+        } else if (strcasecmp(name, "windowsize") == 0) {
+            if (!numeric || v < 1 || v > 65535) return -1;
+            opts->windowsize = (int)v;
+        } else if (strcasecmp(name, "sack") == 0) {
+            if (!numeric || v < 0 || v > 1) return -1;
+            opts->sack = (int)v;
+        } else if (strcasecmp(name, "rollover") == 0) {
+            if (!numeric || v < 0 || v > 1) return -1;
+            opts->rollover = (int)v;
+        } else if (strcasecmp(name, "exthdr") == 0) {
+            if (!numeric || v < 0 || v > 1) return -1;
+            opts->exthdr = (int)v;
+        } else if (strcasecmp(name, "multicast") == 0) {
+            if (vlen >= sizeof(opts->mcast)) return -1;
+            opts->multicast = 1;
+            memcpy(opts->mcast, val, vlen + 1);
+        } else if (strcasecmp(name, "range") == 0) {
+            /* "offset,length" in bytes */
+            long long off = strtoll(val, &stop, 10);
+            if (stop == val || *stop != ',' || off < 0) return -1;
+            const char *lp = stop + 1;
+            long long len = strtoll(lp, &stop, 10);
+            if (stop == lp || *stop != '\0' || len < 0) return -1;
+            opts->range     = 1;
+            opts->range_off = off;
+            opts->range_len = len;
+        } else if (strcasecmp(name, "resume") == 0) {
+            if (!numeric || v < 0) return -1;
+            opts->resume = v;
+        } else if (strcasecmp(name, "fec") == 0) {
+            /* "K,M": M parity blocks after every K DATA blocks */
+            long long k = strtoll(val, &stop, 10);
+            if (stop == val || *stop != ',' || k < 1 || k > 255) return -1;
+            const char *mp = stop + 1;
+            long long m = strtoll(mp, &stop, 10);
+            if (stop == mp || *stop != '\0' || m < 1 || m > k) return -1;
+            opts->fec_k = (int)k;
+            opts->fec_m = (int)m;
+        } else if (strcasecmp(name, "delta") == 0) {
+            /* Block size of a delta signature (RRQ) or upload (WRQ) */
+            if (!numeric || v < 1 || v > 1 << 20) return -1;
+            opts->delta = (int)v;
+        } else if (strcasecmp(name, "compress") == 0) {
+            /* Codecs in order of preference: the first one we know */
+            const char *c = val;
+            while (*c && opts->compress == CODEC_NONE) {
+                size_t len = strcspn(c, ",");
+                int    id  = codec_find(c, len);
+                if (id > 0)
+                    opts->compress = id;
+                c += len + (c[len] == ',');
+            }
+            if (opts->compress == CODEC_NONE)
+                continue;                       /* none we know        */
+        } else if (strcasecmp(name, "gcm") == 0) {
+            /* The session key salt, as hex */
+            if (vlen != 2 * GCM_SALT_LEN) return -1;
+            for (int i = 0; i < GCM_SALT_LEN; i++) {
+                unsigned int byte;
+                if (!isxdigit((unsigned char)val[2 * i]) ||
+                    !isxdigit((unsigned char)val[2 * i + 1]) ||
+                    sscanf(val + 2 * i, "%2x", &byte) != 1)
+                    return -1;
+                opts->gcm_salt[i] = (uint8_t)byte;
+            }
+            opts->gcm = 1;
+        } else {
+            continue;
+        }
+        found++;
+    }
+    return found;
+}
+
+/* Append one "name\0value\0" pair if it fits. */
+static inline size_t option_append_str(uint8_t *buf, size_t off, size_t cap,
+                                       const char *name, const char *value)
+{
+    char pair[64];
+    int  len = snprintf(pair, sizeof(pair), "%s%c%s",
+                        name, '\0', value);
+
+    if (len > 0 && (size_t)len < sizeof(pair) && off + len + 1 <= cap) {
+        memcpy(buf + off, pair, len + 1);
+        off += len + 1;
+    }
+    return off;
+}
+
+static inline size_t option_append(uint8_t *buf, size_t off, size_t cap,
+                                   const char *name, long long value)
+{
+    char num[24];
+    snprintf(num, sizeof(num), "%lld", value);
+    return option_append_str(buf, off, cap, name, num);
+}
+
+/*
+ * options_encode – Append every present field of `opts` to `buf` at
+ *                  offset `off` as "name\0value\0" pairs.  Returns the
+ *                  new offset (unchanged if nothing fits).
+ */
+static inline size_t options_encode(uint8_t *buf, size_t off, size_t cap,
+                                    const TransferOptions *opts)
+{
+    if (opts->blksize > 0)
+        off = option_append(buf, off, cap, "blksize", opts->blksize);
+    if (opts->timeout > 0)
+        off = option_append(buf, off, cap, "timeout", opts->timeout);
+    if (opts->tsize >= 0)
+        off = option_append(buf, off, cap, "tsize", opts->tsize);
+    if (opts->windowsize > 0)
+        off = option_append(buf, off, cap, "windowsize", opts->windowsize);
+    if (opts->sack > 0)
+        off = option_append(buf, off, cap, "sack", opts->sack);
+    if (opts->rollover >= 0)
+        off = option_append(buf, off, cap, "rollover", opts->rollover);
+    if (opts->exthdr > 0)
+        off = option_append(buf, off, cap, "exthdr", opts->exthdr);
+    if (opts->multicast)
+        off = option_append_str(buf, off, cap, "multicast", opts->mcast);
+    if (opts->range) {
+        char range[48];
+        snprintf(range, sizeof(range), "%lld,%lld",
+                 opts->range_off, opts->range_len);
+        off = option_append_str(buf, off, cap, "range", range);
+    }
+    if (opts->resume >= 0)
+        off = option_append(buf, off, cap, "resume", opts->resume);
+    if (opts->fec_k > 0) {
+        char fec[24];
+        snprintf(fec, sizeof(fec), "%d,%d", opts->fec_k, opts->fec_m);
+        off = option_append_str(buf, off, cap, "fec", fec);
+    }
+    if (opts->delta > 0)
+        off = option_append(buf, off, cap, "delta", opts->delta);
+    if (opts->compress > CODEC_NONE)
+        off = option_append_str(buf, off, cap, "compress",
+                                CODEC_NAMES[opts->compress]);
+    if (opts->gcm) {
+        char salt[2 * GCM_SALT_LEN + 1];
+        for (int i = 0; i < GCM_SALT_LEN; i++)
+            sprintf(salt + 2 * i, "%02x", opts->gcm_salt[i]);
+        off = option_append_str(buf, off, cap, "gcm", salt);
+    }
+    return off;
+}
+
+/*
+ * set_socket_buffers – Grow the kernel send/receive queues of `sockfd`
+ *                      to hold at least `bytes` (a full window of large
+ *                      blocks would otherwise overflow the defaults).
+ *                      Beyond net.core.[rw]mem_max this needs
+ *                      CAP_NET_ADMIN; without it the kernel limit stays.
+ */
+static inline void set_socket_buffers(int sockfd, int bytes)
+{
+    static const int opts[2][2] = {
+        { SO_RCVBUF, SO_RCVBUFFORCE },
+        { SO_SNDBUF, SO_SNDBUFFORCE },
+    };
+
+    for (int i = 0; i < 2; i++) {
+        int cur = 0;
+        socklen_t len = sizeof(cur);
+
+        if (getsockopt(sockfd, SOL_SOCKET, opts[i][0], &cur, &len) < 0 ||
+            cur >= bytes)
+            continue;
+        if (setsockopt(sockfd, SOL_SOCKET, opts[i][1],
+                       &bytes, sizeof(bytes)) < 0)
+            setsockopt(sockfd, SOL_SOCKET, opts[i][0],
+                       &bytes, sizeof(bytes));
+    }
+}
+
 /*
  * print_timestamp – Print the current date/time for log messages.
  */
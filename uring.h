@@ -0,0 +1,839 @@
+/*
+ * uring.h
+ * =====================================================================
+ * Enhanced TFTP – io_uring disk I/O for the server's sessions
+ *
+ * A reactor worker runs hundreds of transfers, and every pread() or
+ * pwrite() a session makes stalls all of them until the disk answers.
+ * With an engine (-U), each worker hands its sessions' file I/O to an
+ * io_uring of its own instead:
+ *
+ *   • Reads – a download reads ahead up to URING_READAHEAD chunks of
+ *             whole blocks with READ_FIXED.  Until the chunk holding
+ *             the next block has landed the producer returns
+ *             PRODUCE_AGAIN, and the completion kicks the session
+ *             (reactor_kick) to go on pumping.
+ *   • Writes – an upload collects decrypted blocks into a chunk and
+ *              hands it to WRITE_FIXED once full; the receiver goes on
+ *              ACKing meanwhile.  A failed write fails the next block,
+ *              and the session waits for its writes (SESSION_FLUSH)
+ *              before the file is verified and closed.
+ *   • Checkpoints – once the writes before a checkpoint have landed,
+ *                   the journal goes out as one chain of linked SQEs:
+ *                   fdatasync of the file, write of the journal, fsync
+ *                   of the journal.  The last completion renames it
+ *                   into place, so it still never claims more than the
+ *                   disk holds (checkpoint.h).
+ *
+ * Chunks live in URING_BUFS buffers registered with the ring, and each
+ * session's file in a slot of its registered file table, so the kernel
+ * maps neither per request.  When either runs out a session simply
+ * does that block's I/O synchronously, as without an engine.
+ *
+ * Sockets stay with epoll and sendmmsg()/GSO: DATA is encrypted between
+ * disk and network, so a DATA packet cannot be linked to the read that
+ * feeds it, and the sockets never block anyway.  Completions are
+ * announced on an eventfd the worker watches like any other task.
+ * =====================================================================
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include "udp_file_transfer.h"
+#include "transport.h"
+#include "checkpoint.h"
+#include "reactor.h"
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+/* ------------------------------------------------------------------ */
+/*  Constants                                                          */
+/* ------------------------------------------------------------------ */
+
+#define URING_ENTRIES       256         /* Submission queue size          */
+#define URING_REQS          256         /* Requests in flight, ≤ entries  */
+#define URING_BUFS          64          /* Registered chunk buffers       */
+#define URING_BUF_SIZE      65536       /* One chunk, ≥ MAX_BLOCK_SIZE    */
+#define URING_FILES         1024        /* Registered file table slots    */
+#define URING_READAHEAD     4           /* Chunks a download reads ahead  */
+
+/* What a request is doing */
+#define URING_READ          1
+#define URING_WRITE         2
+#define URING_SYNC          3           /* One step of a checkpoint chain */
+
+/* Where a session's checkpoint stands */
+#define CKPT_IDLE           0
+#define CKPT_DRAIN          1           /* Waiting for earlier writes     */
+#define CKPT_SYNC           2           /* Linked chain in flight         */
+
+/* ------------------------------------------------------------------ */
+/*  The ring                                                           */
+/* ------------------------------------------------------------------ */
+
+typedef struct {
+    int                  fd;
+    unsigned            *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned            *cq_head, *cq_tail, *cq_mask;
+    unsigned             sq_entries;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void                *sq_ring, *cq_ring;
+    size_t               sq_ring_size, cq_ring_size, sqes_size;
+    unsigned             queued;        /* SQEs not yet submitted         */
+} Uring;
+
+static inline int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static inline int uring_enter(int fd, unsigned submit, unsigned flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, submit, 0, flags,
+                        NULL, 0);
+}
+
+static inline int uring_register(int fd, unsigned op, const void *arg,
+                                 unsigned nargs)
+{
+    return (int)syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static inline void uring_exit(Uring *u)
+{
+    if (u->sqes)
+        munmap(u->sqes, u->sqes_size);
+    if (u->cq_ring && u->cq_ring != u->sq_ring)
+        munmap(u->cq_ring, u->cq_ring_size);
+    if (u->sq_ring)
+        munmap(u->sq_ring, u->sq_ring_size);
+    if (u->fd >= 0)
+        close(u->fd);
+    memset(u, 0, sizeof(*u));
+    u->fd = -1;
+}
+
+/*
+ * uring_init – Create a ring with `entries` submission slots and map its
+ *              queues.  Returns 0, or -1 with errno set (ENOSYS or EPERM
+ *              where io_uring is missing or disabled).
+ */
+static inline int uring_init(Uring *u, unsigned entries)
+{
+    struct io_uring_params p;
+    memset(u, 0, sizeof(*u));
+    memset(&p, 0, sizeof(p));
+    u->fd = uring_setup(entries, &p);
+    if (u->fd < 0)
+        return -1;
+
+    u->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_size > u->sq_ring_size)
+            u->sq_ring_size = u->cq_ring_size;
+        u->cq_ring_size = u->sq_ring_size;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        goto fail;
+    }
+    u->cq_ring = u->sq_ring;
+    if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+        u->cq_ring = mmap(NULL, u->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd,
+                          IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            goto fail;
+        }
+    }
+    u->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        goto fail;
+    }
+
+    uint8_t *sq = (uint8_t *)u->sq_ring, *cq = (uint8_t *)u->cq_ring;
+    u->sq_head    = (unsigned *)(sq + p.sq_off.head);
+    u->sq_tail    = (unsigned *)(sq + p.sq_off.tail);
+    u->sq_mask    = (unsigned *)(sq + p.sq_off.ring_mask);
+    u->sq_array   = (unsigned *)(sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->cq_head    = (unsigned *)(cq + p.cq_off.head);
+    u->cq_tail    = (unsigned *)(cq + p.cq_off.tail);
+    u->cq_mask    = (unsigned *)(cq + p.cq_off.ring_mask);
+    u->cqes       = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+fail:
+    uring_exit(u);
+    return -1;
+}
+
+/* Hand every queued SQE to the kernel; 0, or -1 if it took none */
+static inline int uring_submit(Uring *u)
+{
+    while (u->queued > 0) {
+        int n = uring_enter(u->fd, u->queued, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        u->queued -= (unsigned)n;
+    }
+    return 0;
+}
+
+/*
+ * uring_sqe – A cleared SQE at the tail of the submission queue,
+ *             submitting what is queued first if it is full.  NULL if
+ *             there is still no room.
+ */
+static inline struct io_uring_sqe *uring_sqe(Uring *u)
+{
+    unsigned tail = *u->sq_tail;
+    if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+        u->sq_entries) {
+        uring_submit(u);
+        if (tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE) >=
+            u->sq_entries)
+            return NULL;
+    }
+
+    unsigned             idx = tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[idx] = idx;
+    __atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    u->queued++;
+    return sqe;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Engine – one per reactor worker                                    */
+/* ------------------------------------------------------------------ */
+
+typedef struct UringFile UringFile;
+
+typedef struct {
+    UringFile          *owner;          /* NULL once the session is gone  */
+    int                 kind;           /* URING_*                        */
+    int                 buf;            /* Registered buffer, -1 = none   */
+    int                 fd;             /* Closed on completion, or -1    */
+    uint64_t            off;            /* File offset                    */
+    int                 len;            /* Bytes asked for                */
+    int                 done_len;       /* Write: bytes already written   */
+    int                 res;            /* Read: bytes read, or -errno    */
+    int                 done;           /* Read: completed                */
+    unsigned            gen;            /* Write: checkpoint generation   */
+} UringReq;
+
+typedef struct UringEngine {
+    ReactorTask         task;           /* First: the completion eventfd  */
+    Uring               ring;
+    uint8_t            *bufs;           /* URING_BUFS × URING_BUF_SIZE    */
+    int                 free_buf[URING_BUFS];
+    int                 nfree_buf;
+    UringReq            req[URING_REQS];
+    int                 free_req[URING_REQS];
+    int                 nfree_req;
+    int                 free_slot[URING_FILES];
+    int                 nfree_slot;
+} UringEngine;
+
+struct UringFile {
+    UringEngine        *eng;            /* NULL = synchronous I/O         */
+    ReactorTask        *task;           /* Session to kick                */
+    FileStream         *fs;
+    Checkpoint         *ck;             /* Upload journal, or NULL        */
+    int                 slot;           /* Registered file table index    */
+    int                 chunk;          /* Bytes per request, whole blocks*/
+    int                 waiting;        /* Kick the session on completion */
+    int                 inflight;       /* Requests with the kernel       */
+    int                 error;          /* First failed write's errno     */
+
+    /* Download */
+    uint64_t            limit;          /* Reads stop here                */
+    uint64_t            ahead;          /* Next chunk to ask for          */
+    UringReq           *ra[URING_READAHEAD];  /* Chunks, oldest first     */
+    int                 ra_head;
+    int                 ra_count;
+
+    /* Upload */
+    UringReq           *wr;             /* Chunk being filled             */
+    int                 writes;         /* Write requests in flight       */
+    unsigned            gen;            /* Bumped at each checkpoint      */
+    int                 ckpt;           /* CKPT_*                         */
+    int                 barrier;        /* Earlier writes still in flight */
+    int                 sync_left;      /* Chain steps not completed      */
+    int                 sync_failed;
+    uint64_t            ckpt_off;       /* What the journal will vouch for*/
+    char                ckpt_rec[160];
+    int                 ckpt_len;
+
+    unsigned            reads_async;    /* Blocks served from the ring    */
+    unsigned            writes_async;   /* Chunks written through it      */
+};
+
+static inline UringReq *uring_req_get(UringEngine *e, int want_buf)
+{
+    if (e->nfree_req == 0 || (want_buf && e->nfree_buf == 0))
+        return NULL;
+    UringReq *r = &e->req[e->free_req[--e->nfree_req]];
+    memset(r, 0, sizeof(*r));
+    r->buf = want_buf ? e->free_buf[--e->nfree_buf] : -1;
+    r->fd  = -1;
+    return r;
+}
+
+static inline void uring_req_put(UringEngine *e, UringReq *r)
+{
+    if (r->buf >= 0)
+        e->free_buf[e->nfree_buf++] = r->buf;
+    r->buf   = -1;
+    r->owner = NULL;
+    r->kind  = 0;
+    e->free_req[e->nfree_req++] = (int)(r - e->req);
+}
+
+static inline uint8_t *uring_buf(UringEngine *e, const UringReq *r)
+{
+    return e->bufs + (size_t)r->buf * URING_BUF_SIZE;
+}
+
+/* Queue a READ_FIXED / WRITE_FIXED of `r`'s buffer on the file in `slot` */
+static inline int uring_queue_rw(UringEngine *e, UringReq *r, int slot)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&e->ring);
+    if (!sqe)
+        return -1;
+    sqe->opcode    = r->kind == URING_READ ? IORING_OP_READ_FIXED
+                                           : IORING_OP_WRITE_FIXED;
+    sqe->flags     = IOSQE_FIXED_FILE;
+    sqe->fd        = slot;
+    sqe->addr      = (uint64_t)(uintptr_t)(uring_buf(e, r) + r->done_len);
+    sqe->len       = (unsigned)(r->len - r->done_len);
+    sqe->off       = r->off + (uint64_t)r->done_len;
+    sqe->buf_index = (uint16_t)r->buf;
+    sqe->user_data = (uint64_t)(r - e->req);
+    return 0;
+}
+
+static void uring_checkpoint_sync(UringFile *uf);
+
+/* Every step of a checkpoint chain has completed: install the journal */
+static inline void uring_checkpoint_done(UringFile *uf)
+{
+    char tmp_path[sizeof(uf->ck->path) + 4];
+    checkpoint_tmp_path(uf->ck, tmp_path, sizeof(tmp_path));
+    if (!uf->sync_failed && rename(tmp_path, uf->ck->path) == 0)
+        uf->ck->offset = uf->ckpt_off;
+    else
+        unlink(tmp_path);
+    uf->ckpt = CKPT_IDLE;
+}
+
+/*
+ * uring_complete – Account for one CQE.  A short write is queued again
+ *                  for the rest; requests whose session has gone only
+ *                  give back their buffer (and journal descriptor).
+ */
+static inline void uring_complete(UringEngine *e, UringReq *r, int res)
+{
+    UringFile *uf = r->owner;
+
+    if (r->fd >= 0) {
+        close(r->fd);
+        r->fd = -1;
+    }
+    if (!uf) {
+        uring_req_put(e, r);
+        return;
+    }
+
+    switch (r->kind) {
+    case URING_READ:
+        r->res  = res;
+        r->done = 1;
+        uf->inflight--;
+        break;
+
+    case URING_WRITE:
+        if (res > 0 && r->done_len + res < r->len && !uf->error) {
+            r->done_len += res;
+            if (uring_queue_rw(e, r, uf->slot) == 0)
+                return;
+            res = -EAGAIN;
+        }
+        if (res <= 0 && !uf->error)
+            uf->error = res < 0 ? -res : EIO;
+        uf->writes--;
+        uf->inflight--;
+        if (uf->ckpt == CKPT_DRAIN && r->gen != uf->gen &&
+            --uf->barrier == 0) {
+            if (uf->error)
+                uf->ckpt = CKPT_IDLE;
+            else
+                uring_checkpoint_sync(uf);
+        }
+        uring_req_put(e, r);
+        break;
+
+    case URING_SYNC:
+        if (res < 0)
+            uf->sync_failed = 1;
+        uf->inflight--;
+        uring_req_put(e, r);
+        if (--uf->sync_left == 0)
+            uring_checkpoint_done(uf);
+        break;
+    }
+    if (uf->waiting)
+        reactor_kick(uf->task);
+}
+
+/* The eventfd fired: take every completion, then submit what they
+ * queued (resumed short writes, checkpoint chains)                   */
+static int uring_engine_handle(ReactorTask *t, int events)
+{
+    UringEngine *e = (UringEngine *)t;
+    Uring       *u = &e->ring;
+
+    if (events & REACTOR_START)
+        return 0;
+
+    uint64_t count;
+    if (read(t->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        perror("uring: eventfd");
+
+    unsigned head = *u->cq_head;
+    while (head != __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        if (cqe->user_data < URING_REQS)
+            uring_complete(e, &e->req[cqe->user_data], cqe->res);
+        head++;
+        __atomic_store_n(u->cq_head, head, __ATOMIC_RELEASE);
+    }
+    uring_submit(u);
+    return 0;
+}
+
+/* The engine lives as long as its worker */
+static void uring_engine_release(ReactorTask *t)
+{
+    (void)t;
+}
+
+/*
+ * uring_engine_init – Create a worker's ring, register its buffers, an
+ *                     empty file table and the completion eventfd.
+ *                     Post `e->task` to the worker afterwards.  Returns
+ *                     0, or -1 with errno set.
+ */
+static inline int uring_engine_init(UringEngine *e)
+{
+    memset(e, 0, sizeof(*e));
+    e->task.fd      = -1;
+    e->task.handle  = uring_engine_handle;
+    e->task.release = uring_engine_release;
+    if (uring_init(&e->ring, URING_ENTRIES) < 0)
+        return -1;
+
+    e->bufs = mmap(NULL, (size_t)URING_BUFS * URING_BUF_SIZE,
+                   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (e->bufs == MAP_FAILED) {
+        e->bufs = NULL;
+        goto fail;
+    }
+
+    struct iovec iov[URING_BUFS];
+    for (int i = 0; i < URING_BUFS; i++) {
+        iov[i].iov_base = e->bufs + (size_t)i * URING_BUF_SIZE;
+        iov[i].iov_len  = URING_BUF_SIZE;
+        e->free_buf[i]  = URING_BUFS - 1 - i;
+    }
+    e->nfree_buf = URING_BUFS;
+
+    int *files = malloc(URING_FILES * sizeof(int));
+    if (!files)
+        goto fail;
+    for (int i = 0; i < URING_FILES; i++) {
+        files[i]        = -1;           /* sparse: filled per session   */
+        e->free_slot[i] = URING_FILES - 1 - i;
+    }
+    e->nfree_slot = URING_FILES;
+    for (int i = 0; i < URING_REQS; i++)
+        e->free_req[i] = URING_REQS - 1 - i;
+    e->nfree_req = URING_REQS;
+
+    e->task.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    int rc = e->task.fd < 0 ||
+             uring_register(e->ring.fd, IORING_REGISTER_BUFFERS, iov,
+                            URING_BUFS) < 0 ||
+             uring_register(e->ring.fd, IORING_REGISTER_FILES, files,
+                            URING_FILES) < 0 ||
+             uring_register(e->ring.fd, IORING_REGISTER_EVENTFD,
+                            &e->task.fd, 1) < 0;
+    free(files);
+    if (!rc)
+        return 0;
+
+fail:
+    if (e->task.fd >= 0)
+        close(e->task.fd);
+    if (e->bufs)
+        munmap(e->bufs, (size_t)URING_BUFS * URING_BUF_SIZE);
+    uring_exit(&e->ring);
+    e->task.fd = -1;
+    e->bufs    = NULL;
+    return -1;
+}
+
+/* Point registered file `slot` at `fd` (-1 empties it) */
+static inline int uring_set_file(UringEngine *e, int slot, int fd)
+{
+    struct io_uring_files_update up;
+    memset(&up, 0, sizeof(up));
+    up.offset = (unsigned)slot;
+    up.fds    = (uint64_t)(uintptr_t)&fd;
+    return uring_register(e->ring.fd, IORING_REGISTER_FILES_UPDATE,
+                          &up, 1) == 1 ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------ */
+/*  Per-session files                                                  */
+/* ------------------------------------------------------------------ */
+
+/*
+ * uring_file_open – Route the I/O of `fs` (positioned already: range or
+ *                   skip applied) through the engine.  `ck` is the
+ *                   upload's journal, NULL for a download.  Returns 0,
+ *                   or -1 if the file table is full – the stream then
+ *                   stays synchronous.
+ */
+static inline int uring_file_open(UringFile *uf, UringEngine *e,
+                                  ReactorTask *task, FileStream *fs,
+                                  Checkpoint *ck)
+{
+    memset(uf, 0, sizeof(*uf));
+    if (!e || e->nfree_slot == 0)
+        return -1;
+    int slot = e->free_slot[e->nfree_slot - 1];
+    if (uring_set_file(e, slot, fs->fd) < 0)
+        return -1;
+    e->nfree_slot--;
+
+    struct stat st;
+    uf->eng   = e;
+    uf->task  = task;
+    uf->fs    = fs;
+    uf->ck    = ck;
+    uf->slot  = slot;
+    uf->chunk = URING_BUF_SIZE / fs->block_size * fs->block_size;
+    uf->limit = fs->end;
+    if (!ck && fstat(fs->fd, &st) == 0 && (uint64_t)st.st_size < uf->limit)
+        uf->limit = (uint64_t)st.st_size;
+    uf->ahead = fs->base;
+    return 0;
+}
+
+/* Ask for chunks until URING_READAHEAD are on their way or ready */
+static inline void uring_read_ahead(UringFile *uf)
+{
+    UringEngine *e = uf->eng;
+
+    while (uf->ra_count < URING_READAHEAD && uf->ahead < uf->limit) {
+        UringReq *r = uring_req_get(e, 1);
+        if (!r)
+            break;
+        r->owner = uf;
+        r->kind  = URING_READ;
+        r->off   = uf->ahead;
+        r->len   = uf->limit - uf->ahead < (uint64_t)uf->chunk
+                 ? (int)(uf->limit - uf->ahead) : uf->chunk;
+        if (uring_queue_rw(e, r, uf->slot) < 0) {
+            uring_req_put(e, r);
+            break;
+        }
+        uf->ra[(uf->ra_head + uf->ra_count++) % URING_READAHEAD] = r;
+        uf->ahead += (uint64_t)r->len;
+        uf->inflight++;
+    }
+    uring_submit(&e->ring);
+}
+
+/* Drop the oldest read-ahead chunk; the session has used it up */
+static inline void uring_read_pop(UringFile *uf)
+{
+    uring_req_put(uf->eng, uf->ra[uf->ra_head]);
+    uf->ra_head = (uf->ra_head + 1) % URING_READAHEAD;
+    uf->ra_count--;
+}
+
+/*
+ * uring_produce – BlockProducer: as file_stream_produce, but from the
+ *                 read-ahead chunks.  Returns PRODUCE_AGAIN while the
+ *                 chunk holding the block is still being read.
+ */
+static inline int uring_produce(void *arg, uint64_t offset,
+                                uint8_t *payload, int *raw_len)
+{
+    UringFile  *uf  = (UringFile *)arg;
+    FileStream *fs  = uf->fs;
+    uint64_t    pos = fs->base + offset;
+
+    /* Blocks come in order: chunks wholly before this one are spent */
+    while (uf->ra_count > 0) {
+        UringReq *r = uf->ra[uf->ra_head];
+        if (!r->done || pos < r->off + (uint64_t)r->len)
+            break;
+        uring_read_pop(uf);
+    }
+    uring_read_ahead(uf);
+
+    if (pos >= uf->limit)
+        return file_stream_seal(fs, offset, 0, payload, raw_len);
+    if (uf->ra_count == 0 || pos < uf->ra[uf->ra_head]->off)
+        return file_stream_produce(fs, offset, payload, raw_len);
+
+    UringReq *r = uf->ra[uf->ra_head];
+    if (!r->done) {
+        uf->waiting = 1;
+        return PRODUCE_AGAIN;
+    }
+    uf->waiting = 0;
+    if (r->res < 0) {
+        fs->error = "Read failed";
+        return -1;
+    }
+
+    /* A short read means the file shrank: the block ends there */
+    uint64_t got  = r->off + (uint64_t)r->res;
+    int      want = file_stream_want(fs, offset);
+    int      n    = pos >= got ? 0
+                  : got - pos < (uint64_t)want ? (int)(got - pos) : want;
+    memcpy(file_stream_plain(fs), uring_buf(uf->eng, r) + (pos - r->off),
+           n);
+    uf->reads_async++;
+    if (pos + (uint64_t)n >= r->off + (uint64_t)r->len) {
+        uring_read_pop(uf);
+        uring_read_ahead(uf);
+    }
+    return file_stream_seal(fs, offset, n, payload, raw_len);
+}
+
+/* Hand the chunk being filled to the kernel */
+static inline void uring_write_submit(UringFile *uf)
+{
+    UringReq *r = uf->wr;
+    if (!r)
+        return;
+    uf->wr = NULL;
+    if (uring_queue_rw(uf->eng, r, uf->slot) < 0) {
+        /* no SQE to be had: write it here instead */
+        if (file_stream_write(uf->fs, r->off, uring_buf(uf->eng, r),
+                              r->len) < 0 && !uf->error)
+            uf->error = errno ? errno : EIO;
+        uring_req_put(uf->eng, r);
+        return;
+    }
+    r->gen = uf->gen;
+    uf->writes++;
+    uf->inflight++;
+    uf->writes_async++;
+}
+
+/*
+ * uring_checkpoint_sync – The data before `ckpt_off` has been written:
+ *                         make it durable and install the journal, as
+ *                         one linked chain – fdatasync the file, write
+ *                         the journal, fsync it.  A checkpoint that
+ *                         cannot start is skipped, which only costs a
+ *                         resend after a crash.
+ */
+static void uring_checkpoint_sync(UringFile *uf)
+{
+    UringEngine *e = uf->eng;
+    char         tmp_path[sizeof(uf->ck->path) + 4];
+    UringReq    *step[3] = { NULL, NULL, NULL };
+
+    uf->ckpt = CKPT_IDLE;
+    checkpoint_tmp_path(uf->ck, tmp_path, sizeof(tmp_path));
+    int jfd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (jfd < 0)
+        return;
+    for (int i = 0; i < 3; i++)
+        step[i] = uring_req_get(e, 0);
+    if (!step[2] || e->ring.sq_entries - e->ring.queued < 3) {
+        for (int i = 0; i < 3; i++)
+            if (step[i])
+                uring_req_put(e, step[i]);
+        close(jfd);
+        unlink(tmp_path);
+        return;
+    }
+
+    struct io_uring_sqe *sqe;
+    for (int i = 0; i < 3; i++) {
+        step[i]->owner = uf;
+        step[i]->kind  = URING_SYNC;
+        sqe = uring_sqe(&e->ring);
+        sqe->user_data = (uint64_t)(step[i] - e->req);
+        if (i < 2)
+            sqe->flags = IOSQE_IO_LINK;
+        if (i == 0) {
+            sqe->opcode      = IORING_OP_FSYNC;
+            sqe->flags      |= IOSQE_FIXED_FILE;
+            sqe->fd          = uf->slot;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+        } else if (i == 1) {
+            sqe->opcode = IORING_OP_WRITE;
+            sqe->fd     = jfd;
+            sqe->addr   = (uint64_t)(uintptr_t)uf->ckpt_rec;
+            sqe->len    = (unsigned)uf->ckpt_len;
+        } else {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fd     = jfd;
+        }
+    }
+    step[2]->fd     = jfd;              /* closed when the chain ends   */
+    uf->sync_left   = 3;
+    uf->sync_failed = 0;
+    uf->inflight   += 3;
+    uf->ckpt        = CKPT_SYNC;
+    uring_submit(&e->ring);
+}
+
+/* Start a checkpoint of everything consumed so far */
+static inline void uring_checkpoint(UringFile *uf)
+{
+    uf->ckpt_len = checkpoint_record(uf->ck, uf->ckpt_rec,
+                                     sizeof(uf->ckpt_rec));
+    if (uf->ckpt_len < 0)
+        return;
+    uf->ckpt_off = uf->ck->written;
+    uring_write_submit(uf);
+    uf->gen++;
+    uf->barrier = uf->writes;
+    uf->ckpt    = CKPT_DRAIN;
+    if (uf->barrier == 0)
+        uring_checkpoint_sync(uf);
+}
+
+/*
+ * uring_consume – BlockConsumer: as checkpoint_consume, but the block is
+ *                 appended to a chunk that the ring writes once full.
+ *                 A write that failed earlier fails this block.
+ */
+static inline int uring_consume(void *arg, uint64_t offset,
+                                const uint8_t *payload, int len)
+{
+    UringFile     *uf = (UringFile *)arg;
+    FileStream    *fs = uf->fs;
+    const uint8_t *plain;
+
+    if (uf->error) {
+        file_stream_write_failed(fs, uf->error);
+        return -1;
+    }
+    int n = file_stream_decode(fs, offset, payload, len, &plain);
+    if (n < 0)
+        return -1;
+
+    uint64_t pos = fs->base + offset;
+    if (uf->wr && (uf->wr->off + (uint64_t)uf->wr->len != pos ||
+                   uf->wr->len + n > uf->chunk))
+        uring_write_submit(uf);
+    if (!uf->wr && n > 0) {
+        uf->wr = uring_req_get(uf->eng, 1);
+        if (uf->wr) {
+            uf->wr->owner = uf;
+            uf->wr->kind  = URING_WRITE;
+            uf->wr->off   = pos;
+        }
+    }
+    if (!uf->wr) {
+        if (file_stream_write(fs, pos, plain, n) < 0)
+            return -1;
+    } else {
+        memcpy(uring_buf(uf->eng, uf->wr) + uf->wr->len, plain, n);
+        uf->wr->len += n;
+        if (uf->wr->len + fs->block_size > uf->chunk) {
+            uring_write_submit(uf);
+            uring_submit(&uf->eng->ring);
+        }
+    }
+    if (fs->md5)
+        EVP_DigestUpdate(fs->md5, plain, n);
+
+    Checkpoint *ck = uf->ck;
+    ck->written = pos + (uint64_t)n;
+    if (fs->md5 && uf->ckpt == CKPT_IDLE &&
+        ck->written - ck->offset >= CHECKPOINT_INTERVAL)
+        uring_checkpoint(uf);
+    return n;
+}
+
+/* Requests of this session still with the kernel */
+static inline int uring_file_busy(const UringFile *uf)
+{
+    return uf->eng && uf->inflight > 0;
+}
+
+/*
+ * uring_file_flush – The upload is over: write out the last chunk.
+ *                    Returns 1 while requests are in flight; the
+ *                    session is kicked as each completes.
+ */
+static inline int uring_file_flush(UringFile *uf)
+{
+    if (!uf->eng)
+        return 0;
+    uring_write_submit(uf);
+    uring_submit(&uf->eng->ring);
+    uf->waiting = uring_file_busy(uf);
+    return uf->waiting;
+}
+
+/*
+ * uring_file_close – Detach the session from the engine.  Requests still
+ *                    in flight are orphaned, and free their buffers on
+ *                    completion; the file's table slot is emptied.
+ */
+static inline void uring_file_close(UringFile *uf)
+{
+    UringEngine *e = uf->eng;
+    if (!e)
+        return;
+
+    if (uf->wr)
+        uring_req_put(e, uf->wr);
+    while (uf->ra_count > 0) {
+        UringReq *r = uf->ra[uf->ra_head];
+        if (r->done)
+            uring_read_pop(uf);
+        else {
+            uf->ra_head = (uf->ra_head + 1) % URING_READAHEAD;
+            uf->ra_count--;
+        }
+    }
+    for (int i = 0; i < URING_REQS; i++)
+        if (e->req[i].owner == uf)
+            e->req[i].owner = NULL;
+
+    uring_set_file(e, uf->slot, -1);
+    e->free_slot[e->nfree_slot++] = uf->slot;
+    uf->eng = NULL;
+}
+
+#endif /* URING_H */